@@ -0,0 +1,87 @@
+/*!
+ * \file alloc_tracker.h
+ * \brief Heap allocations attributed to the compiler phases
+ *
+ * Configured with -DKALEIDOSCOPE_TRACK_ALLOCATIONS=ON, the lexer library
+ * replaces the global operator new and counts every allocation, with its
+ * size, against the phase of the innermost PhaseScope of the calling
+ * thread. Otherwise, and under the sanitizers (which replace operator new
+ * themselves), PhaseScope is empty and nothing is counted.
+ */
+#ifndef KALEIDOSCOPE_ALLOC_TRACKER_H_
+#define KALEIDOSCOPE_ALLOC_TRACKER_H_
+
+#include <cstdint>
+
+#include "kaleidoscope/macro.h"
+
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#undef KALEIDOSCOPE_TRACK_ALLOCATIONS
+#endif
+
+namespace kaleidoscope {
+namespace alloc {
+
+enum class Phase {
+  kOther = 0,  // outside of any PhaseScope
+  kLex,
+  kParse,
+  kCodeGen,
+  kOptimize,
+  kJIT,  // compiling and linking machine code
+};
+constexpr int kNumPhases = 6;
+
+/*! \brief "other", "lex", "parse", "codegen", "optimize" or "jit" */
+LEXER_DLL const char* PhaseName(Phase phase);
+
+/*! \brief Whether this build counts allocations */
+constexpr bool IsTracking() {
+#if KALEIDOSCOPE_TRACK_ALLOCATIONS
+  return true;
+#else
+  return false;
+#endif
+}
+
+struct PhaseAllocations {
+  uint64_t allocations = 0;
+  uint64_t bytes = 0;  // requested, without the allocator overhead
+};
+
+/*! \brief The allocations of \a phase on all threads since the last reset */
+LEXER_DLL PhaseAllocations GetAllocations(Phase phase);
+
+/*! \brief Zero the counts of every phase */
+LEXER_DLL void ResetAllocations();
+
+/*! \brief Allocations made by the calling thread so far, in any phase */
+LEXER_DLL uint64_t ThreadAllocations();
+
+#if KALEIDOSCOPE_TRACK_ALLOCATIONS
+/*! \brief Attribute the allocations of this thread to \a phase, nestable */
+class PhaseScope {
+ public:
+  LEXER_DLL explicit PhaseScope(Phase phase);
+  LEXER_DLL ~PhaseScope();
+
+  PhaseScope(const PhaseScope&) = delete;
+  PhaseScope& operator=(const PhaseScope&) = delete;
+
+ private:
+  Phase previous_;
+};
+#else
+class PhaseScope {
+ public:
+  explicit PhaseScope(Phase) {}
+
+  PhaseScope(const PhaseScope&) = delete;
+  PhaseScope& operator=(const PhaseScope&) = delete;
+};
+#endif  // KALEIDOSCOPE_TRACK_ALLOCATIONS
+
+}  // namespace alloc
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_ALLOC_TRACKER_H_
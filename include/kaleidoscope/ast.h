@@ -1,11 +1,13 @@
 #ifndef KALEIDOSCOPE_AST_H_
 #define KALEIDOSCOPE_AST_H_
 
+#include <cstdint>
 #include <memory>
 #include <mutex>
 #include <ostream>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace kaleidoscope {
@@ -40,15 +42,32 @@ class AST {
   ASTType type_;
 };
 
+enum class ExprType {
+  kNumber,
+  kVariable,
+  kBinary,
+  kCall,
+  kIf,
+  kFor,
+  kVar,
+};
+
 class ExprAST : public AST {
  public:
-  ExprAST() : AST(ASTType::kExpr) {}
+  explicit ExprAST(ExprType expr_type)
+      : AST(ASTType::kExpr), expr_type_(expr_type) {}
+
+  ExprType GetExprType() const { return expr_type_; }
+
+ private:
+  ExprType expr_type_;
 };
 
 class NumberExprAST : public ExprAST {
  public:
-  NumberExprAST() : ExprAST(), value_(0) {}
-  explicit NumberExprAST(double val) : ExprAST(), value_(val) {}
+  NumberExprAST() : ExprAST(ExprType::kNumber), value_(0) {}
+  explicit NumberExprAST(double val)
+      : ExprAST(ExprType::kNumber), value_(val) {}
 
   virtual void Dump(std::ostream& sm) const override { sm << value_; }
   double GetValue() const { return value_; }
@@ -59,8 +78,9 @@ class NumberExprAST : public ExprAST {
 
 class VariableExprAST : public ExprAST {
  public:
-  VariableExprAST() = default;
-  explicit VariableExprAST(const std::string& name) : ExprAST(), name_(name) {}
+  VariableExprAST() : ExprAST(ExprType::kVariable) {}
+  explicit VariableExprAST(const std::string& name)
+      : ExprAST(ExprType::kVariable), name_(name) {}
 
   virtual void Dump(std::ostream& sm) const override { sm << "%" << name_; }
   const std::string& GetName() const { return name_; }
@@ -69,18 +89,28 @@ class VariableExprAST : public ExprAST {
   std::string name_;
 };
 
-enum class SupportBinaryOpTag { kAdd, kSub, kMul, kDiv, kLess, kInvalid };
+// kAssign stores into the variable on its left and evaluates to the value
+enum class SupportBinaryOpTag {
+  kAdd,
+  kSub,
+  kMul,
+  kDiv,
+  kLess,
+  kAssign,
+  kInvalid
+};
 
-void StringToBinaryOpTagInit(
+inline void StringToBinaryOpTagInit(
     std::unordered_map<std::string, SupportBinaryOpTag>& map) {
   map["+"] = SupportBinaryOpTag::kAdd;
   map["-"] = SupportBinaryOpTag::kSub;
   map["*"] = SupportBinaryOpTag::kMul;
   map["/"] = SupportBinaryOpTag::kDiv;
   map["<"] = SupportBinaryOpTag::kLess;
+  map["="] = SupportBinaryOpTag::kAssign;
 }
 
-std::string BinoryOpTagName(SupportBinaryOpTag tag) {
+inline std::string BinoryOpTagName(SupportBinaryOpTag tag) {
   switch (tag) {
     case SupportBinaryOpTag::kAdd:
       return "+";
@@ -92,6 +122,10 @@ std::string BinoryOpTagName(SupportBinaryOpTag tag) {
       return "/";
     case SupportBinaryOpTag::kLess:
       return "<";
+    case SupportBinaryOpTag::kAssign:
+      return "=";
+    case SupportBinaryOpTag::kInvalid:
+      break;
   }
   return "";
 }
@@ -110,13 +144,13 @@ class BinaryExprAST : public ExprAST {
   BinaryExprAST() = delete;
   BinaryExprAST(const std::string& op_literal, std::unique_ptr<ExprAST> lhs,
                 std::unique_ptr<ExprAST> rhs)
-      : ExprAST(),
+      : ExprAST(ExprType::kBinary),
         op_tag_(StringToBinaryOpTag(op_literal)),
         lhs_(std::move(lhs)),
         rhs_(std::move(rhs)) {}
   BinaryExprAST(SupportBinaryOpTag op_tag, std::unique_ptr<ExprAST> lhs,
                 std::unique_ptr<ExprAST> rhs)
-      : ExprAST(),
+      : ExprAST(ExprType::kBinary),
         op_tag_(op_tag),
         lhs_(std::move(lhs)),
         rhs_(std::move(rhs)) {}
@@ -133,7 +167,7 @@ class BinaryExprAST : public ExprAST {
   const ExprAST* GetLHS() const { return lhs_.get(); }
   ExprAST* GetRHS() { return rhs_.get(); }
   const ExprAST* GetRHS() const { return rhs_.get(); }
-  const auto GetOpTag() { return op_tag_; }
+  SupportBinaryOpTag GetOpTag() const { return op_tag_; }
 
  private:
   SupportBinaryOpTag op_tag_;
@@ -145,7 +179,7 @@ class CallExprAST : public ExprAST {
   CallExprAST() = delete;
   CallExprAST(const std::string& callee,
               std::vector<std::unique_ptr<ExprAST>> args)
-      : ExprAST(), callee_(callee), args_(std::move(args)) {}
+      : ExprAST(ExprType::kCall), callee_(callee), args_(std::move(args)) {}
 
   virtual void Dump(std::ostream& sm) const override {
     sm << callee_ << "(";
@@ -171,14 +205,191 @@ class CallExprAST : public ExprAST {
   std::vector<std::unique_ptr<ExprAST>> args_;
 };
 
+/*! \brief `if cond then a else b`, only one branch is evaluated */
+class IfExprAST : public ExprAST {
+ public:
+  IfExprAST() = delete;
+  IfExprAST(std::unique_ptr<ExprAST> cond, std::unique_ptr<ExprAST> then,
+            std::unique_ptr<ExprAST> otherwise)
+      : ExprAST(ExprType::kIf),
+        cond_(std::move(cond)),
+        then_(std::move(then)),
+        else_(std::move(otherwise)) {}
+
+  virtual void Dump(std::ostream& sm) const override {
+    sm << "if (";
+    cond_->Dump(sm);
+    sm << ") then (";
+    then_->Dump(sm);
+    sm << ") else (";
+    else_->Dump(sm);
+    sm << ")";
+  }
+
+  ExprAST* GetCond() { return cond_.get(); }
+  const ExprAST* GetCond() const { return cond_.get(); }
+  ExprAST* GetThen() { return then_.get(); }
+  const ExprAST* GetThen() const { return then_.get(); }
+  ExprAST* GetElse() { return else_.get(); }
+  const ExprAST* GetElse() const { return else_.get(); }
+
+ private:
+  std::unique_ptr<ExprAST> cond_, then_, else_;
+};
+
+/*!
+ * \brief `for var = start, cond, step in body`
+ *
+ * Runs body while cond is not 0, starting with var = start and adding step,
+ * 1 by default, after every iteration. The loop itself evaluates to 0.
+ */
+class ForExprAST : public ExprAST {
+ public:
+  ForExprAST() = delete;
+  /*! \param step may be null */
+  ForExprAST(const std::string& var_name, std::unique_ptr<ExprAST> start,
+             std::unique_ptr<ExprAST> cond, std::unique_ptr<ExprAST> step,
+             std::unique_ptr<ExprAST> body)
+      : ExprAST(ExprType::kFor),
+        var_name_(var_name),
+        start_(std::move(start)),
+        cond_(std::move(cond)),
+        step_(std::move(step)),
+        body_(std::move(body)) {}
+
+  virtual void Dump(std::ostream& sm) const override {
+    sm << "for %" << var_name_ << " = (";
+    start_->Dump(sm);
+    sm << "), (";
+    cond_->Dump(sm);
+    sm << ")";
+    if (step_) {
+      sm << ", (";
+      step_->Dump(sm);
+      sm << ")";
+    }
+    sm << " in (";
+    body_->Dump(sm);
+    sm << ")";
+  }
+
+  const std::string& GetVarName() const { return var_name_; }
+  ExprAST* GetStart() { return start_.get(); }
+  const ExprAST* GetStart() const { return start_.get(); }
+  ExprAST* GetCond() { return cond_.get(); }
+  const ExprAST* GetCond() const { return cond_.get(); }
+  /*! \return null if the step is the default 1 */
+  ExprAST* GetStep() { return step_.get(); }
+  const ExprAST* GetStep() const { return step_.get(); }
+  ExprAST* GetBody() { return body_.get(); }
+  const ExprAST* GetBody() const { return body_.get(); }
+
+ private:
+  std::string var_name_;
+  std::unique_ptr<ExprAST> start_, cond_, step_, body_;
+};
+
+/*!
+ * \brief `var a = 1, b in body`, mutable variables scoped to body
+ *
+ * Every initializer sees the variables bound before it, a variable without
+ * one starts at 0.
+ */
+class VarExprAST : public ExprAST {
+ public:
+  using Binding = std::pair<std::string, std::unique_ptr<ExprAST>>;
+
+  VarExprAST() = delete;
+  VarExprAST(std::vector<Binding> vars, std::unique_ptr<ExprAST> body)
+      : ExprAST(ExprType::kVar),
+        vars_(std::move(vars)),
+        body_(std::move(body)) {}
+
+  virtual void Dump(std::ostream& sm) const override {
+    sm << "var ";
+    for (size_t i = 0; i < vars_.size(); ++i) {
+      if (i != 0) sm << ", ";
+      sm << "%" << vars_[i].first;
+      if (vars_[i].second) {
+        sm << " = (";
+        vars_[i].second->Dump(sm);
+        sm << ")";
+      }
+    }
+    sm << " in (";
+    body_->Dump(sm);
+    sm << ")";
+  }
+
+  /*! \brief The names and initializers, which may be null */
+  const std::vector<Binding>& GetVars() const { return vars_; }
+  ExprAST* GetBody() { return body_.get(); }
+  const ExprAST* GetBody() const { return body_.get(); }
+
+ private:
+  std::vector<Binding> vars_;
+  std::unique_ptr<ExprAST> body_;
+};
+
+/*!
+ * \brief Whether evaluating \a expr_ptr may assign the variable \a name,
+ *        or any variable if \a name is null
+ *
+ * \note An assignment to another variable of the same name, bound inside
+ *       \a expr_ptr, counts as well.
+ */
+inline bool MayAssign(const ExprAST* expr_ptr, const std::string* name) {
+  switch (expr_ptr->GetExprType()) {
+    case ExprType::kNumber:
+    case ExprType::kVariable:
+      return false;
+    case ExprType::kBinary: {
+      auto* bin_ptr = static_cast<const BinaryExprAST*>(expr_ptr);
+      if (bin_ptr->GetOpTag() == SupportBinaryOpTag::kAssign &&
+          (!name || (bin_ptr->GetLHS()->GetExprType() == ExprType::kVariable &&
+                     static_cast<const VariableExprAST*>(bin_ptr->GetLHS())
+                             ->GetName() == *name))) {
+        return true;
+      }
+      return MayAssign(bin_ptr->GetLHS(), name) ||
+             MayAssign(bin_ptr->GetRHS(), name);
+    }
+    case ExprType::kCall:
+      for (const auto& arg :
+           static_cast<const CallExprAST*>(expr_ptr)->GetArgs()) {
+        if (MayAssign(arg.get(), name)) return true;
+      }
+      return false;
+    case ExprType::kIf: {
+      auto* if_ptr = static_cast<const IfExprAST*>(expr_ptr);
+      return MayAssign(if_ptr->GetCond(), name) ||
+             MayAssign(if_ptr->GetThen(), name) ||
+             MayAssign(if_ptr->GetElse(), name);
+    }
+    case ExprType::kFor: {
+      auto* for_ptr = static_cast<const ForExprAST*>(expr_ptr);
+      return MayAssign(for_ptr->GetStart(), name) ||
+             MayAssign(for_ptr->GetCond(), name) ||
+             (for_ptr->GetStep() && MayAssign(for_ptr->GetStep(), name)) ||
+             MayAssign(for_ptr->GetBody(), name);
+    }
+    case ExprType::kVar: {
+      auto* var_ptr = static_cast<const VarExprAST*>(expr_ptr);
+      for (const auto& var : var_ptr->GetVars()) {
+        if (var.second && MayAssign(var.second.get(), name)) return true;
+      }
+      return MayAssign(var_ptr->GetBody(), name);
+    }
+  }
+  return false;
+}
+
 class ProtoTypeAST : public AST {
  public:
   ProtoTypeAST() = delete;
   ProtoTypeAST(const std::string& name, std::vector<std::string> args)
       : AST(ASTType::kPrototype), name_(name), args_(std::move(args)) {}
 
-  const std::string& GetName() const { return name_; }
-
   virtual void Dump(std::ostream& sm) const override {
     sm << name_ << "(";
     if (!args_.empty()) {
@@ -202,6 +413,50 @@ class ProtoTypeAST : public AST {
   std::vector<std::string> args_;
 };
 
+/*! \brief Annotations of a definition, e.g. `@memo def fib(n) ...` */
+enum class FunctionAttr : uint32_t {
+  kNone = 0,
+  kMemo = 1 << 0,  // cache the results of calls by their arguments
+  // floating-point semantics of the body, overriding the mode of the
+  // compilation, at most one of them
+  kStrictMath = 1 << 1,    // IEEE 754, every operation rounds
+  kContractMath = 1 << 2,  // a * b + c may become an fma
+  kFastMath = 1 << 3,      // fast-math, e.g. reassociation
+};
+
+constexpr FunctionAttr kAllFunctionAttrs[] = {
+    FunctionAttr::kMemo, FunctionAttr::kStrictMath,
+    FunctionAttr::kContractMath, FunctionAttr::kFastMath};
+
+constexpr uint32_t kFPModeAttrs =
+    static_cast<uint32_t>(FunctionAttr::kStrictMath) |
+    static_cast<uint32_t>(FunctionAttr::kContractMath) |
+    static_cast<uint32_t>(FunctionAttr::kFastMath);
+
+inline std::string FunctionAttrName(FunctionAttr attr) {
+  switch (attr) {
+    case FunctionAttr::kMemo:
+      return "memo";
+    case FunctionAttr::kStrictMath:
+      return "strict";
+    case FunctionAttr::kContractMath:
+      return "contract";
+    case FunctionAttr::kFastMath:
+      return "fastmath";
+    case FunctionAttr::kNone:
+      break;
+  }
+  return "";
+}
+
+/*! \return FunctionAttr::kNone for an unknown annotation */
+inline FunctionAttr StringToFunctionAttr(const std::string& name) {
+  for (FunctionAttr attr : kAllFunctionAttrs) {
+    if (FunctionAttrName(attr) == name) return attr;
+  }
+  return FunctionAttr::kNone;
+}
+
 class FunctionAST : public AST {
  public:
   FunctionAST() = delete;
@@ -212,6 +467,9 @@ class FunctionAST : public AST {
         body_(std::move(body)) {}
 
   virtual void Dump(std::ostream& sm) const override {
+    for (FunctionAttr attr : kAllFunctionAttrs) {
+      if (HasAttr(attr)) sm << "@" << FunctionAttrName(attr) << " ";
+    }
     prototype_->Dump(sm);
     sm << "{\n";
     body_->Dump(sm);
@@ -219,11 +477,21 @@ class FunctionAST : public AST {
   }
 
   ProtoTypeAST* GetProto() { return prototype_.get(); }
+  const ProtoTypeAST* GetProto() const { return prototype_.get(); }
   ExprAST* GetBody() { return body_.get(); }
+  const ExprAST* GetBody() const { return body_.get(); }
+
+  bool HasAttr(FunctionAttr attr) const {
+    return (attrs_ & static_cast<uint32_t>(attr)) != 0;
+  }
+  void AddAttr(FunctionAttr attr) { attrs_ |= static_cast<uint32_t>(attr); }
+  /*! \brief The FunctionAttr bits of the annotations */
+  uint32_t GetAttrs() const { return attrs_; }
 
  private:
   std::unique_ptr<ProtoTypeAST> prototype_;
   std::unique_ptr<ExprAST> body_;
+  uint32_t attrs_ = 0;
 };
 
 }  // namespace ast
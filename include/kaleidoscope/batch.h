@@ -0,0 +1,75 @@
+/*!
+ * \file batch.h
+ * \brief Helpers for the multi-file batch mode of the klang_* tools
+ */
+#ifndef KALEIDOSCOPE_BATCH_H_
+#define KALEIDOSCOPE_BATCH_H_
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "kaleidoscope/macro.h"
+
+namespace kaleidoscope {
+
+/*! \brief A source file of a batch and where its output goes */
+struct BatchItem {
+  std::string src_path;
+  std::string dst_path;
+};
+
+/*! \brief Outcome of processing one BatchItem */
+struct BatchResult {
+  bool ok = false;
+  size_t units = 0;      // tokens or top-level ASTs produced
+  double seconds = 0.0;  // wall time spent on this item
+  std::string error;     // error message if not ok
+};
+
+/*!
+ * \brief Collect the sources of a batch
+ *
+ * \param input Either a directory, which is searched recursively for
+ *        regular files ending with \a extension, or a manifest file
+ *        listing one source path per line. Blank lines and lines starting
+ *        with '#' in a manifest are ignored.
+ * \param out_dir Outputs mirror the source paths (relative to the input
+ *        directory, or as listed in the manifest) under this directory,
+ *        with \a out_suffix appended. A source that would land outside
+ *        of it, like ../x.k, or sharing its output with another source,
+ *        like a/x.k and /a/x.k, is an error.
+ * \return the items, sorted by source path for directories and in
+ *         manifest order otherwise
+ */
+LEXER_DLL std::vector<BatchItem> CollectBatchItems(
+    const std::string& input, const std::string& out_dir,
+    const std::string& out_suffix, const std::string& extension = ".k");
+
+/*!
+ * \brief Process \a items on a WorkStealingPool with \a num_jobs workers
+ *
+ * \param process Called as process(worker_id, item) and returns the number
+ *        of units produced. Exceptions mark the item as failed and do not
+ *        stop the batch.
+ * \return one result per item, in the order of \a items
+ */
+LEXER_DLL std::vector<BatchResult> RunBatch(
+    const std::vector<BatchItem>& items, size_t num_jobs,
+    const std::function<size_t(size_t, const BatchItem&)>& process);
+
+/*!
+ * \brief Print per-file timings (in item order) and aggregate throughput
+ *
+ * \return the number of failed items
+ */
+LEXER_DLL size_t PrintBatchReport(std::ostream& sm,
+                                  const std::vector<BatchItem>& items,
+                                  const std::vector<BatchResult>& results,
+                                  double wall_seconds,
+                                  const std::string& unit_name);
+
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_BATCH_H_
@@ -0,0 +1,96 @@
+/*!
+ * \file daemon.h
+ * \brief The protocol between klangd and its clients over a UNIX socket
+ *
+ * Every message is a frame: a little-endian uint32 payload size, then the
+ * payload. A client sends a request frame and reads one response frame
+ * back, and may go on with the next request on the same connection.
+ *
+ * A request payload is the type byte, the name of the source and the
+ * options, each as a little-endian uint32 size and its bytes, then the
+ * source itself up to the end of the frame. A response payload is the
+ * status byte followed by the body: the values of the top-level
+ * expressions as little-endian doubles, the object file, or the error
+ * message.
+ */
+#ifndef KALEIDOSCOPE_DAEMON_H_
+#define KALEIDOSCOPE_DAEMON_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "kaleidoscope/macro.h"
+
+namespace kaleidoscope {
+namespace daemon {
+
+enum class RequestType : uint8_t {
+  kEvaluate = 1,  // run the program, the body is the expression values
+  kCompile = 2,   // compile it ahead of time, the body is the object file
+  kPing = 3,      // an empty body, for checking that the daemon is up
+  kShutdown = 4,  // stop accepting connections and exit
+};
+
+enum class Status : uint8_t {
+  kOk = 0,
+  kError = 1,
+};
+
+struct Request {
+  RequestType type = RequestType::kPing;
+  std::string name;     // of the source, e.g. its path, for the messages
+  std::string options;  // command line flags like "-O2 --fp-mode=fast"
+  std::string source;
+};
+
+struct Response {
+  Status status = Status::kOk;
+  std::string body;
+};
+
+// frames larger than that are taken as garbage
+constexpr uint32_t kMaxFrameSize = 1u << 28;
+
+LEXER_DLL std::string EncodeRequest(const Request& request);
+
+/*! \brief Throws a kaleidoscope::Error if \a payload is not a request */
+LEXER_DLL Request DecodeRequest(const std::string& payload);
+
+LEXER_DLL std::string EncodeResponse(const Response& response);
+
+/*! \brief Throws a kaleidoscope::Error if \a payload is not a response */
+LEXER_DLL Response DecodeResponse(const std::string& payload);
+
+/*! \brief The body of a kEvaluate response */
+LEXER_DLL std::string EncodeValues(const std::vector<double>& values);
+
+LEXER_DLL std::vector<double> DecodeValues(const std::string& body);
+
+/*!
+ * \brief Read the payload of the next frame from the socket \a fd
+ *
+ * \return false if the peer closed the connection before a frame started,
+ *         a frame cut short or too large throws a kaleidoscope::Error
+ */
+LEXER_DLL bool ReadFrame(int fd, std::string* payload);
+
+/*! \brief Write \a payload as a frame, throws a kaleidoscope::Error */
+LEXER_DLL void WriteFrame(int fd, const std::string& payload);
+
+/*!
+ * \brief Bind a listening UNIX stream socket at \a path, replacing a stale
+ *        socket file left there
+ *
+ * A socket is only stale if connecting to it is refused; \a path being a
+ * socket some process listens on, or any other file, is an error.
+ */
+LEXER_DLL int ListenUnixSocket(const std::string& path, int backlog);
+
+/*! \brief Connect to the UNIX stream socket at \a path */
+LEXER_DLL int ConnectUnixSocket(const std::string& path);
+
+}  // namespace daemon
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_DAEMON_H_
@@ -0,0 +1,137 @@
+/*!
+ * \file dump.h
+ * \brief Machine-readable dump formats shared by the lexer and the parser.
+ *
+ * Besides the human-readable text produced by `operator<<`, tokens and ASTs
+ * can be dumped as:
+ *
+ *  - NDJSON: one JSON object per line (one token, or one top-level AST).
+ *  - Binary: a 5-byte header (4-byte magic followed by a 1-byte version)
+ *    and then a sequence of records. All integers are unsigned and in host
+ *    byte order (little-endian on every target we build for), doubles are
+ *    IEEE-754 binary64 and strings are a u32 byte length followed by the
+ *    bytes (no terminator).
+ *
+ *    Token stream (magic "KTOK"), one record per token:
+ *      u8 tag, u32 line, u32 col, u32 offset, payload
+ *    where the payload is an f64 for kNumber, a string for word tokens
+ *    (identifiers, punctuators and keywords) and empty otherwise.
+ *
+ *    AST stream (magic "KAST"), every top-level item is a pre-order
+ *    serialization of its tree, one u8 node kind followed by the node:
+ *      number:    f64 value
+ *      variable:  string name
+ *      binary:    u8 op tag, lhs node, rhs node
+ *      call:      string callee, u32 #args, arg nodes
+ *      if:        cond node, then node, else node
+ *      for:       string var, u8 has step, start node, cond node,
+ *                 step node if it has one, body node
+ *      var:       u32 #vars, for each: string name, u8 has initializer,
+ *                 initializer node if it has one; then body node
+ *      prototype: string name, u32 #args, arg name strings
+ *      function:  u32 FunctionAttr bits, prototype node, body node
+ *
+ * All writers go through OutputBuffer, which never flushes per record.
+ */
+#ifndef KALEIDOSCOPE_DUMP_H_
+#define KALEIDOSCOPE_DUMP_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "kaleidoscope/macro.h"
+
+namespace kaleidoscope {
+
+enum class DumpFormat {
+  kText,
+  kNDJson,
+  kBinary,
+};
+
+constexpr uint8_t kBinaryDumpVersion = 4;
+
+/*!
+ * \brief Parse a dump format name: "text", "ndjson" or "binary"
+ *
+ * \return false if \a name is not a known format
+ */
+LEXER_DLL bool ParseDumpFormat(const std::string& name, DumpFormat* format);
+
+/*! \brief File name suffix of a format: "", ".ndjson" or ".bin" */
+LEXER_DLL std::string DumpFormatSuffix(DumpFormat format);
+
+/*!
+ * \brief A write-only file with a large user-space buffer
+ *
+ * The buffer is handed to the OS only when it is full, on Flush() and on
+ * destruction, so a dump costs one write per \a capacity bytes instead of
+ * one (or a flush) per record.
+ */
+class OutputBuffer {
+ public:
+  static constexpr size_t kDefaultCapacity = 1 << 20;
+
+  LEXER_DLL explicit OutputBuffer(const std::string& path,
+                                  size_t capacity = kDefaultCapacity);
+  LEXER_DLL ~OutputBuffer();
+  OutputBuffer(const OutputBuffer&) = delete;
+  OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+  void Put(char c) {
+    if (size_ == buffer_.size()) Drain();
+    buffer_[size_++] = c;
+  }
+
+  LEXER_DLL void Write(const char* data, size_t size);
+
+  void Write(const std::string& str) { Write(str.data(), str.size()); }
+
+  /*! \brief Append a string literal, without its terminator */
+  template <size_t N>
+  void Write(const char (&literal)[N]) {
+    Write(literal, N - 1);
+  }
+
+  /*! \brief Append the raw (host-endian) bytes of a trivial value */
+  template <typename T>
+  void WriteRaw(T value) {
+    Write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  /*! \brief Append a u32 length and the bytes of \a str */
+  void WriteBinaryString(const std::string& str) {
+    WriteRaw(static_cast<uint32_t>(str.size()));
+    Write(str);
+  }
+
+  /*! \brief Append the decimal text of an integer */
+  LEXER_DLL void WriteInt(int64_t value);
+
+  /*! \brief Append a double as text, with \a precision significant digits */
+  LEXER_DLL void WriteDouble(double value, int precision = 17);
+
+  /*! \brief Append \a str as a quoted and escaped JSON string */
+  LEXER_DLL void WriteJsonString(const std::string& str);
+
+  /*! \brief Hand all buffered bytes to the OS */
+  LEXER_DLL void Flush();
+
+  /*! \brief Total number of bytes appended so far */
+  size_t BytesWritten() const { return drained_ + size_; }
+
+ private:
+  LEXER_DLL void Drain();
+
+  std::string path_;
+  std::FILE* file_;
+  std::vector<char> buffer_;
+  size_t size_ = 0;
+  size_t drained_ = 0;
+};
+
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_DUMP_H_
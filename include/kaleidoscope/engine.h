@@ -0,0 +1,120 @@
+/*!
+ * \file engine.h
+ * \brief Compile kaleidoscope functions at run time and call them from C++
+ *
+ * \code
+ *   kaleidoscope::Engine engine;
+ *   kaleidoscope::ModuleHandle module =
+ *       engine.Compile("def poly(x a b) a * x * x + b");
+ *   auto* poly = engine.Lookup<double(double, double, double)>(module,
+ *                                                              "poly");
+ *   double y = poly(2, 3, 0.5);
+ * \endcode
+ */
+#ifndef KALEIDOSCOPE_ENGINE_H_
+#define KALEIDOSCOPE_ENGINE_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "kaleidoscope/macro.h"
+
+namespace kaleidoscope {
+
+struct EngineOptions {
+  // compiled sources kept for Compile to hand out again, the least recently
+  // used one is dropped beyond that
+  size_t cache_capacity = 128;
+  // optimization pipeline of the functions, 0 to 3 as for -O0 to -O3
+  int opt_level = 2;
+  // floating-point semantics of the functions without an annotation:
+  // "strict", "contract" or "fast"
+  std::string fp_mode = "strict";
+};
+
+/*! \brief The machine code of the functions of one source */
+class CompiledModule;
+
+/*!
+ * \brief Keeps the code of a compiled source alive, and with it the function
+ *        pointers looked up in it, even once the Engine dropped it from its
+ *        cache or is gone itself
+ */
+using ModuleHandle = std::shared_ptr<const CompiledModule>;
+
+namespace detail {
+
+/*! \brief The number of arguments of double(double, ...) */
+template <typename Func>
+struct FormulaArity;
+
+template <typename... Args>
+struct FormulaArity<double(Args...)> {
+  static_assert((std::is_same_v<Args, double> && ...),
+                "kaleidoscope functions only take doubles");
+  static constexpr size_t value = sizeof...(Args);
+};
+
+}  // namespace detail
+
+/*!
+ * \brief Compiles kaleidoscope sources with the JIT and hands out their
+ *        functions as plain C function pointers
+ *
+ * The modules are cached by the hash of their source, so that compiling a
+ * formula seen before only costs hashing it and a lookup, and the least
+ * recently used ones go once there are more than
+ * EngineOptions::cache_capacity of them.
+ *
+ * All the member functions may be called from any number of threads, and so
+ * may the compiled functions. The sources are parsed and lowered in
+ * parallel, but handed to the JIT one at a time. `@memo` is ignored, as the
+ * cache of a memoized function cannot be shared between threads.
+ */
+class Engine {
+ public:
+  /*! \brief Throws a kaleidoscope::Error if \a options are invalid */
+  ENGINE_DLL explicit Engine(const EngineOptions& options = EngineOptions());
+  ENGINE_DLL ~Engine();
+
+  Engine(const Engine&) = delete;
+  Engine& operator=(const Engine&) = delete;
+
+  /*!
+   * \brief Compile the function definitions of \a source, or return the
+   *        module compiled from the same source before
+   *
+   * Top-level expressions have nothing to run them and are skipped.
+   * Throws a kaleidoscope::Error if \a source fails to parse or a function
+   * fails to compile.
+   */
+  ENGINE_DLL ModuleHandle Compile(std::string_view source);
+
+  /*!
+   * \brief The address of the function \a name of \a module, if it takes
+   *        \a num_args arguments, or nullptr
+   */
+  ENGINE_DLL void* Lookup(const ModuleHandle& module, std::string_view name,
+                          size_t num_args) const;
+
+  /*! \brief Same as above, typed, e.g. `Lookup<double(double)>(m, "f")` */
+  template <typename Func>
+  Func* Lookup(const ModuleHandle& module, std::string_view name) const {
+    return reinterpret_cast<Func*>(
+        Lookup(module, name, detail::FormulaArity<Func>::value));
+  }
+
+  /*! \brief The number of modules in the cache */
+  ENGINE_DLL size_t NumCached() const;
+
+ private:
+  class Impl;
+  std::unique_ptr<Impl> pimpl_;
+};
+
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_ENGINE_H_
@@ -5,6 +5,7 @@
 #include <ostream>
 #include <string>
 
+#include "kaleidoscope/dump.h"
 #include "kaleidoscope/macro.h"
 #include "kaleidoscope/token.h"
 
@@ -33,8 +34,24 @@ class Lexer {
 
   LEXER_DLL void ResetFile(const std::string& src_path);
 
+  /*!
+   * \brief Lex \a source from memory from now on, \a name stands for its
+   *        path, e.g. in error messages
+   */
+  LEXER_DLL void ResetSource(const std::string& name,
+                             const std::string& source);
+
   LEXER_DLL friend std::ostream& operator<<(std::ostream& sm, Lexer& lexer);
 
+  /*!
+   * \brief Dump all remaining tokens of \a lexer (including the EOF token)
+   *        into \a out, then reset the lexer like operator<< does
+   *
+   * \return the number of tokens written
+   */
+  LEXER_DLL friend size_t DumpTokens(Lexer& lexer, DumpFormat format,
+                                     OutputBuffer& out);
+
   LEXER_DLL friend void swap(Lexer& l1, Lexer& l2);
 
  private:
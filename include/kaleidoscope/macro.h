@@ -37,4 +37,28 @@
 #endif  // _WIN32
 #endif  // PARSER_DLL
 
+#ifndef VM_DLL
+#ifdef _WIN32
+#ifdef VM_EXPORT
+#define VM_DLL __declspec(dllexport)
+#else  // VM_EXPORT
+#define VM_DLL __declspec(dllimport)
+#endif  // VM_EXPORT
+#else   // _WIN32
+#define VM_DLL
+#endif  // _WIN32
+#endif  // VM_DLL
+
+#ifndef ENGINE_DLL
+#ifdef _WIN32
+#ifdef ENGINE_EXPORT
+#define ENGINE_DLL __declspec(dllexport)
+#else  // ENGINE_EXPORT
+#define ENGINE_DLL __declspec(dllimport)
+#endif  // ENGINE_EXPORT
+#else   // _WIN32
+#define ENGINE_DLL
+#endif  // _WIN32
+#endif  // ENGINE_DLL
+
 #endif  // KALEIDOSCOPE_MACRO_H_
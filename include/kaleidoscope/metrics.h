@@ -0,0 +1,110 @@
+/*!
+ * \file metrics.h
+ * \brief Counters and gauges over the compiler internals, for scraping
+ *
+ * Every thread bumps its own copy of a metric without a lock or a shared
+ * cache line, and TakeSnapshot sums the copies. The copies of a thread are
+ * folded into the totals when it exits, so short-lived workers lose
+ * nothing.
+ *
+ * Metrics are registered once by name and labels, usually into a static:
+ *
+ *   static const metrics::Counter counter =
+ *       metrics::GetCounter("klang_x_total", "Number of x");
+ *   counter.Add();
+ */
+#ifndef KALEIDOSCOPE_METRICS_H_
+#define KALEIDOSCOPE_METRICS_H_
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "kaleidoscope/macro.h"
+
+namespace kaleidoscope {
+namespace metrics {
+
+enum class MetricType {
+  kCounter,  // only goes up
+  kGauge,    // a level, e.g. bytes in use
+};
+
+using Labels = std::vector<std::pair<std::string, std::string>>;
+
+/*! \brief A monotonic count, cheap to bump from any thread */
+class Counter {
+ public:
+  LEXER_DLL void Add(uint64_t n = 1) const;
+
+ private:
+  friend LEXER_DLL Counter GetCounter(const std::string& name,
+                                      const std::string& help,
+                                      const Labels& labels);
+  explicit Counter(uint32_t id) : id_(id) {}
+
+  uint32_t id_;
+};
+
+/*!
+ * \brief A level that goes up and down, cheap to move from any thread
+ *
+ * \note The level is the sum of all the Add calls, so a thread may undo the
+ *       Add of another one.
+ */
+class Gauge {
+ public:
+  LEXER_DLL void Add(int64_t delta) const;
+
+ private:
+  friend LEXER_DLL Gauge GetGauge(const std::string& name,
+                                  const std::string& help,
+                                  const Labels& labels);
+  explicit Gauge(uint32_t id) : id_(id) {}
+
+  uint32_t id_;
+};
+
+/*!
+ * \brief Register a counter, or get the one already registered with the
+ *        same name and labels
+ *
+ * \note Every metric of a name should have the same type and label keys.
+ */
+LEXER_DLL Counter GetCounter(const std::string& name, const std::string& help,
+                             const Labels& labels = {});
+
+/*! \brief Register a gauge, see GetCounter */
+LEXER_DLL Gauge GetGauge(const std::string& name, const std::string& help,
+                         const Labels& labels = {});
+
+/*! \brief The value of one metric at snapshot time */
+struct Sample {
+  std::string name;
+  std::string help;
+  MetricType type;
+  Labels labels;
+  int64_t value;
+};
+
+/*! \brief All the metrics, sorted by name */
+using Snapshot = std::vector<Sample>;
+
+/*! \brief Read every metric, summed over the threads */
+LEXER_DLL Snapshot TakeSnapshot();
+
+/*!
+ * \brief Write \a snapshot as a JSON array with one object per sample:
+ *        {"name": ..., "type": "counter", "labels": {...}, "value": N}
+ */
+LEXER_DLL void WriteJson(const Snapshot& snapshot, std::ostream& out);
+
+/*! \brief Write \a snapshot in the Prometheus text exposition format */
+LEXER_DLL void WritePrometheus(const Snapshot& snapshot, std::ostream& out);
+
+}  // namespace metrics
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_METRICS_H_
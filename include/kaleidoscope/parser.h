@@ -6,10 +6,13 @@
 #include <optional>
 #include <string>
 
+#include "kaleidoscope/alloc_tracker.h"
 #include "kaleidoscope/ast.h"
+#include "kaleidoscope/dump.h"
 #include "kaleidoscope/lexer.h"
 #include "kaleidoscope/macro.h"
 #include "kaleidoscope/token.h"
+#include "kaleidoscope/trace.h"
 
 namespace kaleidoscope {
 namespace parser {
@@ -24,12 +27,16 @@ class Parser {
   DEFPTR(VariableExprAST);
   DEFPTR(BinaryExprAST);
   DEFPTR(CallExprAST);
+  DEFPTR(IfExprAST);
+  DEFPTR(ForExprAST);
+  DEFPTR(VarExprAST);
   DEFPTR(ProtoTypeAST);
   DEFPTR(FunctionAST);
 
 #undef DEFPTR
 
-  Parser() = delete;
+  /*! \brief An empty parser, call ResetFile before Parse */
+  Parser() = default;
 
   explicit Parser(const std::string& src_path)
       : lexer_(src_path), current_token_(nullptr) {}
@@ -49,16 +56,28 @@ class Parser {
     return *this;
   }
 
+  /*! \brief Reuse this parser (and its lexer) for another source file */
+  void ResetFile(const std::string& src_path) { lexer_.ResetFile(src_path); }
+
+  /*! \brief Reuse this parser for a source in memory, see Lexer */
+  void ResetSource(const std::string& name, const std::string& source) {
+    lexer_.ResetSource(name, source);
+  }
+
   std::list<ASTPtr> Parse() {
     std::list<ASTPtr> ast_list;
     bool finish_parse = false;
     ASTPtr current = nullptr;
     std::optional<std::string> lexeme;
     bool has_error = false;
+    trace::Scope parse_scope("ParseFile", lexer_.GetSourceFilePath());
+    alloc::PhaseScope phase(alloc::Phase::kParse);
     lexer_.Reset();
     NextToken();
 
     while (!finish_parse) {
+      const size_t num_items = ast_list.size();
+      const int64_t trace_start = trace::IsEnabled() ? BeginTraceItem() : -1;
       switch (current_token_->tag) {
         case TokenTag::kEOF:
           finish_parse = true;
@@ -85,6 +104,16 @@ class Parser {
           if (lexeme && lexeme.value() == ";") {
             NextToken();
             break;
+          }
+          // an annotated definition
+          if (lexeme && lexeme.value() == "@") {
+            current = HandleDefinition();
+            if (current) {
+              ast_list.push_back(std::move(current));
+            } else {
+              has_error = true;
+            }
+            break;
           }  // else goto default.
         default:
           current = HandleGlobalExpr();
@@ -95,6 +124,9 @@ class Parser {
           }
           break;
       }
+      if (trace_start >= 0 && ast_list.size() > num_items) {
+        EndTraceItem(trace_start, *ast_list.back());
+      }
     }
     if (has_error) return {};
     return ast_list;
@@ -129,12 +161,43 @@ class Parser {
    */
   PARSER_DLL ExprASTPtr IdentifierExprAST();
 
+  /*!
+   * \brief Parse a IfExpr
+   *
+   * \note ifexpr ::= 'if' expr 'then' expr 'else' expr
+   *
+   * \return IfExprASTPtr
+   */
+  PARSER_DLL IfExprASTPtr IfExprAST();
+
+  /*!
+   * \brief Parse a ForExpr
+   *
+   * \note forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expr
+   *
+   * \return ForExprASTPtr
+   */
+  PARSER_DLL ForExprASTPtr ForExprAST();
+
+  /*!
+   * \brief Parse a VarExpr
+   *
+   * \note varexpr ::= 'var' identifier ('=' expr)?
+   *                   (',' identifier ('=' expr)?)* 'in' expr
+   *
+   * \return VarExprASTPtr
+   */
+  PARSER_DLL VarExprASTPtr VarExprAST();
+
   /*!
    * \brief Parse a PrimaryExpr
    *
    * \note primaryexpr ::= numberexpr
    *                   ::= parenexpr
    *                   ::= idexpr
+   *                   ::= ifexpr
+   *                   ::= forexpr
+   *                   ::= varexpr
    *
    * \return ExprASTPtr
    */
@@ -170,7 +233,7 @@ class Parser {
   /*!
    * \brief Parse a function
    *
-   * \note function ::= 'def' prototype expr
+   * \note function ::= ('@' identifier)* 'def' prototype expr
    *
    * \return FunctionASTPtr
    */
@@ -202,13 +265,33 @@ class Parser {
 
   PARSER_DLL void NextToken();
 
+  /*! \brief Reset the lexing counters of a top-level item, for tracing */
+  PARSER_DLL int64_t BeginTraceItem();
+
+  /*!
+   * \brief Record a "Parse" event for \a item, started at \a start_ns, and
+   *        a nested "Lex" event with the time its tokens took to lex
+   */
+  PARSER_DLL void EndTraceItem(int64_t start_ns, const ast::AST& item);
+
   PARSER_DLL std::optional<std::string> TryGetLexeme(TokenTag tag) const;
 
  private:
   std::shared_ptr<Token> current_token_;
   mutable lexer::Lexer lexer_;
+  // only counted while tracing
+  int64_t lex_ns_ = 0;
+  size_t num_lexed_ = 0;
 };
 
+/*!
+ * \brief Dump the top-level ASTs returned by Parser::Parse into \a out
+ *
+ * \note The text format is the same as streaming every AST with operator<<.
+ */
+PARSER_DLL void DumpASTList(const std::list<ast::AST::Ptr>& ast_list,
+                            DumpFormat format, OutputBuffer& out);
+
 }  // namespace parser
 }  // namespace kaleidoscope
 
@@ -0,0 +1,167 @@
+/*!
+ * \file thread_pool.h
+ * \brief A small work-stealing thread pool
+ */
+#ifndef KALEIDOSCOPE_THREAD_POOL_H_
+#define KALEIDOSCOPE_THREAD_POOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace kaleidoscope {
+
+/*!
+ * \brief A fixed-size thread pool where every worker owns a task queue
+ *
+ * Tasks are spread round-robin over the worker queues. A worker takes tasks
+ * from the front of its own queue and, once that is empty, steals from the
+ * back of the others, so a few slow tasks do not leave the other cores
+ * idle. Every task receives the index of the worker running it, which lets
+ * callers keep one reusable object (a Lexer, a Parser, ...) per worker.
+ */
+class WorkStealingPool {
+ public:
+  using Task = std::function<void(size_t worker_id)>;
+
+  /*!
+   * \brief Start \a num_workers threads, 0 means one per hardware thread
+   */
+  explicit WorkStealingPool(size_t num_workers = 0) {
+    if (num_workers == 0) {
+      num_workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < num_workers; ++i) {
+      queues_.push_back(std::make_unique<WorkerQueue>());
+    }
+    for (size_t i = 0; i < num_workers; ++i) {
+      workers_.emplace_back([this, i] { WorkerLoop(i); });
+    }
+  }
+
+  WorkStealingPool(const WorkStealingPool&) = delete;
+  WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto& worker : workers_) worker.join();
+  }
+
+  size_t NumWorkers() const { return workers_.size(); }
+
+  /*! \brief Queue a task, it may run on any worker */
+  void Submit(Task task) {
+    size_t queue_idx = next_queue_.fetch_add(1) % queues_.size();
+    {
+      std::lock_guard<std::mutex> lock(queues_[queue_idx]->mutex);
+      queues_[queue_idx]->tasks.push_back(std::move(task));
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++queued_;
+      ++pending_;
+    }
+    work_cv_.notify_one();
+  }
+
+  /*!
+   * \brief Block until every submitted task has finished
+   *
+   * \note If tasks threw, the first exception is rethrown here.
+   */
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] { return pending_ == 0; });
+    if (error_) {
+      auto error = error_;
+      error_ = nullptr;
+      std::rethrow_exception(error);
+    }
+  }
+
+  /*! \brief Run fn(worker_id, idx) for every idx in [0, n) and wait */
+  void ParallelFor(size_t n, const std::function<void(size_t, size_t)>& fn) {
+    for (size_t idx = 0; idx < n; ++idx) {
+      Submit([&fn, idx](size_t worker_id) { fn(worker_id, idx); });
+    }
+    Wait();
+  }
+
+ private:
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  /*! \brief Pop from the own queue first, then steal from the others */
+  bool TryPop(size_t worker_id, Task* task) {
+    size_t num_queues = queues_.size();
+    for (size_t i = 0; i < num_queues; ++i) {
+      auto& queue = *queues_[(worker_id + i) % num_queues];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.tasks.empty()) continue;
+      if (i == 0) {
+        *task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+      } else {
+        *task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+      }
+      return true;
+    }
+    return false;
+  }
+
+  void WorkerLoop(size_t worker_id) {
+    while (true) {
+      Task task;
+      if (TryPop(worker_id, &task)) {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          --queued_;
+        }
+        std::exception_ptr error = nullptr;
+        try {
+          task(worker_id);
+        } catch (...) {
+          error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (error && !error_) error_ = error;
+        if (--pending_ == 0) done_cv_.notify_all();
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_cv_.wait(lock, [this] { return stop_ || queued_ > 0; });
+      if (stop_ && queued_ == 0) return;
+    }
+  }
+
+  std::vector<std::unique_ptr<WorkerQueue>> queues_;
+  std::vector<std::thread> workers_;
+  std::atomic<size_t> next_queue_{0};
+
+  std::mutex mutex_;  // guards everything below
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  size_t queued_ = 0;   // tasks waiting in some queue
+  size_t pending_ = 0;  // tasks submitted but not finished
+  bool stop_ = false;
+  std::exception_ptr error_ = nullptr;
+};
+
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_THREAD_POOL_H_
@@ -27,10 +27,16 @@ enum class TokenTag {
   // keywords
   kKwDef,
   kKwExtern,
+  kKwIf,
+  kKwThen,
+  kKwElse,
+  kKwFor,
+  kKwIn,
+  kKwVar,
 };
-constexpr int kNumTokenTag = 9;
+constexpr int kNumTokenTag = 15;
 
-void InitTokenNameTable(const char** tag_names) {
+inline void InitTokenNameTable(const char** tag_names) {
   tag_names[0] = "kInvalid";
   tag_names[1] = "kEOF";
   tag_names[2] = "kDef";
@@ -40,9 +46,15 @@ void InitTokenNameTable(const char** tag_names) {
   tag_names[6] = "kPunctuator";
   tag_names[7] = "kKwDef";
   tag_names[8] = "kKwExtern";
+  tag_names[9] = "kKwIf";
+  tag_names[10] = "kKwThen";
+  tag_names[11] = "kKwElse";
+  tag_names[12] = "kKwFor";
+  tag_names[13] = "kKwIn";
+  tag_names[14] = "kKwVar";
 }
 
-const std::string_view DeprecateGetTokenTagName(TokenTag tag) {
+inline const std::string_view DeprecateGetTokenTagName(TokenTag tag) {
   static const char* tag_names[kNumTokenTag];
   std::once_flag flag;
   std::call_once(flag, InitTokenNameTable, tag_names);
@@ -50,7 +62,7 @@ const std::string_view DeprecateGetTokenTagName(TokenTag tag) {
   return std::string_view(tag_names[static_cast<int>(tag)]);
 }
 
-const std::string_view GetTokenTagName(TokenTag tag) {
+inline const std::string_view GetTokenTagName(TokenTag tag) {
 #if NAMEOF_TYPE_SUPPORTED
   return nameof::nameof_enum(tag);
 #else
@@ -128,6 +140,12 @@ struct Id : public Word {
 
 DECL_KEYWORD(Def, "def");
 DECL_KEYWORD(Extern, "extern");
+DECL_KEYWORD(If, "if");
+DECL_KEYWORD(Then, "then");
+DECL_KEYWORD(Else, "else");
+DECL_KEYWORD(For, "for");
+DECL_KEYWORD(In, "in");
+DECL_KEYWORD(Var, "var");
 
 #undef DECL_KEYWORD
 
@@ -0,0 +1,90 @@
+/*!
+ * \file trace.h
+ * \brief Compile-time profiling in the Chrome trace event format
+ *
+ * Like clang's -ftime-trace: the phases of the compiler open a Scope, and
+ * the recorded spans are written as JSON that chrome://tracing or Perfetto
+ * loads. Recording is off until Start, and a disabled Scope only loads one
+ * relaxed atomic flag.
+ */
+#ifndef KALEIDOSCOPE_TRACE_H_
+#define KALEIDOSCOPE_TRACE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "kaleidoscope/macro.h"
+
+namespace kaleidoscope {
+namespace trace {
+
+namespace detail {
+LEXER_DLL extern std::atomic<bool> enabled;
+}  // namespace detail
+
+/*! \brief Whether events are being recorded */
+inline bool IsEnabled() {
+  return detail::enabled.load(std::memory_order_relaxed);
+}
+
+/*!
+ * \brief Drop the recorded events and start recording
+ *
+ * \param granularity_us events shorter than this many microseconds are not
+ *        recorded, which keeps the traces of big programs small
+ */
+LEXER_DLL void Start(int64_t granularity_us = 0);
+
+/*!
+ * \brief Stop recording and write the events to \a path as Chrome trace
+ *        JSON, one track per thread
+ *
+ * \note Throws if \a path cannot be written.
+ */
+LEXER_DLL void Stop(const std::string& path);
+
+/*! \brief Nanoseconds on the trace clock */
+LEXER_DLL int64_t NowNanos();
+
+/*!
+ * \brief Record the span [start_ns, end_ns) of the calling thread
+ *
+ * \param detail shown as the "detail" argument of the event if not empty
+ */
+LEXER_DLL void AddEvent(const std::string& name, const std::string& detail,
+                        int64_t start_ns, int64_t end_ns);
+
+/*!
+ * \brief Record the lifetime of this object as an event named \a name
+ *
+ * \note \a detail is only read when the scope ends, it must outlive it.
+ */
+class Scope {
+ public:
+  explicit Scope(const char* name, const std::string* detail = nullptr)
+      : name_(name), detail_(detail) {
+    if (IsEnabled()) start_ns_ = NowNanos();
+  }
+
+  Scope(const char* name, const std::string& detail) : Scope(name, &detail) {}
+
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+
+  ~Scope() {
+    if (start_ns_ < 0) return;
+    AddEvent(name_, detail_ ? *detail_ : std::string(), start_ns_,
+             NowNanos());
+  }
+
+ private:
+  const char* name_;
+  const std::string* detail_;
+  int64_t start_ns_ = -1;
+};
+
+}  // namespace trace
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_TRACE_H_
@@ -0,0 +1,200 @@
+/*!
+ * \file vm.h
+ * \brief A register bytecode and its interpreter, an execution backend that
+ *        does not depend on LLVM.
+ *
+ * A Program is one flat image which is also the on-disk format, so a saved
+ * program is mmap'd and run in place without any decoding. All integers are
+ * in host byte order (little-endian on every target we build for), and every
+ * section starts 4-byte aligned, doubles 8-byte aligned:
+ *
+ *   FileHeader
+ *   f64          constants[num_constants]
+ *   Instruction  code[num_instructions]
+ *   FunctionInfo functions[num_functions]
+ *   NativeInfo   natives[num_natives]
+ *   u32          entries[num_entries]      top-level expressions, in order
+ *   char         strings[strings_size]     '\0' terminated names
+ *
+ * Every function has its own window of registers, the parameters being the
+ * first ones. A call passes its arguments in consecutive registers of the
+ * caller, and the window of the callee starts right at the first of them,
+ * so arguments are never copied. The result replaces the first argument.
+ * Jumps are relative to the jump itself and stay within their function.
+ */
+#ifndef KALEIDOSCOPE_VM_H_
+#define KALEIDOSCOPE_VM_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "kaleidoscope/ast.h"
+#include "kaleidoscope/macro.h"
+
+namespace kaleidoscope {
+namespace vm {
+
+enum class OpCode : uint8_t {
+  kConst,       // r[a] = constants[bc]
+  kMove,        // r[a] = r[b]
+  kAdd,         // r[a] = r[b] + r[c]
+  kSub,         // r[a] = r[b] - r[c]
+  kMul,         // r[a] = r[b] * r[c]
+  kDiv,         // r[a] = r[b] / r[c]
+  kLess,        // r[a] = r[b] < r[c] or either is NaN ? 1.0 : 0.0
+  kCall,        // r[a] = functions[bc](r[a], r[a + 1], ...)
+  kCallNative,  // r[a] = natives[bc](r[a], r[a + 1], ...)
+  kRet,         // return r[a]
+  kJump,        // pc += int32(bc)
+  kJumpIfZero,  // pc += r[a] is 0 or NaN ? int32(bc) : 1
+  kNumOpCode,
+};
+
+/*! \brief Fixed-size instruction, `bc` is the 32-bit operand b | c << 16 */
+struct Instruction {
+  OpCode op;
+  uint8_t reserved;
+  uint16_t a;
+  uint16_t b;
+  uint16_t c;
+
+  uint32_t bc() const { return b | static_cast<uint32_t>(c) << 16; }
+};
+static_assert(sizeof(Instruction) == 8, "Instruction must stay 8 bytes");
+
+struct FunctionInfo {
+  uint32_t name;  // offset into the strings
+  uint32_t num_params;
+  uint32_t num_registers;
+  uint32_t code_begin;
+  uint32_t code_size;
+  uint32_t reserved;
+};
+
+/*! \brief A host function, resolved by name when the program is loaded */
+struct NativeInfo {
+  uint32_t name;
+  uint32_t num_params;
+};
+
+constexpr char kBytecodeMagic[4] = {'K', 'B', 'C', '1'};
+constexpr uint32_t kBytecodeVersion = 2;
+
+struct FileHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t num_constants;
+  uint32_t num_instructions;
+  uint32_t num_functions;
+  uint32_t num_natives;
+  uint32_t num_entries;
+  uint32_t strings_size;
+};
+
+/*! \brief Signature of the host functions callable through kCallNative */
+using NativeFunction = double (*)(const double* args);
+
+/*!
+ * \brief Look up a builtin host function: the <cmath> functions like sin or
+ *        pow, and putchard/printd which print a char/number to stderr
+ *
+ * \return nullptr if there is no builtin \a name of \a num_params parameters
+ */
+VM_DLL NativeFunction FindNative(const std::string& name, uint32_t num_params);
+
+/*! \brief A validated bytecode image, owned or mapped from a file */
+class Program {
+ public:
+  Program() = default;
+
+  /*! \brief Take over a serialized image, throw if it is malformed */
+  VM_DLL static Program FromImage(std::string image);
+
+  /*! \brief Map a file written by Save, throw if it is malformed */
+  VM_DLL static Program MapFile(const std::string& path);
+
+  VM_DLL void Save(const std::string& path) const;
+
+  const FileHeader& Header() const { return *header_; }
+  const double* Constants() const { return constants_; }
+  const Instruction* Code() const { return code_; }
+  const FunctionInfo* Functions() const { return functions_; }
+  const NativeInfo* Natives() const { return natives_; }
+  const uint32_t* Entries() const { return entries_; }
+  const char* Name(uint32_t offset) const { return strings_ + offset; }
+  size_t ImageSize() const { return size_; }
+
+  /*! \return the index of function \a name, or -1 */
+  VM_DLL int64_t FindFunction(const std::string& name) const;
+
+ private:
+  /*! \brief Point the sections into the image and check all of it */
+  void Attach(std::shared_ptr<const char> data, size_t size);
+
+  std::shared_ptr<const char> data_;  // keeps the buffer or mapping alive
+  size_t size_ = 0;
+  const FileHeader* header_ = nullptr;
+  const double* constants_ = nullptr;
+  const Instruction* code_ = nullptr;
+  const FunctionInfo* functions_ = nullptr;
+  const NativeInfo* natives_ = nullptr;
+  const uint32_t* entries_ = nullptr;
+  const char* strings_ = nullptr;
+};
+
+/*!
+ * \brief Compiles the items returned by Parser::Parse into a Program
+ *
+ * Like the LLVM code generator, a failing item is reported with a warning
+ * and skipped. Functions may be called before their definition, calls to
+ * functions that are never defined go to the builtin of the same name.
+ */
+class BytecodeCompiler {
+ public:
+  VM_DLL BytecodeCompiler();
+  VM_DLL ~BytecodeCompiler();
+
+  /*! \return false if \a ast_ptr could not be compiled */
+  VM_DLL bool Add(const ast::AST* ast_ptr);
+
+  /*! \brief Resolve the remaining calls and build the image */
+  VM_DLL Program Finish();
+
+ private:
+  class Impl;
+  std::unique_ptr<Impl> pimpl_;
+};
+
+/*! \brief Runs the functions of a Program, not thread safe */
+class VM {
+ public:
+  /*!
+   * \param program must outlive the VM
+   * \param stack_size number of registers of all active calls together
+   */
+  VM_DLL explicit VM(const Program& program, size_t stack_size = 1 << 20);
+
+  /*! \brief Call function \a function_idx, throw on a stack overflow */
+  VM_DLL double Call(uint32_t function_idx, const double* args);
+
+  /*! \brief Run the top-level expressions and collect their values */
+  VM_DLL void RunEntries(std::vector<double>* results);
+
+ private:
+  struct Frame {
+    const Instruction* return_pc;
+    double* registers;
+  };
+
+  const Program& program_;
+  std::vector<NativeFunction> natives_;
+  std::vector<double> stack_;
+  std::vector<Frame> frames_;
+};
+
+}  // namespace vm
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_VM_H_
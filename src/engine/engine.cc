@@ -0,0 +1,261 @@
+#include "kaleidoscope/engine.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "jit.h"
+#include "kaleidoscope/ast.h"
+#include "kaleidoscope/logging.h"
+#include "kaleidoscope/metrics.h"
+#include "kaleidoscope/parser.h"
+#include "llvm/Support/Error.h"
+
+namespace kaleidoscope {
+
+namespace {
+
+struct EngineMetrics {
+  metrics::Counter hits = metrics::GetCounter(
+      "klang_engine_cache_hits_total", "Sources compiled before");
+  metrics::Counter misses = metrics::GetCounter(
+      "klang_engine_cache_misses_total", "Sources compiled by the engine");
+  metrics::Counter evictions = metrics::GetCounter(
+      "klang_engine_cache_evictions_total",
+      "Modules dropped from the engine cache");
+};
+
+const EngineMetrics& GetEngineMetrics() {
+  static const EngineMetrics engine_metrics;
+  return engine_metrics;
+}
+
+ir::OptLevel ToOptLevel(int opt_level) {
+  switch (opt_level) {
+    case 0:
+      return ir::OptLevel::kO0;
+    case 1:
+      return ir::OptLevel::kO1;
+    case 2:
+      return ir::OptLevel::kO2;
+    case 3:
+      return ir::OptLevel::kO3;
+  }
+  LOG_FATAL << "Unknown optimization level " << opt_level;
+  return ir::OptLevel::kO0;
+}
+
+}  // namespace
+
+class CompiledModule {
+ public:
+  /*! \brief The JIT of an Engine, which its modules may outlive */
+  struct SharedJIT {
+    explicit SharedJIT(const ir::JITOptions& options) : jit(options) {}
+
+    std::mutex mutex;  // guards the use of jit
+    ir::KaleidoscopeJIT jit;
+  };
+
+  struct Function {
+    std::string name;
+    size_t num_args;
+    void* address;
+  };
+
+  CompiledModule(std::shared_ptr<SharedJIT> jit, std::string_view source,
+                 uint64_t hash)
+      : jit_(std::move(jit)), source_(source), hash_(hash) {}
+
+  ~CompiledModule() {
+    if (!tracker_) return;
+    std::lock_guard<std::mutex> lock(jit_->mutex);
+    if (auto error = tracker_->remove()) {
+      LOG_WARNING << "Failed to remove a module: "
+                  << llvm::toString(std::move(error)) << std::endl;
+    }
+  }
+
+  CompiledModule(const CompiledModule&) = delete;
+  CompiledModule& operator=(const CompiledModule&) = delete;
+
+  /*!
+   * \brief Compile \a module, holding the functions listed, and look them
+   *        up by the names they got in it
+   */
+  void Link(ir::GeneratedModule module, std::vector<Function> functions,
+            const std::vector<std::string>& symbols) {
+    std::lock_guard<std::mutex> lock(jit_->mutex);
+    tracker_ = jit_->jit.AddRemovableModule(std::move(module));
+    for (size_t i = 0; i < functions.size(); ++i) {
+      functions[i].address = jit_->jit.Lookup(symbols[i]);
+    }
+    functions_ = std::move(functions);
+  }
+
+  const Function* Find(std::string_view name) const {
+    // a handful of functions, a scan beats hashing the name
+    for (const auto& func : functions_) {
+      if (func.name == name) return &func;
+    }
+    return nullptr;
+  }
+
+  const std::string& GetSource() const { return source_; }
+  uint64_t GetHash() const { return hash_; }
+
+ private:
+  std::shared_ptr<SharedJIT> jit_;
+  std::string source_;  // tells sources of the same hash apart
+  uint64_t hash_;
+  llvm::orc::ResourceTrackerSP tracker_;
+  std::vector<Function> functions_;
+};
+
+class Engine::Impl {
+ public:
+  explicit Impl(const EngineOptions& options)
+      : capacity_(options.cache_capacity) {
+    GetEngineMetrics();
+    ir::JITOptions jit_options;
+    // the functions are looked up right after they are compiled anyway
+    jit_options.lazy = false;
+    jit_options.opt_level = ToOptLevel(options.opt_level);
+    CHECK(ir::ParseFPMode(options.fp_mode, &fp_mode_))
+        << "Unknown floating-point mode " << options.fp_mode;
+    jit_options.fp_mode = fp_mode_;
+    jit_ = std::make_shared<CompiledModule::SharedJIT>(jit_options);
+  }
+
+  ModuleHandle Compile(std::string_view source) {
+    const uint64_t hash = std::hash<std::string_view>()(source);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto found = by_hash_.find(hash);
+      if (found != by_hash_.end() &&
+          (*found->second)->GetSource() == source) {
+        lru_.splice(lru_.begin(), lru_, found->second);
+        GetEngineMetrics().hits.Add();
+        return *found->second;
+      }
+    }
+
+    GetEngineMetrics().misses.Add();
+    ModuleHandle module = Build(source, hash);
+
+    // the code of the modules dropped is freed once the lock is released
+    std::vector<ModuleHandle> evicted;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = by_hash_.find(hash);
+    if (found != by_hash_.end()) {
+      // compiled by another thread in the meantime
+      if ((*found->second)->GetSource() == source) {
+        lru_.splice(lru_.begin(), lru_, found->second);
+        return *found->second;
+      }
+      evicted.push_back(std::move(*found->second));
+      lru_.erase(found->second);
+      by_hash_.erase(found);
+    }
+    lru_.push_front(module);
+    by_hash_[hash] = lru_.begin();
+    while (lru_.size() > capacity_) {
+      evicted.push_back(std::move(lru_.back()));
+      by_hash_.erase(evicted.back()->GetHash());
+      lru_.pop_back();
+    }
+    GetEngineMetrics().evictions.Add(evicted.size());
+    return module;
+  }
+
+  size_t NumCached() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return lru_.size();
+  }
+
+ private:
+  ModuleHandle Build(std::string_view source, uint64_t hash) {
+    parser::Parser parser;
+    parser.ResetSource("<engine>", std::string(source));
+    std::list<ast::AST::Ptr> items = parser.Parse();
+    CHECK(!items.empty()) << "Cannot parse the source";
+
+    ir::AstLLVMCodeGen codegen;
+    const std::string id = std::to_string(next_id_++);
+    codegen.NewModule("engine." + id);
+    codegen.SetFPMode(fp_mode_);
+    codegen.SetDiscardValueNames(true);
+    codegen.SetMemoize(false);
+    std::vector<CompiledModule::Function> functions;
+    for (const auto& item : items) {
+      if (item->GetType() == ast::ASTType::kPrototype) {
+        auto* proto = static_cast<ast::ProtoTypeAST*>(item.get());
+        CHECK(codegen.visit(proto))
+            << "Cannot declare the function " << proto->GetName();
+        continue;
+      }
+      CHECK(item->GetType() == ast::ASTType::kFunction)
+          << "Unexpected top-level expression";
+      auto* func_ast = static_cast<ast::FunctionAST*>(item.get());
+      const ast::ProtoTypeAST* proto = func_ast->GetProto();
+      if (proto->GetName().empty()) {
+        LOG_WARNING << "Skipped a top-level expression, nothing runs it"
+                    << std::endl;
+        continue;
+      }
+      CHECK(codegen.visit(func_ast))
+          << "Cannot compile the function " << proto->GetName();
+      functions.push_back(CompiledModule::Function{
+          proto->GetName(), proto->GetArgs().size(), nullptr});
+    }
+
+    // all the modules share the JIT, so every one defines its functions
+    // under names of its own, which no kaleidoscope identifier can clash
+    // with
+    std::vector<std::string> symbols;
+    llvm::Module* llvm_module = codegen.GetModule();
+    for (const auto& func : functions) {
+      symbols.push_back(func.name + ".engine." + id);
+      llvm_module->getFunction(func.name)->setName(symbols.back());
+    }
+
+    auto module = std::make_shared<CompiledModule>(jit_, source, hash);
+    module->Link(codegen.TakeModule(), std::move(functions), symbols);
+    return module;
+  }
+
+  size_t capacity_;
+  ir::FPMode fp_mode_ = ir::FPMode::kStrict;
+  std::shared_ptr<CompiledModule::SharedJIT> jit_;
+  std::atomic<uint64_t> next_id_{0};
+
+  mutable std::mutex mutex_;  // guards the cache below
+  // most recently used first
+  std::list<ModuleHandle> lru_;
+  std::unordered_map<uint64_t, std::list<ModuleHandle>::iterator> by_hash_;
+};
+
+Engine::Engine(const EngineOptions& options)
+    : pimpl_(std::make_unique<Impl>(options)) {}
+
+Engine::~Engine() = default;
+
+ModuleHandle Engine::Compile(std::string_view source) {
+  return pimpl_->Compile(source);
+}
+
+void* Engine::Lookup(const ModuleHandle& module, std::string_view name,
+                     size_t num_args) const {
+  const CompiledModule::Function* func = module->Find(name);
+  if (func == nullptr || func->num_args != num_args) return nullptr;
+  return func->address;
+}
+
+size_t Engine::NumCached() const { return pimpl_->NumCached(); }
+
+}  // namespace kaleidoscope
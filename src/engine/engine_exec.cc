@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "kaleidoscope/engine.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double NanosSince(Clock::time_point start, size_t times = 1) {
+  return std::chrono::duration<double, std::nano>(Clock::now() - start)
+             .count() /
+         static_cast<double>(times);
+}
+
+std::string ReadSource(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) throw std::runtime_error("Cannot open " + path);
+  std::ostringstream source;
+  source << in.rdbuf();
+  return source.str();
+}
+
+}  // namespace
+
+// Usage:
+//   klang_engine <src> <function> [--threads=N] [--calls=N] [--cache=N]
+//                [-O0|-O1|-O2|-O3]
+// Compiles the source with kaleidoscope::Engine, then prints the time of
+// compiling it the first time and once cached, of looking the function up,
+// and the calls per second of the function taking 1 as its only argument
+// from --threads threads at once, --calls calls each.
+int main(int argc, char** argv) {
+  kaleidoscope::EngineOptions options;
+  std::vector<std::string> paths;
+  size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+  uint64_t num_calls = 10000000;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 10, "--threads=") == 0) {
+      num_threads = std::max(1ul, std::stoul(arg.substr(10)));
+    } else if (arg.compare(0, 8, "--calls=") == 0) {
+      num_calls = std::stoull(arg.substr(8));
+    } else if (arg.compare(0, 8, "--cache=") == 0) {
+      options.cache_capacity = std::stoul(arg.substr(8));
+    } else if (arg.size() == 3 && arg.compare(0, 2, "-O") == 0 &&
+               arg[2] >= '0' && arg[2] <= '3') {
+      options.opt_level = arg[2] - '0';
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.size() != 2) {
+    throw std::runtime_error("A source path and a function should be given.");
+  }
+  const std::string source = ReadSource(paths[0]);
+
+  kaleidoscope::Engine engine(options);
+  auto start = Clock::now();
+  kaleidoscope::ModuleHandle module = engine.Compile(source);
+  const double cold_ns = NanosSince(start);
+
+  constexpr size_t kRounds = 100000;
+  start = Clock::now();
+  for (size_t i = 0; i < kRounds; ++i) module = engine.Compile(source);
+  const double cached_ns = NanosSince(start, kRounds);
+
+  using Formula = double(double);
+  Formula* func = nullptr;
+  start = Clock::now();
+  for (size_t i = 0; i < kRounds; ++i) {
+    func = engine.Lookup<Formula>(module, paths[1]);
+  }
+  const double lookup_ns = NanosSince(start, kRounds);
+  if (func == nullptr) {
+    throw std::runtime_error("No function " + paths[1] +
+                             " taking one argument.");
+  }
+
+  // every thread sums its results so that none of the calls is dropped
+  std::vector<double> sums(num_threads);
+  std::vector<std::thread> threads;
+  start = Clock::now();
+  for (size_t t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t] {
+      double sum = 0;
+      for (uint64_t i = 0; i < num_calls; ++i) sum += func(1);
+      sums[t] = sum;
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  const double call_seconds = NanosSince(start) / 1e9;
+
+  std::cout << paths[1] << "(1) = " << func(1) << '\n'
+            << "compile: " << cold_ns / 1e6 << " ms\n"
+            << "compile, cached: " << cached_ns << " ns\n"
+            << "lookup: " << lookup_ns << " ns\n"
+            << "calls: "
+            << static_cast<double>(num_calls * num_threads) / call_seconds
+            << " per second over " << num_threads << " threads"
+            << std::endl;
+  return 0;
+}
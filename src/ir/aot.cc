@@ -0,0 +1,277 @@
+#include "aot.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <unordered_set>
+
+#include "ipo.h"
+#include "kaleidoscope/alloc_tracker.h"
+#include "kaleidoscope/logging.h"
+#include "kaleidoscope/trace.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/raw_ostream.h"
+#include "specialize.h"
+
+namespace kaleidoscope {
+namespace ir {
+
+namespace {
+
+// parameter names that would not compile in C or C++
+bool IsCKeyword(const std::string& name) {
+  static const std::unordered_set<std::string> keywords = {
+      "auto",     "bool",     "break",    "case",     "catch",
+      "char",     "class",    "const",    "continue", "default",
+      "delete",   "do",       "double",   "else",     "enum",
+      "explicit", "extern",   "false",    "float",    "for",
+      "friend",   "goto",     "if",       "inline",   "int",
+      "long",     "namespace", "new",     "operator", "private",
+      "protected", "public",  "register", "restrict", "return",
+      "short",    "signed",   "sizeof",   "static",   "struct",
+      "switch",   "template", "this",     "throw",    "true",
+      "try",      "typedef",  "typename", "union",    "unsigned",
+      "using",    "virtual",  "void",     "volatile", "while"};
+  return keywords.count(name) != 0;
+}
+
+// foo/bar-baz.h gives BAR_BAZ_H_
+std::string HeaderGuard(const std::string& path) {
+  std::string base = path.substr(path.find_last_of('/') + 1);
+  std::string guard;
+  for (char c : base) {
+    guard.push_back(std::isalnum(static_cast<unsigned char>(c))
+                        ? static_cast<char>(
+                              std::toupper(static_cast<unsigned char>(c)))
+                        : '_');
+  }
+  return guard + "_";
+}
+
+// instruction selection and scheduling effort matching the IR pipeline
+llvm::CodeGenOpt::Level CodeGenLevel(OptLevel level) {
+  switch (level) {
+    case OptLevel::kO0:
+      return llvm::CodeGenOpt::None;
+    case OptLevel::kO3:
+      return llvm::CodeGenOpt::Aggressive;
+    default:
+      return llvm::CodeGenOpt::Default;
+  }
+}
+
+}  // namespace
+
+std::unique_ptr<llvm::TargetMachine> CreateTargetMachine(
+    const std::string& cpu, llvm::CodeGenOpt::Level level, bool pic) {
+  InitializeNativeTarget();
+  std::string triple = llvm::sys::getProcessTriple();
+  std::string error;
+  const llvm::Target* target = llvm::TargetRegistry::lookupTarget(triple,
+                                                                  error);
+  if (!target) {
+    LOG_WARNING << "Unknown target " << triple << ": " << error << std::endl;
+    return nullptr;
+  }
+
+  std::string cpu_name = cpu;
+  llvm::SubtargetFeatures features;
+  if (cpu == "native") {
+    cpu_name = llvm::sys::getHostCPUName().str();
+    llvm::StringMap<bool> host_features;
+    if (llvm::sys::getHostCPUFeatures(host_features)) {
+      for (const auto& feature : host_features) {
+        features.AddFeature(feature.first(), feature.second);
+      }
+    }
+  }
+
+  std::unique_ptr<llvm::MCSubtargetInfo> subtarget(
+      target->createMCSubtargetInfo(triple, cpu_name, ""));
+  if (!subtarget || !subtarget->isCPUStringValid(cpu_name)) {
+    LOG_WARNING << "Unknown CPU " << cpu_name << " for " << triple
+                << std::endl;
+    return nullptr;
+  }
+
+  llvm::Optional<llvm::Reloc::Model> reloc;
+  if (pic) reloc = llvm::Reloc::PIC_;
+  return std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(
+      triple, cpu_name, features.getString(), llvm::TargetOptions(), reloc,
+      llvm::None, level));
+}
+
+AOTCompiler::AOTCompiler(const AOTOptions& options,
+                         const std::string& module_name)
+    : options_(options),
+      target_machine_(CreateTargetMachine(
+          options.cpu, CodeGenLevel(options.opt_level), options.pic)) {
+  codegen_.SetDiscardValueNames(options.discard_value_names);
+  codegen_.NewModule(module_name);
+  codegen_.SetFPMode(options.fp_mode);
+  // the host may call the functions from any thread
+  codegen_.SetMemoize(false);
+}
+
+size_t AOTCompiler::Add(const std::list<ast::AST::Ptr>& items) {
+  size_t num_errors = 0;
+  for (const auto& item : items) {
+    switch (item->GetType()) {
+      case ast::ASTType::kPrototype:
+        if (!codegen_.visit(static_cast<ast::ProtoTypeAST*>(item.get()))) {
+          ++num_errors;
+        }
+        break;
+
+      case ast::ASTType::kFunction: {
+        auto* func_ast = static_cast<ast::FunctionAST*>(item.get());
+        const ast::ProtoTypeAST* proto = func_ast->GetProto();
+        if (proto->GetName().empty()) {
+          LOG_WARNING << "Skipped a top-level expression, nothing runs it "
+                      << "ahead of time" << std::endl;
+          break;
+        }
+        if (!codegen_.visit(func_ast)) {
+          ++num_errors;
+          break;
+        }
+        // a clone of SpecializeCalls is an implementation detail
+        if (IsSpecialization(proto->GetName())) break;
+        if (options_.exports.empty() ||
+            std::find(options_.exports.begin(), options_.exports.end(),
+                      proto->GetName()) != options_.exports.end()) {
+          exports_.emplace_back(proto->GetName(), proto->GetArgs());
+        }
+        break;
+      }
+
+      case ast::ASTType::kExpr:
+        LOG_WARNING << "Unexpected top-level expression" << std::endl;
+        ++num_errors;
+        break;
+    }
+  }
+  for (const auto& name : options_.exports) {
+    auto is_defined = [&name](const std::pair<std::string,
+                                              std::vector<std::string>>& e) {
+      return e.first == name;
+    };
+    if (std::find_if(exports_.begin(), exports_.end(), is_defined) ==
+        exports_.end()) {
+      LOG_WARNING << "Exported function " << name << " is not defined"
+                  << std::endl;
+      ++num_errors;
+    }
+  }
+  return num_errors;
+}
+
+void AOTCompiler::Finish() {
+  if (finished_) return;
+  finished_ = true;
+  llvm::Module* module = codegen_.GetModule();
+  module->setTargetTriple(target_machine_->getTargetTriple().str());
+  module->setDataLayout(target_machine_->createDataLayout());
+  for (auto& func : *module) {
+    if (!func.isDeclaration() && IsSpecialization(func.getName().str())) {
+      func.setLinkage(llvm::GlobalValue::InternalLinkage);
+    }
+  }
+  OptLevel level = options_.opt_level;
+  if (options_.whole_program) {
+    std::unordered_set<std::string> exports;
+    for (const auto& func : exports_) exports.insert(func.first);
+    PrepareWholeProgram(*module, exports);
+    // the inliner, IPSCCP and GlobalDCE only run from -O2 on
+    if (level == OptLevel::kO0 || level == OptLevel::kO1) {
+      level = OptLevel::kO2;
+    }
+  }
+  Optimizer optimizer(level, false, target_machine_.get());
+  optimizer.Run(*module);
+}
+
+bool AOTCompiler::WriteObject(const std::string& path) {
+  Finish();
+  trace::Scope scope("EmitObject", path);
+  alloc::PhaseScope phase(alloc::Phase::kJIT);
+  std::error_code ec;
+  llvm::raw_fd_ostream out(path, ec, llvm::sys::fs::OF_None);
+  if (ec) {
+    LOG_WARNING << "Failed to open " << path << ": " << ec.message()
+                << std::endl;
+    return false;
+  }
+  if (!EmitObject(out)) return false;
+  out.flush();
+  return true;
+}
+
+bool AOTCompiler::WriteObject(llvm::SmallVectorImpl<char>* object) {
+  Finish();
+  trace::Scope scope("EmitObject");
+  alloc::PhaseScope phase(alloc::Phase::kJIT);
+  llvm::raw_svector_ostream out(*object);
+  return EmitObject(out);
+}
+
+bool AOTCompiler::EmitObject(llvm::raw_pwrite_stream& out) {
+  llvm::legacy::PassManager pass_manager;
+  if (target_machine_->addPassesToEmitFile(pass_manager, out, nullptr,
+                                           llvm::CGFT_ObjectFile)) {
+    LOG_WARNING << "The target cannot emit object files" << std::endl;
+    return false;
+  }
+  pass_manager.run(*codegen_.GetModule());
+  return true;
+}
+
+bool AOTCompiler::WriteIR(const std::string& path) {
+  Finish();
+  std::error_code ec;
+  llvm::raw_fd_ostream out(path, ec, llvm::sys::fs::OF_Text);
+  if (ec) {
+    LOG_WARNING << "Failed to open " << path << ": " << ec.message()
+                << std::endl;
+    return false;
+  }
+  codegen_.GetModule()->print(out, nullptr);
+  return true;
+}
+
+bool AOTCompiler::WriteHeader(const std::string& path,
+                              const std::string& source_name) const {
+  std::ofstream out(path);
+  if (!out) {
+    LOG_WARNING << "Failed to open " << path << std::endl;
+    return false;
+  }
+
+  const std::string guard = HeaderGuard(path);
+  out << "/* Generated by klang_compile from " << source_name
+      << ", do not edit. */\n"
+      << "#ifndef " << guard << "\n#define " << guard << "\n\n"
+      << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+  for (const auto& func : exports_) {
+    out << "double " << func.first << "(";
+    if (func.second.empty()) out << "void";
+    for (size_t i = 0; i < func.second.size(); ++i) {
+      if (i != 0) out << ", ";
+      out << "double";
+      if (!IsCKeyword(func.second[i])) out << ' ' << func.second[i];
+    }
+    out << ");\n";
+  }
+  out << "\n#ifdef __cplusplus\n}  /* extern \"C\" */\n#endif\n\n"
+      << "#endif  /* " << guard << " */\n";
+  return static_cast<bool>(out);
+}
+
+}  // namespace ir
+}  // namespace kaleidoscope
@@ -0,0 +1,113 @@
+/*!
+ * \file aot.h
+ * \brief Ahead-of-time compilation of kaleidoscope sources to native objects
+ */
+#ifndef KALEIDOSCOPE_IR_AOT_H_
+#define KALEIDOSCOPE_IR_AOT_H_
+
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ast_visiter.h"
+#include "kaleidoscope/ast.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "optimizer.h"
+
+namespace kaleidoscope {
+namespace ir {
+
+struct AOTOptions {
+  // CPU to tune and select instructions for, "native" for the host one
+  std::string cpu = "native";
+  OptLevel opt_level = OptLevel::kO2;
+  // position independent code, needed to link the object into a .so
+  bool pic = true;
+  // mark pure functions and internalize the ones not exported before
+  // optimizing, see PrepareWholeProgram
+  bool whole_program = false;
+  // functions visible from the object and declared in the header, all the
+  // definitions if empty
+  std::vector<std::string> exports;
+  // floating-point semantics of the functions without an annotation
+  FPMode fp_mode = FPMode::kStrict;
+  // emit unnamed instructions, for objects only as it makes IR harder to
+  // read
+  bool discard_value_names = false;
+};
+
+/*!
+ * \brief Create a target machine for the host triple and \a cpu
+ *
+ * "native" picks the host CPU with all of its features, any other name
+ * gets the features that CPU implies.
+ *
+ * \return nullptr if the target or the CPU is unknown
+ */
+std::unique_ptr<llvm::TargetMachine> CreateTargetMachine(
+    const std::string& cpu, llvm::CodeGenOpt::Level level, bool pic);
+
+/*!
+ * \brief Lowers a whole program into one module and writes it as a
+ *        relocatable object, along with a C header declaring its functions
+ *
+ * Named definitions are exported as `double name(double, ...)` with C
+ * linkage, so host applications link formulas without any JIT start-up.
+ * Top-level expressions have nothing to run them and are skipped. `@memo`
+ * is ignored, as the cache of a memoized function cannot be shared between
+ * the threads of the host.
+ */
+class AOTCompiler {
+ public:
+  AOTCompiler(const AOTOptions& options, const std::string& module_name);
+
+  /*!
+   * \brief Lower the items returned by Parser::Parse
+   *
+   * \return the number of items that failed to lower
+   */
+  size_t Add(const std::list<ast::AST::Ptr>& items);
+
+  /*! \brief Optimize the module and write it as an object file */
+  bool WriteObject(const std::string& path);
+
+  /*! \brief Same as above, appending the object file to \a object */
+  bool WriteObject(llvm::SmallVectorImpl<char>* object);
+
+  /*! \brief Write the module as textual LLVM IR, after optimizing it */
+  bool WriteIR(const std::string& path);
+
+  /*!
+   * \brief Write a C header declaring every exported function
+   *
+   * \param source_name mentioned in the header comment
+   */
+  bool WriteHeader(const std::string& path,
+                   const std::string& source_name) const;
+
+  /*! \brief false if the target machine could not be created */
+  bool IsValid() const { return target_machine_ != nullptr; }
+
+ private:
+  /*! \brief Run the optimization pipeline once, before anything is written */
+  void Finish();
+
+  bool EmitObject(llvm::raw_pwrite_stream& out);
+
+  AOTOptions options_;
+  std::unique_ptr<llvm::TargetMachine> target_machine_;
+  AstLLVMCodeGen codegen_;
+  // name and parameter names of every exported function
+  std::vector<std::pair<std::string, std::vector<std::string>>> exports_;
+  bool finished_ = false;
+};
+
+}  // namespace ir
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_IR_AOT_H_
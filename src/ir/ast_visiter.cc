@@ -1,13 +1,23 @@
-#include <vector>
 #include "ast_visiter.h"
 
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+#include "kaleidoscope/alloc_tracker.h"
 #include "kaleidoscope/logging.h"
+#include "kaleidoscope/metrics.h"
+#include "kaleidoscope/trace.h"
+#include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
-#include "llvm/IR/Type.h"
-#include "llvm/IR/Function.h"
 #include "llvm/IR/DerivedTypes.h"
-#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/raw_ostream.h"
 
 namespace kaleidoscope {
 namespace ir {
@@ -18,20 +28,190 @@ namespace ir {
     return nullptr;                  \
   }
 
+bool ParseFPMode(const std::string& name, FPMode* mode) {
+  if (name == "strict") {
+    *mode = FPMode::kStrict;
+  } else if (name == "contract") {
+    *mode = FPMode::kContract;
+  } else if (name == "fast") {
+    *mode = FPMode::kFast;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* FPModeName(FPMode mode) {
+  switch (mode) {
+    case FPMode::kStrict:
+      return "strict";
+    case FPMode::kContract:
+      return "contract";
+    case FPMode::kFast:
+      return "fast";
+  }
+  return "";
+}
+
+void RenameDefinition(llvm::Function* func, const std::string& new_name) {
+  std::string name = func->getName().str();
+  func->setName(new_name);
+  auto* decl = llvm::Function::Create(func->getFunctionType(),
+                                      llvm::Function::ExternalLinkage, name,
+                                      func->getParent());
+  if (func->hasFnAttribute(llvm::Attribute::NoBuiltin)) {
+    decl->addFnAttr(llvm::Attribute::NoBuiltin);
+  }
+  func->replaceAllUsesWith(decl);
+}
+
+void AstLLVMCodeGen::NewModule(const std::string& name) {
+  // the module and builder must go before the context they live in
+  module_.reset();
+  builder_.reset();
+  context_ = std::make_unique<llvm::LLVMContext>();
+  context_->setDiscardValueNames(discard_value_names_);
+  builder_ = std::make_unique<llvm::IRBuilder<>>(*context_);
+  module_ = std::make_unique<llvm::Module>(name, *context_);
+}
+
+void AstLLVMCodeGen::SetDiscardValueNames(bool discard) {
+  discard_value_names_ = discard;
+  context_->setDiscardValueNames(discard);
+}
+
+GeneratedModule AstLLVMCodeGen::TakeModule() {
+  GeneratedModule generated;
+  std::string name = module_->getName().str();
+  generated.module = std::move(module_);
+  generated.context = std::move(context_);
+  NewModule(name);
+  return generated;
+}
+
+void AstLLVMCodeGen::ImportFunction(const ast::ProtoTypeAST* proto_ptr,
+                                    bool defined) {
+  function_protos_[proto_ptr->GetName()] = proto_ptr->GetArgs();
+  if (defined) {
+    defined_functions_.insert(proto_ptr->GetName());
+    user_functions_.insert(proto_ptr->GetName());
+  }
+}
+
+void AstLLVMCodeGen::ImportDefinition(const ast::ProtoTypeAST* proto_ptr) {
+  function_protos_[proto_ptr->GetName()] = proto_ptr->GetArgs();
+  user_functions_.insert(proto_ptr->GetName());
+}
+
+llvm::Function* AstLLVMCodeGen::GetFunction(const std::string& name) {
+  if (auto* func = module_->getFunction(name)) {
+    return func;
+  }
+
+  // declared or defined in a previous module, declare it in this one
+  auto proto = function_protos_.find(name);
+  if (proto != function_protos_.end()) {
+    ast::ProtoTypeAST decl(name, proto->second);
+    return visit(&decl);
+  }
+  return nullptr;
+}
+
+namespace {
+
+// C math functions with an LLVM intrinsic of the same meaning, which folds
+// constants, lowers to instructions like sqrtsd and widens when vectorized
+struct Builtin {
+  const char* name;
+  size_t num_args;
+  llvm::Intrinsic::ID id;
+};
+
+const Builtin kBuiltins[] = {
+    {"sin", 1, llvm::Intrinsic::sin},     {"cos", 1, llvm::Intrinsic::cos},
+    {"exp", 1, llvm::Intrinsic::exp},     {"log", 1, llvm::Intrinsic::log},
+    {"sqrt", 1, llvm::Intrinsic::sqrt},   {"fabs", 1, llvm::Intrinsic::fabs},
+    {"pow", 2, llvm::Intrinsic::pow},     {"floor", 1, llvm::Intrinsic::floor},
+    {"ceil", 1, llvm::Intrinsic::ceil},   {"fma", 3, llvm::Intrinsic::fma},
+    {"min", 2, llvm::Intrinsic::minnum},  {"max", 2, llvm::Intrinsic::maxnum},
+};
+
+llvm::Intrinsic::ID FindBuiltin(const std::string& name, size_t num_args) {
+  for (const auto& builtin : kBuiltins) {
+    if (builtin.num_args == num_args && name == builtin.name) {
+      return builtin.id;
+    }
+  }
+  return llvm::Intrinsic::not_intrinsic;
+}
+
+}  // namespace
+
+bool IsBuiltin(const std::string& name, size_t num_args) {
+  return FindBuiltin(name, num_args) != llvm::Intrinsic::not_intrinsic;
+}
+
+llvm::Function* AstLLVMCodeGen::GetCallee(const std::string& name,
+                                          size_t num_args) {
+  // a definition wins, in this module (recursive calls included), before
+  // or in another code generator
+  auto* func = module_->getFunction(name);
+  if ((func && !func->isDeclaration()) || user_functions_.count(name)) {
+    return GetFunction(name);
+  }
+  auto proto = function_protos_.find(name);
+  if (proto != function_protos_.end() && proto->second.size() == num_args) {
+    llvm::Intrinsic::ID id = FindBuiltin(name, num_args);
+    if (id != llvm::Intrinsic::not_intrinsic) {
+      return llvm::Intrinsic::getDeclaration(
+          module_.get(), id, {llvm::Type::getDoubleTy(*context_)});
+    }
+  }
+  return GetFunction(name);
+}
+
 llvm::Value* AstLLVMCodeGen::visit(ast::NumberExprAST* number_ptr) {
-  return llvm::ConstantFP::get(context_, llvm::APFloat(number_ptr->GetValue()));
+  return llvm::ConstantFP::get(*context_,
+                               llvm::APFloat(number_ptr->GetValue()));
 }
 
 llvm::Value* AstLLVMCodeGen::visit(ast::VariableExprAST* var_ptr) {
   // look this variable up in the function
-  llvm::Value* var = named_values[var_ptr->GetName()];
+  Variable* var = FindVariable(var_ptr->GetName());
   if (!var) {
     CodeGenError("Unkonwn variable name");
   }
-  return var;
+  if (auto* slot = llvm::dyn_cast<llvm::AllocaInst>(var->value)) {
+    return builder_->CreateLoad(slot->getAllocatedType(), slot,
+                                var_ptr->GetName());
+  }
+  return var->value;
 }
 
 llvm::Value* AstLLVMCodeGen::visit(ast::BinaryExprAST* bin_ptr) {
+  if (bin_ptr->GetOpTag() == ast::SupportBinaryOpTag::kAssign) {
+    if (bin_ptr->GetLHS()->GetExprType() != ast::ExprType::kVariable) {
+      CodeGenError("destination of '=' must be a variable");
+    }
+    const std::string& name =
+        static_cast<ast::VariableExprAST*>(bin_ptr->GetLHS())->GetName();
+    llvm::Value* value = visit(bin_ptr->GetRHS());
+    if (!value) {
+      return nullptr;
+    }
+    Variable* var = FindVariable(name);
+    if (!var) {
+      CodeGenError("Unkonwn variable name");
+    }
+    // every variable assigned in its scope has a stack slot
+    auto* slot = llvm::dyn_cast<llvm::AllocaInst>(var->value);
+    if (!slot) {
+      CodeGenError("Variable " << name << " cannot be assigned");
+    }
+    builder_->CreateStore(value, slot);
+    return value;
+  }
+
   llvm::Value* left_value = visit(bin_ptr->GetLHS());
   llvm::Value* right_value = visit(bin_ptr->GetRHS());
   if (!left_value || !right_value) {
@@ -40,16 +220,18 @@ llvm::Value* AstLLVMCodeGen::visit(ast::BinaryExprAST* bin_ptr) {
 
   switch (bin_ptr->GetOpTag()) {
     case ast::SupportBinaryOpTag::kAdd:
-      return builder_.CreateFAdd(left_value, right_value, "addtmp");
+      return builder_->CreateFAdd(left_value, right_value, "addtmp");
     case ast::SupportBinaryOpTag::kSub:
-      return builder_.CreateFSub(left_value, right_value, "subtmp");
+      return builder_->CreateFSub(left_value, right_value, "subtmp");
     case ast::SupportBinaryOpTag::kMul:
-      return builder_.CreateFMul(left_value, right_value, "multmp");
+      return builder_->CreateFMul(left_value, right_value, "multmp");
+    case ast::SupportBinaryOpTag::kDiv:
+      return builder_->CreateFDiv(left_value, right_value, "divtmp");
     case ast::SupportBinaryOpTag::kLess:
-      left_value = builder_.CreateFCmpULT(left_value, right_value, "cmptmp");
+      left_value = builder_->CreateFCmpULT(left_value, right_value, "cmptmp");
       // Convert bool 0/1 to double 0.0 or 1.0
-      return builder_.CreateUIToFP(
-          left_value, llvm::Type::getDoubleTy(context_), "booltmp");
+      return builder_->CreateUIToFP(
+          left_value, llvm::Type::getDoubleTy(*context_), "booltmp");
     default:
       CodeGenError("Invalid binary operator");
   }
@@ -58,7 +240,8 @@ llvm::Value* AstLLVMCodeGen::visit(ast::BinaryExprAST* bin_ptr) {
 
 llvm::Value* AstLLVMCodeGen::visit(ast::CallExprAST* call_ptr) {
   // look up the name in the global module table.
-  llvm::Function* callee_func = module_->getFunction(call_ptr->GetCallee());
+  llvm::Function* callee_func =
+      GetCallee(call_ptr->GetCallee(), call_ptr->GetArgs().size());
   if (!callee_func) {
     CodeGenError("Unknown function referenced");
   }
@@ -68,76 +251,750 @@ llvm::Value* AstLLVMCodeGen::visit(ast::CallExprAST* call_ptr) {
     CodeGenError("Incorrect # arguments passes");
   }
 
-  std::vector<llvm::Value*> llvm_args;
+  llvm::SmallVector<llvm::Value*, 8> llvm_args;
   for (auto i = 0; i < call_ptr->GetArgs().size(); ++i) {
     llvm_args.push_back(visit(call_ptr->GetArg(i).get()));
     if (!llvm_args.back()) {
       return nullptr;
     }
   }
-  return builder_.CreateCall(callee_func, llvm_args, "calltmp");
+  return builder_->CreateCall(callee_func, llvm_args, "calltmp");
+}
+
+llvm::AllocaInst* AstLLVMCodeGen::CreateEntryBlockAlloca(
+    const std::string& name) {
+  llvm::Function* func = builder_->GetInsertBlock()->getParent();
+  llvm::IRBuilder<> entry_builder(&func->getEntryBlock(),
+                                  func->getEntryBlock().begin());
+  // a Twine, so that no name is built when value names are discarded
+  return entry_builder.CreateAlloca(llvm::Type::getDoubleTy(*context_),
+                                    nullptr, llvm::Twine(name) + ".addr");
+}
+
+AstLLVMCodeGen::Variable* AstLLVMCodeGen::FindVariable(
+    const std::string& name) {
+  for (auto var = scope_.rbegin(); var != scope_.rend(); ++var) {
+    if (*var->name == name) return &*var;
+  }
+  return nullptr;
+}
+
+void AstLLVMCodeGen::BindVariable(const std::string& name, llvm::Value* value,
+                                  bool is_mutable) {
+  if (!is_mutable) {
+    scope_.push_back({&name, value});
+    return;
+  }
+  llvm::AllocaInst* slot = CreateEntryBlockAlloca(name);
+  builder_->CreateStore(value, slot);
+  scope_.push_back({&name, slot});
+}
+
+llvm::Value* AstLLVMCodeGen::EmitCondition(llvm::Value* value,
+                                           const std::string& name) {
+  return builder_->CreateFCmpONE(
+      value, llvm::ConstantFP::get(*context_, llvm::APFloat(0.0)), name);
+}
+
+llvm::Value* AstLLVMCodeGen::visit(ast::IfExprAST* if_ptr) {
+  llvm::Value* cond_value = visit(if_ptr->GetCond());
+  if (!cond_value) {
+    return nullptr;
+  }
+  cond_value = EmitCondition(cond_value, "ifcond");
+
+  llvm::Function* func = builder_->GetInsertBlock()->getParent();
+  auto* then_bb = llvm::BasicBlock::Create(*context_, "then", func);
+  auto* else_bb = llvm::BasicBlock::Create(*context_, "else", func);
+  auto* merge_bb = llvm::BasicBlock::Create(*context_, "ifcont", func);
+  builder_->CreateCondBr(cond_value, then_bb, else_bb);
+
+  // a branch may end in another block than it started, e.g. a nested if,
+  // the PHI takes its value from wherever it ended
+  builder_->SetInsertPoint(then_bb);
+  llvm::Value* then_value = visit(if_ptr->GetThen());
+  if (!then_value) {
+    return nullptr;
+  }
+  builder_->CreateBr(merge_bb);
+  then_bb = builder_->GetInsertBlock();
+
+  builder_->SetInsertPoint(else_bb);
+  llvm::Value* else_value = visit(if_ptr->GetElse());
+  if (!else_value) {
+    return nullptr;
+  }
+  builder_->CreateBr(merge_bb);
+  else_bb = builder_->GetInsertBlock();
+
+  builder_->SetInsertPoint(merge_bb);
+  llvm::PHINode* phi =
+      builder_->CreatePHI(llvm::Type::getDoubleTy(*context_), 2, "iftmp");
+  phi->addIncoming(then_value, then_bb);
+  phi->addIncoming(else_value, else_bb);
+  return phi;
+}
+
+namespace {
+
+// integers up to this are exact in a double and cannot overflow an i64 when
+// a step is added
+constexpr double kMaxCountedValue = 4611686018427387904.0;  // 2^62
+
+bool IsNumber(const ast::ExprAST* expr_ptr, double* value) {
+  if (expr_ptr->GetExprType() == ast::ExprType::kNumber) {
+    *value = static_cast<const ast::NumberExprAST*>(expr_ptr)->GetValue();
+    return true;
+  }
+  // there is no unary minus, negative constants are written `0 - x`
+  if (expr_ptr->GetExprType() != ast::ExprType::kBinary) return false;
+  auto* bin_ptr = static_cast<const ast::BinaryExprAST*>(expr_ptr);
+  if (bin_ptr->GetOpTag() != ast::SupportBinaryOpTag::kSub ||
+      bin_ptr->GetLHS()->GetExprType() != ast::ExprType::kNumber ||
+      bin_ptr->GetRHS()->GetExprType() != ast::ExprType::kNumber) {
+    return false;
+  }
+  *value = static_cast<const ast::NumberExprAST*>(bin_ptr->GetLHS())
+               ->GetValue() -
+           static_cast<const ast::NumberExprAST*>(bin_ptr->GetRHS())
+               ->GetValue();
+  return true;
+}
+
+bool IsIntegerNumber(const ast::ExprAST* expr_ptr, double limit,
+                     double* value) {
+  return IsNumber(expr_ptr, value) && std::trunc(*value) == *value &&
+         std::fabs(*value) <= limit;
+}
+
+bool IsVariable(const ast::ExprAST* expr_ptr, const std::string& name) {
+  return expr_ptr->GetExprType() == ast::ExprType::kVariable &&
+         static_cast<const ast::VariableExprAST*>(expr_ptr)->GetName() == name;
+}
+
+}  // namespace
+
+bool AstLLVMCodeGen::MatchCountedLoop(ast::ForExprAST* for_ptr,
+                                      CountedLoop* loop) {
+  double start, step = 1;
+  if (!IsIntegerNumber(for_ptr->GetStart(), 9007199254740992.0, &start)) {
+    return false;
+  }
+  if (for_ptr->GetStep() &&
+      !IsIntegerNumber(for_ptr->GetStep(), 2147483648.0, &step)) {
+    return false;
+  }
+  auto* cond = for_ptr->GetCond();
+  if (step == 0 || cond->GetExprType() != ast::ExprType::kBinary) {
+    return false;
+  }
+  auto* less = static_cast<ast::BinaryExprAST*>(cond);
+  if (less->GetOpTag() != ast::SupportBinaryOpTag::kLess) return false;
+
+  // `var < bound` counting up or `bound < var` counting down, with a bound
+  // that cannot change during the loop
+  const std::string& var_name = for_ptr->GetVarName();
+  loop->upward = step > 0;
+  loop->bound = loop->upward ? less->GetRHS() : less->GetLHS();
+  ast::ExprAST* var = loop->upward ? less->GetLHS() : less->GetRHS();
+  if (!IsVariable(var, var_name) ||
+      (loop->bound->GetExprType() != ast::ExprType::kNumber &&
+       (loop->bound->GetExprType() != ast::ExprType::kVariable ||
+        IsVariable(loop->bound, var_name)))) {
+    return false;
+  }
+  for (const std::string* name :
+       {&var_name, loop->bound->GetExprType() == ast::ExprType::kVariable
+                       ? &static_cast<ast::VariableExprAST*>(loop->bound)
+                              ->GetName()
+                       : nullptr}) {
+    if (name && (MayAssign(for_ptr->GetBody(), name) ||
+                 (for_ptr->GetStep() && MayAssign(for_ptr->GetStep(), name)))) {
+      return false;
+    }
+  }
+  loop->start = static_cast<int64_t>(start);
+  loop->step = static_cast<int64_t>(step);
+  return true;
+}
+
+llvm::Value* AstLLVMCodeGen::visit(ast::ForExprAST* for_ptr) {
+  // Emitted rotated, the form the loop passes expect:
+  //   var = start; if (cond) do { body; var += step; } while (cond);
+  // with the loop variable a PHI of the start value and the increment.
+  // When the loop counts with integer start and step up or down to a fixed
+  // bound, the PHI is an i64 and the compare an integer one, so that the
+  // trip count is computable and the loop can be unrolled and vectorized.
+  // A loop variable assigned in the loop lives in a stack slot instead.
+  auto* double_type = llvm::Type::getDoubleTy(*context_);
+  auto* i64_type = llvm::Type::getInt64Ty(*context_);
+  const std::string& var_name = for_ptr->GetVarName();
+  bool is_mutable =
+      MayAssign(for_ptr->GetCond(), &var_name) ||
+      (for_ptr->GetStep() && MayAssign(for_ptr->GetStep(), &var_name)) ||
+      MayAssign(for_ptr->GetBody(), &var_name);
+  CountedLoop counted;
+  bool is_counted = !is_mutable && MatchCountedLoop(for_ptr, &counted);
+
+  llvm::Value* start_value = nullptr;
+  llvm::Value* limit = nullptr;
+  if (is_counted) {
+    start_value = llvm::ConstantInt::get(i64_type, counted.start);
+    llvm::Value* bound = visit(counted.bound);
+    if (!bound) {
+      return nullptr;
+    }
+    // var < bound iff var < ceil(bound) for an integer var, and NaN < x as
+    // well as x < NaN hold, i.e. NaN never ends the loop. Past 2^53 a double
+    // var stops moving, such loops would not end either.
+    auto* max = llvm::ConstantFP::get(double_type, kMaxCountedValue);
+    auto* min = llvm::ConstantFP::get(double_type, -kMaxCountedValue);
+    llvm::Value* is_nan = builder_->CreateFCmpUNO(bound, bound, "isnan");
+    bound = builder_->CreateSelect(is_nan, counted.upward ? max : min, bound);
+    bound = builder_->CreateSelect(builder_->CreateFCmpOGT(bound, max), max,
+                                   bound);
+    bound = builder_->CreateSelect(builder_->CreateFCmpOLT(bound, min), min,
+                                   bound);
+    bound = builder_->CreateUnaryIntrinsic(
+        counted.upward ? llvm::Intrinsic::ceil : llvm::Intrinsic::floor,
+        bound);
+    limit = builder_->CreateFPToSI(bound, i64_type, "limit");
+  } else {
+    start_value = visit(for_ptr->GetStart());
+    if (!start_value) {
+      return nullptr;
+    }
+  }
+  auto emit_cond = [&](llvm::Value* var_value,
+                       const std::string& name) -> llvm::Value* {
+    if (is_counted) {
+      return counted.upward
+                 ? builder_->CreateICmpSLT(var_value, limit, name)
+                 : builder_->CreateICmpSGT(var_value, limit, name);
+    }
+    llvm::Value* cond_value = visit(for_ptr->GetCond());
+    return cond_value ? EmitCondition(cond_value, name) : nullptr;
+  };
+
+  // the loop variable shadows a variable of the same name until the scope
+  // is truncated back to mark
+  const size_t mark = scope_.size();
+  auto restore = [this, mark]() { scope_.resize(mark); };
+
+  BindVariable(var_name, start_value, is_mutable);
+  llvm::Value* guard_value = emit_cond(start_value, "loopguard");
+  if (!guard_value) {
+    restore();
+    return nullptr;
+  }
+
+  llvm::Function* func = builder_->GetInsertBlock()->getParent();
+  llvm::BasicBlock* preheader_bb = builder_->GetInsertBlock();
+  auto* loop_bb = llvm::BasicBlock::Create(*context_, "loop", func);
+  auto* after_bb = llvm::BasicBlock::Create(*context_, "afterloop", func);
+  builder_->CreateCondBr(guard_value, loop_bb, after_bb);
+
+  builder_->SetInsertPoint(loop_bb);
+  llvm::PHINode* var = nullptr;
+  if (!is_mutable) {
+    var = builder_->CreatePHI(start_value->getType(), 2,
+                              is_counted ? "counter" : var_name);
+    var->addIncoming(start_value, preheader_bb);
+    scope_[mark].value =
+        is_counted ? builder_->CreateSIToFP(var, double_type, var_name) : var;
+  }
+
+  // the value of the body is dropped
+  if (!visit(for_ptr->GetBody())) {
+    restore();
+    return nullptr;
+  }
+
+  llvm::Value* next_var = nullptr;
+  if (is_counted) {
+    next_var = builder_->CreateNSWAdd(
+        var, llvm::ConstantInt::get(i64_type, counted.step), "nextvar");
+  } else {
+    llvm::Value* step_value = nullptr;
+    if (for_ptr->GetStep()) {
+      step_value = visit(for_ptr->GetStep());
+      if (!step_value) {
+        restore();
+        return nullptr;
+      }
+    } else {
+      step_value = llvm::ConstantFP::get(*context_, llvm::APFloat(1.0));
+    }
+    if (is_mutable) {
+      auto* slot = llvm::cast<llvm::AllocaInst>(scope_[mark].value);
+      llvm::Value* cur_var = builder_->CreateLoad(double_type, slot, var_name);
+      next_var = builder_->CreateFAdd(cur_var, step_value, "nextvar");
+      builder_->CreateStore(next_var, slot);
+    } else {
+      next_var = builder_->CreateFAdd(var, step_value, "nextvar");
+      scope_[mark].value = next_var;
+    }
+  }
+
+  llvm::Value* cond_value = emit_cond(next_var, "loopcond");
+  if (!cond_value) {
+    restore();
+    return nullptr;
+  }
+  llvm::BasicBlock* latch_bb = builder_->GetInsertBlock();
+  auto* back_edge = builder_->CreateCondBr(cond_value, loop_bb, after_bb);
+  if (var) var->addIncoming(next_var, latch_bb);
+
+  // like C++, a loop without side effects may be assumed to terminate, so
+  // that it can be deleted once nothing uses what it computes
+  llvm::Metadata* ops[] = {
+      nullptr, llvm::MDNode::get(*context_, llvm::MDString::get(
+                                                *context_,
+                                                "llvm.loop.mustprogress"))};
+  llvm::MDNode* loop_id = llvm::MDNode::getDistinct(*context_, ops);
+  loop_id->replaceOperandWith(0, loop_id);
+  back_edge->setMetadata(llvm::LLVMContext::MD_loop, loop_id);
+
+  builder_->SetInsertPoint(after_bb);
+  restore();
+
+  // a for loop always evaluates to 0
+  return llvm::Constant::getNullValue(double_type);
+}
+
+llvm::Value* AstLLVMCodeGen::visit(ast::VarExprAST* var_ptr) {
+  // the bindings go out of scope when it is truncated back to mark
+  const size_t mark = scope_.size();
+
+  const auto& vars = var_ptr->GetVars();
+  for (auto binding = vars.begin(); binding != vars.end(); ++binding) {
+    const std::string& name = binding->first;
+    llvm::Value* init_value = nullptr;
+    if (binding->second) {
+      init_value = visit(binding->second.get());
+      if (!init_value) {
+        scope_.resize(mark);
+        return nullptr;
+      }
+    } else {
+      init_value = llvm::ConstantFP::get(*context_, llvm::APFloat(0.0));
+    }
+
+    // a variable never assigned, in the body or the initializers after it,
+    // is a plain value, the others get a slot that SROA promotes back to
+    // registers
+    bool is_mutable = MayAssign(var_ptr->GetBody(), &name);
+    for (auto next = binding + 1; !is_mutable && next != vars.end(); ++next) {
+      is_mutable = next->second && MayAssign(next->second.get(), &name);
+    }
+    BindVariable(name, init_value, is_mutable);
+  }
+
+  llvm::Value* body_value = visit(var_ptr->GetBody());
+  scope_.resize(mark);
+  return body_value;
 }
 
 llvm::Value* AstLLVMCodeGen::visit(ast::ExprAST* expr_ptr) {
-  CodeGenError("This procedure should not be called directly.");
+  switch (expr_ptr->GetExprType()) {
+    case ast::ExprType::kNumber:
+      return visit(static_cast<ast::NumberExprAST*>(expr_ptr));
+    case ast::ExprType::kVariable:
+      return visit(static_cast<ast::VariableExprAST*>(expr_ptr));
+    case ast::ExprType::kBinary:
+      return visit(static_cast<ast::BinaryExprAST*>(expr_ptr));
+    case ast::ExprType::kCall:
+      return visit(static_cast<ast::CallExprAST*>(expr_ptr));
+    case ast::ExprType::kIf:
+      return visit(static_cast<ast::IfExprAST*>(expr_ptr));
+    case ast::ExprType::kFor:
+      return visit(static_cast<ast::ForExprAST*>(expr_ptr));
+    case ast::ExprType::kVar:
+      return visit(static_cast<ast::VarExprAST*>(expr_ptr));
+  }
+  CodeGenError("Unknown expression type.");
 }
 
 llvm::Function* AstLLVMCodeGen::visit(ast::ProtoTypeAST* proto_ptr) {
+  // Top-level expressions come as prototypes without a name, give them a
+  // unique one so that they can be looked up after being emitted.
+  std::string name = proto_ptr->GetName();
+  if (name.empty()) {
+    name = "__anon_expr." + std::to_string(num_anonymous_functions_++);
+  } else {
+    function_protos_[name] = proto_ptr->GetArgs();
+    // e.g. an 'extern' repeated in the same module
+    if (auto* func = module_->getFunction(name)) {
+      if (func->arg_size() != proto_ptr->GetArgs().size()) {
+        CodeGenError("Function redeclared with a different # arguments.");
+      }
+      return func;
+    }
+  }
+
   // Make the function type: double(duble...) etc.
-  std::vector<llvm::Type*> doubles(proto_ptr->GetArgs().size(), llvm::Type::getDoubleTy(context_));
-  auto* func_type = llvm::FunctionType::get(llvm::Type::getDoubleTy(context_), doubles, false);
-  auto* func = llvm::Function::Create(func_type, llvm::Function::ExternalLinkage, proto_ptr->GetName(), module_.get());
+  std::vector<llvm::Type*> doubles(proto_ptr->GetArgs().size(),
+                                   llvm::Type::getDoubleTy(*context_));
+  auto* func_type = llvm::FunctionType::get(
+      llvm::Type::getDoubleTy(*context_), doubles, false);
+  auto* func = llvm::Function::Create(
+      func_type, llvm::Function::ExternalLinkage, name, module_.get());
+  // neither folded like nor replaced by the library function of its name
+  if (user_functions_.count(name) != 0) {
+    func->addFnAttr(llvm::Attribute::NoBuiltin);
+  }
 
   // Set names for all arguments
   unsigned int idx = 0;
-  for (auto& arg: func->args()) {
+  for (auto& arg : func->args()) {
     arg.setName(proto_ptr->GetArgs()[idx++]);
   }
 
   return func;
 }
 
+namespace {
+
+/*! \brief Count a function lowered by any of the code generators */
+void CountFunction(const llvm::Function& func) {
+  static const metrics::Counter functions = metrics::GetCounter(
+      "klang_codegen_functions_total", "Functions lowered to LLVM IR");
+  static const metrics::Counter instructions =
+      metrics::GetCounter("klang_codegen_instructions_total",
+                          "LLVM IR instructions of the lowered functions");
+  functions.Add();
+  instructions.Add(func.getInstructionCount());
+}
+
+/*!
+ * \brief Remove a function whose body failed to lower
+ *
+ * Calls to it lowered before into the same module, e.g. through an extern
+ * in whole-program mode, keep it as a declaration.
+ */
+void DropFunction(llvm::Function* func) {
+  if (func->use_empty()) {
+    func->eraseFromParent();
+  } else {
+    func->deleteBody();
+  }
+}
+
+}  // namespace
+
 llvm::Function* AstLLVMCodeGen::visit(ast::FunctionAST* func_ptr) {
-  // TODO: use function definition's arg name to overwrite arg name in the previous extern declaration.
-  // First, check for an existing function from a previous 'extern' declaration.
-  llvm::Function* def_func = module_->getFunction(func_ptr->GetProto()->GetName());
+  const std::string& name = func_ptr->GetProto()->GetName();
+  trace::Scope scope("CodeGen", name);
+  alloc::PhaseScope phase(alloc::Phase::kCodeGen);
+
+  // multi def, possibly in a previous module
+  if (defined_functions_.count(name) != 0) {
+    if (!allow_redefinition_) {
+      CodeGenError("Function cannot be redefined.");
+    }
+    // the callers compiled so far pass the old number of arguments
+    if (function_protos_[name].size() !=
+        func_ptr->GetProto()->GetArgs().size()) {
+      CodeGenError("Function redefined with a different # arguments.");
+    }
+  }
+  // the calls after the extern went to the builtin, see GetCallee
+  auto proto = function_protos_.find(name);
+  if (proto != function_protos_.end() && user_functions_.count(name) == 0 &&
+      proto->second.size() == func_ptr->GetProto()->GetArgs().size() &&
+      IsBuiltin(name, proto->second.size())) {
+    CodeGenError("Function cannot define a builtin declared as extern.");
+  }
+  if (!name.empty()) user_functions_.insert(name);
+
+  // First, check for an existing function from a previous 'extern'
+  // declaration.
+  llvm::Function* def_func =
+      name.empty() ? nullptr : module_->getFunction(name);
   if (!def_func) {
     def_func = visit(func_ptr->GetProto());
   }
 
   if (!def_func) {
-    return nullptr; // error
+    return nullptr;  // error
   }
+  if (!name.empty()) def_func->addFnAttr(llvm::Attribute::NoBuiltin);
 
-  // multi def
   if (!def_func->empty()) {
     CodeGenError("Function cannot be redefined.");
+  }
+
+  if (memoize_ && func_ptr->HasAttr(ast::FunctionAttr::kMemo)) {
+    if (!EmitMemoized(func_ptr, def_func)) return nullptr;
+  } else if (!EmitBody(func_ptr, def_func)) {
     return nullptr;
   }
+  if (!name.empty()) defined_functions_.insert(name);
+  CountFunction(*def_func);
+  return def_func;
+}
+
+llvm::Function* AstLLVMCodeGen::EmitMemoized(ast::FunctionAST* func_ptr,
+                                             llvm::Function* def_func) {
+  const std::string name = def_func->getName().str();
+  const unsigned num_args = def_func->arg_size();
+
+  // the body goes to a private function, recursive calls in it still go to
+  // the cached entry point
+  auto* body = llvm::Function::Create(def_func->getFunctionType(),
+                                      llvm::Function::InternalLinkage,
+                                      name + ".body", module_.get());
+  if (!EmitBody(func_ptr, body)) {
+    DropFunction(def_func);
+    return nullptr;
+  }
+
+  // { i64 state, double value, [num_args x i64] key }, state 0 is empty
+  auto* i64_type = builder_->getInt64Ty();
+  auto* entry_type = llvm::StructType::get(
+      *context_, {i64_type, builder_->getDoubleTy(),
+                  llvm::ArrayType::get(i64_type, num_args)});
+  auto* table_type = llvm::ArrayType::get(entry_type, kMemoCapacity);
+  auto* table = new llvm::GlobalVariable(
+      *module_, table_type, false, llvm::GlobalValue::InternalLinkage,
+      llvm::ConstantAggregateZero::get(table_type), name + ".memo");
+
+  // inlining the lookup into callers would inline the bodies of chains of
+  // @memo functions into each other, exponentially
+  def_func->addFnAttr(llvm::Attribute::NoInline);
+  llvm::BasicBlock* entry =
+      llvm::BasicBlock::Create(*context_, "entry", def_func);
+  builder_->SetInsertPoint(entry);
+
+  // hash the bit patterns of the arguments, so that e.g. -0.0 and 0.0 get
+  // their own entries like they may get their own results
+  std::vector<llvm::Value*> args, keys;
+  llvm::Value* hash = builder_->getInt64(0x9E3779B97F4A7C15ULL);
+  for (auto& arg : def_func->args()) {
+    args.push_back(&arg);
+    keys.push_back(builder_->CreateBitCast(&arg, i64_type, "key"));
+    hash = builder_->CreateMul(builder_->CreateXor(hash, keys.back()),
+                               builder_->getInt64(0xFF51AFD7ED558CCDULL));
+  }
+  // the fmix64 finalizer of MurmurHash3: small integers only differ in the
+  // high bits of their mantissa, which must reach the low bits of the index
+  hash = builder_->CreateXor(hash, builder_->CreateLShr(hash, 33));
+  hash = builder_->CreateMul(hash, builder_->getInt64(0xFF51AFD7ED558CCDULL));
+  hash = builder_->CreateXor(hash, builder_->CreateLShr(hash, 33));
+  hash = builder_->CreateMul(hash, builder_->getInt64(0xC4CEB9FE1A85EC53ULL));
+  hash = builder_->CreateXor(hash, builder_->CreateLShr(hash, 33), "hash");
+  llvm::Value* home = builder_->CreateAnd(hash, kMemoCapacity - 1, "home");
+
+  // open addressing with linear probing over kMemoProbes entries, the home
+  // entry is evicted when they are all taken
+  auto* miss = llvm::BasicBlock::Create(*context_, "miss", def_func);
+  auto* slot_type = entry_type->getPointerTo();
+  builder_->SetInsertPoint(miss);
+  llvm::PHINode* slot = builder_->CreatePHI(slot_type, kMemoProbes, "slot");
+  builder_->SetInsertPoint(entry);
+  llvm::Value* home_entry = nullptr;
+  for (unsigned probe = 0; probe < kMemoProbes; ++probe) {
+    llvm::Value* index = builder_->CreateAnd(
+        builder_->CreateAdd(home, builder_->getInt64(probe)),
+        kMemoCapacity - 1, "index");
+    llvm::Value* cached = builder_->CreateInBoundsGEP(
+        table_type, table, {builder_->getInt64(0), index}, "entry");
+    if (probe == 0) home_entry = cached;
+    llvm::Value* state = builder_->CreateLoad(
+        i64_type, builder_->CreateStructGEP(entry_type, cached, 0));
+    auto* compare = llvm::BasicBlock::Create(*context_, "compare", def_func);
+    builder_->CreateCondBr(
+        builder_->CreateICmpEQ(state, builder_->getInt64(0), "empty"), miss,
+        compare);
+    slot->addIncoming(cached, builder_->GetInsertBlock());
+
+    builder_->SetInsertPoint(compare);
+    llvm::Value* found = builder_->getTrue();
+    for (unsigned i = 0; i < num_args; ++i) {
+      llvm::Value* key = builder_->CreateLoad(
+          i64_type, builder_->CreateConstInBoundsGEP2_32(
+                        entry_type, cached, 2, i));
+      found = builder_->CreateAnd(found,
+                                  builder_->CreateICmpEQ(key, keys[i]));
+    }
+    auto* hit = llvm::BasicBlock::Create(*context_, "hit", def_func);
+    auto* next = probe + 1 < kMemoProbes
+                     ? llvm::BasicBlock::Create(*context_, "probe", def_func)
+                     : miss;
+    builder_->CreateCondBr(found, hit, next);
+    if (next == miss) slot->addIncoming(home_entry, compare);
+
+    builder_->SetInsertPoint(hit);
+    builder_->CreateRet(builder_->CreateLoad(
+        builder_->getDoubleTy(),
+        builder_->CreateStructGEP(entry_type, cached, 1), "cached"));
+    builder_->SetInsertPoint(next);
+  }
+
+  // miss: compute the result and remember it
+  llvm::Value* result = builder_->CreateCall(body, args, "result");
+  for (unsigned i = 0; i < num_args; ++i) {
+    builder_->CreateStore(keys[i], builder_->CreateConstInBoundsGEP2_32(
+                                       entry_type, slot, 2, i));
+  }
+  builder_->CreateStore(result,
+                        builder_->CreateStructGEP(entry_type, slot, 1));
+  builder_->CreateStore(builder_->getInt64(1),
+                        builder_->CreateStructGEP(entry_type, slot, 0));
+  builder_->CreateRet(result);
+
+  assert(!llvm::verifyFunction(*def_func, &llvm::errs()));
+  return def_func;
+}
+
+FPMode AstLLVMCodeGen::GetFPMode(const ast::FunctionAST* func_ptr) const {
+  if (func_ptr->HasAttr(ast::FunctionAttr::kStrictMath)) {
+    return FPMode::kStrict;
+  }
+  if (func_ptr->HasAttr(ast::FunctionAttr::kContractMath)) {
+    return FPMode::kContract;
+  }
+  if (func_ptr->HasAttr(ast::FunctionAttr::kFastMath)) {
+    return FPMode::kFast;
+  }
+  return fp_mode_;
+}
+
+llvm::Function* AstLLVMCodeGen::EmitBody(ast::FunctionAST* func_ptr,
+                                         llvm::Function* def_func) {
+  // every floating-point operation of the body carries the flags, the
+  // guard drops them again for whatever is emitted next
+  llvm::IRBuilderBase::FastMathFlagGuard flags_guard(*builder_);
+  llvm::FastMathFlags flags;
+  switch (GetFPMode(func_ptr)) {
+    case FPMode::kStrict:
+      break;
+    case FPMode::kContract:
+      flags.setAllowContract();
+      break;
+    case FPMode::kFast:
+      flags.setFast();
+      // read by the code generator, e.g. to reassociate fmas
+      def_func->addFnAttr("unsafe-fp-math", "true");
+      def_func->addFnAttr("no-nans-fp-math", "true");
+      def_func->addFnAttr("no-infs-fp-math", "true");
+      def_func->addFnAttr("no-signed-zeros-fp-math", "true");
+      def_func->addFnAttr("approx-func-fp-math", "true");
+      break;
+  }
+  builder_->setFastMathFlags(flags);
 
   // Create a new basic block to start insertion into.
-  llvm::BasicBlock *bb = llvm::BasicBlock::Create(context_, "entry", def_func);
-  builder_.SetInsertPoint(bb);
+  llvm::BasicBlock* bb =
+      llvm::BasicBlock::Create(*context_, "entry", def_func);
+  builder_->SetInsertPoint(bb);
 
-  // Record the function arguments in the named values map
-  named_values.clear();
-  for (auto &arg : def_func->args()) {
-    named_values[static_cast<const std::string>(arg.getName())] = &arg;
+  // Record the function arguments in the named values map, the ones
+  // assigned in the body are copied into stack slots
+  scope_.clear();
+  unsigned int idx = 0;
+  for (auto& arg : def_func->args()) {
+    const std::string& name = func_ptr->GetProto()->GetArgs()[idx++];
+    arg.setName(name);
+    BindVariable(name, &arg, MayAssign(func_ptr->GetBody(), &name));
   }
 
   if (llvm::Value* ret_val = visit(func_ptr->GetBody())) {
     // finish off the function
-    builder_.CreateRet(ret_val);
+    builder_->CreateRet(ret_val);
 
-    // validate the generated code, checking for consistency
-    llvm::verifyFunction(*def_func);
+    // validate the generated code, checking for consistency, in debug
+    // builds only as it costs about as much as lowering the function
+    assert(!llvm::verifyFunction(*def_func, &llvm::errs()));
     return def_func;
   }
 
   // error reading body, remove function
-  def_func->eraseFromParent();
+  DropFunction(def_func);
   return nullptr;
 }
 
+llvm::Function* AstLLVMCodeGen::EmitBatchWrapper(ast::FunctionAST* func_ptr) {
+  const std::string& name = func_ptr->GetProto()->GetName();
+  if (name.empty()) {
+    CodeGenError("Top-level expressions have no batch wrapper.");
+  }
+  const size_t num_args = func_ptr->GetProto()->GetArgs().size();
+  auto* double_type = llvm::Type::getDoubleTy(*context_);
+  auto* double_ptr_type = llvm::PointerType::getUnqual(double_type);
+  auto* i64_type = llvm::Type::getInt64Ty(*context_);
+
+  // a private copy of the body, so that it can be inlined into the loop
+  std::vector<llvm::Type*> doubles(num_args, double_type);
+  auto* scalar = llvm::Function::Create(
+      llvm::FunctionType::get(double_type, doubles, false),
+      llvm::Function::InternalLinkage, name + ".scalar", module_.get());
+  scalar->addFnAttr(llvm::Attribute::AlwaysInline);
+  if (!EmitBody(func_ptr, scalar)) {
+    return nullptr;
+  }
+
+  // void name.batch(double** columns, double* out, i64 num_rows)
+  auto* batch_type = llvm::FunctionType::get(
+      llvm::Type::getVoidTy(*context_),
+      {llvm::PointerType::getUnqual(double_ptr_type), double_ptr_type,
+       i64_type},
+      false);
+  auto* batch = llvm::Function::Create(batch_type,
+                                       llvm::Function::ExternalLinkage,
+                                       name + ".batch", module_.get());
+  llvm::Argument* columns = batch->getArg(0);
+  llvm::Argument* out = batch->getArg(1);
+  llvm::Argument* num_rows = batch->getArg(2);
+  columns->setName("columns");
+  out->setName("out");
+  num_rows->setName("num_rows");
+  batch->addParamAttr(0, llvm::Attribute::NoCapture);
+  batch->addParamAttr(0, llvm::Attribute::ReadOnly);
+  batch->addParamAttr(1, llvm::Attribute::NoCapture);
+
+  auto* entry = llvm::BasicBlock::Create(*context_, "entry", batch);
+  auto* loop = llvm::BasicBlock::Create(*context_, "loop", batch);
+  auto* exit = llvm::BasicBlock::Create(*context_, "exit", batch);
+
+  // the column pointers are loop invariant, load them once
+  builder_->SetInsertPoint(entry);
+  std::vector<llvm::Value*> column_ptrs;
+  for (size_t i = 0; i < num_args; ++i) {
+    llvm::Value* slot = builder_->CreateConstInBoundsGEP1_64(
+        double_ptr_type, columns, i, "column.slot");
+    column_ptrs.push_back(builder_->CreateLoad(double_ptr_type, slot,
+                                               "column"));
+  }
+  builder_->CreateCondBr(
+      builder_->CreateICmpSGT(num_rows, llvm::ConstantInt::get(i64_type, 0)),
+      loop, exit);
+
+  // out[row] = name.scalar(columns[0][row], ...), the vectorizer widens this
+  // loop and leaves the rows that do not fill a vector to a scalar tail loop
+  builder_->SetInsertPoint(loop);
+  llvm::PHINode* row = builder_->CreatePHI(i64_type, 2, "row");
+  row->addIncoming(llvm::ConstantInt::get(i64_type, 0), entry);
+  std::vector<llvm::Value*> args;
+  for (auto* column : column_ptrs) {
+    llvm::Value* element =
+        builder_->CreateInBoundsGEP(double_type, column, row, "element");
+    args.push_back(builder_->CreateLoad(double_type, element, "arg"));
+  }
+  llvm::Value* result = builder_->CreateCall(scalar, args, "result");
+  builder_->CreateStore(
+      result, builder_->CreateInBoundsGEP(double_type, out, row, "dest"));
+  llvm::Value* next = builder_->CreateAdd(
+      row, llvm::ConstantInt::get(i64_type, 1), "row.next", true, true);
+  row->addIncoming(next, loop);
+  builder_->CreateCondBr(builder_->CreateICmpEQ(next, num_rows, "done"),
+                         exit, loop);
+
+  builder_->SetInsertPoint(exit);
+  builder_->CreateRetVoid();
+  assert(!llvm::verifyFunction(*batch, &llvm::errs()));
+  return batch;
+}
+
 }  // namespace ir
 }  // namespace kaleidoscope
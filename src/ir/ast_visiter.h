@@ -2,10 +2,14 @@
 #define KALEIDOSCOPE_IR_AST_VISITER_H_
 
 #include <memory>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "kaleidoscope/ast.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Value.h"
@@ -13,21 +17,237 @@
 namespace kaleidoscope {
 namespace ir {
 
+/*! \brief How freely the floating-point arithmetic may be transformed */
+enum class FPMode {
+  kStrict,    // IEEE 754, every operation rounds and nothing is reordered
+  kContract,  // a * b + c may be fused into one fma, rounding once
+  // fast-math: reassociation, reciprocals, no NaNs, infinities or signed
+  // zeros are assumed, so that e.g. reductions vectorize
+  kFast,
+};
+
+/*!
+ * \brief Parse a floating-point mode as given on the command line
+ *
+ * \param name one of "strict", "contract" and "fast"
+ * \return false if \a name is not a known mode
+ */
+bool ParseFPMode(const std::string& name, FPMode* mode);
+
+const char* FPModeName(FPMode mode);
+
+/*! \brief A finished module together with the context owning its types */
+struct GeneratedModule {
+  std::unique_ptr<llvm::LLVMContext> context;
+  std::unique_ptr<llvm::Module> module;
+};
+
+/*!
+ * \brief Rename the definition \a func to \a new_name and declare it again
+ *        under its old name, where all of its uses go, recursive calls
+ *        included
+ *
+ * The JIT then resolves the old name to a stub that can be repointed.
+ */
+void RenameDefinition(llvm::Function* func, const std::string& new_name);
+
+/*!
+ * \brief Whether \a name with \a num_args arguments is a math builtin, see
+ *        AstLLVMCodeGen::GetCallee
+ */
+bool IsBuiltin(const std::string& name, size_t num_args);
+
 class AstLLVMCodeGen {
  public:
+  AstLLVMCodeGen() { NewModule("kaleidoscope"); }
+
   llvm::Value* visit(ast::NumberExprAST* number_ptr);
   llvm::Value* visit(ast::VariableExprAST* var_ptr);
   llvm::Value* visit(ast::BinaryExprAST* bin_ptr);
   llvm::Value* visit(ast::CallExprAST* call_ptr);
+  llvm::Value* visit(ast::IfExprAST* if_ptr);
+  llvm::Value* visit(ast::ForExprAST* for_ptr);
+  llvm::Value* visit(ast::VarExprAST* var_ptr);
   llvm::Value* visit(ast::ExprAST* bin_ptr);
   llvm::Function* visit(ast::FunctionAST* func_ptr);
   llvm::Function* visit(ast::ProtoTypeAST* proto_ptr);
 
+  /*!
+   * \brief Start emitting into a fresh module, which lives in its own
+   *        LLVMContext so that it can be handed to the JIT on its own.
+   *
+   * \note Prototypes seen so far stay known: calls to functions emitted in
+   *       earlier modules are declared again in the new one.
+   */
+  void NewModule(const std::string& name);
+
+  /*! \brief Give up the current module and go on in a fresh one */
+  GeneratedModule TakeModule();
+
+  llvm::Module* GetModule() { return module_.get(); }
+
+  /*!
+   * \brief Make a function emitted by another code generator known to this
+   *        one, so that calls to it are declared on use
+   *
+   * \param defined whether the function has a body already, which forbids
+   *        redefining it here
+   */
+  void ImportFunction(const ast::ProtoTypeAST* proto_ptr, bool defined);
+
+  /*!
+   * \brief Make known that the program defines the function of \a proto_ptr,
+   *        here or in another code generator, maybe only later
+   *
+   * Calls to it are declared on use and never go to a builtin of the same
+   * name, and it may still be defined here once.
+   */
+  void ImportDefinition(const ast::ProtoTypeAST* proto_ptr);
+
+  /*!
+   * \brief Make known that the program defines \a name further on, so that
+   *        the declarations of an extern of it are nobuiltin too
+   */
+  void ReserveDefinition(const std::string& name) {
+    user_functions_.insert(name);
+  }
+
+  /*!
+   * \brief Accept definitions of functions defined before, as long as the
+   *        number of arguments stays the same
+   */
+  void SetAllowRedefinition(bool allow) { allow_redefinition_ = allow; }
+
+  /*!
+   * \brief The floating-point mode of the definitions emitted from now on,
+   *        except those annotated with @strict, @contract or @fastmath
+   */
+  void SetFPMode(FPMode mode) { fp_mode_ = mode; }
+
+  /*!
+   * \brief Emit instructions, blocks and arguments without names, as
+   *        "addtmp" or "calltmp", which only help reading the IR but cost
+   *        an allocation each; functions and globals keep theirs
+   */
+  void SetDiscardValueNames(bool discard);
+
+  /*!
+   * \brief Give @memo functions their cache, true by default; the cache is
+   *        a plain global, so the code must not be called from several
+   *        threads at once then
+   */
+  void SetMemoize(bool memoize) { memoize_ = memoize; }
+
+  /*!
+   * \brief Emit `void name.batch(double** columns, double* out, i64 rows)`
+   *        for the definition \a func_ptr into the current module
+   *
+   * The wrapper computes out[i] = name(columns[0][i], ...) for every row.
+   * It calls a private copy of the body which the optimizer inlines, so the
+   * loop can be vectorized; calls to other functions stay scalar calls.
+   */
+  llvm::Function* EmitBatchWrapper(ast::FunctionAST* func_ptr);
+
  private:
-  llvm::LLVMContext context_;
-  llvm::IRBuilder<> builder_;
+  // entries of the cache of a @memo function, a power of 2
+  static constexpr uint64_t kMemoCapacity = 1 << 12;
+  // entries looked at before evicting the first one
+  static constexpr unsigned kMemoProbes = 4;
+
+  /*!
+   * \brief Find \a name in the current module, or declare it there if a
+   *        prototype of it has been seen before
+   */
+  llvm::Function* GetFunction(const std::string& name);
+
+  /*!
+   * \brief The function a call to \a name with \a num_args arguments goes
+   *        to: the intrinsic of a math builtin like sin, sqrt, fma or min
+   *        (llvm.minnum) if it is only declared by an extern of that many
+   *        arguments, GetFunction(name) otherwise
+   *
+   * \note A definition of the builtin after its extern is rejected, as the
+   *       calls before it already went to the intrinsic.
+   */
+  llvm::Function* GetCallee(const std::string& name, size_t num_args);
+
+  // a for loop from an integer start by an integer step while its variable
+  // is below (above when counting down) a loop invariant bound
+  struct CountedLoop {
+    int64_t start;
+    int64_t step;
+    bool upward;
+    ast::ExprAST* bound;
+  };
+
+  /*! \brief Whether \a for_ptr can count with an integer variable */
+  bool MatchCountedLoop(ast::ForExprAST* for_ptr, CountedLoop* loop);
+
+  // a variable in scope, see scope_
+  struct Variable {
+    const std::string* name;  // owned by the AST
+    llvm::Value* value;
+  };
+
+  /*! \brief The innermost variable called \a name, or nullptr */
+  Variable* FindVariable(const std::string& name);
+
+  /*! \brief A double stack slot at the top of the current function */
+  llvm::AllocaInst* CreateEntryBlockAlloca(const std::string& name);
+
+  /*!
+   * \brief Bind \a name to \a value in a new innermost scope, through a
+   *        stack slot if the variable is \a is_mutable
+   */
+  void BindVariable(const std::string& name, llvm::Value* value,
+                    bool is_mutable);
+
+  /*! \brief An i1 true if the double \a value is neither 0 nor NaN */
+  llvm::Value* EmitCondition(llvm::Value* value, const std::string& name);
+
+  /*!
+   * \brief Lower a `@memo` definition: \a def_func looks its arguments up
+   *        in a cache of kMemoCapacity entries, and only calls the body,
+   *        emitted as a private `name.body`, on a miss
+   *
+   * \note The cache is a plain global array, calls from several threads at
+   *       once may read torn entries.
+   */
+  llvm::Function* EmitMemoized(ast::FunctionAST* func_ptr,
+                               llvm::Function* def_func);
+
+  /*! \brief The mode of \a func_ptr, given by its annotations or fp_mode_ */
+  FPMode GetFPMode(const ast::FunctionAST* func_ptr) const;
+
+  /*!
+   * \brief Lower the body of \a func_ptr into the empty \a def_func, with
+   *        the fast-math flags of its floating-point mode
+   */
+  llvm::Function* EmitBody(ast::FunctionAST* func_ptr,
+                           llvm::Function* def_func);
+
+  std::unique_ptr<llvm::LLVMContext> context_;
+  std::unique_ptr<llvm::IRBuilder<>> builder_;
   std::unique_ptr<llvm::Module> module_;
-  std::unordered_map<std::string, llvm::Value*> named_values;
+  // the variables in scope, innermost last: the arguments of the function
+  // at their index, then the var and for bindings, which are dropped by
+  // truncating it. The value is an AllocaInst for the variables that are
+  // assigned, which is loaded on every use, the variable itself otherwise.
+  // There are few variables, searching them beats hashing their names.
+  std::vector<Variable> scope_;
+
+  // state shared by all modules emitted by this code generator
+  std::unordered_map<std::string, std::vector<std::string>> function_protos_;
+  std::unordered_set<std::string> defined_functions_;
+  // named by a definition, which may have failed or not be emitted yet, so
+  // calls to them never go to a builtin and their declarations are
+  // nobuiltin
+  std::unordered_set<std::string> user_functions_;
+  int num_anonymous_functions_ = 0;
+  bool allow_redefinition_ = false;
+  FPMode fp_mode_ = FPMode::kStrict;
+  bool discard_value_names_ = false;
+  bool memoize_ = true;
 };
 
 }  // namespace ir
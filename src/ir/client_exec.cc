@@ -0,0 +1,127 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "kaleidoscope/daemon.h"
+
+namespace {
+
+namespace daemon = kaleidoscope::daemon;
+
+using Clock = std::chrono::steady_clock;
+
+// The \a q quantile of \a sorted, by the nearest rank.
+double Quantile(const std::vector<double>& sorted, double q) {
+  size_t rank = static_cast<size_t>(q * static_cast<double>(sorted.size()));
+  return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+std::string ReadSource(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) throw std::runtime_error("Cannot open " + path);
+  std::ostringstream source;
+  source << in.rdbuf();
+  return source.str();
+}
+
+}  // namespace
+
+// Usage:
+//   klang_client <socket> <src> [-O0|-O1|-O2|-O3|-Os] [--eager]
+//                [--whole-program] [--fp-mode=strict|contract|fast]
+//                [--specialize] [--repeat=N]
+//   klang_client <socket> <src> --compile -o <out.o> [--cpu=native|name]
+//                [--export=f,g,...] [-O...] [--whole-program] [--fp-mode=...]
+//   klang_client <socket> --ping|--shutdown
+// Sends the source file to klangd and prints what klang_jit would, the value
+// of every top-level expression, or writes the object file klang_compile
+// would with --compile. The other options are passed on with the request.
+// --repeat sends the request N times over the same connection and prints
+// the p50 and p99 latency to stderr.
+int main(int argc, char** argv) {
+  daemon::Request request;
+  request.type = daemon::RequestType::kEvaluate;
+  std::vector<std::string> paths;
+  std::string output;
+  int repeat = 1;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-o" && i + 1 < argc) {
+      output = argv[++i];
+    } else if (arg == "--compile") {
+      request.type = daemon::RequestType::kCompile;
+    } else if (arg == "--ping") {
+      request.type = daemon::RequestType::kPing;
+    } else if (arg == "--shutdown") {
+      request.type = daemon::RequestType::kShutdown;
+    } else if (arg.compare(0, 9, "--repeat=") == 0) {
+      repeat = std::max(1, std::stoi(arg.substr(9)));
+    } else if (arg.compare(0, 1, "-") == 0) {
+      if (!request.options.empty()) request.options += ' ';
+      request.options += arg;
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  const bool has_source = request.type == daemon::RequestType::kEvaluate ||
+                          request.type == daemon::RequestType::kCompile;
+  if (paths.size() != (has_source ? 2 : 1)) {
+    throw std::runtime_error(has_source
+                                 ? "A socket and a source path should be given."
+                                 : "A socket path should be given.");
+  }
+  if (request.type == daemon::RequestType::kCompile && output.empty()) {
+    throw std::runtime_error("An output path should be given with -o.");
+  }
+  if (has_source) {
+    request.name = paths[1];
+    request.source = ReadSource(paths[1]);
+  }
+
+  int fd = daemon::ConnectUnixSocket(paths[0]);
+  const std::string payload = daemon::EncodeRequest(request);
+  std::vector<double> latencies;
+  daemon::Response response;
+  for (int i = 0; i < repeat; ++i) {
+    auto start = Clock::now();
+    daemon::WriteFrame(fd, payload);
+    std::string reply;
+    if (!daemon::ReadFrame(fd, &reply)) {
+      throw std::runtime_error("The daemon hung up.");
+    }
+    response = daemon::DecodeResponse(reply);
+    latencies.push_back(
+        std::chrono::duration<double, std::milli>(Clock::now() - start)
+            .count());
+  }
+  ::close(fd);
+
+  if (response.status != daemon::Status::kOk) {
+    std::cerr << response.body << std::endl;
+    return 1;
+  }
+  if (request.type == daemon::RequestType::kEvaluate) {
+    for (double value : daemon::DecodeValues(response.body)) {
+      std::cout << value << '\n';
+    }
+  } else if (request.type == daemon::RequestType::kCompile) {
+    std::ofstream out(output, std::ios::binary);
+    out << response.body;
+    if (!out.flush()) throw std::runtime_error("Cannot write " + output);
+  }
+  if (repeat > 1) {
+    std::sort(latencies.begin(), latencies.end());
+    std::cerr << "p50: " << Quantile(latencies, 0.5)
+              << " ms, p99: " << Quantile(latencies, 0.99) << " ms over "
+              << repeat << " requests" << std::endl;
+  }
+  return 0;
+}
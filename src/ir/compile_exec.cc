@@ -0,0 +1,150 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <list>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "aot.h"
+#include "kaleidoscope/ast.h"
+#include "kaleidoscope/parser.h"
+#include "kaleidoscope/trace.h"
+#include "llvm/Support/Host.h"
+#include "specialize.h"
+
+namespace {
+
+bool EndsWith(const std::string& str, const std::string& suffix) {
+  return str.size() >= suffix.size() &&
+         str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/*! \brief Compile \a src to \a output, return the exit status */
+int Compile(const kaleidoscope::ir::AOTOptions& options,
+            const std::string& src, const std::string& output,
+            const std::string& header, bool specialize) {
+  kaleidoscope::parser::Parser parser(src);
+  std::list<kaleidoscope::ast::AST::Ptr> ast_list = parser.Parse();
+  if (specialize) {
+    kaleidoscope::ir::SpecializeOptions specialize_options;
+    specialize_options.fp_mode = options.fp_mode;
+    kaleidoscope::ir::SpecializeCalls(&ast_list, specialize_options);
+  }
+
+  kaleidoscope::ir::AOTCompiler compiler(options, src);
+  if (!compiler.IsValid()) {
+    throw std::runtime_error("Cannot compile for the CPU " + options.cpu);
+  }
+  size_t num_errors = compiler.Add(ast_list);
+
+  if (!header.empty() && !compiler.WriteHeader(header, src)) {
+    return 1;
+  }
+  if (EndsWith(output, ".ll")) {
+    return compiler.WriteIR(output) && num_errors == 0 ? 0 : 1;
+  }
+  if (!EndsWith(output, ".so")) {
+    return compiler.WriteObject(output) && num_errors == 0 ? 0 : 1;
+  }
+
+  const std::string object = output + ".o";
+  if (!compiler.WriteObject(object)) return 1;
+  const char* cc = std::getenv("CC");
+  std::string link = std::string(cc ? cc : "cc") + " -shared -o '" + output +
+                     "' '" + object + "' -lm";
+  if (kaleidoscope::ir::HasVectorMathLibrary(
+          llvm::Triple(llvm::sys::getProcessTriple()))) {
+    // only if the vectorized loops call into it
+    link += " -Wl,--as-needed -lmvec";
+  }
+  int status;
+  {
+    kaleidoscope::trace::Scope scope("Link", output);
+    status = std::system(link.c_str());
+  }
+  std::remove(object.c_str());
+  if (status != 0) {
+    throw std::runtime_error("Linking failed: " + link);
+  }
+  return num_errors == 0 ? 0 : 1;
+}
+
+}  // namespace
+
+// Usage:
+//   klang_compile <src> -o <out.o|out.so|out.ll> [--header=out.h]
+//                 [--cpu=native|name] [-O0|-O1|-O2|-O3|-Os]
+//                 [--whole-program] [--export=f,g,...] [--specialize]
+//                 [--fp-mode=strict|contract|fast]
+//                 [--trace=out.json [--trace-granularity=us]]
+// Compiles every function definition of the source file ahead of time.
+// With --whole-program the functions not exported are internalized, and
+// may be inlined or dropped. --specialize evaluates the calls with constant
+// arguments and specializes the functions they call to the constants, see
+// SpecializeCalls.
+// A .so is linked from the object by the C compiler driver, $CC or cc.
+// --trace writes where the compile time goes as Chrome trace JSON, for
+// chrome://tracing or Perfetto, leaving out the events shorter than the
+// granularity.
+int main(int argc, char** argv) {
+  kaleidoscope::ir::AOTOptions options;
+  std::vector<std::string> paths;
+  std::string output;
+  std::string header;
+  std::string trace_path;
+  int64_t trace_granularity = 0;
+  bool specialize = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-o" && i + 1 < argc) {
+      output = argv[++i];
+    } else if (arg.compare(0, 9, "--header=") == 0) {
+      header = arg.substr(9);
+    } else if (arg == "--whole-program") {
+      options.whole_program = true;
+    } else if (arg == "--specialize") {
+      specialize = true;
+    } else if (arg.compare(0, 9, "--export=") == 0) {
+      std::stringstream names(arg.substr(9));
+      std::string name;
+      while (std::getline(names, name, ',')) {
+        if (!name.empty()) options.exports.push_back(name);
+      }
+    } else if (arg.compare(0, 8, "--trace=") == 0) {
+      trace_path = arg.substr(8);
+    } else if (arg.compare(0, 20, "--trace-granularity=") == 0) {
+      trace_granularity = std::stoll(arg.substr(20));
+    } else if (arg.compare(0, 6, "--cpu=") == 0) {
+      options.cpu = arg.substr(6);
+    } else if (arg.compare(0, 10, "--fp-mode=") == 0) {
+      if (!kaleidoscope::ir::ParseFPMode(arg.substr(10), &options.fp_mode)) {
+        throw std::runtime_error("Unknown floating-point mode: " + arg);
+      }
+    } else if (arg.size() > 2 && arg.compare(0, 2, "-O") == 0) {
+      if (!kaleidoscope::ir::ParseOptLevel(arg, &options.opt_level)) {
+        throw std::runtime_error("Unknown optimization level: " + arg);
+      }
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.size() != 1) {
+    throw std::runtime_error("A source file path should be given.");
+  }
+  if (output.empty()) {
+    throw std::runtime_error("An output path should be given with -o.");
+  }
+  // only the textual IR is meant to be read
+  options.discard_value_names = !EndsWith(output, ".ll");
+
+  if (trace_path.empty()) {
+    return Compile(options, paths[0], output, header, specialize);
+  }
+  kaleidoscope::trace::Start(trace_granularity);
+  int status = Compile(options, paths[0], output, header, specialize);
+  kaleidoscope::trace::Stop(trace_path);
+  return status;
+}
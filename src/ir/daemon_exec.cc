@@ -0,0 +1,367 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "aot.h"
+#include "jit.h"
+#include "kaleidoscope/ast.h"
+#include "kaleidoscope/daemon.h"
+#include "kaleidoscope/logging.h"
+#include "kaleidoscope/metrics.h"
+#include "kaleidoscope/parser.h"
+#include "kaleidoscope/thread_pool.h"
+#include "llvm/ADT/SmallVector.h"
+#include "specialize.h"
+
+namespace {
+
+namespace daemon = kaleidoscope::daemon;
+
+struct DaemonMetrics {
+  DaemonMetrics()
+      : connections(kaleidoscope::metrics::GetGauge(
+            "klang_daemon_connections", "Clients connected to the daemon")),
+        errors(kaleidoscope::metrics::GetCounter(
+            "klang_daemon_errors_total", "Requests answered with an error")) {
+    for (const char* type : {"evaluate", "compile", "ping", "shutdown"}) {
+      requests.push_back(kaleidoscope::metrics::GetCounter(
+          "klang_daemon_requests_total", "Requests served by the daemon",
+          {{"type", type}}));
+    }
+  }
+
+  kaleidoscope::metrics::Gauge connections;
+  kaleidoscope::metrics::Counter errors;
+  // by RequestType - 1
+  std::vector<kaleidoscope::metrics::Counter> requests;
+};
+
+const DaemonMetrics& GetDaemonMetrics() {
+  static const DaemonMetrics daemon_metrics;
+  return daemon_metrics;
+}
+
+// The flags of a request that change how its source is compiled.
+struct RequestOptions {
+  kaleidoscope::ir::JITOptions jit;
+  kaleidoscope::ir::AOTOptions aot;
+  bool whole_program = false;
+  bool specialize = false;
+};
+
+// Applies the flags of \a options, separated by whitespace, on top of
+// \a base. They mean the same as for klang_jit and klang_compile.
+RequestOptions ParseRequestOptions(const std::string& options,
+                                   const RequestOptions& base) {
+  RequestOptions result = base;
+  std::istringstream flags(options);
+  std::string arg;
+  while (flags >> arg) {
+    if (arg == "--eager") {
+      result.jit.lazy = false;
+    } else if (arg == "--whole-program") {
+      result.whole_program = true;
+      result.aot.whole_program = true;
+    } else if (arg == "--specialize") {
+      result.specialize = true;
+    } else if (arg.compare(0, 6, "--cpu=") == 0) {
+      result.aot.cpu = arg.substr(6);
+    } else if (arg.compare(0, 9, "--export=") == 0) {
+      std::stringstream names(arg.substr(9));
+      std::string name;
+      while (std::getline(names, name, ',')) {
+        if (!name.empty()) result.aot.exports.push_back(name);
+      }
+    } else if (arg.compare(0, 10, "--fp-mode=") == 0) {
+      if (!kaleidoscope::ir::ParseFPMode(arg.substr(10),
+                                         &result.jit.fp_mode)) {
+        throw std::runtime_error("Unknown floating-point mode: " + arg);
+      }
+      result.aot.fp_mode = result.jit.fp_mode;
+    } else if (arg.size() > 2 && arg.compare(0, 2, "-O") == 0) {
+      if (!kaleidoscope::ir::ParseOptLevel(arg, &result.jit.opt_level)) {
+        throw std::runtime_error("Unknown optimization level: " + arg);
+      }
+      result.aot.opt_level = result.jit.opt_level;
+    } else {
+      throw std::runtime_error("Unsupported option: " + arg);
+    }
+  }
+  return result;
+}
+
+// SpecializeCalls on \a items if \a options ask for it.
+void Specialize(const RequestOptions& options,
+                std::list<kaleidoscope::ast::AST::Ptr>* items) {
+  if (!options.specialize) return;
+  kaleidoscope::ir::SpecializeOptions specialize_options;
+  specialize_options.fp_mode = options.jit.fp_mode;
+  kaleidoscope::ir::SpecializeCalls(items, specialize_options);
+}
+
+daemon::Response Error(const std::string& message) {
+  GetDaemonMetrics().errors.Add();
+  daemon::Response response;
+  response.status = daemon::Status::kError;
+  response.body = message;
+  return response;
+}
+
+// Whether \a source has anything but whitespace and comments, so that
+// parsing it to nothing is a syntax error.
+bool HasCode(const std::string& source) {
+  bool in_comment = false;
+  for (char c : source) {
+    if (c == '\n') {
+      in_comment = false;
+    } else if (c == '#') {
+      in_comment = true;
+    } else if (!in_comment && !std::isspace(static_cast<unsigned char>(c))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*!
+ * \brief Serves the connections of klang_client
+ *
+ * Every connection is a task of a WorkStealingPool, which answers its
+ * requests in order until the client hangs up, so as many clients as there
+ * are workers are served at once and the next ones wait for a worker.
+ * Every worker keeps its Parser, and LLVM, the target and the object cache
+ * stay initialized for the life of the daemon. A request still gets a JIT
+ * or an AOT compiler of its own, so nothing leaks from one to the next.
+ */
+class Server {
+ public:
+  Server(const std::string& socket_path, size_t num_workers,
+         const RequestOptions& base)
+      : socket_path_(socket_path),
+        base_(base),
+        pool_(num_workers),
+        parsers_(pool_.NumWorkers()) {
+    listen_fd_ = daemon::ListenUnixSocket(socket_path_, 128);
+  }
+
+  ~Server() {
+    ::close(listen_fd_);
+    ::unlink(socket_path_.c_str());
+  }
+
+  /*! \brief Accept connections until a kShutdown request */
+  void Run() {
+    while (!stopping_) {
+      int fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        if (stopping_) break;
+        LOG_FATAL << "Cannot accept connections: " << std::strerror(errno);
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) {
+          ::close(fd);
+          break;
+        }
+        connections_.insert(fd);
+      }
+      pool_.Submit([this, fd](size_t worker_id) { Serve(fd, worker_id); });
+    }
+    pool_.Wait();
+  }
+
+ private:
+  void Serve(int fd, size_t worker_id) {
+    GetDaemonMetrics().connections.Add(1);
+    try {
+      std::string payload;
+      while (daemon::ReadFrame(fd, &payload)) {
+        daemon::Response response;
+        try {
+          response = Handle(daemon::DecodeRequest(payload), worker_id);
+        } catch (const std::exception& error) {
+          response = Error(error.what());
+        }
+        daemon::WriteFrame(fd, daemon::EncodeResponse(response));
+      }
+    } catch (const std::exception& error) {
+      // the client went away, the others go on
+      LOG_WARNING << error.what() << std::endl;
+    }
+    GetDaemonMetrics().connections.Add(-1);
+    std::lock_guard<std::mutex> lock(mutex_);
+    connections_.erase(fd);
+    ::close(fd);
+  }
+
+  daemon::Response Handle(const daemon::Request& request, size_t worker_id) {
+    GetDaemonMetrics().requests[static_cast<int>(request.type) - 1].Add();
+    switch (request.type) {
+      case daemon::RequestType::kEvaluate:
+        return Evaluate(request, &parsers_[worker_id]);
+      case daemon::RequestType::kCompile:
+        return Compile(request, &parsers_[worker_id]);
+      case daemon::RequestType::kPing:
+        return daemon::Response();
+      case daemon::RequestType::kShutdown:
+        Stop();
+        return daemon::Response();
+    }
+    return Error("Unknown request");
+  }
+
+  daemon::Response Evaluate(const daemon::Request& request,
+                            kaleidoscope::parser::Parser* parser) {
+    RequestOptions options = ParseRequestOptions(request.options, base_);
+    parser->ResetSource(request.name, request.source);
+    std::list<kaleidoscope::ast::AST::Ptr> items = parser->Parse();
+    if (items.empty() && HasCode(request.source)) {
+      return Error("Cannot parse " + request.name);
+    }
+    Specialize(options, &items);
+
+    kaleidoscope::ir::JITSession session(options.jit);
+    std::vector<double> results;
+    size_t num_errors = options.whole_program
+                            ? session.RunWholeProgram(items, &results)
+                            : session.RunProgram(items, 1, &results);
+    if (num_errors != 0) {
+      return Error(std::to_string(num_errors) + " items of " + request.name +
+                   " failed");
+    }
+    daemon::Response response;
+    response.body = daemon::EncodeValues(results);
+    return response;
+  }
+
+  daemon::Response Compile(const daemon::Request& request,
+                           kaleidoscope::parser::Parser* parser) {
+    RequestOptions options = ParseRequestOptions(request.options, base_);
+    parser->ResetSource(request.name, request.source);
+    std::list<kaleidoscope::ast::AST::Ptr> items = parser->Parse();
+    if (items.empty() && HasCode(request.source)) {
+      return Error("Cannot parse " + request.name);
+    }
+    Specialize(options, &items);
+
+    kaleidoscope::ir::AOTCompiler compiler(options.aot, request.name);
+    if (!compiler.IsValid()) {
+      return Error("Cannot compile for the CPU " + options.aot.cpu);
+    }
+    size_t num_errors = compiler.Add(items);
+    llvm::SmallVector<char, 0> object;
+    if (!compiler.WriteObject(&object)) {
+      return Error("Cannot emit the object of " + request.name);
+    }
+    if (num_errors != 0) {
+      return Error(std::to_string(num_errors) + " items of " + request.name +
+                   " failed");
+    }
+    daemon::Response response;
+    response.body.assign(object.data(), object.size());
+    return response;
+  }
+
+  /*! \brief Stop accepting, and hang up once the requests being served end */
+  void Stop() {
+    stopping_ = true;
+    // wakes up accept
+    ::shutdown(listen_fd_, SHUT_RDWR);
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int fd : connections_) ::shutdown(fd, SHUT_RD);
+  }
+
+  std::string socket_path_;
+  RequestOptions base_;
+  int listen_fd_ = -1;
+  std::atomic<bool> stopping_{false};
+  kaleidoscope::WorkStealingPool pool_;
+  // one per worker of pool_
+  std::vector<kaleidoscope::parser::Parser> parsers_;
+
+  std::mutex mutex_;  // guards connections_
+  std::unordered_set<int> connections_;
+};
+
+}  // namespace
+
+// Usage:
+//   klangd <socket> [--jobs=N] [-O0|-O1|-O2|-O3|-Os]
+//          [--fp-mode=strict|contract|fast]
+//          [--cache-dir=dir [--cache-size=MiB]]
+//          [--metrics[=prometheus|json]]
+// Listens on the UNIX socket and serves the requests of klang_client, see
+// kaleidoscope/daemon.h, until one asks it to shut down. Up to --jobs
+// clients are served at once, one per hardware thread by default. The
+// options are the defaults of every request, which may override them.
+// --cache-dir keeps the machine code of the JIT in a directory as in
+// klang_jit, so that a source sent again skips the optimizer and the code
+// generation; all requests share one cache, which scans it once.
+// --metrics prints the counters of the compiler internals and of the
+// daemon to stderr on shutdown.
+int main(int argc, char** argv) {
+  RequestOptions base;
+  std::vector<std::string> paths;
+  size_t num_workers = 0;
+  std::string metrics_format;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 7, "--jobs=") == 0) {
+      num_workers = std::stoul(arg.substr(7));
+    } else if (arg.compare(0, 12, "--cache-dir=") == 0) {
+      base.jit.cache_dir = arg.substr(12);
+    } else if (arg.compare(0, 13, "--cache-size=") == 0) {
+      base.jit.cache_max_bytes = std::stoull(arg.substr(13)) << 20;
+    } else if (arg == "--metrics") {
+      metrics_format = "prometheus";
+    } else if (arg.compare(0, 10, "--metrics=") == 0) {
+      metrics_format = arg.substr(10);
+      if (metrics_format != "prometheus" && metrics_format != "json") {
+        throw std::runtime_error("Unknown metrics format: " + arg);
+      }
+    } else if (arg.compare(0, 10, "--fp-mode=") == 0 ||
+               (arg.size() > 2 && arg.compare(0, 2, "-O") == 0)) {
+      base = ParseRequestOptions(arg, base);
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.size() != 1) {
+    throw std::runtime_error("A socket path should be given.");
+  }
+
+  // paid once here instead of by every request
+  kaleidoscope::ir::InitializeNativeTarget();
+  if (!base.jit.cache_dir.empty()) {
+    base.jit.object_cache = std::make_shared<kaleidoscope::ir::DiskObjectCache>(
+        base.jit.cache_dir, base.jit.cache_max_bytes);
+  }
+  GetDaemonMetrics();
+  {
+    Server server(paths[0], num_workers, base);
+    server.Run();
+  }
+
+  if (metrics_format == "json") {
+    kaleidoscope::metrics::WriteJson(kaleidoscope::metrics::TakeSnapshot(),
+                                     std::cerr);
+  } else if (!metrics_format.empty()) {
+    kaleidoscope::metrics::WritePrometheus(
+        kaleidoscope::metrics::TakeSnapshot(), std::cerr);
+  }
+  return 0;
+}
@@ -0,0 +1,204 @@
+#include "hot_swap.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <unordered_set>
+#include <utility>
+
+#include "kaleidoscope/logging.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm_error.h"
+
+namespace kaleidoscope {
+namespace ir {
+
+HotSwapCompiler::HotSwapCompiler(llvm::orc::LLJIT* jit) : jit_(jit) {
+  auto stubs_builder = llvm::orc::createLocalIndirectStubsManagerBuilder(
+      jit_->getTargetTriple());
+  CHECK(stubs_builder) << "Indirect stubs are not supported on "
+                       << jit_->getTargetTriple().str();
+  stubs_ = stubs_builder();
+}
+
+void HotSwapCompiler::AddModule(GeneratedModule generated) {
+  std::vector<GeneratedModule> modules;
+  modules.push_back(std::move(generated));
+  AddModules(std::move(modules));
+}
+
+void HotSwapCompiler::AddModules(std::vector<GeneratedModule> modules) {
+  auto start = std::chrono::steady_clock::now();
+
+  struct Definition {
+    llvm::Function* func;
+    std::string name;
+    int version;
+  };
+  std::vector<std::vector<Definition>> definitions(modules.size());
+  size_t num_redefined = 0;
+  llvm::orc::SymbolMap stub_symbols;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < modules.size(); ++i) {
+      for (auto& func : *modules[i].module) {
+        // private helpers, e.g. the body of a @memo function, go with it
+        if (func.isDeclaration() || func.hasLocalLinkage()) continue;
+        std::string name = func.getName().str();
+        auto found = functions_.find(name);
+        if (found != functions_.end()) {
+          definitions[i].push_back({&func, name, found->second.version + 1});
+          ++num_redefined;
+          continue;
+        }
+
+        // a new function, its stub is exported before any body is compiled
+        // as the bodies may call each other. Until one is, or if none does,
+        // it throws, and a later definition counts as a redefinition.
+        CheckLLVMError(
+            stubs_->createStub(
+                name, llvm::pointerToJITTargetAddress(&OnCompileFailure),
+                llvm::JITSymbolFlags::Exported),
+            "Failed to create the stub of " + name);
+        stub_symbols[jit_->mangleAndIntern(name)] = llvm::JITEvaluatedSymbol(
+            stubs_->findStub(name, true).getAddress(),
+            llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable);
+        functions_[name];
+        definitions[i].push_back({&func, name, 0});
+      }
+    }
+  }
+  if (!stub_symbols.empty()) {
+    CheckLLVMError(jit_->getMainJITDylib().define(
+                       llvm::orc::absoluteSymbols(std::move(stub_symbols))),
+                   "Failed to define the stubs");
+  }
+
+  std::vector<std::shared_ptr<ModuleCode>> codes(modules.size());
+  for (size_t i = 0; i < modules.size(); ++i) {
+    if (definitions[i].empty()) continue;
+    llvm::Module& module = *modules[i].module;
+    module.setDataLayout(jit_->getDataLayout());
+    codes[i] = std::make_shared<ModuleCode>();
+    for (const auto& definition : definitions[i]) {
+      const std::string version = ".v" + std::to_string(definition.version);
+      // the cache of a @memo function is exported so that it can be cleared
+      if (auto* table =
+              module.getGlobalVariable(definition.name + ".memo", true)) {
+        table->setName(definition.name + ".memo" + version);
+        table->setLinkage(llvm::GlobalValue::ExternalLinkage);
+        codes[i]->memo_tables.push_back(
+            {table->getName().str(), nullptr,
+             module.getDataLayout().getTypeAllocSize(table->getValueType())});
+      }
+      RenameDefinition(definition.func, definition.name + version);
+    }
+    codes[i]->tracker = jit_->getMainJITDylib().createResourceTracker();
+    CheckLLVMError(
+        jit_->addIRModule(codes[i]->tracker,
+                          llvm::orc::ThreadSafeModule(
+                              std::move(modules[i].module),
+                              std::move(modules[i].context))),
+        "Failed to add a module");
+  }
+
+  // the stubs of a module that fails keep their old body, the others
+  // still go to theirs
+  std::exception_ptr error;
+  for (size_t i = 0; i < modules.size(); ++i) {
+    std::vector<llvm::JITTargetAddress> addresses;
+    try {
+      if (codes[i]) {
+        for (auto& table : codes[i]->memo_tables) {
+          table.address = reinterpret_cast<void*>(static_cast<uintptr_t>(
+              CheckLLVMError(jit_->lookup(table.name),
+                             "Failed to look up " + table.name)
+                  .getAddress()));
+        }
+      }
+      for (const auto& definition : definitions[i]) {
+        const std::string& name = definition.name;
+        addresses.push_back(
+            CheckLLVMError(jit_->lookup(name + ".v" +
+                                        std::to_string(definition.version)),
+                           "Failed to compile " + name)
+                .getAddress());
+      }
+    } catch (...) {
+      if (!error) error = std::current_exception();
+      if (codes[i]) {
+        CheckLLVMError(codes[i]->tracker->remove(), "Failed to free a module");
+      }
+      continue;
+    }
+
+    for (size_t j = 0; j < definitions[i].size(); ++j) {
+      const Definition& definition = definitions[i][j];
+      const std::string& name = definition.name;
+      CheckLLVMError(stubs_->updatePointer(name, addresses[j]),
+                     "Failed to update the stub of " + name);
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      Function& function = functions_[name];
+      std::shared_ptr<ModuleCode> old_code = std::move(function.code);
+      function.version = definition.version;
+      function.code = codes[i];
+      // no function uses the old module anymore
+      if (old_code && old_code.use_count() == 1) {
+        retired_.push_back(std::move(old_code));
+      }
+    }
+  }
+
+  if (num_redefined != 0) {
+    ClearMemoTables();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::lock_guard<std::mutex> lock(mutex_);
+    num_redefinitions_ += num_redefined;
+    redefinition_seconds_ += elapsed.count();
+    max_redefinition_seconds_ =
+        std::max(max_redefinition_seconds_, elapsed.count());
+  }
+  if (error) std::rethrow_exception(error);
+}
+
+void HotSwapCompiler::ClearMemoTables() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::unordered_set<const ModuleCode*> cleared;
+  for (const auto& function : functions_) {
+    const ModuleCode* code = function.second.code.get();
+    // e.g. a function whose first body failed to compile
+    if (!code || !cleared.insert(code).second) continue;
+    for (const auto& table : code->memo_tables) {
+      std::memset(table.address, 0, table.num_bytes);
+    }
+  }
+}
+
+void HotSwapCompiler::ReleaseRetired() {
+  std::vector<std::shared_ptr<ModuleCode>> retired;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    retired.swap(retired_);
+  }
+  for (const auto& code : retired) {
+    CheckLLVMError(code->tracker->remove(), "Failed to free a module");
+  }
+}
+
+void HotSwapCompiler::PrintStats(std::ostream& os) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  os << "functions: " << functions_.size()
+     << ", redefinitions: " << num_redefinitions_;
+  if (num_redefinitions_ != 0) {
+    os << ", mean update latency: "
+       << redefinition_seconds_ / num_redefinitions_ * 1e3
+       << "ms, max: " << max_redefinition_seconds_ * 1e3 << "ms";
+  }
+  os << '\n';
+}
+
+}  // namespace ir
+}  // namespace kaleidoscope
@@ -0,0 +1,99 @@
+/*!
+ * \file hot_swap.h
+ * \brief Functions that can be redefined while the JIT session keeps running
+ */
+#ifndef KALEIDOSCOPE_IR_HOT_SWAP_H_
+#define KALEIDOSCOPE_IR_HOT_SWAP_H_
+
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ast_visiter.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+
+namespace kaleidoscope {
+namespace ir {
+
+/*!
+ * \brief Redefinable functions on top of an LLJIT
+ *
+ * Every function `f` is reached through an ORC indirect stub exported as
+ * `f`, so all calls to it, recursive ones included, go through the stub.
+ * The body of its n-th definition is renamed to `f.vn` and compiled on its
+ * own, under the ResourceTracker of the module it came from.
+ *
+ * Redefining `f` compiles the new body alone and then repoints the stub
+ * with a single store: calls already in the old body finish there, the
+ * next ones run the new body. The code of the old body is retired, and
+ * freed by ReleaseRetired once every function of its module has moved on.
+ *
+ * The results cached by @memo functions may have been computed through a
+ * function that is redefined, so every redefinition empties their caches.
+ */
+class HotSwapCompiler {
+ public:
+  /*! \param jit the JIT holding the bodies, it must outlive this object */
+  explicit HotSwapCompiler(llvm::orc::LLJIT* jit);
+
+  HotSwapCompiler(const HotSwapCompiler&) = delete;
+  HotSwapCompiler& operator=(const HotSwapCompiler&) = delete;
+
+  /*! \brief Define or redefine the functions of \a generated */
+  void AddModule(GeneratedModule generated);
+
+  /*! \brief Define or redefine the functions of modules calling each other */
+  void AddModules(std::vector<GeneratedModule> modules);
+
+  /*!
+   * \brief Free the code of the modules whose functions were all redefined
+   *
+   * \note No thread may be running one of the old bodies anymore.
+   */
+  void ReleaseRetired();
+
+  /*! \brief The number of redefinitions and how long they took */
+  void PrintStats(std::ostream& os);
+
+ private:
+  // the cache of a @memo function, see AstLLVMCodeGen::EmitMemoized
+  struct MemoTable {
+    std::string name;
+    void* address;
+    size_t num_bytes;
+  };
+
+  // the compiled code of one module, shared by the functions defined in it
+  struct ModuleCode {
+    llvm::orc::ResourceTrackerSP tracker;
+    std::vector<MemoTable> memo_tables;
+  };
+
+  struct Function {
+    int version = 0;
+    std::shared_ptr<ModuleCode> code;
+  };
+
+  /*! \brief Empty the caches of the @memo functions in use */
+  void ClearMemoTables();
+
+  llvm::orc::LLJIT* jit_;
+  std::unique_ptr<llvm::orc::IndirectStubsManager> stubs_;
+
+  std::mutex mutex_;  // guards the members below
+  std::unordered_map<std::string, Function> functions_;
+  std::vector<std::shared_ptr<ModuleCode>> retired_;
+  size_t num_redefinitions_ = 0;
+  double redefinition_seconds_ = 0;
+  double max_redefinition_seconds_ = 0;
+};
+
+}  // namespace ir
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_IR_HOT_SWAP_H_
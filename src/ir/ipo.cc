@@ -0,0 +1,131 @@
+#include "ipo.h"
+
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+
+namespace kaleidoscope {
+namespace ir {
+
+namespace {
+
+// externs that only compute their result from their arguments
+bool IsPureExtern(const llvm::Function& func) {
+  static const std::unordered_set<std::string> pure_externs = {
+      "sin",   "cos",  "tan",   "asin",  "acos", "atan", "atan2",
+      "sinh",  "cosh", "tanh",  "exp",   "exp2", "log",  "log2",
+      "log10", "pow",  "sqrt",  "cbrt",  "fabs", "floor", "ceil",
+      "round", "trunc", "fmod", "hypot", "fmin", "fmax"};
+  return func.doesNotAccessMemory() ||
+         pure_externs.count(func.getName().str()) != 0;
+}
+
+// the stack slots of mutable variables are local to one call
+bool IsLocalMemoryAccess(const llvm::Instruction& inst) {
+  const llvm::Value* pointer = nullptr;
+  if (const auto* load = llvm::dyn_cast<llvm::LoadInst>(&inst)) {
+    pointer = load->getPointerOperand();
+  } else if (const auto* store = llvm::dyn_cast<llvm::StoreInst>(&inst)) {
+    pointer = store->getPointerOperand();
+  } else {
+    return false;
+  }
+  return llvm::isa<llvm::AllocaInst>(llvm::getUnderlyingObject(pointer));
+}
+
+bool HasLoop(const llvm::Function& func) {
+  llvm::SmallVector<std::pair<const llvm::BasicBlock*,
+                              const llvm::BasicBlock*>, 4> backedges;
+  llvm::FindFunctionBackedges(func, backedges);
+  return !backedges.empty();
+}
+
+}  // namespace
+
+void InferFunctionAttributes(llvm::Module& module, WholeProgramStats* stats) {
+  std::unordered_set<const llvm::Function*> pure;
+  std::unordered_set<const llvm::Function*> terminating;
+  for (auto& func : module) {
+    func.setDoesNotThrow();
+    if (func.isDeclaration() && IsPureExtern(func)) {
+      func.setDoesNotAccessMemory();
+      func.setWillReturn();
+      pure.insert(&func);
+      terminating.insert(&func);
+    }
+  }
+
+  // bottom-up, so that the callees outside an SCC are decided before it
+  llvm::CallGraph call_graph(module);
+  for (auto scc = llvm::scc_begin(&call_graph); !scc.isAtEnd(); ++scc) {
+    std::unordered_set<const llvm::Function*> members;
+    for (auto* node : *scc) {
+      const llvm::Function* func = node->getFunction();
+      if (func && !func->isDeclaration()) members.insert(func);
+    }
+    if (members.empty()) continue;
+
+    bool is_pure = true;
+    bool is_terminating = !scc.hasCycle();
+    for (const auto* func : members) {
+      if (HasLoop(*func)) is_terminating = false;
+      for (const auto& inst : llvm::instructions(*func)) {
+        const auto* call = llvm::dyn_cast<llvm::CallBase>(&inst);
+        if (!call) {
+          // e.g. the cache of a @memo function
+          if (inst.mayReadOrWriteMemory() && !IsLocalMemoryAccess(inst)) {
+            is_pure = false;
+          }
+          continue;
+        }
+        const llvm::Function* callee = call->getCalledFunction();
+        if (callee && members.count(callee) != 0) continue;
+        if (!callee || pure.count(callee) == 0) is_pure = false;
+        if (!callee || terminating.count(callee) == 0) {
+          is_terminating = false;
+        }
+      }
+    }
+    if (!is_pure) continue;
+
+    for (const auto* member : members) {
+      auto* func = const_cast<llvm::Function*>(member);
+      func->setDoesNotAccessMemory();
+      pure.insert(func);
+      ++stats->num_pure;
+      if (is_terminating) {
+        func->setWillReturn();
+        terminating.insert(func);
+        ++stats->num_terminating;
+      }
+    }
+  }
+}
+
+void Internalize(llvm::Module& module,
+                 const std::unordered_set<std::string>& exports,
+                 WholeProgramStats* stats) {
+  for (auto& func : module) {
+    if (func.isDeclaration() || func.hasLocalLinkage()) continue;
+    if (exports.count(func.getName().str()) != 0) continue;
+    func.setLinkage(llvm::GlobalValue::InternalLinkage);
+    ++stats->num_internalized;
+  }
+}
+
+WholeProgramStats PrepareWholeProgram(
+    llvm::Module& module, const std::unordered_set<std::string>& exports) {
+  WholeProgramStats stats;
+  InferFunctionAttributes(module, &stats);
+  Internalize(module, exports, &stats);
+  return stats;
+}
+
+}  // namespace ir
+}  // namespace kaleidoscope
@@ -0,0 +1,55 @@
+/*!
+ * \file ipo.h
+ * \brief Whole-program preparation: function attributes and internalizing
+ */
+#ifndef KALEIDOSCOPE_IR_IPO_H_
+#define KALEIDOSCOPE_IR_IPO_H_
+
+#include <string>
+#include <unordered_set>
+
+#include "llvm/IR/Module.h"
+
+namespace kaleidoscope {
+namespace ir {
+
+/*! \brief What PrepareWholeProgram found out about a module */
+struct WholeProgramStats {
+  size_t num_pure = 0;          // marked readnone
+  size_t num_terminating = 0;   // marked willreturn as well
+  size_t num_internalized = 0;  // no longer visible outside the module
+};
+
+/*!
+ * \brief Mark the functions of \a module that cannot have side effects
+ *
+ * Kaleidoscope functions only compute doubles from doubles, so a definition
+ * is pure unless it calls, directly or not, an extern outside the known
+ * side-effect free math functions (putchard or printd for instance), or
+ * accesses memory other than the stack slots of its variables, which only
+ * the cache of a @memo function does. Pure functions get readnone, so that
+ * their calls can be CSE'd, hoisted and deleted, and willreturn unless they
+ * are recursive. Nothing throws, so
+ * every function gets nounwind.
+ *
+ * \note Only a module holding the whole program can be analyzed this way,
+ *       a function defined elsewhere is assumed to have side effects.
+ */
+void InferFunctionAttributes(llvm::Module& module, WholeProgramStats* stats);
+
+/*!
+ * \brief Give every definition outside \a exports internal linkage, so that
+ *        the inliner and the dead function elimination are free to remove it
+ */
+void Internalize(llvm::Module& module,
+                 const std::unordered_set<std::string>& exports,
+                 WholeProgramStats* stats);
+
+/*! \brief InferFunctionAttributes and Internalize */
+WholeProgramStats PrepareWholeProgram(
+    llvm::Module& module, const std::unordered_set<std::string>& exports);
+
+}  // namespace ir
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_IR_IPO_H_
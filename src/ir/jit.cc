@@ -0,0 +1,541 @@
+#include "jit.h"
+
+#include <unordered_set>
+#include <vector>
+
+#include "kaleidoscope/alloc_tracker.h"
+#include "kaleidoscope/logging.h"
+#include "kaleidoscope/metrics.h"
+#include "kaleidoscope/trace.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm_error.h"
+#include "parallel_codegen.h"
+#include "specialize.h"
+
+namespace kaleidoscope {
+namespace ir {
+
+namespace {
+
+const metrics::Gauge& JITMemoryGauge() {
+  static const metrics::Gauge gauge = metrics::GetGauge(
+      "klang_jit_memory_bytes",
+      "Bytes of the code and data sections of the objects linked in the JIT");
+  return gauge;
+}
+
+/*!
+ * \brief The memory manager of one JIT-linked object, which reports its
+ *        sections until the object is removed
+ */
+class MeteredMemoryManager : public llvm::SectionMemoryManager {
+ public:
+  ~MeteredMemoryManager() override { JITMemoryGauge().Add(-num_bytes_); }
+
+  uint8_t* allocateCodeSection(uintptr_t size, unsigned alignment,
+                               unsigned section_id,
+                               llvm::StringRef section_name) override {
+    Track(size);
+    return SectionMemoryManager::allocateCodeSection(size, alignment,
+                                                     section_id, section_name);
+  }
+
+  uint8_t* allocateDataSection(uintptr_t size, unsigned alignment,
+                               unsigned section_id,
+                               llvm::StringRef section_name,
+                               bool is_read_only) override {
+    Track(size);
+    return SectionMemoryManager::allocateDataSection(
+        size, alignment, section_id, section_name, is_read_only);
+  }
+
+ private:
+  void Track(uintptr_t size) {
+    num_bytes_ += static_cast<int64_t>(size);
+    JITMemoryGauge().Add(static_cast<int64_t>(size));
+  }
+
+  int64_t num_bytes_ = 0;
+};
+
+/*! \brief What the object cache keys on besides the IR */
+std::string CacheConfig(const llvm::orc::JITTargetMachineBuilder& machine,
+                        OptLevel opt_level) {
+  return machine.getTargetTriple().str() + " " + machine.getCPU() + " " +
+         machine.getFeatures().getString() + " " + OptLevelName(opt_level) +
+         // set together with CodeGenOpt::None for tiered or quick code
+         (machine.getOptions().EnableFastISel ? " fast-isel" : "") +
+         " LLVM " LLVM_VERSION_STRING;
+}
+
+/*!
+ * \brief Throw unless all the functions \a module calls but only declares
+ *        are in the host process, the program's own and the intrinsics
+ *        aside
+ *
+ * ORC only finds out while linking the code calling one, which in lazy
+ * mode happens on a call from JIT'd code.
+ */
+void CheckExterns(const llvm::Module& module) {
+  for (const auto& func : module) {
+    if (!func.isDeclaration() || func.isIntrinsic() || func.use_empty() ||
+        func.hasFnAttribute(llvm::Attribute::NoBuiltin)) {
+      continue;
+    }
+    const std::string name = func.getName().str();
+    if (!llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(name)) {
+      LOG_FATAL << "Unknown external function " << name;
+    }
+  }
+}
+
+}  // namespace
+
+KaleidoscopeJIT::KaleidoscopeJIT(const JITOptions& options)
+    : options_(options),
+      target_machine_(CreateHostTargetMachine(llvm::CodeGenOpt::Default)),
+      optimizer_(options.tiered ? OptLevel::kO0 : options.opt_level,
+                 options.time_passes, target_machine_.get()),
+      module_optimizer_(OptLevel::kO3, options.time_passes,
+                       target_machine_.get()) {
+  CHECK(!options_.tiered || !options_.redefinable)
+      << "Tiered functions cannot be redefined";
+  // export the gauge as 0 before the first object is linked
+  JITMemoryGauge();
+  llvm::orc::LLLazyJITBuilder builder;
+  builder.setLazyCompileFailureAddr(
+      llvm::pointerToJITTargetAddress(&OnCompileFailure));
+  if (options_.tiered || options_.quick_codegen) {
+    auto machine_builder =
+        CheckLLVMError(llvm::orc::JITTargetMachineBuilder::detectHost(),
+                       "Failed to detect the host");
+    machine_builder.setCodeGenOptLevel(llvm::CodeGenOpt::None);
+    machine_builder.getOptions().EnableFastISel = true;
+    builder.setJITTargetMachineBuilder(std::move(machine_builder));
+  }
+  // the default RuntimeDyld linking layer, with metered memory
+  builder.setObjectLinkingLayerCreator(
+      [](llvm::orc::ExecutionSession& session, const llvm::Triple&) {
+        auto create_memory_manager = [] {
+          return std::make_unique<MeteredMemoryManager>();
+        };
+        std::unique_ptr<llvm::orc::ObjectLayer> layer =
+            std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(
+                session, create_memory_manager);
+        return layer;
+      });
+  object_cache_ = options_.object_cache;
+  if (!object_cache_ && !options_.cache_dir.empty()) {
+    object_cache_ = std::make_shared<DiskObjectCache>(
+        options_.cache_dir, options_.cache_max_bytes);
+  }
+  if (object_cache_) {
+    builder.setCompileFunctionCreator(
+        [this](llvm::orc::JITTargetMachineBuilder machine_builder)
+            -> llvm::Expected<
+                std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+          object_config_ = CacheConfig(machine_builder, optimizer_.GetLevel());
+          auto machine = machine_builder.createTargetMachine();
+          if (!machine) return machine.takeError();
+          return std::make_unique<llvm::orc::TMOwningSimpleCompiler>(
+              std::move(*machine), object_cache_.get());
+        });
+  }
+  jit_ = CheckLLVMError(builder.create(), "Failed to create the JIT");
+  // only compile the functions that are actually called, except in a module
+  // with clones of SpecializeCalls, which is compiled as a whole so that
+  // they are inlined into the function they were made for
+  jit_->setPartitionFunction(
+      [](llvm::orc::CompileOnDemandLayer::GlobalValueSet requested)
+          -> llvm::Optional<llvm::orc::CompileOnDemandLayer::GlobalValueSet> {
+        if (!requested.empty()) {
+          for (const auto& func : *(*requested.begin())->getParent()) {
+            if (!func.isDeclaration() &&
+                IsSpecialization(func.getName().str())) {
+              return llvm::None;
+            }
+          }
+        }
+        return llvm::orc::CompileOnDemandLayer::compileRequested(
+            std::move(requested));
+      });
+
+  jit_->getIRTransformLayer().setTransform(
+      [this](llvm::orc::ThreadSafeModule tsm,
+             const llvm::orc::MaterializationResponsibility&)
+          -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+        tsm.withModuleDo([this](llvm::Module& module) {
+          // a cached object was optimized before it was stored
+          if (object_cache_ && object_cache_->Prepare(module, object_config_)) {
+            return;
+          }
+          optimizer_.Run(module);
+        });
+        return tsm;
+      });
+
+  // resolve 'extern' functions against the host process, e.g. sin or cos
+  jit_->getMainJITDylib().addGenerator(CheckLLVMError(
+      llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+          jit_->getDataLayout().getGlobalPrefix()),
+      "Failed to load the host process symbols"));
+
+  if (options_.tiered) {
+    tiering_ = std::make_unique<TieredCompiler>(
+        jit_.get(), options_.tier_up_threshold, options_.time_passes);
+  }
+  if (options_.redefinable) {
+    hot_swap_ = std::make_unique<HotSwapCompiler>(jit_.get());
+  }
+}
+
+KaleidoscopeJIT::~KaleidoscopeJIT() = default;
+
+const llvm::DataLayout& KaleidoscopeJIT::GetDataLayout() const {
+  return jit_->getDataLayout();
+}
+
+void KaleidoscopeJIT::PrintPassTimings() {
+  optimizer_.PrintTimings();
+  if (tiering_ && options_.time_passes) {
+    tiering_->Drain();
+    tiering_->PrintTimings();
+  }
+}
+
+void KaleidoscopeJIT::AddModule(GeneratedModule generated) {
+  CheckExterns(*generated.module);
+  optimizer_.AddProgramFunctions(*generated.module);
+  if (tiering_) {
+    tiering_->AddModule(std::move(generated));
+    return;
+  }
+  if (hot_swap_) {
+    hot_swap_->AddModule(std::move(generated));
+    return;
+  }
+
+  generated.module->setDataLayout(jit_->getDataLayout());
+  std::vector<std::string> definitions;
+  for (const auto& func : *generated.module) {
+    if (!func.isDeclaration() && !func.hasLocalLinkage()) {
+      definitions.push_back(func.getName().str());
+    }
+  }
+
+  llvm::orc::ThreadSafeModule tsm(std::move(generated.module),
+                                  std::move(generated.context));
+  if (options_.lazy) {
+    CheckLLVMError(jit_->addLazyIRModule(std::move(tsm)),
+                   "Failed to add a module");
+    return;
+  }
+
+  CheckLLVMError(jit_->addIRModule(std::move(tsm)), "Failed to add a module");
+  // ORC materializes a module on its first lookup, force that right now
+  for (const auto& name : definitions) {
+    Lookup(name);
+  }
+}
+
+llvm::orc::ResourceTrackerSP KaleidoscopeJIT::AddRemovableModule(
+    GeneratedModule generated) {
+  CHECK(!tiering_ && !hot_swap_)
+      << "Tiered or redefinable functions cannot be removed";
+  CheckExterns(*generated.module);
+  optimizer_.AddProgramFunctions(*generated.module);
+  generated.module->setDataLayout(jit_->getDataLayout());
+  std::vector<std::string> definitions;
+  for (const auto& func : *generated.module) {
+    if (!func.isDeclaration() && !func.hasLocalLinkage()) {
+      definitions.push_back(func.getName().str());
+    }
+  }
+
+  llvm::orc::ThreadSafeModule tsm(std::move(generated.module),
+                                  std::move(generated.context));
+  auto tracker = jit_->getMainJITDylib().createResourceTracker();
+  try {
+    CheckLLVMError(jit_->addIRModule(tracker, std::move(tsm)),
+                   "Failed to add a module");
+    for (const auto& name : definitions) {
+      Lookup(name);
+    }
+  } catch (...) {
+    // a dropped tracker hands its code and symbols to the JITDylib for good
+    CheckLLVMError(tracker->remove(), "Failed to remove a module");
+    throw;
+  }
+  return tracker;
+}
+
+void KaleidoscopeJIT::AddModules(std::vector<GeneratedModule> modules) {
+  // before the first of them is compiled, which may call into the others
+  for (const auto& generated : modules) CheckExterns(*generated.module);
+  for (const auto& generated : modules) {
+    optimizer_.AddProgramFunctions(*generated.module);
+  }
+  if (tiering_) {
+    tiering_->AddModules(std::move(modules));
+    return;
+  }
+  if (hot_swap_) {
+    hot_swap_->AddModules(std::move(modules));
+    return;
+  }
+  for (auto& generated : modules) {
+    AddModule(std::move(generated));
+  }
+}
+
+double KaleidoscopeJIT::RunExpr(GeneratedModule generated,
+                                const std::string& name) {
+  CheckExterns(*generated.module);
+  generated.module->setDataLayout(jit_->getDataLayout());
+  llvm::orc::ThreadSafeModule tsm(std::move(generated.module),
+                                  std::move(generated.context));
+
+  // track the expression module so that its memory is freed after the run
+  auto tracker = jit_->getMainJITDylib().createResourceTracker();
+  CheckLLVMError(jit_->addIRModule(tracker, std::move(tsm)),
+                 "Failed to add a module");
+  double result;
+  try {
+    auto* func = reinterpret_cast<double (*)()>(Lookup(name));
+    trace::Scope scope("Run", name);
+    result = func();
+  } catch (...) {
+    // e.g. a callee that failed to compile, the module goes all the same
+    CheckLLVMError(tracker->remove(), "Failed to remove a module");
+    throw;
+  }
+  CheckLLVMError(tracker->remove(), "Failed to remove a module");
+  return result;
+}
+
+void KaleidoscopeJIT::AddOptimizedModule(GeneratedModule generated) {
+  CheckExterns(*generated.module);
+  generated.module->setDataLayout(jit_->getDataLayout());
+  generated.module->setTargetTriple(
+      target_machine_->getTargetTriple().str());
+  module_optimizer_.Run(*generated.module);
+  llvm::orc::ThreadSafeModule tsm(std::move(generated.module),
+                                  std::move(generated.context));
+  CheckLLVMError(jit_->addIRModule(std::move(tsm)), "Failed to add a module");
+}
+
+void* KaleidoscopeJIT::Lookup(const std::string& name) {
+  // the first lookup optimizes, compiles and links the module
+  trace::Scope scope("Materialize", name);
+  alloc::PhaseScope phase(alloc::Phase::kJIT);
+  auto symbol =
+      CheckLLVMError(jit_->lookup(name), "Failed to look up " + name);
+  return reinterpret_cast<void*>(
+      static_cast<uintptr_t>(symbol.getAddress()));
+}
+
+JITSession::ItemKind JITSession::Run(ast::AST* ast_ptr, double* result) {
+  if (auto* hot_swap = jit_.GetHotSwap()) hot_swap->ReleaseRetired();
+
+  switch (ast_ptr->GetType()) {
+    case ast::ASTType::kPrototype:
+      // declarations only need to be known by the code generator
+      if (!codegen_.visit(static_cast<ast::ProtoTypeAST*>(ast_ptr))) {
+        return ItemKind::kError;
+      }
+      return ItemKind::kDeclaration;
+
+    case ast::ASTType::kFunction: {
+      auto* func_ast = static_cast<ast::FunctionAST*>(ast_ptr);
+      const bool is_expression = func_ast->GetProto()->GetName().empty();
+      if (is_expression && has_open_clones_) {
+        // the module of an expression goes once it ran, the clones stay
+        jit_.AddModule(codegen_.TakeModule());
+        has_open_clones_ = false;
+      }
+      auto* func = codegen_.visit(func_ast);
+      if (!func) return ItemKind::kError;
+      std::string name = func->getName().str();
+
+      if (IsSpecialization(name)) {
+        has_open_clones_ = true;
+        return ItemKind::kDefinition;
+      }
+      if (!is_expression) {
+        has_open_clones_ = false;
+        jit_.AddModule(codegen_.TakeModule());
+        // a batch wrapper inlines the body it was built from
+        batch_functions_.erase(name);
+        return ItemKind::kDefinition;
+      }
+      *result = jit_.RunExpr(codegen_.TakeModule(), name);
+      return ItemKind::kExpression;
+    }
+
+    case ast::ASTType::kExpr:
+      break;
+  }
+  LOG_WARNING << "Unexpected top-level expression" << std::endl;
+  return ItemKind::kError;
+}
+
+BatchFunction JITSession::CompileBatch(ast::FunctionAST* func_ast) {
+  const std::string& name = func_ast->GetProto()->GetName();
+  auto found = batch_functions_.find(name);
+  if (found != batch_functions_.end()) return found->second;
+
+  auto* batch = codegen_.EmitBatchWrapper(func_ast);
+  if (!batch) {
+    // drop whatever made it into the module before the error
+    codegen_.TakeModule();
+    return nullptr;
+  }
+  // the wrapper of an earlier definition may still be in the JIT
+  batch->setName(batch->getName() + "." +
+                 std::to_string(num_batch_wrappers_++));
+  std::string batch_name = batch->getName().str();
+  jit_.AddOptimizedModule(codegen_.TakeModule());
+  auto func = reinterpret_cast<BatchFunction>(jit_.Lookup(batch_name));
+  batch_functions_[name] = func;
+  return func;
+}
+
+size_t JITSession::RunProgram(const std::list<ast::AST::Ptr>& items,
+                              size_t num_jobs, std::vector<double>* results) {
+  size_t num_errors = 0;
+  std::vector<ast::ProtoTypeAST*> externs;
+  std::vector<ast::FunctionAST*> definitions;
+  std::unordered_set<std::string> names;
+  std::unordered_map<std::string, size_t> extern_args;
+  for (const auto& item : items) {
+    if (item->GetType() == ast::ASTType::kPrototype) {
+      auto* proto_ast = static_cast<ast::ProtoTypeAST*>(item.get());
+      externs.push_back(proto_ast);
+      extern_args[proto_ast->GetName()] = proto_ast->GetArgs().size();
+    } else if (item->GetType() == ast::ASTType::kFunction) {
+      auto* func_ast = static_cast<ast::FunctionAST*>(item.get());
+      const std::string& name = func_ast->GetProto()->GetName();
+      if (name.empty()) continue;
+      // the partitions cannot see each other's definitions, leave the
+      // redefinitions to Run below which reports them, as well as the
+      // definitions of a builtin declared as extern before
+      size_t num_args = func_ast->GetProto()->GetArgs().size();
+      auto declared = extern_args.find(name);
+      if (declared != extern_args.end() && names.count(name) == 0 &&
+          declared->second == num_args && IsBuiltin(name, num_args)) {
+        continue;
+      }
+      if (names.insert(name).second) definitions.push_back(func_ast);
+    }
+  }
+
+  std::unordered_set<const ast::AST*> done;
+  if (num_jobs == 1) {
+    // an extern of them is no host function, see KaleidoscopeJIT
+    for (const auto* func_ast : definitions) {
+      codegen_.ReserveDefinition(func_ast->GetProto()->GetName());
+    }
+  } else {
+    ParallelCodeGen parallel_codegen(num_jobs);
+    parallel_codegen.SetFPMode(fp_mode_);
+    parallel_codegen.SetDiscardValueNames(discard_value_names_);
+    size_t codegen_errors = 0;
+    auto modules = parallel_codegen.Run(externs, definitions, &codegen_errors);
+    num_errors += codegen_errors;
+    try {
+      jit_.AddModules(std::move(modules));
+    } catch (const std::exception& error) {
+      // e.g. an unknown extern, the calls to these functions fail too
+      LOG_WARNING << error.what() << std::endl;
+      ++num_errors;
+    }
+    for (const auto* func_ast : definitions) {
+      codegen_.ImportFunction(func_ast->GetProto(), true);
+    }
+    done.insert(definitions.begin(), definitions.end());
+  }
+
+  for (const auto& item : items) {
+    if (done.count(item.get()) != 0) continue;
+    double result = 0;
+    ItemKind kind;
+    try {
+      kind = Run(item.get(), &result);
+    } catch (const std::exception& error) {
+      // e.g. a function that failed to link, the program goes on
+      LOG_WARNING << error.what() << std::endl;
+      kind = ItemKind::kError;
+    }
+    switch (kind) {
+      case ItemKind::kExpression:
+        results->push_back(result);
+        break;
+      case ItemKind::kError:
+        ++num_errors;
+        break;
+      default:
+        break;
+    }
+  }
+  return num_errors;
+}
+
+size_t JITSession::RunWholeProgram(const std::list<ast::AST::Ptr>& items,
+                                   std::vector<double>* results,
+                                   WholeProgramStats* stats) {
+  size_t num_errors = 0;
+  std::vector<std::string> expressions;
+  for (const auto& item : items) {
+    switch (item->GetType()) {
+      case ast::ASTType::kPrototype:
+        if (!codegen_.visit(static_cast<ast::ProtoTypeAST*>(item.get()))) {
+          ++num_errors;
+        }
+        break;
+
+      case ast::ASTType::kFunction: {
+        auto* func_ast = static_cast<ast::FunctionAST*>(item.get());
+        auto* func = codegen_.visit(func_ast);
+        if (!func) {
+          ++num_errors;
+        } else if (func_ast->GetProto()->GetName().empty()) {
+          expressions.push_back(func->getName().str());
+        }
+        break;
+      }
+
+      case ast::ASTType::kExpr:
+        LOG_WARNING << "Unexpected top-level expression" << std::endl;
+        ++num_errors;
+        break;
+    }
+  }
+
+  GeneratedModule generated = codegen_.TakeModule();
+  WholeProgramStats program_stats = PrepareWholeProgram(
+      *generated.module,
+      std::unordered_set<std::string>(expressions.begin(), expressions.end()));
+  if (stats) *stats = program_stats;
+  try {
+    jit_.AddOptimizedModule(std::move(generated));
+    for (const auto& name : expressions) {
+      results->push_back(reinterpret_cast<double (*)()>(jit_.Lookup(name))());
+    }
+  } catch (const std::exception& error) {
+    // e.g. an unknown extern, which fails the one module of the program
+    LOG_WARNING << error.what() << std::endl;
+    ++num_errors;
+  }
+  return num_errors;
+}
+
+}  // namespace ir
+}  // namespace kaleidoscope
@@ -0,0 +1,244 @@
+/*!
+ * \file jit.h
+ * \brief ORC based JIT that runs the modules emitted by AstLLVMCodeGen
+ */
+#ifndef KALEIDOSCOPE_IR_JIT_H_
+#define KALEIDOSCOPE_IR_JIT_H_
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ast_visiter.h"
+#include "hot_swap.h"
+#include "ipo.h"
+#include "kaleidoscope/ast.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "object_cache.h"
+#include "optimizer.h"
+#include "tiering.h"
+
+namespace kaleidoscope {
+namespace ir {
+
+/*! \brief out[i] = f(columns[0][i], columns[1][i], ...) for i < num_rows */
+using BatchFunction = void (*)(const double* const* columns, double* out,
+                               int64_t num_rows);
+
+struct JITOptions {
+  // compile function bodies on their first call instead of when added
+  bool lazy = true;
+  // pipeline run over every module right before it is compiled
+  OptLevel opt_level = OptLevel::kO0;
+  // sum up the time spent in every optimization pass
+  bool time_passes = false;
+  // compile quickly first and recompile hot functions at -O3 in the
+  // background, opt_level and lazy are ignored then
+  bool tiered = false;
+  // number of calls after which a function is recompiled at tier 1
+  uint64_t tier_up_threshold = 1000;
+  // let functions be redefined, every one is compiled eagerly on its own
+  // and reached through a stub then, lazy is ignored and tiered not allowed
+  bool redefinable = false;
+  // emit machine code with FastISel and no codegen optimizations, as tier 0
+  // does, for when the compile latency matters more than the code, e.g. in
+  // a REPL
+  bool quick_codegen = false;
+  // floating-point semantics of the functions without an annotation
+  FPMode fp_mode = FPMode::kStrict;
+  // emit unnamed instructions, nobody reads the IR handed to the JIT
+  bool discard_value_names = true;
+  // directory of the machine code kept across processes, see
+  // DiskObjectCache, nothing is kept if empty
+  std::string cache_dir;
+  // size cap of the objects in cache_dir
+  uint64_t cache_max_bytes = uint64_t{256} << 20;
+  // the cache to use instead of opening cache_dir, e.g. one shared by the
+  // JITs of all the requests of a server
+  std::shared_ptr<DiskObjectCache> object_cache;
+};
+
+/*!
+ * \brief A JIT on top of llvm::orc::LLLazyJIT
+ *
+ * Definitions are added lazily: every function gets a call-through stub and
+ * its body is only compiled the first time the stub is called, so a large
+ * library of which only a few functions are used starts quickly.
+ * Top-level expressions are compiled eagerly, run once and freed.
+ *
+ * Every module, or every function partition of it in lazy mode, goes through
+ * the optimization pipeline of JITOptions::opt_level just before it is
+ * compiled to machine code.
+ *
+ * With JITOptions::cache_dir or JITOptions::object_cache, the modules whose
+ * object is in the cache are neither optimized nor compiled, the object is
+ * linked as it is.
+ *
+ * A module may only declare functions of the host process besides those
+ * of the program, which are nobuiltin, or adding it throws. A function
+ * that still fails to compile lazily throws from the call to it.
+ *
+ * In tiered mode definitions are handed to a TieredCompiler instead, and the
+ * JIT itself only emits quick, unoptimized code with FastISel. With
+ * redefinable functions they are handed to a HotSwapCompiler.
+ */
+class KaleidoscopeJIT {
+ public:
+  explicit KaleidoscopeJIT(const JITOptions& options = JITOptions());
+  ~KaleidoscopeJIT();
+
+  KaleidoscopeJIT(const KaleidoscopeJIT&) = delete;
+  KaleidoscopeJIT& operator=(const KaleidoscopeJIT&) = delete;
+
+  /*! \brief Add a module of definitions to the JIT */
+  void AddModule(GeneratedModule generated);
+
+  /*! \brief Add modules whose definitions may call each other */
+  void AddModules(std::vector<GeneratedModule> modules);
+
+  /*!
+   * \brief Compile the module holding the top-level expression \a name,
+   *        run it and remove it from the JIT again
+   *
+   * \return the value of the expression
+   */
+  double RunExpr(GeneratedModule generated, const std::string& name);
+
+  /*!
+   * \brief Optimize the module at -O3 for the host CPU, whatever
+   *        JITOptions::opt_level is, and compile it right away
+   *
+   * Used for modules that need the full pipeline to pay off, e.g. so that
+   * their loops are vectorized.
+   */
+  void AddOptimizedModule(GeneratedModule generated);
+
+  /*!
+   * \brief Compile a module of definitions right away, in a way that it can
+   *        be removed from the JIT again
+   *
+   * Not for the tiered or redefinable modes.
+   *
+   * \return the tracker of the module, whose remove() frees its code
+   */
+  llvm::orc::ResourceTrackerSP AddRemovableModule(GeneratedModule generated);
+
+  /*! \brief Address of a JIT'd function, compiling it if needed */
+  void* Lookup(const std::string& name);
+
+  const llvm::DataLayout& GetDataLayout() const;
+
+  /*! \brief Print the pass timings if JITOptions::time_passes is set */
+  void PrintPassTimings();
+
+  /*! \brief The tiered compiler if JITOptions::tiered is set, or nullptr */
+  TieredCompiler* GetTiering() { return tiering_.get(); }
+
+  /*! \brief The hot swap compiler if JITOptions::redefinable is set */
+  HotSwapCompiler* GetHotSwap() { return hot_swap_.get(); }
+
+ private:
+  JITOptions options_;
+  std::unique_ptr<llvm::TargetMachine> target_machine_;  // for cost models
+  Optimizer optimizer_;  // outlives jit_, which calls it while compiling
+  Optimizer module_optimizer_;  // for AddOptimizedModule
+  std::shared_ptr<DiskObjectCache> object_cache_;  // outlives jit_ too
+  std::string object_config_;  // see DiskObjectCache::Prepare
+  std::unique_ptr<llvm::orc::LLLazyJIT> jit_;
+  std::unique_ptr<TieredCompiler> tiering_;  // goes before jit_
+  std::unique_ptr<HotSwapCompiler> hot_swap_;  // goes before jit_
+};
+
+/*!
+ * \brief Compile and run the top-level items of a program one by one
+ */
+class JITSession {
+ public:
+  /*! \brief What a top-level item turned out to be */
+  enum class ItemKind { kDeclaration, kDefinition, kExpression, kError };
+
+  explicit JITSession(const JITOptions& options = JITOptions())
+      : fp_mode_(options.fp_mode),
+        discard_value_names_(options.discard_value_names),
+        jit_(options) {
+    codegen_.SetAllowRedefinition(options.redefinable);
+    codegen_.SetFPMode(options.fp_mode);
+    codegen_.SetDiscardValueNames(options.discard_value_names);
+  }
+
+  /*!
+   * \brief Handle one item returned by Parser::Parse
+   *
+   * A redefinition replaces the function for all of its callers. The code
+   * it replaces is freed at the next item, as nothing can be running it
+   * anymore then. The clones of SpecializeCalls share the module of the
+   * definition after them, so that a chain of clones can be inlined into
+   * it.
+   *
+   * \param result set to the value of the item if it is an expression
+   * \note Throws a kaleidoscope::Error if the JIT fails on the item, e.g.
+   *       on an unknown extern
+   */
+  ItemKind Run(ast::AST* ast_ptr, double* result);
+
+  /*!
+   * \brief Handle a whole program
+   *
+   * With more than one job, all named function definitions are lowered
+   * first by a ParallelCodeGen, then the declarations and expressions are
+   * handled in source order. Expressions may thus call functions defined
+   * after them.
+   *
+   * An item that fails, in the code generator or in the JIT, is reported
+   * with a warning and the next ones still run.
+   *
+   * \param results set to the values of the expressions in source order
+   * \return the number of items that failed
+   */
+  size_t RunProgram(const std::list<ast::AST::Ptr>& items, size_t num_jobs,
+                    std::vector<double>* results);
+
+  /*!
+   * \brief Handle a whole program as a single module
+   *
+   * Only the top-level expressions are visible from outside the module, see
+   * PrepareWholeProgram, so that the -O3 pipeline may inline, propagate
+   * constants, CSE pure calls and delete the functions left unused. The
+   * functions cannot be looked up or redefined afterwards.
+   *
+   * \param results set to the values of the expressions in source order
+   * \param stats set to what was found out about the functions if not null
+   * \return the number of items that failed
+   */
+  size_t RunWholeProgram(const std::list<ast::AST::Ptr>& items,
+                         std::vector<double>* results,
+                         WholeProgramStats* stats = nullptr);
+
+  /*!
+   * \brief Compile the batch wrapper of a definition already run, see
+   *        AstLLVMCodeGen::EmitBatchWrapper
+   *
+   * \return the wrapper, or nullptr if the body failed to lower
+   */
+  BatchFunction CompileBatch(ast::FunctionAST* func_ast);
+
+  KaleidoscopeJIT& GetJIT() { return jit_; }
+
+ private:
+  AstLLVMCodeGen codegen_;
+  // for the code generators of RunProgram
+  FPMode fp_mode_;
+  bool discard_value_names_;
+  std::unordered_map<std::string, BatchFunction> batch_functions_;
+  size_t num_batch_wrappers_ = 0;
+  // clones lowered into the module of codegen_ and not added yet
+  bool has_open_clones_ = false;
+  KaleidoscopeJIT jit_;
+};
+
+}  // namespace ir
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_IR_JIT_H_
@@ -0,0 +1,429 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <list>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "jit.h"
+#include "kaleidoscope/alloc_tracker.h"
+#include "kaleidoscope/ast.h"
+#include "kaleidoscope/metrics.h"
+#include "kaleidoscope/parser.h"
+#include "kaleidoscope/trace.h"
+#include "specialize.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double Seconds(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Whether \a a and \a b are at most \a max_ulps representable doubles apart.
+bool AlmostEqual(double a, double b, int64_t max_ulps) {
+  if (std::isnan(a) || std::isnan(b)) return std::isnan(a) && std::isnan(b);
+  if (a == b) return true;
+  if (std::signbit(a) != std::signbit(b)) return false;
+  int64_t a_bits, b_bits;
+  std::memcpy(&a_bits, &a, sizeof(a));
+  std::memcpy(&b_bits, &b, sizeof(b));
+  return std::abs(a_bits - b_bits) <= max_ulps;
+}
+
+// Calls a JIT'd function of up to four arguments once per row.
+void ScalarLoop(void* func, size_t num_args,
+                const std::vector<const double*>& columns, double* out,
+                size_t num_rows) {
+  const double* const* c = columns.data();
+  switch (num_args) {
+    case 0: {
+      auto* f = reinterpret_cast<double (*)()>(func);
+      for (size_t i = 0; i < num_rows; ++i) out[i] = f();
+      break;
+    }
+    case 1: {
+      auto* f = reinterpret_cast<double (*)(double)>(func);
+      for (size_t i = 0; i < num_rows; ++i) out[i] = f(c[0][i]);
+      break;
+    }
+    case 2: {
+      auto* f = reinterpret_cast<double (*)(double, double)>(func);
+      for (size_t i = 0; i < num_rows; ++i) out[i] = f(c[0][i], c[1][i]);
+      break;
+    }
+    case 3: {
+      auto* f = reinterpret_cast<double (*)(double, double, double)>(func);
+      for (size_t i = 0; i < num_rows; ++i) {
+        out[i] = f(c[0][i], c[1][i], c[2][i]);
+      }
+      break;
+    }
+    case 4: {
+      auto* f =
+          reinterpret_cast<double (*)(double, double, double, double)>(func);
+      for (size_t i = 0; i < num_rows; ++i) {
+        out[i] = f(c[0][i], c[1][i], c[2][i], c[3][i]);
+      }
+      break;
+    }
+    default:
+      throw std::runtime_error(
+          "The scalar loop supports up to 4 arguments.");
+  }
+}
+
+// Evaluates \a name over random columns of \a num_rows rows, once with the
+// batch wrapper and once calling the function row by row, and prints the
+// throughput of both.
+void BenchBatch(kaleidoscope::ir::JITSession* session,
+                const std::list<kaleidoscope::ast::AST::Ptr>& ast_list,
+                const std::string& name, size_t num_rows) {
+  kaleidoscope::ast::FunctionAST* func_ast = nullptr;
+  for (const auto& item : ast_list) {
+    if (item->GetType() != kaleidoscope::ast::ASTType::kFunction) continue;
+    auto* func = static_cast<kaleidoscope::ast::FunctionAST*>(item.get());
+    if (func->GetProto()->GetName() == name) func_ast = func;
+  }
+  if (!func_ast) {
+    throw std::runtime_error("No definition of " + name + " to benchmark.");
+  }
+  kaleidoscope::ir::BatchFunction batch = session->CompileBatch(func_ast);
+  if (!batch) {
+    throw std::runtime_error("Failed to compile the batch wrapper of " +
+                             name);
+  }
+  void* scalar = session->GetJIT().Lookup(name);
+
+  const size_t num_args = func_ast->GetProto()->GetArgs().size();
+  std::mt19937_64 rng(42);
+  std::uniform_real_distribution<double> dist(0.5, 2.0);
+  std::vector<std::vector<double>> data(num_args,
+                                        std::vector<double>(num_rows));
+  std::vector<const double*> columns;
+  for (auto& column : data) {
+    for (double& value : column) value = dist(rng);
+    columns.push_back(column.data());
+  }
+  std::vector<double> scalar_out(num_rows), batch_out(num_rows);
+
+  // the lazy JIT compiles the scalar function on its first call
+  ScalarLoop(scalar, num_args, columns, scalar_out.data(),
+             std::min<size_t>(num_rows, 1));
+
+  constexpr int kRepeat = 10;
+  auto start = Clock::now();
+  for (int i = 0; i < kRepeat; ++i) {
+    ScalarLoop(scalar, num_args, columns, scalar_out.data(), num_rows);
+  }
+  double scalar_seconds = Seconds(start);
+  start = Clock::now();
+  for (int i = 0; i < kRepeat; ++i) {
+    batch(columns.data(), batch_out.data(), static_cast<int64_t>(num_rows));
+  }
+  double batch_seconds = Seconds(start);
+
+  // both run the same operations in the same order, but the vectorized
+  // sin, exp etc. of libmvec may round up to 4 ulps away from libm's
+  size_t mismatches = 0;
+  for (size_t i = 0; i < num_rows; ++i) {
+    if (!AlmostEqual(scalar_out[i], batch_out[i], 4)) ++mismatches;
+  }
+  double total_rows = static_cast<double>(num_rows) * kRepeat;
+  std::cerr << "scalar: " << total_rows / scalar_seconds << " rows/s\n"
+            << "batch:  " << total_rows / batch_seconds << " rows/s\n"
+            << "speedup: " << scalar_seconds / batch_seconds << "x, "
+            << mismatches << " mismatching rows" << std::endl;
+  if (mismatches != 0) {
+    throw std::runtime_error("The batch wrapper disagrees with " + name);
+  }
+}
+
+// Lowers every item of the program \a num_reps times, each time with a
+// fresh code generator, and prints the definitions lowered per second and
+// the allocations per definition, with the value names kept and discarded.
+void BenchCodeGen(const std::list<kaleidoscope::ast::AST::Ptr>& ast_list,
+                  int num_reps) {
+  using kaleidoscope::ast::ASTType;
+  for (bool discard : {false, true}) {
+    size_t num_functions = 0;
+    uint64_t allocations = kaleidoscope::alloc::ThreadAllocations();
+    auto start = Clock::now();
+    for (int rep = 0; rep < num_reps; ++rep) {
+      kaleidoscope::ir::AstLLVMCodeGen codegen;
+      codegen.SetDiscardValueNames(discard);
+      for (const auto& item : ast_list) {
+        if (item->GetType() == ASTType::kPrototype) {
+          codegen.visit(
+              static_cast<kaleidoscope::ast::ProtoTypeAST*>(item.get()));
+        } else if (item->GetType() == ASTType::kFunction) {
+          codegen.visit(
+              static_cast<kaleidoscope::ast::FunctionAST*>(item.get()));
+          ++num_functions;
+        }
+      }
+    }
+    double seconds = Seconds(start);
+    allocations = kaleidoscope::alloc::ThreadAllocations() - allocations;
+    std::cerr << (discard ? "names discarded: " : "names kept:      ")
+              << num_functions / seconds << " functions/s";
+    if (kaleidoscope::alloc::IsTracking()) {
+      std::cerr << ", " << static_cast<double>(allocations) / num_functions
+                << " allocations per function";
+    }
+    std::cerr << std::endl;
+  }
+}
+
+// Prints the allocations and bytes of every phase, as "phase: N allocations,
+// M bytes" lines.
+void PrintAllocations() {
+  namespace alloc = kaleidoscope::alloc;
+  for (int i = 0; i < alloc::kNumPhases; ++i) {
+    auto phase = static_cast<alloc::Phase>(i);
+    alloc::PhaseAllocations stats = alloc::GetAllocations(phase);
+    std::cerr << alloc::PhaseName(phase) << ": " << stats.allocations
+              << " allocations, " << stats.bytes << " bytes\n";
+  }
+}
+
+// Reads the standard input a line at a time and runs the items of every
+// line in \a session as soon as it is complete, printing the value of each
+// expression and, to stderr, the time from reading the line to its values.
+// A line is run as a program, so an extern may only declare a function
+// defined on a line before or on the same line. Returns the number of
+// items that failed.
+size_t Repl(kaleidoscope::ir::JITSession* session) {
+  const bool interactive = ::isatty(STDIN_FILENO);
+  kaleidoscope::parser::Parser parser;
+  size_t num_errors = 0;
+  std::string line;
+  while (true) {
+    if (interactive) std::cerr << "ready> " << std::flush;
+    if (!std::getline(std::cin, line)) break;
+    auto start = Clock::now();
+    size_t num_items = 0;
+    try {
+      parser.ResetSource("<stdin>", line);
+      auto items = parser.Parse();
+      std::vector<double> values;
+      num_errors += session->RunProgram(items, 1, &values);
+      for (double value : values) std::cout << value << '\n';
+      num_items = items.size();
+    } catch (const std::exception& error) {
+      // whatever RunProgram does not report itself, the session goes on
+      std::cerr << error.what() << std::endl;
+      ++num_errors;
+    }
+    std::cout << std::flush;
+    if (num_items > 0) {
+      std::cerr << "(" << Seconds(start) * 1e3 << " ms)" << std::endl;
+    }
+  }
+  if (interactive) std::cerr << std::endl;
+  return num_errors;
+}
+
+}  // namespace
+
+// Usage:
+//   klang_jit [src] [--eager] [-O0|-O1|-O2|-O3|-Os] [--time-passes]
+//             [--jobs=N] [--tiered[=threshold]] [--tier-stats]
+//             [--redefinable [--swap-stats]] [--whole-program] [--specialize]
+//             [--fp-mode=strict|contract|fast]
+//             [--bench-batch=function [--rows=N]] [--bench-codegen[=reps]]
+//             [--trace=out.json [--trace-granularity=us]]
+//             [--metrics[=prometheus|json]] [--alloc-stats]
+//             [--cache-dir=dir [--cache-size=MiB]]
+// Runs every top-level expression of the source file and prints its value.
+// Without a source file it reads the program from the standard input line
+// by line instead, runs each line as soon as it is entered and reports how
+// long it took. Functions may be redefined there unless --tiered is given,
+// and the lines are compiled quickly, with FastISel, unless an -O level
+// above -O0 asks for better code.
+// --fp-mode sets the floating-point semantics of the functions without a
+// @strict, @contract or @fastmath annotation, strict by default.
+// --whole-program compiles the program as one module, in which the functions
+// only called from the file are internalized and optimized at -O3.
+// --specialize replaces the calls with constant arguments by their value
+// before compiling, and the other calls passing constants by calls to
+// clones of the callees specialized to them, see SpecializeCalls.
+// --bench-batch then compares the vectorized batch wrapper of a function
+// against calling it once per row, on random columns. --bench-codegen only
+// lowers the program to IR, 10 times by default, and reports the speed and
+// the allocations of the code generator.
+// --trace writes where the parse, code generation, optimization and JIT time
+// goes as Chrome trace JSON, leaving out the events shorter than the
+// granularity. --metrics prints the counters of the compiler internals to
+// stderr when done, and --alloc-stats the heap allocations of each phase in
+// the builds that track them.
+// --cache-dir keeps the machine code of every compiled module in a directory
+// shared with later runs, which then skip optimizing and compiling it. The
+// least recently used objects go once it holds more than --cache-size, 256
+// MiB by default.
+int main(int argc, char** argv) {
+  kaleidoscope::ir::JITOptions options;
+  std::vector<std::string> paths;
+  size_t num_jobs = 1;
+  bool tier_stats = false;
+  bool swap_stats = false;
+  bool whole_program = false;
+  bool specialize = false;
+  std::string bench_batch;
+  size_t num_rows = 1 << 20;
+  int bench_codegen = 0;
+  std::string trace_path;
+  int64_t trace_granularity = 0;
+  std::string metrics_format;
+  bool alloc_stats = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--eager") {
+      options.lazy = false;
+    } else if (arg.compare(0, 7, "--jobs=") == 0) {
+      num_jobs = std::stoul(arg.substr(7));
+    } else if (arg == "--tiered") {
+      options.tiered = true;
+    } else if (arg.compare(0, 9, "--tiered=") == 0) {
+      options.tiered = true;
+      options.tier_up_threshold = std::stoull(arg.substr(9));
+    } else if (arg.compare(0, 14, "--bench-batch=") == 0) {
+      bench_batch = arg.substr(14);
+    } else if (arg == "--bench-codegen") {
+      bench_codegen = 10;
+    } else if (arg.compare(0, 16, "--bench-codegen=") == 0) {
+      bench_codegen = std::stoi(arg.substr(16));
+    } else if (arg.compare(0, 8, "--trace=") == 0) {
+      trace_path = arg.substr(8);
+    } else if (arg.compare(0, 20, "--trace-granularity=") == 0) {
+      trace_granularity = std::stoll(arg.substr(20));
+    } else if (arg == "--metrics") {
+      metrics_format = "prometheus";
+    } else if (arg.compare(0, 10, "--metrics=") == 0) {
+      metrics_format = arg.substr(10);
+      if (metrics_format != "prometheus" && metrics_format != "json") {
+        throw std::runtime_error("Unknown metrics format: " + arg);
+      }
+    } else if (arg.compare(0, 12, "--cache-dir=") == 0) {
+      options.cache_dir = arg.substr(12);
+    } else if (arg.compare(0, 13, "--cache-size=") == 0) {
+      options.cache_max_bytes = std::stoull(arg.substr(13)) << 20;
+    } else if (arg == "--alloc-stats") {
+      alloc_stats = true;
+    } else if (arg.compare(0, 7, "--rows=") == 0) {
+      num_rows = std::stoul(arg.substr(7));
+    } else if (arg == "--redefinable") {
+      options.redefinable = true;
+    } else if (arg == "--whole-program") {
+      whole_program = true;
+    } else if (arg == "--specialize") {
+      specialize = true;
+    } else if (arg == "--swap-stats") {
+      swap_stats = true;
+    } else if (arg == "--tier-stats") {
+      tier_stats = true;
+    } else if (arg == "--time-passes") {
+      options.time_passes = true;
+    } else if (arg.compare(0, 10, "--fp-mode=") == 0) {
+      if (!kaleidoscope::ir::ParseFPMode(arg.substr(10), &options.fp_mode)) {
+        throw std::runtime_error("Unknown floating-point mode: " + arg);
+      }
+    } else if (arg.size() > 2 && arg.compare(0, 2, "-O") == 0) {
+      if (!kaleidoscope::ir::ParseOptLevel(arg, &options.opt_level)) {
+        throw std::runtime_error("Unknown optimization level: " + arg);
+      }
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.size() > 1) {
+    throw std::runtime_error("Only one source file path should be given.");
+  }
+  if (alloc_stats && !kaleidoscope::alloc::IsTracking()) {
+    throw std::runtime_error(
+        "This build does not track allocations, configure it with "
+        "-DKALEIDOSCOPE_TRACK_ALLOCATIONS=ON.");
+  }
+  if (!trace_path.empty()) kaleidoscope::trace::Start(trace_granularity);
+
+  if (paths.empty()) {
+    if (whole_program || specialize || !bench_batch.empty() ||
+        bench_codegen > 0) {
+      throw std::runtime_error(
+          "A whole program, specializing or a benchmark needs a source "
+          "file.");
+    }
+    options.redefinable = !options.tiered;
+    // a line is compiled while the user waits, unless asked to optimize
+    options.quick_codegen =
+        options.opt_level == kaleidoscope::ir::OptLevel::kO0;
+    kaleidoscope::ir::JITSession session(options);
+    size_t num_errors = Repl(&session);
+    if (!trace_path.empty()) kaleidoscope::trace::Stop(trace_path);
+    return num_errors == 0 ? 0 : 1;
+  }
+
+  kaleidoscope::parser::Parser parser(paths[0]);
+  std::list<kaleidoscope::ast::AST::Ptr> ast_list = parser.Parse();
+  if (specialize) {
+    // the calls specialized would go to the first definition
+    if (options.redefinable) {
+      throw std::runtime_error("Redefinable functions cannot be specialized.");
+    }
+    kaleidoscope::ir::SpecializeOptions specialize_options;
+    specialize_options.fp_mode = options.fp_mode;
+    kaleidoscope::ir::SpecializeCalls(&ast_list, specialize_options);
+  }
+
+  if (bench_codegen > 0) {
+    BenchCodeGen(ast_list, bench_codegen);
+    if (!trace_path.empty()) kaleidoscope::trace::Stop(trace_path);
+    return 0;
+  }
+
+  kaleidoscope::ir::JITSession session(options);
+  std::vector<double> results;
+  size_t num_errors = 0;
+  if (whole_program) {
+    if (options.tiered || options.redefinable || !bench_batch.empty()) {
+      throw std::runtime_error(
+          "A whole program cannot be tiered, redefined or benchmarked.");
+    }
+    num_errors = session.RunWholeProgram(ast_list, &results);
+  } else {
+    num_errors = session.RunProgram(ast_list, num_jobs, &results);
+  }
+  for (double result : results) {
+    std::cout << result << '\n';
+  }
+
+  if (!bench_batch.empty()) {
+    BenchBatch(&session, ast_list, bench_batch, num_rows);
+  }
+  if (!trace_path.empty()) kaleidoscope::trace::Stop(trace_path);
+  if (alloc_stats) PrintAllocations();
+  if (metrics_format == "json") {
+    kaleidoscope::metrics::WriteJson(kaleidoscope::metrics::TakeSnapshot(),
+                                     std::cerr);
+  } else if (!metrics_format.empty()) {
+    kaleidoscope::metrics::WritePrometheus(
+        kaleidoscope::metrics::TakeSnapshot(), std::cerr);
+  }
+
+  session.GetJIT().PrintPassTimings();
+  if (tier_stats && session.GetJIT().GetTiering()) {
+    session.GetJIT().GetTiering()->PrintStats(std::cerr);
+  }
+  if (swap_stats && session.GetJIT().GetHotSwap()) {
+    session.GetJIT().GetHotSwap()->PrintStats(std::cerr);
+  }
+  return num_errors == 0 ? 0 : 1;
+}
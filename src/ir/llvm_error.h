@@ -0,0 +1,47 @@
+/*!
+ * \file llvm_error.h
+ * \brief Turn llvm::Error into the logging errors of this project
+ */
+#ifndef KALEIDOSCOPE_IR_LLVM_ERROR_H_
+#define KALEIDOSCOPE_IR_LLVM_ERROR_H_
+
+#include <string>
+#include <utility>
+
+#include "kaleidoscope/logging.h"
+#include "llvm/Support/Error.h"
+
+namespace kaleidoscope {
+namespace ir {
+
+/*! \brief Throw a kaleidoscope::Error if \a err holds a failure */
+inline void CheckLLVMError(llvm::Error err, const std::string& what) {
+  if (err) {
+    LOG_FATAL << what << ": " << llvm::toString(std::move(err));
+  }
+}
+
+/*! \brief Unwrap \a value, throwing a kaleidoscope::Error on failure */
+template <typename T>
+T CheckLLVMError(llvm::Expected<T> value, const std::string& what) {
+  CheckLLVMError(value.takeError(), what);
+  return std::move(*value);
+}
+
+/*!
+ * \brief Where a call to a function that failed to compile lands, in place
+ *        of the function, to throw a kaleidoscope::Error
+ *
+ * The exception unwinds through the JIT'd callers, which all call a
+ * function of another module and thus have unwind tables.
+ */
+inline double OnCompileFailure() {
+  // ORC reported why before, e.g. symbols not found
+  LOG_FATAL << "Called a function that failed to compile";
+  return 0;
+}
+
+}  // namespace ir
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_IR_LLVM_ERROR_H_
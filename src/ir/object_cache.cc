@@ -0,0 +1,209 @@
+#include "object_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "kaleidoscope/logging.h"
+#include "kaleidoscope/metrics.h"
+#include "kaleidoscope/trace.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace kaleidoscope {
+namespace ir {
+
+namespace {
+
+// where Prepare leaves the key of a module for the compiler
+constexpr const char* kKeyMetadata = "klang.object_key";
+
+struct CacheMetrics {
+  metrics::Counter hits = metrics::GetCounter(
+      "klang_jit_cache_hits_total", "Modules whose object was on disk");
+  metrics::Counter misses = metrics::GetCounter(
+      "klang_jit_cache_misses_total", "Modules compiled to machine code");
+  metrics::Counter evictions = metrics::GetCounter(
+      "klang_jit_cache_evictions_total", "Objects removed from the disk");
+};
+
+const CacheMetrics& GetCacheMetrics() {
+  static const CacheMetrics cache_metrics;
+  return cache_metrics;
+}
+
+std::string GetKey(const llvm::Module& module) {
+  const llvm::NamedMDNode* node = module.getNamedMetadata(kKeyMetadata);
+  if (node == nullptr || node->getNumOperands() == 0) return "";
+  const auto* key =
+      llvm::cast<llvm::MDString>(node->getOperand(0)->getOperand(0));
+  return key->getString().str();
+}
+
+struct CachedObject {
+  std::string path;
+  uint64_t size;
+  llvm::sys::TimePoint<> last_used;
+};
+
+std::vector<CachedObject> ScanObjects(const std::string& dir) {
+  std::vector<CachedObject> objects;
+  std::error_code ec;
+  for (llvm::sys::fs::directory_iterator entry(dir, ec), end;
+       !ec && entry != end; entry.increment(ec)) {
+    if (llvm::sys::path::extension(entry->path()) != ".o") continue;
+    auto status = entry->status();
+    if (!status) continue;
+    objects.push_back(CachedObject{entry->path(), status->getSize(),
+                                   status->getLastModificationTime()});
+  }
+  return objects;
+}
+
+}  // namespace
+
+DiskObjectCache::DiskObjectCache(const std::string& dir, uint64_t max_bytes)
+    : dir_(dir), max_bytes_(max_bytes) {
+  GetCacheMetrics();
+  if (auto ec = llvm::sys::fs::create_directories(dir_)) {
+    LOG_WARNING << "Cannot create the object cache " << dir_ << ": "
+                << ec.message() << std::endl;
+  }
+  for (const auto& object : ScanObjects(dir_)) total_bytes_ += object.size;
+}
+
+std::string DiskObjectCache::PathOf(const std::string& key) const {
+  llvm::SmallString<128> path(dir_);
+  llvm::sys::path::append(path, key + ".o");
+  return path.str().str();
+}
+
+bool DiskObjectCache::Prepare(llvm::Module& module,
+                              const std::string& config) {
+  trace::Scope scope("CacheLookup", module.getModuleIdentifier());
+  llvm::SmallString<0> bitcode;
+  {
+    llvm::raw_svector_ostream out(bitcode);
+    llvm::WriteBitcodeToFile(module, out);
+  }
+  llvm::SHA1 sha1;
+  sha1.update(config);
+  sha1.update(llvm::StringRef("\0", 1));
+  sha1.update(bitcode);
+  std::string key = llvm::toHex(sha1.final(), true);
+
+  llvm::LLVMContext& context = module.getContext();
+  module.getOrInsertNamedMetadata(kKeyMetadata)
+      ->addOperand(llvm::MDNode::get(context,
+                                     llvm::MDString::get(context, key)));
+
+  const std::string path = PathOf(key);
+  int fd;
+  if (llvm::sys::fs::openFileForRead(path, fd)) {
+    GetCacheMetrics().misses.Add();
+    return false;
+  }
+  auto object = llvm::MemoryBuffer::getOpenFile(fd, path, -1, false);
+  if (object) {
+    // the modification time orders the objects for eviction
+    llvm::sys::fs::setLastAccessAndModificationTime(
+        fd, std::chrono::system_clock::now());
+  }
+  llvm::sys::Process::SafelyCloseFileDescriptor(fd);
+  if (!object) {
+    GetCacheMetrics().misses.Add();
+    return false;
+  }
+
+  GetCacheMetrics().hits.Add();
+  std::lock_guard<std::mutex> lock(mutex_);
+  loaded_[key] = std::move(*object);
+  return true;
+}
+
+std::unique_ptr<llvm::MemoryBuffer> DiskObjectCache::getObject(
+    const llvm::Module* module) {
+  std::string key = GetKey(*module);
+  if (key.empty()) return nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto loaded = loaded_.find(key);
+    if (loaded != loaded_.end()) {
+      std::unique_ptr<llvm::MemoryBuffer> object = std::move(loaded->second);
+      loaded_.erase(loaded);
+      return object;
+    }
+  }
+  // e.g. a second module with the same key, whose object was taken
+  auto object = llvm::MemoryBuffer::getFile(PathOf(key), false, false);
+  return object ? std::move(*object) : nullptr;
+}
+
+void DiskObjectCache::notifyObjectCompiled(const llvm::Module* module,
+                                           llvm::MemoryBufferRef object) {
+  std::string key = GetKey(*module);
+  if (key.empty()) return;
+  trace::Scope scope("CacheStore", module->getModuleIdentifier());
+
+  // readers see either no file or the whole of it
+  const std::string path = PathOf(key);
+  int fd;
+  llvm::SmallString<128> temp_path;
+  if (auto ec = llvm::sys::fs::createUniqueFile(path + ".%%%%%%%%.tmp", fd,
+                                                temp_path)) {
+    LOG_WARNING << "Cannot write to the object cache " << dir_ << ": "
+                << ec.message() << std::endl;
+    return;
+  }
+  {
+    llvm::raw_fd_ostream out(fd, true);
+    out << object.getBuffer();
+    out.close();
+    if (out.has_error()) {
+      LOG_WARNING << "Cannot write " << temp_path.str().str() << ": "
+                  << out.error().message() << std::endl;
+      out.clear_error();
+      llvm::sys::fs::remove(temp_path);
+      return;
+    }
+  }
+  if (auto ec = llvm::sys::fs::rename(temp_path, path)) {
+    LOG_WARNING << "Cannot rename " << temp_path.str().str() << ": "
+                << ec.message() << std::endl;
+    llvm::sys::fs::remove(temp_path);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  total_bytes_ += object.getBufferSize();
+  if (total_bytes_ > max_bytes_) Evict();
+}
+
+void DiskObjectCache::Evict() {
+  // other processes write and evict too, start from what is there
+  std::vector<CachedObject> objects = ScanObjects(dir_);
+  total_bytes_ = 0;
+  for (const auto& object : objects) total_bytes_ += object.size;
+  std::sort(objects.begin(), objects.end(),
+            [](const CachedObject& a, const CachedObject& b) {
+              return a.last_used < b.last_used;
+            });
+  // down to 90% of the cap, so that the next writes do not scan again
+  const uint64_t target = max_bytes_ / 10 * 9;
+  for (const auto& object : objects) {
+    if (total_bytes_ <= target) break;
+    if (llvm::sys::fs::remove(object.path)) continue;
+    total_bytes_ -= object.size;
+    GetCacheMetrics().evictions.Add();
+  }
+}
+
+}  // namespace ir
+}  // namespace kaleidoscope
@@ -0,0 +1,92 @@
+/*!
+ * \file object_cache.h
+ * \brief Machine code of the JIT kept on disk across processes
+ */
+#ifndef KALEIDOSCOPE_IR_OBJECT_CACHE_H_
+#define KALEIDOSCOPE_IR_OBJECT_CACHE_H_
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace kaleidoscope {
+namespace ir {
+
+/*!
+ * \brief An llvm::ObjectCache of object files in a directory, shared by all
+ *        the processes using it
+ *
+ * An object is stored as `<key>.o`, the key being the SHA-1 of the module
+ * bitcode before optimization and of the configuration: target triple, CPU
+ * features, optimization level and LLVM version. A warm start thus skips
+ * both the optimization pipeline and the code generation.
+ *
+ * Objects are written to a unique temporary file and renamed into place,
+ * so a reader never sees a partial object. Using an object updates its
+ * modification time, and once the directory outgrows its size cap the
+ * least recently used objects are removed until it is 10% below.
+ *
+ * The directory is only scanned when the cache is created and when it
+ * outgrows its cap, so JITs created one after the other, e.g. for the
+ * requests of a server, better share one cache, even if their
+ * configurations differ.
+ *
+ * \note Failures to read or write the directory only lose the caching,
+ *       they are logged as warnings.
+ */
+class DiskObjectCache : public llvm::ObjectCache {
+ public:
+  /*!
+   * \param dir the directory of the objects, created if missing
+   * \param max_bytes the size cap of the objects in the directory
+   */
+  DiskObjectCache(const std::string& dir, uint64_t max_bytes);
+
+  DiskObjectCache(const DiskObjectCache&) = delete;
+  DiskObjectCache& operator=(const DiskObjectCache&) = delete;
+
+  /*!
+   * \brief Key the unoptimized \a module and load its object if it is
+   *        cached, for getObject to return when \a module is compiled
+   *
+   * \param config whatever besides the IR decides the machine code
+   * \return whether the object is cached, then optimizing \a module is
+   *         wasted work
+   */
+  bool Prepare(llvm::Module& module, const std::string& config);
+
+  /*! \brief Store the object of a module keyed by Prepare */
+  void notifyObjectCompiled(const llvm::Module* module,
+                            llvm::MemoryBufferRef object) override;
+
+  /*! \brief The object of \a module if Prepare found it, or nullptr */
+  std::unique_ptr<llvm::MemoryBuffer> getObject(
+      const llvm::Module* module) override;
+
+ private:
+  std::string PathOf(const std::string& key) const;
+
+  /*! \brief Remove the least recently used objects, mutex_ is held */
+  void Evict();
+
+  std::string dir_;
+  uint64_t max_bytes_;
+
+  std::mutex mutex_;  // guards the members below
+  // objects loaded by Prepare and not compiled yet, by key
+  std::unordered_map<std::string, std::unique_ptr<llvm::MemoryBuffer>>
+      loaded_;
+  // the objects in the directory, as of the last scan and our own writes
+  uint64_t total_bytes_ = 0;
+};
+
+}  // namespace ir
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_IR_OBJECT_CACHE_H_
@@ -0,0 +1,244 @@
+#include "optimizer.h"
+
+#include <mutex>
+#include <vector>
+
+#include "kaleidoscope/alloc_tracker.h"
+#include "kaleidoscope/trace.h"
+#include "llvm/ADT/Any.h"
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/LoopAnalysisManager.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SROA.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm_error.h"
+
+namespace kaleidoscope {
+namespace ir {
+
+bool ParseOptLevel(const std::string& name, OptLevel* level) {
+  std::string key = (!name.empty() && name[0] == '-') ? name.substr(1) : name;
+  if (key == "O0") {
+    *level = OptLevel::kO0;
+  } else if (key == "O1") {
+    *level = OptLevel::kO1;
+  } else if (key == "O2") {
+    *level = OptLevel::kO2;
+  } else if (key == "O3") {
+    *level = OptLevel::kO3;
+  } else if (key == "Os") {
+    *level = OptLevel::kOs;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* OptLevelName(OptLevel level) {
+  switch (level) {
+    case OptLevel::kO0:
+      return "O0";
+    case OptLevel::kO1:
+      return "O1";
+    case OptLevel::kO2:
+      return "O2";
+    case OptLevel::kO3:
+      return "O3";
+    case OptLevel::kOs:
+      return "Os";
+  }
+  return "unknown";
+}
+
+void InitializeNativeTarget() {
+  static std::once_flag flag;
+  std::call_once(flag, [] {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+  });
+}
+
+bool HasVectorMathLibrary(const llvm::Triple& triple) {
+  if (triple.getArch() != llvm::Triple::x86_64 || !triple.isOSLinux()) {
+    return false;
+  }
+  static const bool loaded =
+      !llvm::sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1");
+  return loaded;
+}
+
+std::unique_ptr<llvm::TargetMachine> CreateHostTargetMachine(
+    llvm::CodeGenOpt::Level level) {
+  InitializeNativeTarget();
+  auto machine_builder =
+      CheckLLVMError(llvm::orc::JITTargetMachineBuilder::detectHost(),
+                     "Failed to detect the host");
+  machine_builder.setCodeGenOptLevel(level);
+  return CheckLLVMError(machine_builder.createTargetMachine(),
+                        "Failed to create the target machine");
+}
+
+Optimizer::Optimizer(OptLevel level, bool time_passes,
+                     llvm::TargetMachine* target_machine)
+    : level_(level), target_machine_(target_machine) {
+  if (target_machine_) {
+    const llvm::Triple& triple = target_machine_->getTargetTriple();
+    library_info_ = std::make_unique<llvm::TargetLibraryInfoImpl>(triple);
+    if (HasVectorMathLibrary(triple)) {
+      library_info_->addVectorizableFunctionsFromVecLib(
+          llvm::TargetLibraryInfoImpl::LIBMVEC_X86);
+    }
+  }
+  if (time_passes) {
+    time_passes_ = std::make_unique<llvm::TimePassesHandler>(true);
+  }
+}
+
+Optimizer::~Optimizer() = default;
+
+void Optimizer::AddProgramFunctions(const llvm::Module& module) {
+  std::lock_guard<std::mutex> lock(program_functions_mutex_);
+  for (const auto& func : module) {
+    if (!func.isDeclaration() ||
+        func.hasFnAttribute(llvm::Attribute::NoBuiltin)) {
+      program_functions_.insert(func.getName().str());
+    }
+  }
+}
+
+namespace {
+
+/*! \brief The function or module a pass runs on, as trace event detail */
+std::string PassUnitName(const llvm::Any& unit) {
+  if (llvm::any_isa<const llvm::Function*>(unit)) {
+    return llvm::any_cast<const llvm::Function*>(unit)->getName().str();
+  }
+  if (llvm::any_isa<const llvm::Module*>(unit)) {
+    return llvm::any_cast<const llvm::Module*>(unit)->getModuleIdentifier();
+  }
+  return "";
+}
+
+/*! \brief Pass managers and adaptors only wrap the passes worth showing */
+bool IsWrapperPass(llvm::StringRef pass) {
+  return llvm::isSpecialPass(pass, {"PassManager", "PassAdaptor"});
+}
+
+/*! \brief Record one trace event per pass run, nested like the passes */
+void RegisterTraceCallbacks(llvm::PassInstrumentationCallbacks& pic,
+                            std::vector<int64_t>* starts) {
+  pic.registerBeforeNonSkippedPassCallback(
+      [starts](llvm::StringRef pass, llvm::Any) {
+        if (!IsWrapperPass(pass)) starts->push_back(trace::NowNanos());
+      });
+  pic.registerAfterPassCallback([starts](llvm::StringRef pass, llvm::Any unit,
+                                         const llvm::PreservedAnalyses&) {
+    if (IsWrapperPass(pass)) return;
+    trace::AddEvent(pass.str(), PassUnitName(unit), starts->back(),
+                    trace::NowNanos());
+    starts->pop_back();
+  });
+  pic.registerAfterPassInvalidatedCallback(
+      [starts](llvm::StringRef pass, const llvm::PreservedAnalyses&) {
+        if (IsWrapperPass(pass)) return;
+        // the unit is gone, e.g. a deleted function
+        trace::AddEvent(pass.str(), "", starts->back(), trace::NowNanos());
+        starts->pop_back();
+      });
+}
+
+}  // namespace
+
+void Optimizer::Run(llvm::Module& module) {
+  if (level_ == OptLevel::kO0) return;
+  trace::Scope scope("Optimize", module.getModuleIdentifier());
+  alloc::PhaseScope phase(alloc::Phase::kOptimize);
+
+  // e.g. a `def sin(x)` must neither be folded like nor replaced by libm's
+  AddProgramFunctions(module);
+  llvm::TargetLibraryInfoImpl library_info =
+      library_info_ ? *library_info_
+                    : llvm::TargetLibraryInfoImpl(
+                          llvm::Triple(module.getTargetTriple()));
+  {
+    std::lock_guard<std::mutex> lock(program_functions_mutex_);
+    for (const auto& name : program_functions_) {
+      llvm::LibFunc func;
+      if (library_info.getLibFunc(name, func)) {
+        library_info.setUnavailable(func);
+      }
+    }
+  }
+
+  std::unique_lock<std::mutex> timing_lock;
+  llvm::PassInstrumentationCallbacks pic;
+  if (time_passes_) {
+    timing_lock = std::unique_lock<std::mutex>(time_passes_mutex_);
+    time_passes_->registerCallbacks(pic);
+  }
+  std::vector<int64_t> pass_starts;
+  if (trace::IsEnabled()) RegisterTraceCallbacks(pic, &pass_starts);
+
+  // analysis managers cache per IR unit, so they only live for one module
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+  llvm::PassBuilder pb(target_machine_, llvm::PipelineTuningOptions(),
+                       llvm::None, &pic);
+  // registered first, the default one is not registered again
+  fam.registerPass(
+      [&library_info] { return llvm::TargetLibraryAnalysis(library_info); });
+  pb.registerModuleAnalyses(mam);
+  pb.registerCGSCCAnalyses(cgam);
+  pb.registerFunctionAnalyses(fam);
+  pb.registerLoopAnalyses(lam);
+  pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+  llvm::ModulePassManager mpm;
+  switch (level_) {
+    case OptLevel::kO1: {
+      llvm::FunctionPassManager fpm;
+      // promote the stack slots of mutable variables to registers first
+      fpm.addPass(llvm::SROAPass());
+      fpm.addPass(llvm::InstCombinePass());
+      fpm.addPass(llvm::ReassociatePass());
+      fpm.addPass(llvm::GVNPass());
+      fpm.addPass(llvm::SimplifyCFGPass());
+      mpm.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(fpm)));
+      break;
+    }
+    case OptLevel::kO2:
+      mpm = pb.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2);
+      break;
+    case OptLevel::kO3:
+      mpm = pb.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O3);
+      break;
+    case OptLevel::kOs:
+      mpm = pb.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::Os);
+      break;
+    case OptLevel::kO0:
+      break;
+  }
+  mpm.run(module, mam);
+}
+
+void Optimizer::PrintTimings() {
+  if (!time_passes_) return;
+  std::lock_guard<std::mutex> lock(time_passes_mutex_);
+  time_passes_->print();
+}
+
+}  // namespace ir
+}  // namespace kaleidoscope
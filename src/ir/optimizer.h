@@ -0,0 +1,122 @@
+/*!
+ * \file optimizer.h
+ * \brief Optimization pipelines on top of the new LLVM pass manager
+ */
+#ifndef KALEIDOSCOPE_IR_OPTIMIZER_H_
+#define KALEIDOSCOPE_IR_OPTIMIZER_H_
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Target/TargetMachine.h"
+
+namespace llvm {
+class TargetLibraryInfoImpl;
+}  // namespace llvm
+
+namespace kaleidoscope {
+namespace ir {
+
+enum class OptLevel {
+  kO0,  // no optimization at all
+  kO1,  // a cheap per-function cleanup pipeline
+  kO2,  // the standard LLVM per-module pipeline
+  kO3,  // the standard pipeline with the aggressive passes
+  kOs,  // the standard pipeline tuned for code size
+};
+
+/*!
+ * \brief Parse an optimization level as given on the command line
+ *
+ * \param name one of "O0", "O1", "O2", "O3" and "Os", a leading '-' is
+ *        accepted as well
+ * \return false if \a name is not a known level
+ */
+bool ParseOptLevel(const std::string& name, OptLevel* level);
+
+const char* OptLevelName(OptLevel level);
+
+/*! \brief Initialize the native target, only the first call does anything */
+void InitializeNativeTarget();
+
+/*!
+ * \brief Whether the code for \a triple can call the vector variants of
+ *        the math functions in glibc's libmvec, e.g. _ZGVdN4v_sin
+ *
+ * Only on x86-64 Linux. The first call loads the library into this process,
+ * so that the JIT resolves the variants; shared objects link -lmvec.
+ */
+bool HasVectorMathLibrary(const llvm::Triple& triple);
+
+/*! \brief Create a target machine for the host CPU and its features */
+std::unique_ptr<llvm::TargetMachine> CreateHostTargetMachine(
+    llvm::CodeGenOpt::Level level);
+
+/*!
+ * \brief Runs the pipeline of an optimization level over modules
+ *
+ * -O1 runs SROA, instcombine, reassociate, GVN and simplifycfg on every
+ * function, the other levels use PassBuilder::buildPerModuleDefaultPipeline.
+ * SROA promotes the stack slots of the mutable variables to registers. The
+ * pass timings are summed up over all the modules optimized by one optimizer.
+ * Without a target machine the cost model knows nothing about the CPU, so
+ * e.g. loops are not vectorized. With one, the vectorized calls of sin, cos,
+ * exp, log and pow go to libmvec if HasVectorMathLibrary.
+ *
+ * A function the program defines is never taken for the C library function
+ * of the same name, which LLVM would fold or call in its place: its name is
+ * unavailable to the passes, see AddProgramFunctions.
+ *
+ * \note Run can be called from several threads, the runs are serialized
+ *       when pass timing is enabled.
+ */
+class Optimizer {
+ public:
+  explicit Optimizer(OptLevel level, bool time_passes = false,
+                     llvm::TargetMachine* target_machine = nullptr);
+  ~Optimizer();
+
+  Optimizer(const Optimizer&) = delete;
+  Optimizer& operator=(const Optimizer&) = delete;
+
+  /*!
+   * \brief Optimize \a module in place, after AddProgramFunctions(module)
+   */
+  void Run(llvm::Module& module);
+
+  /*!
+   * \brief Remember the functions \a module defines, or declares with the
+   *        nobuiltin attribute, as functions of the program for all the
+   *        modules optimized from now on
+   *
+   * Called when a module is added to a JIT, before any module calling into
+   * it is optimized.
+   */
+  void AddProgramFunctions(const llvm::Module& module);
+
+  /*! \brief Print the accumulated pass timings and reset them */
+  void PrintTimings();
+
+  OptLevel GetLevel() const { return level_; }
+
+ private:
+  OptLevel level_;
+  llvm::TargetMachine* target_machine_;
+  // the library functions of the target, with their vector variants
+  std::unique_ptr<llvm::TargetLibraryInfoImpl> library_info_;
+  std::unordered_set<std::string> program_functions_;
+  std::mutex program_functions_mutex_;
+  std::unique_ptr<llvm::TimePassesHandler> time_passes_;
+  std::mutex time_passes_mutex_;
+};
+
+}  // namespace ir
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_IR_OPTIMIZER_H_
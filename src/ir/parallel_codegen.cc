@@ -0,0 +1,129 @@
+#include "parallel_codegen.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <queue>
+#include <string>
+#include <utility>
+
+namespace kaleidoscope {
+namespace ir {
+
+namespace {
+
+size_t EstimateExprSize(const ast::ExprAST* expr_ptr) {
+  switch (expr_ptr->GetExprType()) {
+    case ast::ExprType::kNumber:
+    case ast::ExprType::kVariable:
+      return 1;
+    case ast::ExprType::kBinary: {
+      auto* bin_ptr = static_cast<const ast::BinaryExprAST*>(expr_ptr);
+      return 1 + EstimateExprSize(bin_ptr->GetLHS()) +
+             EstimateExprSize(bin_ptr->GetRHS());
+    }
+    case ast::ExprType::kCall: {
+      size_t size = 1;
+      for (const auto& arg :
+           static_cast<const ast::CallExprAST*>(expr_ptr)->GetArgs()) {
+        size += EstimateExprSize(arg.get());
+      }
+      return size;
+    }
+    case ast::ExprType::kIf: {
+      auto* if_ptr = static_cast<const ast::IfExprAST*>(expr_ptr);
+      return 1 + EstimateExprSize(if_ptr->GetCond()) +
+             EstimateExprSize(if_ptr->GetThen()) +
+             EstimateExprSize(if_ptr->GetElse());
+    }
+    case ast::ExprType::kFor: {
+      auto* for_ptr = static_cast<const ast::ForExprAST*>(expr_ptr);
+      // the condition is emitted twice, before the loop and at its latch
+      size_t size = 1 + EstimateExprSize(for_ptr->GetStart()) +
+                    2 * EstimateExprSize(for_ptr->GetCond()) +
+                    EstimateExprSize(for_ptr->GetBody());
+      if (for_ptr->GetStep()) size += EstimateExprSize(for_ptr->GetStep());
+      return size;
+    }
+    case ast::ExprType::kVar: {
+      auto* var_ptr = static_cast<const ast::VarExprAST*>(expr_ptr);
+      size_t size = 1 + EstimateExprSize(var_ptr->GetBody());
+      for (const auto& var : var_ptr->GetVars()) {
+        size += var.second ? EstimateExprSize(var.second.get()) : 1;
+      }
+      return size;
+    }
+  }
+  return 1;
+}
+
+}  // namespace
+
+size_t EstimateFunctionSize(const ast::FunctionAST* func_ptr) {
+  return 1 + EstimateExprSize(func_ptr->GetBody());
+}
+
+std::vector<std::vector<size_t>> PartitionBySize(
+    const std::vector<size_t>& sizes, size_t num_partitions) {
+  std::vector<std::vector<size_t>> partitions(
+      std::max<size_t>(1, std::min(num_partitions, sizes.size())));
+
+  std::vector<size_t> order(sizes.size());
+  for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+  std::stable_sort(order.begin(), order.end(),
+                   [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+  // (total size, partition index), lightest partition on top
+  using Load = std::pair<size_t, size_t>;
+  std::priority_queue<Load, std::vector<Load>, std::greater<Load>> loads;
+  for (size_t i = 0; i < partitions.size(); ++i) loads.emplace(0, i);
+  for (size_t idx : order) {
+    Load lightest = loads.top();
+    loads.pop();
+    partitions[lightest.second].push_back(idx);
+    loads.emplace(lightest.first + sizes[idx], lightest.second);
+  }
+
+  // keep the source order inside a partition
+  for (auto& partition : partitions) {
+    std::sort(partition.begin(), partition.end());
+  }
+  return partitions;
+}
+
+std::vector<GeneratedModule> ParallelCodeGen::Run(
+    const std::vector<ast::ProtoTypeAST*>& externs,
+    const std::vector<ast::FunctionAST*>& funcs, size_t* num_errors) {
+  std::vector<size_t> sizes;
+  sizes.reserve(funcs.size());
+  for (const auto* func_ptr : funcs) {
+    sizes.push_back(EstimateFunctionSize(func_ptr));
+  }
+  auto partitions = PartitionBySize(sizes, pool_.NumWorkers());
+
+  std::vector<GeneratedModule> modules(partitions.size());
+  std::atomic<size_t> errors(0);
+  pool_.ParallelFor(partitions.size(), [&](size_t, size_t part) {
+    AstLLVMCodeGen codegen;
+    codegen.SetDiscardValueNames(discard_value_names_);
+    codegen.NewModule("kaleidoscope.part" + std::to_string(part));
+    codegen.SetFPMode(fp_mode_);
+    for (const auto* proto_ptr : externs) {
+      codegen.ImportFunction(proto_ptr, false);
+    }
+    for (const auto* func_ptr : funcs) {
+      codegen.ImportDefinition(func_ptr->GetProto());
+    }
+
+    for (size_t idx : partitions[part]) {
+      if (!codegen.visit(funcs[idx])) ++errors;
+    }
+    modules[part] = codegen.TakeModule();
+  });
+
+  *num_errors = errors.load();
+  return modules;
+}
+
+}  // namespace ir
+}  // namespace kaleidoscope
@@ -0,0 +1,69 @@
+/*!
+ * \file parallel_codegen.h
+ * \brief Lower function definitions to IR on several threads
+ */
+#ifndef KALEIDOSCOPE_IR_PARALLEL_CODEGEN_H_
+#define KALEIDOSCOPE_IR_PARALLEL_CODEGEN_H_
+
+#include <vector>
+
+#include "ast_visiter.h"
+#include "kaleidoscope/ast.h"
+#include "kaleidoscope/thread_pool.h"
+
+namespace kaleidoscope {
+namespace ir {
+
+/*! \brief Estimated lowering cost of a function: the number of AST nodes */
+size_t EstimateFunctionSize(const ast::FunctionAST* func_ptr);
+
+/*!
+ * \brief Assign functions to \a num_partitions partitions of about the same
+ *        total size, largest function first onto the lightest partition
+ *
+ * \return indices into \a sizes for every partition
+ */
+std::vector<std::vector<size_t>> PartitionBySize(
+    const std::vector<size_t>& sizes, size_t num_partitions);
+
+/*!
+ * \brief Lowers independent function definitions in parallel
+ *
+ * LLVM contexts are not thread safe, so every partition gets its own code
+ * generator, and thus its own LLVMContext and module. Every code generator
+ * knows all the prototypes, calls across partitions are declared in the
+ * caller's module and resolved when the modules are linked or JIT'd.
+ */
+class ParallelCodeGen {
+ public:
+  /*! \param num_workers number of threads, 0 for one per hardware thread */
+  explicit ParallelCodeGen(size_t num_workers = 0) : pool_(num_workers) {}
+
+  /*!
+   * \brief Lower \a funcs into one module per partition
+   *
+   * \param externs declarations the definitions may call besides each other
+   * \param num_errors set to the number of definitions that failed to lower
+   */
+  std::vector<GeneratedModule> Run(
+      const std::vector<ast::ProtoTypeAST*>& externs,
+      const std::vector<ast::FunctionAST*>& funcs, size_t* num_errors);
+
+  size_t NumWorkers() const { return pool_.NumWorkers(); }
+
+  /*! \brief See AstLLVMCodeGen::SetFPMode */
+  void SetFPMode(FPMode mode) { fp_mode_ = mode; }
+
+  /*! \brief See AstLLVMCodeGen::SetDiscardValueNames */
+  void SetDiscardValueNames(bool discard) { discard_value_names_ = discard; }
+
+ private:
+  WorkStealingPool pool_;
+  FPMode fp_mode_ = FPMode::kStrict;
+  bool discard_value_names_ = false;
+};
+
+}  // namespace ir
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_IR_PARALLEL_CODEGEN_H_
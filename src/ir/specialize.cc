@@ -0,0 +1,891 @@
+#include "specialize.h"
+
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "kaleidoscope/metrics.h"
+#include "kaleidoscope/trace.h"
+
+namespace kaleidoscope {
+namespace ir {
+
+namespace {
+
+using ExprPtr = std::unique_ptr<ast::ExprAST>;
+
+// marks the name of a clone, a '.' cannot be part of an identifier
+constexpr char kCloneInfix[] = ".spec";
+
+// calls nested in an evaluation, and clones in the making of a clone, so
+// that neither runs out of stack
+constexpr size_t kMaxEvalDepth = 256;
+constexpr size_t kMaxCloneDepth = 16;
+
+// The semantics of the code generator: `<` is an unordered compare, true if
+// either side is NaN, and a condition holds if it is neither 0 nor NaN.
+double Less(double lhs, double rhs) {
+  return (lhs < rhs || std::isnan(lhs) || std::isnan(rhs)) ? 1 : 0;
+}
+
+bool IsTrue(double value) { return value != 0 && !std::isnan(value); }
+
+// The sign of a NaN depends on where it is computed: IRBuilder folds 0/0
+// to +NaN, while x86 computes -NaN at run time. A NaN is thus never folded,
+// as LLVM does not fold the NaN results of the math builtins either.
+bool FoldBinary(ast::SupportBinaryOpTag op, double lhs, double rhs,
+                double* result) {
+  switch (op) {
+    case ast::SupportBinaryOpTag::kAdd:
+      *result = lhs + rhs;
+      break;
+    case ast::SupportBinaryOpTag::kSub:
+      *result = lhs - rhs;
+      break;
+    case ast::SupportBinaryOpTag::kMul:
+      *result = lhs * rhs;
+      break;
+    case ast::SupportBinaryOpTag::kDiv:
+      *result = lhs / rhs;
+      break;
+    case ast::SupportBinaryOpTag::kLess:
+      *result = Less(lhs, rhs);
+      break;
+    default:
+      return false;
+  }
+  return !std::isnan(*result);
+}
+
+// The math builtins the code generator lowers to LLVM intrinsics, which
+// fold their constants with the same C functions, but not to a NaN.
+bool EvaluateBuiltin(const std::string& name, const std::vector<double>& args,
+                     double* result) {
+  if (args.size() == 1) {
+    double x = args[0];
+    if (name == "sin") {
+      *result = std::sin(x);
+    } else if (name == "cos") {
+      *result = std::cos(x);
+    } else if (name == "exp") {
+      *result = std::exp(x);
+    } else if (name == "log") {
+      *result = std::log(x);
+    } else if (name == "sqrt") {
+      *result = std::sqrt(x);
+    } else if (name == "fabs") {
+      *result = std::fabs(x);
+    } else if (name == "floor") {
+      *result = std::floor(x);
+    } else if (name == "ceil") {
+      *result = std::ceil(x);
+    } else {
+      return false;
+    }
+    return !std::isnan(*result);
+  }
+  if (args.size() == 2) {
+    if (name == "pow") {
+      *result = std::pow(args[0], args[1]);
+    } else if (name == "min") {
+      *result = std::fmin(args[0], args[1]);
+    } else if (name == "max") {
+      *result = std::fmax(args[0], args[1]);
+    } else {
+      return false;
+    }
+    return !std::isnan(*result);
+  }
+  if (args.size() == 3 && name == "fma") {
+    *result = std::fma(args[0], args[1], args[2]);
+    return !std::isnan(*result);
+  }
+  return false;
+}
+
+bool IsNumber(const ast::ExprAST* expr_ptr, double* value) {
+  if (expr_ptr->GetExprType() != ast::ExprType::kNumber) return false;
+  *value = static_cast<const ast::NumberExprAST*>(expr_ptr)->GetValue();
+  return true;
+}
+
+ExprPtr MakeNumber(double value) {
+  return std::make_unique<ast::NumberExprAST>(value);
+}
+
+size_t CountNodes(const ast::ExprAST* expr_ptr) {
+  switch (expr_ptr->GetExprType()) {
+    case ast::ExprType::kNumber:
+    case ast::ExprType::kVariable:
+      return 1;
+    case ast::ExprType::kBinary: {
+      auto* bin_ptr = static_cast<const ast::BinaryExprAST*>(expr_ptr);
+      return 1 + CountNodes(bin_ptr->GetLHS()) + CountNodes(bin_ptr->GetRHS());
+    }
+    case ast::ExprType::kCall: {
+      size_t count = 1;
+      for (const auto& arg :
+           static_cast<const ast::CallExprAST*>(expr_ptr)->GetArgs()) {
+        count += CountNodes(arg.get());
+      }
+      return count;
+    }
+    case ast::ExprType::kIf: {
+      auto* if_ptr = static_cast<const ast::IfExprAST*>(expr_ptr);
+      return 1 + CountNodes(if_ptr->GetCond()) + CountNodes(if_ptr->GetThen()) +
+             CountNodes(if_ptr->GetElse());
+    }
+    case ast::ExprType::kFor: {
+      auto* for_ptr = static_cast<const ast::ForExprAST*>(expr_ptr);
+      return 1 + CountNodes(for_ptr->GetStart()) +
+             CountNodes(for_ptr->GetCond()) +
+             (for_ptr->GetStep() ? CountNodes(for_ptr->GetStep()) : 0) +
+             CountNodes(for_ptr->GetBody());
+    }
+    case ast::ExprType::kVar: {
+      auto* var_ptr = static_cast<const ast::VarExprAST*>(expr_ptr);
+      size_t count = 1 + CountNodes(var_ptr->GetBody());
+      for (const auto& var : var_ptr->GetVars()) {
+        if (var.second) count += CountNodes(var.second.get());
+      }
+      return count;
+    }
+  }
+  return 1;
+}
+
+// A callee and the bits of its constant arguments, '?' for the others.
+std::string MakeKey(const std::string& callee,
+                    const std::vector<ExprPtr>& args) {
+  std::string key = callee;
+  for (const auto& arg : args) {
+    double value;
+    if (IsNumber(arg.get(), &value)) {
+      char bits[sizeof(value)];
+      std::memcpy(bits, &value, sizeof(value));
+      key += '#';
+      key.append(bits, sizeof(bits));
+    } else {
+      key += '?';
+    }
+  }
+  return key;
+}
+
+struct SpecializeMetrics {
+  metrics::Counter evaluated = metrics::GetCounter(
+      "klang_specialize_evaluated_total",
+      "Calls with constant arguments replaced by their value");
+  metrics::Counter specialized = metrics::GetCounter(
+      "klang_specialize_calls_total",
+      "Calls redirected to a clone specialized to their constants");
+  metrics::Counter clones = metrics::GetCounter(
+      "klang_specialize_clones_total", "Specialized clones of functions");
+};
+
+const SpecializeMetrics& GetSpecializeMetrics() {
+  static const SpecializeMetrics specialize_metrics;
+  return specialize_metrics;
+}
+
+class Specializer {
+ public:
+  Specializer(const SpecializeOptions& options, SpecializeStats* stats)
+      : options_(options), stats_(stats) {}
+
+  void Run(std::list<ast::AST::Ptr>* items) {
+    for (auto item = items->begin(); item != items->end(); ++item) {
+      if ((*item)->GetType() == ast::ASTType::kPrototype) {
+        auto* proto = static_cast<ast::ProtoTypeAST*>(item->get());
+        externs_[proto->GetName()] = proto->GetArgs().size();
+        continue;
+      }
+      if ((*item)->GetType() != ast::ASTType::kFunction) continue;
+
+      auto* func_ast = static_cast<ast::FunctionAST*>(item->get());
+      const std::string& name = func_ast->GetProto()->GetName();
+      if (!name.empty() && defined_.count(name) == 0 &&
+          externs_.count(name) != 0 &&
+          externs_[name] == func_ast->GetProto()->GetArgs().size() &&
+          IsBuiltin(name, externs_[name])) {
+        // fails to compile, the calls go to the builtin declared as extern
+        continue;
+      }
+      if (!name.empty() && !defined_.insert(name).second) {
+        // fails to compile, the calls before went to the first definition
+        continue;
+      }
+      if (!IsWellFormed(func_ast)) continue;
+      // visible to its own body, for recursive calls
+      if (!name.empty()) functions_[name] = func_ast;
+
+      ast::AST::Ptr specialized = Specialize(func_ast);
+      if (!name.empty()) {
+        functions_[name] = static_cast<ast::FunctionAST*>(specialized.get());
+      }
+      *item = std::move(specialized);
+      for (auto& clone : new_clones_) {
+        const std::string clone_name = clone->GetProto()->GetName();
+        clones_by_name_[clone_name] = items->insert(item, std::move(clone));
+      }
+      new_clones_.clear();
+    }
+    DropUnusedClones(items);
+  }
+
+ private:
+  struct Binding {
+    const std::string* name;
+    bool known;
+    double value;
+  };
+
+  enum class CloneState { kBuilding, kKept, kRejected };
+
+  struct Clone {
+    std::string name;
+    CloneState state;
+  };
+
+  /*!
+   * \brief Whether \a func_ast compiles: every variable is bound and every
+   *        call goes to a function defined before, itself or an extern,
+   *        with the right number of arguments
+   *
+   * Folding a branch away must not make a function compile that did not,
+   * nor must a call be evaluated through one.
+   */
+  bool IsWellFormed(const ast::FunctionAST* func_ast) {
+    std::vector<const std::string*> scope;
+    for (const auto& arg : func_ast->GetProto()->GetArgs()) {
+      scope.push_back(&arg);
+    }
+    return IsWellFormed(func_ast->GetBody(), func_ast->GetProto(), &scope);
+  }
+
+  bool IsWellFormed(const ast::ExprAST* expr_ptr,
+                    const ast::ProtoTypeAST* self,
+                    std::vector<const std::string*>* scope) {
+    auto is_bound = [scope](const std::string& name) {
+      for (const std::string* var : *scope) {
+        if (*var == name) return true;
+      }
+      return false;
+    };
+    switch (expr_ptr->GetExprType()) {
+      case ast::ExprType::kNumber:
+        return true;
+      case ast::ExprType::kVariable:
+        return is_bound(
+            static_cast<const ast::VariableExprAST*>(expr_ptr)->GetName());
+      case ast::ExprType::kBinary: {
+        auto* bin_ptr = static_cast<const ast::BinaryExprAST*>(expr_ptr);
+        if (bin_ptr->GetOpTag() == ast::SupportBinaryOpTag::kInvalid ||
+            (bin_ptr->GetOpTag() == ast::SupportBinaryOpTag::kAssign &&
+             bin_ptr->GetLHS()->GetExprType() != ast::ExprType::kVariable)) {
+          return false;
+        }
+        return IsWellFormed(bin_ptr->GetLHS(), self, scope) &&
+               IsWellFormed(bin_ptr->GetRHS(), self, scope);
+      }
+      case ast::ExprType::kCall: {
+        auto* call_ptr = static_cast<const ast::CallExprAST*>(expr_ptr);
+        const std::string& callee = call_ptr->GetCallee();
+        size_t num_args = call_ptr->GetArgs().size();
+        bool resolves = false;
+        if (callee == self->GetName()) {
+          resolves = self->GetArgs().size() == num_args;
+        } else if (defined_.count(callee) != 0) {
+          auto func = functions_.find(callee);
+          resolves = func != functions_.end() &&
+                     func->second->GetProto()->GetArgs().size() == num_args;
+        } else {
+          auto proto = externs_.find(callee);
+          resolves = proto != externs_.end() && proto->second == num_args;
+        }
+        if (!resolves) return false;
+        for (const auto& arg : call_ptr->GetArgs()) {
+          if (!IsWellFormed(arg.get(), self, scope)) return false;
+        }
+        return true;
+      }
+      case ast::ExprType::kIf: {
+        auto* if_ptr = static_cast<const ast::IfExprAST*>(expr_ptr);
+        return IsWellFormed(if_ptr->GetCond(), self, scope) &&
+               IsWellFormed(if_ptr->GetThen(), self, scope) &&
+               IsWellFormed(if_ptr->GetElse(), self, scope);
+      }
+      case ast::ExprType::kFor: {
+        auto* for_ptr = static_cast<const ast::ForExprAST*>(expr_ptr);
+        if (!IsWellFormed(for_ptr->GetStart(), self, scope)) return false;
+        scope->push_back(&for_ptr->GetVarName());
+        bool well_formed =
+            IsWellFormed(for_ptr->GetCond(), self, scope) &&
+            (!for_ptr->GetStep() ||
+             IsWellFormed(for_ptr->GetStep(), self, scope)) &&
+            IsWellFormed(for_ptr->GetBody(), self, scope);
+        scope->pop_back();
+        return well_formed;
+      }
+      case ast::ExprType::kVar: {
+        auto* var_ptr = static_cast<const ast::VarExprAST*>(expr_ptr);
+        const size_t mark = scope->size();
+        bool well_formed = true;
+        for (const auto& var : var_ptr->GetVars()) {
+          if (var.second && !IsWellFormed(var.second.get(), self, scope)) {
+            well_formed = false;
+            break;
+          }
+          scope->push_back(&var.first);
+        }
+        well_formed =
+            well_formed && IsWellFormed(var_ptr->GetBody(), self, scope);
+        scope->resize(mark);
+        return well_formed;
+      }
+    }
+    return false;
+  }
+
+  /*! \brief Whether a call may be evaluated through \a func_ast */
+  bool IsStrict(const ast::FunctionAST* func_ast) const {
+    if (func_ast->HasAttr(ast::FunctionAttr::kStrictMath)) return true;
+    if ((func_ast->GetAttrs() & ast::kFPModeAttrs) != 0) return false;
+    return options_.fp_mode == FPMode::kStrict;
+  }
+
+  /*! \brief A copy of \a func_ast with its calls specialized */
+  ast::AST::Ptr Specialize(const ast::FunctionAST* func_ast) {
+    std::vector<Binding> scope;
+    for (const auto& arg : func_ast->GetProto()->GetArgs()) {
+      scope.push_back({&arg, false, 0});
+    }
+    std::swap(scope, scope_);
+    ExprPtr body = Transform(func_ast->GetBody());
+    std::swap(scope, scope_);
+    return MakeFunction(func_ast, func_ast->GetProto()->GetName(),
+                        func_ast->GetProto()->GetArgs(), std::move(body));
+  }
+
+  static std::unique_ptr<ast::FunctionAST> MakeFunction(
+      const ast::FunctionAST* func_ast, const std::string& name,
+      std::vector<std::string> args, ExprPtr body) {
+    auto result = std::make_unique<ast::FunctionAST>(
+        std::make_unique<ast::ProtoTypeAST>(name, std::move(args)),
+        std::move(body));
+    for (ast::FunctionAttr attr : ast::kAllFunctionAttrs) {
+      if (func_ast->HasAttr(attr)) result->AddAttr(attr);
+    }
+    return result;
+  }
+
+  Binding* FindBinding(const std::string& name) {
+    for (auto var = scope_.rbegin(); var != scope_.rend(); ++var) {
+      if (*var->name == name) return &*var;
+    }
+    return nullptr;
+  }
+
+  /*!
+   * \brief A copy of \a expr_ptr with the known variables substituted, the
+   *        constants folded and the calls specialized
+   */
+  ExprPtr Transform(const ast::ExprAST* expr_ptr) {
+    switch (expr_ptr->GetExprType()) {
+      case ast::ExprType::kNumber:
+        return MakeNumber(
+            static_cast<const ast::NumberExprAST*>(expr_ptr)->GetValue());
+
+      case ast::ExprType::kVariable: {
+        const std::string& name =
+            static_cast<const ast::VariableExprAST*>(expr_ptr)->GetName();
+        Binding* var = FindBinding(name);
+        if (var && var->known) return MakeNumber(var->value);
+        return std::make_unique<ast::VariableExprAST>(name);
+      }
+
+      case ast::ExprType::kBinary: {
+        auto* bin_ptr = static_cast<const ast::BinaryExprAST*>(expr_ptr);
+        if (bin_ptr->GetOpTag() == ast::SupportBinaryOpTag::kAssign) {
+          // a variable assigned anywhere in its scope is never known
+          const std::string& name =
+              static_cast<const ast::VariableExprAST*>(bin_ptr->GetLHS())
+                  ->GetName();
+          return std::make_unique<ast::BinaryExprAST>(
+              bin_ptr->GetOpTag(),
+              std::make_unique<ast::VariableExprAST>(name),
+              Transform(bin_ptr->GetRHS()));
+        }
+        ExprPtr lhs = Transform(bin_ptr->GetLHS());
+        ExprPtr rhs = Transform(bin_ptr->GetRHS());
+        double lhs_value, rhs_value, result;
+        if (IsNumber(lhs.get(), &lhs_value) &&
+            IsNumber(rhs.get(), &rhs_value) &&
+            FoldBinary(bin_ptr->GetOpTag(), lhs_value, rhs_value, &result)) {
+          return MakeNumber(result);
+        }
+        return std::make_unique<ast::BinaryExprAST>(
+            bin_ptr->GetOpTag(), std::move(lhs), std::move(rhs));
+      }
+
+      case ast::ExprType::kCall:
+        return TransformCall(static_cast<const ast::CallExprAST*>(expr_ptr));
+
+      case ast::ExprType::kIf: {
+        auto* if_ptr = static_cast<const ast::IfExprAST*>(expr_ptr);
+        ExprPtr cond = Transform(if_ptr->GetCond());
+        double cond_value;
+        if (IsNumber(cond.get(), &cond_value)) {
+          return Transform(IsTrue(cond_value) ? if_ptr->GetThen()
+                                              : if_ptr->GetElse());
+        }
+        ExprPtr then = Transform(if_ptr->GetThen());
+        return std::make_unique<ast::IfExprAST>(
+            std::move(cond), std::move(then), Transform(if_ptr->GetElse()));
+      }
+
+      case ast::ExprType::kFor: {
+        auto* for_ptr = static_cast<const ast::ForExprAST*>(expr_ptr);
+        ExprPtr start = Transform(for_ptr->GetStart());
+        scope_.push_back({&for_ptr->GetVarName(), false, 0});
+        ExprPtr cond = Transform(for_ptr->GetCond());
+        ExprPtr step =
+            for_ptr->GetStep() ? Transform(for_ptr->GetStep()) : nullptr;
+        ExprPtr body = Transform(for_ptr->GetBody());
+        scope_.pop_back();
+        return std::make_unique<ast::ForExprAST>(
+            for_ptr->GetVarName(), std::move(start), std::move(cond),
+            std::move(step), std::move(body));
+      }
+
+      case ast::ExprType::kVar: {
+        auto* var_ptr = static_cast<const ast::VarExprAST*>(expr_ptr);
+        const auto& vars = var_ptr->GetVars();
+        const size_t mark = scope_.size();
+        std::vector<ast::VarExprAST::Binding> kept;
+        for (size_t i = 0; i < vars.size(); ++i) {
+          const std::string& name = vars[i].first;
+          ExprPtr init = vars[i].second ? Transform(vars[i].second.get())
+                                        : nullptr;
+          double value = 0;
+          bool known = (!init || IsNumber(init.get(), &value)) &&
+                       !ast::MayAssign(var_ptr->GetBody(), &name);
+          for (size_t j = i + 1; known && j < vars.size(); ++j) {
+            known = !vars[j].second ||
+                    !ast::MayAssign(vars[j].second.get(), &name);
+          }
+          scope_.push_back({&name, known, value});
+          if (!known) kept.emplace_back(name, std::move(init));
+        }
+        ExprPtr body = Transform(var_ptr->GetBody());
+        scope_.resize(mark);
+        if (kept.empty()) return body;
+        return std::make_unique<ast::VarExprAST>(std::move(kept),
+                                                 std::move(body));
+      }
+    }
+    return nullptr;
+  }
+
+  ExprPtr TransformCall(const ast::CallExprAST* call_ptr) {
+    const std::string& callee = call_ptr->GetCallee();
+    std::vector<ExprPtr> args;
+    std::vector<double> values;
+    for (const auto& arg : call_ptr->GetArgs()) {
+      args.push_back(Transform(arg.get()));
+      double value;
+      if (IsNumber(args.back().get(), &value)) values.push_back(value);
+    }
+
+    const ast::FunctionAST* func_ast = nullptr;
+    auto func = functions_.find(callee);
+    if (func != functions_.end() &&
+        func->second->GetProto()->GetArgs().size() == args.size()) {
+      func_ast = func->second;
+    }
+    if (values.size() == args.size()) {
+      double result;
+      if (EvaluateCall(callee, func_ast, values, &result)) {
+        ++stats_->num_evaluated;
+        return MakeNumber(result);
+      }
+    }
+    if (func_ast && !values.empty()) {
+      std::string clone = GetClone(func_ast, args);
+      if (!clone.empty()) {
+        ++stats_->num_specialized;
+        std::vector<ExprPtr> rest;
+        for (auto& arg : args) {
+          if (arg->GetExprType() != ast::ExprType::kNumber) {
+            rest.push_back(std::move(arg));
+          }
+        }
+        return std::make_unique<ast::CallExprAST>(clone, std::move(rest));
+      }
+    }
+    return std::make_unique<ast::CallExprAST>(callee, std::move(args));
+  }
+
+  /*!
+   * \brief The name of the clone of \a func_ast for the constants of
+   *        \a args, made if need be, or empty if it is not worth one
+   */
+  std::string GetClone(const ast::FunctionAST* func_ast,
+                       const std::vector<ExprPtr>& args) {
+    if (func_ast->HasAttr(ast::FunctionAttr::kMemo)) return "";
+    const std::string& callee = func_ast->GetProto()->GetName();
+    const std::string key = MakeKey(callee, args);
+    auto found = clones_.find(key);
+    if (found != clones_.end()) {
+      switch (found->second.state) {
+        case CloneState::kKept:
+          return found->second.name;
+        case CloneState::kRejected:
+          return "";
+        case CloneState::kBuilding:
+          // only the clone being built may call itself, the others may not
+          // be kept
+          return building_.back() == key ? found->second.name : "";
+      }
+    }
+
+    const size_t size = CountNodes(func_ast->GetBody());
+    if (size > options_.max_callee_size ||
+        grown_ + size > options_.growth_budget ||
+        building_.size() >= kMaxCloneDepth) {
+      return "";
+    }
+    Clone& clone = clones_[key];
+    clone.name = callee + kCloneInfix + std::to_string(clones_.size());
+    clone.state = CloneState::kBuilding;
+    building_.push_back(key);
+
+    // the constants a parameter is assigned over stay variables of the
+    // clone, initialized to them
+    const auto& params = func_ast->GetProto()->GetArgs();
+    std::vector<Binding> scope;
+    std::vector<std::string> rest;
+    std::vector<ast::VarExprAST::Binding> assigned;
+    for (size_t i = 0; i < params.size(); ++i) {
+      double value;
+      if (!IsNumber(args[i].get(), &value)) {
+        rest.push_back(params[i]);
+        scope.push_back({&params[i], false, 0});
+      } else if (ast::MayAssign(func_ast->GetBody(), &params[i])) {
+        assigned.emplace_back(params[i], MakeNumber(value));
+        scope.push_back({&params[i], false, 0});
+      } else {
+        scope.push_back({&params[i], true, value});
+      }
+    }
+    const SpecializeStats before = *stats_;
+    std::swap(scope, scope_);
+    ExprPtr body = Transform(func_ast->GetBody());
+    std::swap(scope, scope_);
+    if (!assigned.empty()) {
+      body = std::make_unique<ast::VarExprAST>(std::move(assigned),
+                                               std::move(body));
+    }
+    building_.pop_back();
+
+    // substituting a constant alone saves nothing the inliner would not,
+    // something has to fold away
+    const size_t new_size = CountNodes(body.get());
+    Clone& built = clones_[key];
+    if (new_size + options_.min_benefit > size) {
+      built.state = CloneState::kRejected;
+      stats_->num_evaluated = before.num_evaluated;
+      stats_->num_specialized = before.num_specialized;
+      ++stats_->num_rejected;
+      return "";
+    }
+    built.state = CloneState::kKept;
+    grown_ += new_size;
+    ++stats_->num_clones;
+    new_clones_.push_back(
+        MakeFunction(func_ast, built.name, std::move(rest), std::move(body)));
+    return built.name;
+  }
+
+  bool EvaluateCall(const std::string& callee, const ast::FunctionAST* func_ast,
+                    const std::vector<double>& args, double* result) {
+    if (!func_ast) {
+      // a definition of the same name wins over a builtin, even if it does
+      // not compile
+      auto proto = externs_.find(callee);
+      return defined_.count(callee) == 0 && proto != externs_.end() &&
+             proto->second == args.size() &&
+             EvaluateBuiltin(callee, args, result);
+    }
+
+    std::string key = callee;
+    for (double arg : args) {
+      char bits[sizeof(arg)];
+      std::memcpy(bits, &arg, sizeof(arg));
+      key.append(bits, sizeof(bits));
+    }
+    auto cached = evaluated_.find(key);
+    if (cached != evaluated_.end()) {
+      *result = cached->second.second;
+      return cached->second.first;
+    }
+    fuel_ = options_.eval_fuel;
+    depth_ = 0;
+    frames_.clear();
+    frame_begin_ = 0;
+    bool evaluated = Call(func_ast, args, result);
+    evaluated_[key] = std::make_pair(evaluated, *result);
+    return evaluated;
+  }
+
+  bool Call(const ast::FunctionAST* func_ast, const std::vector<double>& args,
+            double* result) {
+    if (!IsStrict(func_ast) || depth_ == kMaxEvalDepth) return false;
+    const size_t saved_begin = frame_begin_;
+    frame_begin_ = frames_.size();
+    const auto& params = func_ast->GetProto()->GetArgs();
+    for (size_t i = 0; i < params.size(); ++i) {
+      frames_.emplace_back(&params[i], args[i]);
+    }
+    ++depth_;
+    bool evaluated = Evaluate(func_ast->GetBody(), result);
+    --depth_;
+    frames_.resize(frame_begin_);
+    frame_begin_ = saved_begin;
+    return evaluated;
+  }
+
+  double* FindValue(const std::string& name) {
+    for (size_t i = frames_.size(); i > frame_begin_; --i) {
+      if (*frames_[i - 1].first == name) return &frames_[i - 1].second;
+    }
+    return nullptr;
+  }
+
+  /*! \brief Run \a expr_ptr as the compiled code would, out of fuel_ */
+  bool Evaluate(const ast::ExprAST* expr_ptr, double* result) {
+    if (fuel_ == 0) return false;
+    --fuel_;
+    switch (expr_ptr->GetExprType()) {
+      case ast::ExprType::kNumber:
+        return IsNumber(expr_ptr, result);
+
+      case ast::ExprType::kVariable: {
+        double* value = FindValue(
+            static_cast<const ast::VariableExprAST*>(expr_ptr)->GetName());
+        if (!value) return false;
+        *result = *value;
+        return true;
+      }
+
+      case ast::ExprType::kBinary: {
+        auto* bin_ptr = static_cast<const ast::BinaryExprAST*>(expr_ptr);
+        if (bin_ptr->GetOpTag() == ast::SupportBinaryOpTag::kAssign) {
+          if (!Evaluate(bin_ptr->GetRHS(), result)) return false;
+          double* value = FindValue(
+              static_cast<const ast::VariableExprAST*>(bin_ptr->GetLHS())
+                  ->GetName());
+          if (!value) return false;
+          *value = *result;
+          return true;
+        }
+        double lhs, rhs;
+        return Evaluate(bin_ptr->GetLHS(), &lhs) &&
+               Evaluate(bin_ptr->GetRHS(), &rhs) &&
+               FoldBinary(bin_ptr->GetOpTag(), lhs, rhs, result);
+      }
+
+      case ast::ExprType::kCall: {
+        auto* call_ptr = static_cast<const ast::CallExprAST*>(expr_ptr);
+        std::vector<double> args(call_ptr->GetArgs().size());
+        for (size_t i = 0; i < args.size(); ++i) {
+          if (!Evaluate(call_ptr->GetArg(i).get(), &args[i])) return false;
+        }
+        auto func = functions_.find(call_ptr->GetCallee());
+        if (func == functions_.end()) {
+          return defined_.count(call_ptr->GetCallee()) == 0 &&
+                 externs_.count(call_ptr->GetCallee()) != 0 &&
+                 externs_[call_ptr->GetCallee()] == args.size() &&
+                 EvaluateBuiltin(call_ptr->GetCallee(), args, result);
+        }
+        return func->second->GetProto()->GetArgs().size() == args.size() &&
+               Call(func->second, args, result);
+      }
+
+      case ast::ExprType::kIf: {
+        auto* if_ptr = static_cast<const ast::IfExprAST*>(expr_ptr);
+        double cond;
+        if (!Evaluate(if_ptr->GetCond(), &cond)) return false;
+        return Evaluate(IsTrue(cond) ? if_ptr->GetThen() : if_ptr->GetElse(),
+                        result);
+      }
+
+      case ast::ExprType::kFor: {
+        // var = start; if (cond) do { body; var += step; } while (cond);
+        auto* for_ptr = static_cast<const ast::ForExprAST*>(expr_ptr);
+        double start, cond, ignored;
+        if (!Evaluate(for_ptr->GetStart(), &start)) return false;
+        const size_t slot = frames_.size();
+        frames_.emplace_back(&for_ptr->GetVarName(), start);
+        bool evaluated = Evaluate(for_ptr->GetCond(), &cond);
+        while (evaluated && IsTrue(cond)) {
+          double step = 1;
+          evaluated = Evaluate(for_ptr->GetBody(), &ignored) &&
+                      (!for_ptr->GetStep() ||
+                       Evaluate(for_ptr->GetStep(), &step));
+          if (!evaluated) break;
+          frames_[slot].second += step;
+          evaluated = Evaluate(for_ptr->GetCond(), &cond);
+        }
+        frames_.resize(slot);
+        *result = 0;
+        return evaluated;
+      }
+
+      case ast::ExprType::kVar: {
+        auto* var_ptr = static_cast<const ast::VarExprAST*>(expr_ptr);
+        const size_t mark = frames_.size();
+        bool evaluated = true;
+        for (const auto& var : var_ptr->GetVars()) {
+          double value = 0;
+          if (var.second && !Evaluate(var.second.get(), &value)) {
+            evaluated = false;
+            break;
+          }
+          frames_.emplace_back(&var.first, value);
+        }
+        evaluated = evaluated && Evaluate(var_ptr->GetBody(), result);
+        frames_.resize(mark);
+        return evaluated;
+      }
+    }
+    return false;
+  }
+
+  /*! \brief Remove the clones only called from bodies thrown away */
+  void DropUnusedClones(std::list<ast::AST::Ptr>* items) {
+    std::unordered_set<std::string> used;
+    std::vector<const ast::ExprAST*> work;
+    for (const auto& item : *items) {
+      if (item->GetType() != ast::ASTType::kFunction) continue;
+      auto* func_ast = static_cast<const ast::FunctionAST*>(item.get());
+      if (!IsSpecialization(func_ast->GetProto()->GetName())) {
+        work.push_back(func_ast->GetBody());
+      }
+    }
+    while (!work.empty()) {
+      const ast::ExprAST* expr_ptr = work.back();
+      work.pop_back();
+      switch (expr_ptr->GetExprType()) {
+        case ast::ExprType::kNumber:
+        case ast::ExprType::kVariable:
+          break;
+        case ast::ExprType::kBinary: {
+          auto* bin_ptr = static_cast<const ast::BinaryExprAST*>(expr_ptr);
+          work.push_back(bin_ptr->GetLHS());
+          work.push_back(bin_ptr->GetRHS());
+          break;
+        }
+        case ast::ExprType::kCall: {
+          auto* call_ptr = static_cast<const ast::CallExprAST*>(expr_ptr);
+          for (const auto& arg : call_ptr->GetArgs()) work.push_back(arg.get());
+          auto clone = clones_by_name_.find(call_ptr->GetCallee());
+          if (clone != clones_by_name_.end() &&
+              used.insert(call_ptr->GetCallee()).second) {
+            work.push_back(
+                static_cast<const ast::FunctionAST*>(clone->second->get())
+                    ->GetBody());
+          }
+          break;
+        }
+        case ast::ExprType::kIf: {
+          auto* if_ptr = static_cast<const ast::IfExprAST*>(expr_ptr);
+          work.push_back(if_ptr->GetCond());
+          work.push_back(if_ptr->GetThen());
+          work.push_back(if_ptr->GetElse());
+          break;
+        }
+        case ast::ExprType::kFor: {
+          auto* for_ptr = static_cast<const ast::ForExprAST*>(expr_ptr);
+          work.push_back(for_ptr->GetStart());
+          work.push_back(for_ptr->GetCond());
+          if (for_ptr->GetStep()) work.push_back(for_ptr->GetStep());
+          work.push_back(for_ptr->GetBody());
+          break;
+        }
+        case ast::ExprType::kVar: {
+          auto* var_ptr = static_cast<const ast::VarExprAST*>(expr_ptr);
+          for (const auto& var : var_ptr->GetVars()) {
+            if (var.second) work.push_back(var.second.get());
+          }
+          work.push_back(var_ptr->GetBody());
+          break;
+        }
+      }
+    }
+    for (const auto& clone : clones_by_name_) {
+      if (used.count(clone.first) == 0) {
+        items->erase(clone.second);
+        --stats_->num_clones;
+      }
+    }
+  }
+
+  const SpecializeOptions& options_;
+  SpecializeStats* stats_;
+
+  // the definitions that compile and the externs seen so far, which are
+  // all the calls can go to
+  std::unordered_map<std::string, const ast::FunctionAST*> functions_;
+  std::unordered_map<std::string, size_t> externs_;
+  // every name defined so far, compiling or not
+  std::unordered_set<std::string> defined_;
+
+  // the variables of the body being transformed
+  std::vector<Binding> scope_;
+  // by MakeKey
+  std::unordered_map<std::string, Clone> clones_;
+  // the keys of the clones being built, innermost last
+  std::vector<std::string> building_;
+  // made while transforming the current item, to go right before it
+  std::vector<std::unique_ptr<ast::FunctionAST>> new_clones_;
+  std::unordered_map<std::string, std::list<ast::AST::Ptr>::iterator>
+      clones_by_name_;
+  // AST nodes of the clones kept
+  size_t grown_ = 0;
+
+  // the results of the calls evaluated, by callee and argument bits, and
+  // whether they could be
+  std::unordered_map<std::string, std::pair<bool, double>> evaluated_;
+  // the variables of the calls being evaluated, the innermost call's from
+  // frame_begin_ on
+  std::vector<std::pair<const std::string*, double>> frames_;
+  size_t frame_begin_ = 0;
+  size_t depth_ = 0;
+  uint64_t fuel_ = 0;
+};
+
+}  // namespace
+
+SpecializeStats SpecializeCalls(std::list<ast::AST::Ptr>* items,
+                                const SpecializeOptions& options) {
+  trace::Scope scope("Specialize");
+  SpecializeStats stats;
+  Specializer(options, &stats).Run(items);
+  const SpecializeMetrics& specialize_metrics = GetSpecializeMetrics();
+  specialize_metrics.evaluated.Add(stats.num_evaluated);
+  specialize_metrics.specialized.Add(stats.num_specialized);
+  specialize_metrics.clones.Add(stats.num_clones);
+  return stats;
+}
+
+bool IsSpecialization(const std::string& name) {
+  return name.find(kCloneInfix) != std::string::npos;
+}
+
+}  // namespace ir
+}  // namespace kaleidoscope
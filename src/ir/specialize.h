@@ -0,0 +1,71 @@
+/*!
+ * \file specialize.h
+ * \brief Partial evaluation of calls with constant arguments, on the AST
+ */
+#ifndef KALEIDOSCOPE_IR_SPECIALIZE_H_
+#define KALEIDOSCOPE_IR_SPECIALIZE_H_
+
+#include <cstdint>
+#include <list>
+#include <string>
+
+#include "ast_visiter.h"
+#include "kaleidoscope/ast.h"
+
+namespace kaleidoscope {
+namespace ir {
+
+struct SpecializeOptions {
+  // semantics of the functions without an annotation, calls are only
+  // evaluated through strict functions, where nothing may round differently
+  FPMode fp_mode = FPMode::kStrict;
+  // AST nodes a call with constant arguments may evaluate, it is left to
+  // run time past that
+  uint64_t eval_fuel = 100000;
+  // a clone is only kept if it has at least this many AST nodes less than
+  // the function it specializes
+  size_t min_benefit = 2;
+  // functions of more AST nodes than that are not cloned
+  size_t max_callee_size = 256;
+  // AST nodes all the clones together may add to the program
+  size_t growth_budget = 4096;
+};
+
+/*! \brief What SpecializeCalls did to a program */
+struct SpecializeStats {
+  size_t num_evaluated = 0;    // calls replaced by their value
+  size_t num_specialized = 0;  // calls redirected to a clone
+  size_t num_clones = 0;       // clones added to the program
+  size_t num_rejected = 0;     // clones dropped for too little benefit
+};
+
+/*!
+ * \brief Specialize the calls of \a items to the constants they pass
+ *
+ * A call whose arguments are all constant is evaluated right away and
+ * replaced by its value, if the callee is a pure function defined before,
+ * or a math builtin, and the evaluation ends within
+ * SpecializeOptions::eval_fuel. A call with only some constant arguments
+ * goes to a clone of the callee taking the other arguments, in which the
+ * constants are propagated, the branches they decide folded away and the
+ * calls they make constant evaluated in turn. A clone is made once per
+ * callee and constants, and only kept if it saves enough to be worth the
+ * code, see SpecializeOptions.
+ *
+ * Every clone is inserted right before the first item calling it, under a
+ * name no kaleidoscope identifier can have, see IsSpecialization. Constant
+ * subexpressions are folded everywhere along the way.
+ *
+ * \note The items must not redefine a function, which would change the
+ *       callee of the calls specialized before.
+ */
+SpecializeStats SpecializeCalls(std::list<ast::AST::Ptr>* items,
+                                const SpecializeOptions& options);
+
+/*! \brief Whether the function \a name is a clone made by SpecializeCalls */
+bool IsSpecialization(const std::string& name);
+
+}  // namespace ir
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_IR_SPECIALIZE_H_
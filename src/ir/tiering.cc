@@ -0,0 +1,246 @@
+#include "tiering.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <utility>
+
+#include "kaleidoscope/logging.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm_error.h"
+
+namespace kaleidoscope {
+namespace ir {
+
+TieredCompiler::TieredCompiler(llvm::orc::LLJIT* jit, uint64_t threshold,
+                               bool time_passes)
+    : jit_(jit),
+      threshold_(std::max<uint64_t>(1, threshold)),
+      tier1_machine_(CreateHostTargetMachine(llvm::CodeGenOpt::Aggressive)),
+      tier1_optimizer_(OptLevel::kO3, time_passes, tier1_machine_.get()) {
+  auto stubs_builder = llvm::orc::createLocalIndirectStubsManagerBuilder(
+      jit_->getTargetTriple());
+  CHECK(stubs_builder) << "Indirect stubs are not supported on "
+                       << jit_->getTargetTriple().str();
+  stubs_ = stubs_builder();
+
+  worker_ = std::thread([this] { WorkerLoop(); });
+}
+
+TieredCompiler::~TieredCompiler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  worker_.join();
+}
+
+void TieredCompiler::Instrument(llvm::Function* func, Function* function) {
+  llvm::BasicBlock* entry = &func->getEntryBlock();
+  llvm::BasicBlock* body = entry->splitBasicBlock(entry->begin(), "body");
+  entry->getTerminator()->eraseFromParent();
+
+  llvm::IRBuilder<> builder(entry);
+  llvm::Type* int64_type = builder.getInt64Ty();
+  auto* counter = builder.CreateIntToPtr(
+      builder.getInt64(reinterpret_cast<uintptr_t>(&function->calls)),
+      int64_type->getPointerTo(), "counter");
+  auto* calls = builder.CreateAtomicRMW(
+      llvm::AtomicRMWInst::Add, counter, builder.getInt64(1),
+      llvm::MaybeAlign(8), llvm::AtomicOrdering::Monotonic);
+  auto* is_hot =
+      builder.CreateICmpEQ(calls, builder.getInt64(threshold_ - 1), "hot");
+  auto* tier_up = llvm::BasicBlock::Create(func->getContext(), "tier_up",
+                                           func, body);
+  builder.CreateCondBr(
+      is_hot, tier_up, body,
+      llvm::MDBuilder(func->getContext()).createBranchWeights(1, 1 << 20));
+
+  builder.SetInsertPoint(tier_up);
+  llvm::Type* ptr_type = builder.getInt8PtrTy();
+  auto* hook_type = llvm::FunctionType::get(
+      builder.getVoidTy(), {ptr_type, ptr_type}, false);
+  auto* hook = builder.CreateIntToPtr(
+      builder.getInt64(reinterpret_cast<uintptr_t>(&TierUp)),
+      hook_type->getPointerTo());
+  auto* self = builder.CreateIntToPtr(
+      builder.getInt64(reinterpret_cast<uintptr_t>(this)), ptr_type);
+  auto* hot_function = builder.CreateIntToPtr(
+      builder.getInt64(reinterpret_cast<uintptr_t>(function)), ptr_type);
+  builder.CreateCall(hook_type, hook, {self, hot_function});
+  builder.CreateBr(body);
+}
+
+void TieredCompiler::AddModule(GeneratedModule generated) {
+  std::vector<GeneratedModule> modules;
+  modules.push_back(std::move(generated));
+  AddModules(std::move(modules));
+}
+
+void TieredCompiler::AddModules(std::vector<GeneratedModule> modules) {
+  // (definition, its function) of every module
+  std::vector<std::vector<std::pair<llvm::Function*, Function*>>> definitions(
+      modules.size());
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < modules.size(); ++i) {
+      tier1_optimizer_.AddProgramFunctions(*modules[i].module);
+      auto pristine = std::make_shared<llvm::orc::ThreadSafeModule>();
+      for (auto& func : *modules[i].module) {
+        // private helpers, e.g. the body of a @memo function, go with it
+        if (func.isDeclaration() || func.hasLocalLinkage()) continue;
+        functions_.emplace_back(new Function);
+        functions_.back()->name = func.getName().str();
+        functions_.back()->pristine = pristine;
+        definitions[i].emplace_back(&func, functions_.back().get());
+      }
+    }
+  }
+
+  // The stubs of all modules are exported first as they may call each
+  // other. They are pointed to the tier 0 bodies before any of them runs,
+  // and throw until then, or for good if a body fails to compile.
+  llvm::orc::SymbolMap stub_symbols;
+  for (const auto& module_definitions : definitions) {
+    for (const auto& entry : module_definitions) {
+      const std::string& name = entry.second->name;
+      CheckLLVMError(
+          stubs_->createStub(
+              name, llvm::pointerToJITTargetAddress(&OnCompileFailure),
+              llvm::JITSymbolFlags::Exported),
+          "Failed to create the stub of " + name);
+      stub_symbols[jit_->mangleAndIntern(name)] = llvm::JITEvaluatedSymbol(
+          stubs_->findStub(name, true).getAddress(),
+          llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable);
+    }
+  }
+  CheckLLVMError(jit_->getMainJITDylib().define(
+                     llvm::orc::absoluteSymbols(std::move(stub_symbols))),
+                 "Failed to define the stubs");
+
+  for (size_t i = 0; i < modules.size(); ++i) {
+    if (definitions[i].empty()) continue;
+    llvm::Module& module = *modules[i].module;
+    module.setDataLayout(jit_->getDataLayout());
+
+    llvm::orc::ThreadSafeContext context(std::move(modules[i].context));
+    *definitions[i].front().second->pristine =
+        llvm::orc::ThreadSafeModule(llvm::CloneModule(module), context);
+    for (const auto& entry : definitions[i]) {
+      RenameDefinition(entry.first, entry.second->name + ".tier0");
+      Instrument(entry.first, entry.second);
+    }
+    CheckLLVMError(jit_->addIRModule(llvm::orc::ThreadSafeModule(
+                       std::move(modules[i].module), context)),
+                   "Failed to add a module");
+  }
+
+  // the stubs of a module that fails keep throwing, the others still go
+  // to their bodies
+  std::exception_ptr error;
+  for (const auto& module_definitions : definitions) {
+    for (const auto& entry : module_definitions) {
+      const std::string& name = entry.second->name;
+      try {
+        auto symbol = CheckLLVMError(jit_->lookup(name + ".tier0"),
+                                     "Failed to compile " + name);
+        CheckLLVMError(stubs_->updatePointer(name, symbol.getAddress()),
+                       "Failed to update the stub of " + name);
+      } catch (...) {
+        if (!error) error = std::current_exception();
+      }
+    }
+  }
+  if (error) std::rethrow_exception(error);
+}
+
+void TieredCompiler::TierUp(TieredCompiler* self, Function* function) {
+  {
+    std::lock_guard<std::mutex> lock(self->mutex_);
+    self->hot_queue_.push_back(function);
+  }
+  self->cv_.notify_all();
+}
+
+void TieredCompiler::CompileTier1(Function* function) {
+  const std::string& name = function->name;
+  std::unique_ptr<llvm::MemoryBuffer> object;
+  function->pristine->withModuleDo([&](llvm::Module& pristine) {
+    auto module = llvm::CloneModule(pristine);
+    for (auto& func : *module) {
+      // the other bodies of the module may still be inlined, but are not
+      // emitted again
+      if (!func.isDeclaration() && !func.hasLocalLinkage() &&
+          func.getName() != name) {
+        func.setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+      }
+    }
+    RenameDefinition(module->getFunction(name), name + ".tier1");
+    tier1_optimizer_.Run(*module);
+
+    llvm::orc::SimpleCompiler compile(*tier1_machine_);
+    object = CheckLLVMError(compile(*module), "Failed to compile " + name);
+  });
+
+  CheckLLVMError(jit_->addObjectFile(std::move(object)),
+                 "Failed to add the tier 1 code of " + name);
+  auto symbol = CheckLLVMError(jit_->lookup(name + ".tier1"),
+                               "Failed to link the tier 1 code of " + name);
+  CheckLLVMError(stubs_->updatePointer(name, symbol.getAddress()),
+                 "Failed to update the stub of " + name);
+  function->tier = 1;
+}
+
+void TieredCompiler::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this] { return stop_ || !hot_queue_.empty(); });
+    if (stop_) return;
+
+    Function* function = hot_queue_.front();
+    hot_queue_.pop_front();
+    ++num_compiling_;
+    lock.unlock();
+
+    auto start = std::chrono::steady_clock::now();
+    try {
+      CompileTier1(function);
+    } catch (const std::exception& e) {
+      // the function simply stays in tier 0
+      LOG_WARNING << e.what() << std::endl;
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    lock.lock();
+    tier1_seconds_ += elapsed.count();
+    --num_compiling_;
+    cv_.notify_all();
+  }
+}
+
+void TieredCompiler::Drain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return hot_queue_.empty() && num_compiling_ == 0; });
+}
+
+void TieredCompiler::PrintStats(std::ostream& os) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t num_hot = 0;
+  for (const auto& function : functions_) {
+    if (function->tier == 1) {
+      ++num_hot;
+      os << "tier 1: " << function->name << '\n';
+    }
+  }
+  os << "functions: " << functions_.size() << ", in tier 1: " << num_hot
+     << ", tier 1 compile time: " << tier1_seconds_ << "s\n";
+}
+
+}  // namespace ir
+}  // namespace kaleidoscope
@@ -0,0 +1,112 @@
+/*!
+ * \file tiering.h
+ * \brief Two-tier execution: a quick baseline compile, and a background
+ *        -O3 recompile of the functions that turn out to be hot
+ */
+#ifndef KALEIDOSCOPE_IR_TIERING_H_
+#define KALEIDOSCOPE_IR_TIERING_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ast_visiter.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Target/TargetMachine.h"
+#include "optimizer.h"
+
+namespace kaleidoscope {
+namespace ir {
+
+/*!
+ * \brief Tiered compilation on top of an LLJIT
+ *
+ * Every function `f` is reached through an ORC indirect stub exported as
+ * `f`, all calls (from JIT'd code and from the host) go through it.
+ *
+ * - Tier 0: the body is renamed to `f.tier0`, compiled without optimization
+ *   by the JIT (which is set up with FastISel), and counts its entries with
+ *   an atomic add. The call that reaches the threshold queues the function
+ *   for tier 1.
+ * - Tier 1: a background thread re-optimizes a pristine copy of the IR at
+ *   -O3, compiles it as `f.tier1` with an aggressive target machine, and
+ *   points the stub of `f` to it. Calls already running in tier 0 finish
+ *   there.
+ */
+class TieredCompiler {
+ public:
+  /*!
+   * \param jit the JIT holding both tiers, it must outlive this object and
+   *        be set up with CodeGenOpt::None for the tier 0 code
+   * \param threshold number of calls after which a function is hot
+   */
+  TieredCompiler(llvm::orc::LLJIT* jit, uint64_t threshold,
+                 bool time_passes);
+  ~TieredCompiler();
+
+  TieredCompiler(const TieredCompiler&) = delete;
+  TieredCompiler& operator=(const TieredCompiler&) = delete;
+
+  /*! \brief Compile the definitions of \a generated at tier 0 */
+  void AddModule(GeneratedModule generated);
+
+  /*! \brief Compile the definitions of modules that call each other */
+  void AddModules(std::vector<GeneratedModule> modules);
+
+  /*! \brief Wait until all queued tier 1 compilations are done */
+  void Drain();
+
+  /*! \brief The functions in tier 1 and the time spent compiling them */
+  void PrintStats(std::ostream& os);
+
+  /*! \brief Print the pass timings of the tier 1 pipeline */
+  void PrintTimings() { tier1_optimizer_.PrintTimings(); }
+
+ private:
+  struct Function {
+    std::string name;
+    std::atomic<uint64_t> calls{0};
+    std::atomic<int> tier{0};
+    // unoptimized IR of the module the function came from, shared with the
+    // other functions of that module
+    std::shared_ptr<llvm::orc::ThreadSafeModule> pristine;
+  };
+
+  /*! \brief Called by tier 0 code when a function gets hot */
+  static void TierUp(TieredCompiler* self, Function* function);
+
+  /*! \brief Count the entries of \a func and call TierUp at the threshold */
+  void Instrument(llvm::Function* func, Function* function);
+
+  void CompileTier1(Function* function);
+  void WorkerLoop();
+
+  llvm::orc::LLJIT* jit_;
+  uint64_t threshold_;
+  std::unique_ptr<llvm::TargetMachine> tier1_machine_;
+  Optimizer tier1_optimizer_;
+  std::unique_ptr<llvm::orc::IndirectStubsManager> stubs_;
+
+  std::mutex mutex_;  // guards the members below
+  std::condition_variable cv_;
+  std::deque<std::unique_ptr<Function>> functions_;
+  std::deque<Function*> hot_queue_;
+  size_t num_compiling_ = 0;
+  bool stop_ = false;
+  double tier1_seconds_ = 0;
+  std::thread worker_;
+};
+
+}  // namespace ir
+}  // namespace kaleidoscope
+
+#endif  // KALEIDOSCOPE_IR_TIERING_H_
@@ -0,0 +1,107 @@
+#include "kaleidoscope/alloc_tracker.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace kaleidoscope {
+namespace alloc {
+
+namespace {
+
+// trivially destructible, so counting still works while threads exit
+#if KALEIDOSCOPE_TRACK_ALLOCATIONS
+thread_local Phase current_phase = Phase::kOther;
+#endif  // KALEIDOSCOPE_TRACK_ALLOCATIONS
+thread_local uint64_t thread_allocations = 0;
+
+std::atomic<uint64_t> phase_allocations[kNumPhases];
+std::atomic<uint64_t> phase_bytes[kNumPhases];
+
+}  // namespace
+
+const char* PhaseName(Phase phase) {
+  switch (phase) {
+    case Phase::kOther:
+      return "other";
+    case Phase::kLex:
+      return "lex";
+    case Phase::kParse:
+      return "parse";
+    case Phase::kCodeGen:
+      return "codegen";
+    case Phase::kOptimize:
+      return "optimize";
+    case Phase::kJIT:
+      return "jit";
+  }
+  return "";
+}
+
+PhaseAllocations GetAllocations(Phase phase) {
+  auto index = static_cast<int>(phase);
+  PhaseAllocations result;
+  result.allocations =
+      phase_allocations[index].load(std::memory_order_relaxed);
+  result.bytes = phase_bytes[index].load(std::memory_order_relaxed);
+  return result;
+}
+
+void ResetAllocations() {
+  for (int i = 0; i < kNumPhases; ++i) {
+    phase_allocations[i].store(0, std::memory_order_relaxed);
+    phase_bytes[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+uint64_t ThreadAllocations() { return thread_allocations; }
+
+#if KALEIDOSCOPE_TRACK_ALLOCATIONS
+PhaseScope::PhaseScope(Phase phase) : previous_(current_phase) {
+  current_phase = phase;
+}
+
+PhaseScope::~PhaseScope() { current_phase = previous_; }
+
+namespace {
+
+void Record(std::size_t size) {
+  ++thread_allocations;
+  auto index = static_cast<int>(current_phase);
+  phase_allocations[index].fetch_add(1, std::memory_order_relaxed);
+  phase_bytes[index].fetch_add(size, std::memory_order_relaxed);
+}
+
+}  // namespace
+#endif  // KALEIDOSCOPE_TRACK_ALLOCATIONS
+
+}  // namespace alloc
+}  // namespace kaleidoscope
+
+#if KALEIDOSCOPE_TRACK_ALLOCATIONS
+// The array and nothrow forms of new of the standard library call these.
+void* operator new(std::size_t size) {
+  kaleidoscope::alloc::Record(size);
+  if (void* ptr = std::malloc(size != 0 ? size : 1)) return ptr;
+  throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, std::align_val_t align) {
+  kaleidoscope::alloc::Record(size);
+  auto alignment = static_cast<std::size_t>(align);
+  size = (std::max<std::size_t>(size, 1) + alignment - 1) & ~(alignment - 1);
+  if (void* ptr = std::aligned_alloc(alignment, size)) return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+
+void operator delete(void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+#endif  // KALEIDOSCOPE_TRACK_ALLOCATIONS
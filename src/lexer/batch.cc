@@ -0,0 +1,126 @@
+#include "kaleidoscope/batch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <unordered_map>
+
+#include "kaleidoscope/logging.h"
+#include "kaleidoscope/thread_pool.h"
+
+namespace kaleidoscope {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+/*! \brief Mirror the source path \a rel_src under \a out_dir */
+std::string OutputPath(const fs::path& rel_src, const std::string& out_dir,
+                       const std::string& out_suffix) {
+  // keep absolute sources inside out_dir as well
+  fs::path mirrored = rel_src.lexically_normal().relative_path();
+  CHECK(!mirrored.empty() && *mirrored.begin() != "..")
+      << "Batch source " << rel_src << " has no output under " << out_dir;
+  return (fs::path(out_dir) / mirrored).string() + out_suffix;
+}
+
+}  // namespace
+
+std::vector<BatchItem> CollectBatchItems(const std::string& input,
+                                         const std::string& out_dir,
+                                         const std::string& out_suffix,
+                                         const std::string& extension) {
+  std::vector<BatchItem> items;
+  if (fs::is_directory(input)) {
+    for (const auto& entry : fs::recursive_directory_iterator(input)) {
+      if (!entry.is_regular_file() ||
+          entry.path().extension().string() != extension) {
+        continue;
+      }
+      auto rel_src = fs::relative(entry.path(), input);
+      items.push_back(
+          {entry.path().string(), OutputPath(rel_src, out_dir, out_suffix)});
+    }
+    std::sort(items.begin(), items.end(),
+              [](const BatchItem& a, const BatchItem& b) {
+                return a.src_path < b.src_path;
+              });
+  } else {
+    std::ifstream manifest(input);
+    CHECK(manifest.is_open()) << "Cannot open batch manifest: " << input;
+    std::string line;
+    while (std::getline(manifest, line)) {
+      auto begin = line.find_first_not_of(" \t\r");
+      if (begin == std::string::npos || line[begin] == '#') continue;
+      auto end = line.find_last_not_of(" \t\r");
+      auto src = line.substr(begin, end - begin + 1);
+      items.push_back({src, OutputPath(fs::path(src), out_dir, out_suffix)});
+    }
+  }
+
+  // two sources writing one output would race, e.g. a/x.k and /a/x.k
+  std::unordered_map<std::string, const BatchItem*> by_dst;
+  for (const auto& item : items) {
+    auto inserted = by_dst.emplace(item.dst_path, &item);
+    CHECK(inserted.second)
+        << "Batch sources " << inserted.first->second->src_path << " and "
+        << item.src_path << " both write " << item.dst_path;
+  }
+
+  // create output directories up front, workers only open files
+  for (const auto& item : items) {
+    auto dir = fs::path(item.dst_path).parent_path();
+    if (!dir.empty()) fs::create_directories(dir);
+  }
+  return items;
+}
+
+std::vector<BatchResult> RunBatch(
+    const std::vector<BatchItem>& items, size_t num_jobs,
+    const std::function<size_t(size_t, const BatchItem&)>& process) {
+  using Clock = std::chrono::steady_clock;
+  std::vector<BatchResult> results(items.size());
+  WorkStealingPool pool(num_jobs);
+  pool.ParallelFor(items.size(), [&](size_t worker_id, size_t idx) {
+    auto& result = results[idx];
+    auto start = Clock::now();
+    try {
+      result.units = process(worker_id, items[idx]);
+      result.ok = true;
+    } catch (const std::exception& e) {
+      result.error = e.what();
+    }
+    result.seconds =
+        std::chrono::duration<double>(Clock::now() - start).count();
+  });
+  return results;
+}
+
+size_t PrintBatchReport(std::ostream& sm, const std::vector<BatchItem>& items,
+                        const std::vector<BatchResult>& results,
+                        double wall_seconds, const std::string& unit_name) {
+  size_t num_failed = 0;
+  size_t total_units = 0;
+  sm << std::fixed << std::setprecision(3);
+  for (size_t i = 0; i < items.size(); ++i) {
+    const auto& result = results[i];
+    sm << items[i].src_path << ": ";
+    if (result.ok) {
+      sm << result.units << " " << unit_name << ", ";
+    } else {
+      sm << "FAILED (" << result.error << "), ";
+      ++num_failed;
+    }
+    sm << result.seconds * 1e3 << " ms\n";
+    total_units += result.units;
+  }
+  sm << "total: " << items.size() << " files (" << num_failed << " failed), "
+     << total_units << " " << unit_name << " in " << wall_seconds << " s, "
+     << items.size() / wall_seconds << " files/s, "
+     << total_units / wall_seconds << " " << unit_name << "/s\n";
+  return num_failed;
+}
+
+}  // namespace kaleidoscope
@@ -0,0 +1,221 @@
+#include "kaleidoscope/daemon.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "kaleidoscope/logging.h"
+
+namespace kaleidoscope {
+namespace daemon {
+
+namespace {
+
+void PutUint32(uint32_t value, std::string* out) {
+  for (int i = 0; i < 4; ++i) out->push_back(static_cast<char>(value >> 8 * i));
+}
+
+uint32_t GetUint32(const char* data) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; ++i) {
+    value |= static_cast<uint32_t>(static_cast<unsigned char>(data[i]))
+             << 8 * i;
+  }
+  return value;
+}
+
+void PutString(const std::string& str, std::string* out) {
+  PutUint32(static_cast<uint32_t>(str.size()), out);
+  out->append(str);
+}
+
+/*! \brief Read a string of \a payload at \a pos and move past it */
+std::string GetString(const std::string& payload, size_t* pos) {
+  CHECK_LE(*pos + 4, payload.size()) << "Truncated request";
+  uint32_t size = GetUint32(payload.data() + *pos);
+  *pos += 4;
+  CHECK_LE(size, payload.size() - *pos) << "Truncated request";
+  std::string str = payload.substr(*pos, size);
+  *pos += size;
+  return str;
+}
+
+sockaddr_un SocketAddress(const std::string& path) {
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  CHECK_LT(path.size(), sizeof(address.sun_path))
+      << "Socket path too long: " << path;
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return address;
+}
+
+/*! \brief Whether \a path is a socket nobody listens on anymore */
+bool IsStaleSocket(const std::string& path, const sockaddr_un& address) {
+  struct stat info;
+  if (::lstat(path.c_str(), &info) != 0 || !S_ISSOCK(info.st_mode)) {
+    return false;
+  }
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return false;
+  bool refused = ::connect(fd, reinterpret_cast<const sockaddr*>(&address),
+                           sizeof(address)) != 0 &&
+                 errno == ECONNREFUSED;
+  ::close(fd);
+  return refused;
+}
+
+/*! \brief Read exactly \a size bytes, false on EOF before the first one */
+bool ReadAll(int fd, char* data, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = ::recv(fd, data + done, size - done, 0);
+    if (n < 0 && errno == EINTR) continue;
+    CHECK_GE(n, 0) << "Cannot read from the socket: " << std::strerror(errno);
+    if (n == 0) {
+      CHECK_EQ(done, 0) << "Connection closed in the middle of a frame";
+      return false;
+    }
+    done += static_cast<size_t>(n);
+  }
+  return true;
+}
+
+}  // namespace
+
+std::string EncodeRequest(const Request& request) {
+  std::string payload;
+  payload.reserve(13 + request.name.size() + request.options.size() +
+                  request.source.size());
+  payload.push_back(static_cast<char>(request.type));
+  PutString(request.name, &payload);
+  PutString(request.options, &payload);
+  payload.append(request.source);
+  return payload;
+}
+
+Request DecodeRequest(const std::string& payload) {
+  CHECK(!payload.empty()) << "Empty request";
+  Request request;
+  auto type = static_cast<uint8_t>(payload[0]);
+  CHECK(type >= static_cast<uint8_t>(RequestType::kEvaluate) &&
+        type <= static_cast<uint8_t>(RequestType::kShutdown))
+      << "Unknown request type " << static_cast<int>(type);
+  request.type = static_cast<RequestType>(type);
+  size_t pos = 1;
+  request.name = GetString(payload, &pos);
+  request.options = GetString(payload, &pos);
+  request.source = payload.substr(pos);
+  return request;
+}
+
+std::string EncodeResponse(const Response& response) {
+  std::string payload;
+  payload.reserve(1 + response.body.size());
+  payload.push_back(static_cast<char>(response.status));
+  payload.append(response.body);
+  return payload;
+}
+
+Response DecodeResponse(const std::string& payload) {
+  CHECK(!payload.empty()) << "Empty response";
+  auto status = static_cast<uint8_t>(payload[0]);
+  CHECK_LE(status, static_cast<uint8_t>(Status::kError))
+      << "Unknown response status " << static_cast<int>(status);
+  Response response;
+  response.status = static_cast<Status>(status);
+  response.body = payload.substr(1);
+  return response;
+}
+
+std::string EncodeValues(const std::vector<double>& values) {
+  std::string body;
+  body.reserve(values.size() * 8);
+  for (double value : values) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 8; ++i) {
+      body.push_back(static_cast<char>(bits >> 8 * i));
+    }
+  }
+  return body;
+}
+
+std::vector<double> DecodeValues(const std::string& body) {
+  CHECK_EQ(body.size() % 8, 0) << "Truncated values";
+  std::vector<double> values(body.size() / 8);
+  for (size_t k = 0; k < values.size(); ++k) {
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; ++i) {
+      auto byte = static_cast<unsigned char>(body[8 * k + i]);
+      bits |= static_cast<uint64_t>(byte) << 8 * i;
+    }
+    std::memcpy(&values[k], &bits, sizeof(bits));
+  }
+  return values;
+}
+
+bool ReadFrame(int fd, std::string* payload) {
+  char header[4];
+  if (!ReadAll(fd, header, sizeof(header))) return false;
+  uint32_t size = GetUint32(header);
+  CHECK_LE(size, kMaxFrameSize) << "Frame of " << size << " bytes";
+  payload->resize(size);
+  CHECK(size == 0 || ReadAll(fd, &(*payload)[0], size))
+      << "Connection closed in the middle of a frame";
+  return true;
+}
+
+void WriteFrame(int fd, const std::string& payload) {
+  CHECK_LE(payload.size(), kMaxFrameSize)
+      << "Frame of " << payload.size() << " bytes";
+  std::string frame;
+  frame.reserve(4 + payload.size());
+  PutUint32(static_cast<uint32_t>(payload.size()), &frame);
+  frame.append(payload);
+  size_t done = 0;
+  while (done < frame.size()) {
+    // a peer gone away is an error, not a SIGPIPE
+    ssize_t n = ::send(fd, frame.data() + done, frame.size() - done,
+                       MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    CHECK_GE(n, 0) << "Cannot write to the socket: " << std::strerror(errno);
+    done += static_cast<size_t>(n);
+  }
+}
+
+int ListenUnixSocket(const std::string& path, int backlog) {
+  sockaddr_un address = SocketAddress(path);
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  CHECK_GE(fd, 0) << "Cannot create a socket: " << std::strerror(errno);
+  // neither a running daemon's socket nor any other file is replaced, bind
+  // fails on them
+  if (IsStaleSocket(path, address)) ::unlink(path.c_str());
+  if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      ::listen(fd, backlog) != 0) {
+    int error = errno;
+    ::close(fd);
+    LOG_FATAL << "Cannot listen on " << path << ": " << std::strerror(error);
+  }
+  return fd;
+}
+
+int ConnectUnixSocket(const std::string& path) {
+  sockaddr_un address = SocketAddress(path);
+  int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  CHECK_GE(fd, 0) << "Cannot create a socket: " << std::strerror(errno);
+  if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) !=
+      0) {
+    int error = errno;
+    ::close(fd);
+    LOG_FATAL << "Cannot connect to " << path << ": " << std::strerror(error);
+  }
+  return fd;
+}
+
+}  // namespace daemon
+}  // namespace kaleidoscope
@@ -0,0 +1,120 @@
+#include "kaleidoscope/dump.h"
+
+#include <cinttypes>
+#include <cstring>
+
+#include "kaleidoscope/logging.h"
+
+namespace kaleidoscope {
+
+bool ParseDumpFormat(const std::string& name, DumpFormat* format) {
+  if (name == "text") {
+    *format = DumpFormat::kText;
+  } else if (name == "ndjson") {
+    *format = DumpFormat::kNDJson;
+  } else if (name == "binary") {
+    *format = DumpFormat::kBinary;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+std::string DumpFormatSuffix(DumpFormat format) {
+  switch (format) {
+    case DumpFormat::kText:
+      return "";
+    case DumpFormat::kNDJson:
+      return ".ndjson";
+    case DumpFormat::kBinary:
+      return ".bin";
+  }
+  return "";
+}
+
+OutputBuffer::OutputBuffer(const std::string& path, size_t capacity)
+    : path_(path), file_(std::fopen(path.c_str(), "wb")), buffer_(capacity) {
+  CHECK(file_ != nullptr) << "Cannot open file: " << path_;
+  CHECK_GT(capacity, 0) << "Output buffer capacity should be positive";
+  // we do our own buffering, stdio's would only add a copy
+  std::setvbuf(file_, nullptr, _IONBF, 0);
+}
+
+OutputBuffer::~OutputBuffer() {
+  Drain();
+  std::fclose(file_);
+}
+
+void OutputBuffer::Write(const char* data, size_t size) {
+  if (size_ + size > buffer_.size()) {
+    Drain();
+    // records larger than the whole buffer go straight to the file
+    if (size >= buffer_.size()) {
+      drained_ += std::fwrite(data, 1, size, file_);
+      return;
+    }
+  }
+  std::memcpy(buffer_.data() + size_, data, size);
+  size_ += size;
+}
+
+void OutputBuffer::WriteInt(int64_t value) {
+  char text[24];
+  int len = std::snprintf(text, sizeof(text), "%" PRId64, value);
+  Write(text, static_cast<size_t>(len));
+}
+
+void OutputBuffer::WriteDouble(double value, int precision) {
+  char text[32];
+  int len = std::snprintf(text, sizeof(text), "%.*g", precision, value);
+  Write(text, static_cast<size_t>(len));
+}
+
+void OutputBuffer::WriteJsonString(const std::string& str) {
+  static const char* kHexDigits = "0123456789abcdef";
+  Put('"');
+  for (char c : str) {
+    switch (c) {
+      case '"':
+        Write("\\\"");
+        break;
+      case '\\':
+        Write("\\\\");
+        break;
+      case '\n':
+        Write("\\n");
+        break;
+      case '\t':
+        Write("\\t");
+        break;
+      case '\r':
+        Write("\\r");
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          Write("\\u00");
+          Put(kHexDigits[(c >> 4) & 0xf]);
+          Put(kHexDigits[c & 0xf]);
+        } else {
+          Put(c);
+        }
+        break;
+    }
+  }
+  Put('"');
+}
+
+void OutputBuffer::Flush() {
+  Drain();
+  std::fflush(file_);
+}
+
+void OutputBuffer::Drain() {
+  if (size_ == 0) return;
+  size_t written = std::fwrite(buffer_.data(), 1, size_, file_);
+  CHECK_EQ(written, size_) << "Failed to write to file: " << path_;
+  drained_ += written;
+  size_ = 0;
+}
+
+}  // namespace kaleidoscope
@@ -1,5 +1,7 @@
 #include "file.h"
 
+#include <fstream>
+#include <sstream>
 #include <utility>
 
 namespace kaleidoscope {
@@ -18,13 +20,27 @@ SourceFile::SourceFile(const std::string& path)
 #ifdef BUILD_DEBUG
   LOG_DEBUG << "Opening file: " << path << std::endl;
 #endif
-  stream_.open(path_, stream_.in);
-  CHECK(stream_.is_open()) << "Cannot open file: " << path_;
+  stream_ = std::make_unique<std::ifstream>(path_, std::ios::in);
+  CHECK(stream_->good()) << "Cannot open file: " << path_;
 
   // init load
   LoadBuffer();
 }
 
+SourceFile::SourceFile(const std::string& name, const std::string& source)
+    : path_(name),
+      stream_(std::make_unique<std::istringstream>(source)),
+      forward_(0),
+      begin_(0),
+      extent_(0),
+      forward_buffer_idx_(0),
+      start_buffer_idx_(0),
+      forward_location_(Location::Begin()),
+      start_location_(Location::Begin()),
+      is_end_(false) {
+  LoadBuffer();
+}
+
 SourceFile::SourceFile(SourceFile&& f)
     : path_(f.path_),
       stream_(std::move(f.stream_)),
@@ -67,10 +83,10 @@ SourceFile& SourceFile::operator=(SourceFile&& f) {
 void SourceFile::LoadBuffer() {
   if (!IsNextStamp(buff_timestamp_[forward_buffer_idx_],
                    buff_timestamp_[start_buffer_idx_])) {
-    stream_.read(input_buffer_[forward_buffer_idx_].data(), kBufferSize - 1);
+    stream_->read(input_buffer_[forward_buffer_idx_].data(), kBufferSize - 1);
     input_buffer_[forward_buffer_idx_][kBufferSize - 1] = kEOF;  // sentinel
-    is_end_ = stream_.eof();
-    if (is_end_) input_buffer_[forward_buffer_idx_][stream_.gcount()] = kEOF;
+    is_end_ = stream_->eof();
+    if (is_end_) input_buffer_[forward_buffer_idx_][stream_->gcount()] = kEOF;
     buff_timestamp_[forward_buffer_idx_] =
         NextStamp(buff_timestamp_[start_buffer_idx_]);
   }
@@ -90,8 +106,11 @@ void SourceFile::NextValidPos() {
   ++extent_;
   CHECK_LT(extent_, kBufferSize) << "Lexeme too long!";
 
+  // The sentinel of a full buffer: go on in the other one. A lookahead may
+  // have loaded the last block into it already, so the stream being at its
+  // end does not mean that there is nothing left.
   peek = Peek();
-  if (peek == kEOF && HasNext() && IsForwardBufferEnd()) {
+  if (peek == kEOF && IsForwardBufferEnd()) {
     forward_ = 0;
     ChangeForwardBuffer();
     LoadBuffer();
@@ -126,7 +145,12 @@ void SourceFile::Eat(int num_char) {
 }
 
 void SourceFile::Reset() {
-  stream_.seekg(0);
+  // forget the loaded blocks, otherwise the stamps left by the previous pass
+  // can mark a stale buffer as the next one
+  stream_->clear();
+  stream_->seekg(0);
+  buff_timestamp_[0] = 0;
+  buff_timestamp_[1] = 0;
   forward_ = 0;
   begin_ = 0;
   extent_ = 0;
@@ -139,10 +163,16 @@ void SourceFile::Reset() {
 }
 
 void SourceFile::CloseAndOpenOther(const std::string& path) {
-  stream_.close();
+  stream_ = std::make_unique<std::ifstream>(path, std::ios::in);
   this->path_ = path;
-  stream_.open(path, stream_.in);
-  CHECK(stream_.is_open()) << "Cannot open file: " << path;
+  CHECK(stream_->good()) << "Cannot open file: " << path;
+  this->Reset();
+}
+
+void SourceFile::CloseAndUseSource(const std::string& name,
+                                   const std::string& source) {
+  stream_ = std::make_unique<std::istringstream>(source);
+  this->path_ = name;
   this->Reset();
 }
 
@@ -6,7 +6,8 @@
 #define KALEIDOSCOPE_LEXER_FILE_H_
 
 #include <array>
-#include <fstream>
+#include <istream>
+#include <memory>
 #include <string>
 
 #include "kaleidoscope/logging.h"
@@ -22,12 +23,12 @@ class SourceFile {
   static constexpr char kNewLine = '\n';
 
  private:
-  using stream_t = std::ifstream;
+  using stream_t = std::unique_ptr<std::istream>;
   using buffer_pair_t = std::array<std::array<char, kBufferSize>, 2>;
   using Location = SourceLocation;
 
   std::string path_;                // source file path
-  stream_t stream_;                 // fstream used by this abstraction
+  stream_t stream_;                 // the file, or a string in memory
   buffer_pair_t input_buffer_;      // input buffer pair
   int forward_;                     // current char scanned
   int begin_;                       // where current lexeme begin
@@ -54,6 +55,8 @@ class SourceFile {
  public:
   SourceFile() = delete;
   SourceFile(const std::string& path);
+  /*! \brief A source in memory, \a name stands for its path */
+  SourceFile(const std::string& name, const std::string& source);
   friend void swap(SourceFile& f1, SourceFile& f2);
   SourceFile(SourceFile&& f);
   SourceFile& operator=(SourceFile&& f);
@@ -62,9 +65,7 @@ class SourceFile {
   SourceFile(const SourceFile&) = delete;
   SourceFile& operator=(const SourceFile&) = delete;
 
-  ~SourceFile() {
-    if (stream_.is_open()) stream_.close();
-  }
+  ~SourceFile() = default;
 
   /*!
    * \brief Get the Source File Path object
@@ -143,6 +144,9 @@ class SourceFile {
   void Reset();
 
   void CloseAndOpenOther(const std::string& path);
+
+  /*! \brief Go on with the source \a source in memory, see the constructor */
+  void CloseAndUseSource(const std::string& name, const std::string& source);
 };
 
 }  // namespace lexer
@@ -1,10 +1,13 @@
 #include "kaleidoscope/lexer.h"
 
+#include <cstring>
 #include <optional>
 #include <type_traits>
 #include <unordered_map>
+#include <vector>
 
 #include "file.h"
+#include "kaleidoscope/metrics.h"
 
 namespace kaleidoscope {
 namespace lexer {
@@ -97,6 +100,34 @@ enum class NumberState {
   kFloatEnd
 };
 
+/*! \brief The metrics of all lexers, labeled by token kind */
+struct LexerMetrics {
+  LexerMetrics()
+      : word_table(metrics::GetGauge(
+            "klang_lexer_word_table_entries",
+            "Words (keywords and identifiers) interned by the live lexers")) {
+    for (int i = 0; i < kNumTokenTag; ++i) {
+      metrics::Labels labels = {
+          {"kind", std::string(GetTokenTagName(static_cast<TokenTag>(i)))}};
+      tokens.push_back(
+          metrics::GetCounter("klang_lexer_tokens_total", "Tokens lexed",
+                              labels));
+      bytes.push_back(metrics::GetCounter(
+          "klang_lexer_bytes_total", "Source bytes of the tokens lexed",
+          labels));
+    }
+  }
+
+  std::vector<metrics::Counter> tokens;
+  std::vector<metrics::Counter> bytes;
+  metrics::Gauge word_table;
+};
+
+const LexerMetrics& GetLexerMetrics() {
+  static const LexerMetrics lexer_metrics;
+  return lexer_metrics;
+}
+
 }  // namespace
 
 //////////////////////// Lexer Impl Class ////////////////////////
@@ -112,20 +143,37 @@ class Lexer::Impl {
   Impl() = delete;
 
   Impl(const std::string& src_path)
-      : file_(src_path), location_(SourceLocation::Begin()) {
+      : location_(SourceLocation::Begin()), file_(src_path) {
+    RegisterKeyWords();
+    peek_ = file_.Peek();
+  }
+
+  Impl(const std::string& name, const std::string& source)
+      : location_(SourceLocation::Begin()), file_(name, source) {
     RegisterKeyWords();
     peek_ = file_.Peek();
   }
 
+  ~Impl() {
+    FlushMetrics();
+    GetLexerMetrics().word_table.Add(-static_cast<int64_t>(word_table_.size()));
+  }
+
   /*! \brief Reset Lexer's state */
   void Reset();
 
   /*! \brief Reset this Lexer to another file */
   void ResetFile(const std::string& src_path);
 
+  /*! \brief Reset this Lexer to a source in memory */
+  void ResetSource(const std::string& name, const std::string& source);
+
   /*! \brief Get the next token */
   TokenPtr NextToken();
 
+  /*! \brief Publish the token counts not published yet */
+  void FlushMetrics();
+
   /*! \brief Have we finish reading this source file */
   bool IsFinish() const;
 
@@ -147,6 +195,9 @@ class Lexer::Impl {
 
   // void SkipMultiLineComment();
 
+  /*! \brief Scan the next token, nullptr on a lexing error */
+  TokenPtr ScanToken();
+
   /*! \brief Skip all blank characters before next token */
   void SkipBlank();
 
@@ -169,7 +220,9 @@ class Lexer::Impl {
     bool no_duplicate =
         word_table_.insert({lexeme, std::make_shared<T>(std::forward<T>(word))})
             .second;
-    if (!no_duplicate) {
+    if (no_duplicate) {
+      GetLexerMetrics().word_table.Add(1);
+    } else {
       LOG_WARNING << "Find duplicated reserved word \"" << lexeme << "\""
                   << std::endl;
     }
@@ -185,10 +238,16 @@ class Lexer::Impl {
   char peek_;
   SourceFile file_;
   char lexeme_buffer_[SourceFile::kBufferSize + 1];
+  // counted per token but published in batches, see FlushMetrics
+  uint64_t pending_tokens_[kNumTokenTag] = {};
+  uint64_t pending_bytes_[kNumTokenTag] = {};
+  size_t num_pending_ = 0;
 };
 
 void Lexer::Impl::Reset() {
   location_ = SourceLocation::Begin();
+  FlushMetrics();
+  GetLexerMetrics().word_table.Add(-static_cast<int64_t>(word_table_.size()));
   word_table_.clear();
   this->RegisterKeyWords();
   file_.Reset();
@@ -201,7 +260,39 @@ void Lexer::Impl::ResetFile(const std::string& src_path) {
   this->Reset();
 }
 
+void Lexer::Impl::ResetSource(const std::string& name,
+                              const std::string& source) {
+  file_.CloseAndUseSource(name, source);
+  this->Reset();
+}
+
 TokenPtr Lexer::Impl::NextToken() {
+  constexpr size_t kFlushInterval = 1024;
+  TokenPtr token = ScanToken();
+  if (!token) return token;
+  auto tag = static_cast<size_t>(token->tag);
+  ++pending_tokens_[tag];
+  pending_bytes_[tag] += file_.GetStartLocation().pos - token->location.pos;
+  if (++num_pending_ == kFlushInterval || token->tag == TokenTag::kEOF) {
+    FlushMetrics();
+  }
+  return token;
+}
+
+void Lexer::Impl::FlushMetrics() {
+  if (num_pending_ == 0) return;
+  const LexerMetrics& lexer_metrics = GetLexerMetrics();
+  for (int i = 0; i < kNumTokenTag; ++i) {
+    if (pending_tokens_[i] == 0) continue;
+    lexer_metrics.tokens[i].Add(pending_tokens_[i]);
+    lexer_metrics.bytes[i].Add(pending_bytes_[i]);
+    pending_tokens_[i] = 0;
+    pending_bytes_[i] = 0;
+  }
+  num_pending_ = 0;
+}
+
+TokenPtr Lexer::Impl::ScanToken() {
   while (true) {
     SkipBlank();
     if (file_.StartWith("#")) {
@@ -268,6 +359,7 @@ TokenPtr Lexer::Impl::InsertId(Id id) {
   auto entry = word_table_.find(id.lexeme);
   if (entry == word_table_.end()) {
     word_table_[id.lexeme] = std::make_shared<Id>(Id(std::move(id)));
+    GetLexerMetrics().word_table.Add(1);
   }
   return word_table_[id.lexeme];
 }
@@ -325,11 +417,9 @@ TokenPtr Lexer::Impl::GetNumber() {
   std::shared_ptr<Number> ret;
 
   while (!scan_failed) {
+    // the end of the source ends a number like any other non-digit, e.g. a
+    // REPL line has no newline to end it
     peek_ = file_.Peek();
-    if (peek_ == SourceFile::kEOF) {
-      scan_failed = true;
-      break;
-    }
     if (buffer_idx >= SourceFile::kBufferSize) {
       LOG_ERROR << "[Lex Error]: int const too long";
     }
@@ -603,6 +693,12 @@ TokenPtr Lexer::Impl::GetNumber() {
 void Lexer::Impl::RegisterKeyWords() {
   ReserveWord(KwDef());
   ReserveWord(KwExtern());
+  ReserveWord(KwIf());
+  ReserveWord(KwThen());
+  ReserveWord(KwElse());
+  ReserveWord(KwFor());
+  ReserveWord(KwIn());
+  ReserveWord(KwVar());
 }
 
 //////////////////////// Lexer Functions ////////////////////////
@@ -637,18 +733,129 @@ TokenPtr Lexer::NextToken() { return pimpl_->NextToken(); }
 
 void Lexer::Reset() { pimpl_->Reset(); }
 
-void Lexer::ResetFile(const std::string& path) { pimpl_->ResetFile(path); }
+void Lexer::ResetFile(const std::string& path) {
+  // an empty lexer (e.g. one per batch worker) is opened lazily
+  if (Empty()) {
+    pimpl_ = std::make_unique<Impl>(path);
+  } else {
+    pimpl_->ResetFile(path);
+  }
+}
+
+void Lexer::ResetSource(const std::string& name, const std::string& source) {
+  if (Empty()) {
+    pimpl_ = std::make_unique<Impl>(name, source);
+  } else {
+    pimpl_->ResetSource(name, source);
+  }
+}
 
 std::ostream& operator<<(std::ostream& sm, Lexer& lexer) {
   TokenPtr token = nullptr;
   do {
     token = lexer.NextToken();
-    sm << *token << std::endl;
+    sm << *token << '\n';
   } while (token->tag != TokenTag::kEOF);
   lexer.Reset();
   return sm;
 }
 
+namespace {
+
+// Token writers below dispatch on the tag instead of the virtual
+// Token::Dump, every tag other than these is produced as a Word.
+bool IsWordTag(TokenTag tag) {
+  return tag != TokenTag::kNumber && tag != TokenTag::kEOF &&
+         tag != TokenTag::kInvalid;
+}
+
+void WriteTagName(TokenTag tag, OutputBuffer& out) {
+  auto name = GetTokenTagName(tag);
+  out.Write(name.data(), name.size());
+}
+
+// same layout as Token::Dump and its overrides
+void WriteTextToken(const Token& token, OutputBuffer& out) {
+  if (token.tag == TokenTag::kNumber) {
+    out.Write("(Value: tag=");
+    WriteTagName(token.tag, out);
+    out.Write(", value=");
+    out.WriteDouble(static_cast<const Number&>(token).value, 6);
+    out.Put(')');
+  } else if (IsWordTag(token.tag)) {
+    out.Write("(Word: tag=");
+    WriteTagName(token.tag, out);
+    out.Write(", lexeme=\"");
+    out.Write(static_cast<const Word&>(token).lexeme);
+    out.Write("\")");
+  } else {
+    out.Write("(Token: tag=");
+    WriteTagName(token.tag, out);
+    out.Put(')');
+  }
+  out.Put('\n');
+}
+
+void WriteJsonToken(const Token& token, OutputBuffer& out) {
+  out.Write("{\"tag\":\"");
+  WriteTagName(token.tag, out);
+  out.Write("\",\"line\":");
+  out.WriteInt(token.location.line);
+  out.Write(",\"col\":");
+  out.WriteInt(token.location.col);
+  out.Write(",\"offset\":");
+  out.WriteInt(token.location.pos);
+  if (token.tag == TokenTag::kNumber) {
+    out.Write(",\"value\":");
+    out.WriteDouble(static_cast<const Number&>(token).value);
+  } else if (IsWordTag(token.tag)) {
+    out.Write(",\"lexeme\":");
+    out.WriteJsonString(static_cast<const Word&>(token).lexeme);
+  }
+  out.Write("}\n");
+}
+
+void WriteBinaryToken(const Token& token, OutputBuffer& out) {
+  out.WriteRaw(static_cast<uint8_t>(token.tag));
+  out.WriteRaw(static_cast<uint32_t>(token.location.line));
+  out.WriteRaw(static_cast<uint32_t>(token.location.col));
+  out.WriteRaw(static_cast<uint32_t>(token.location.pos));
+  if (token.tag == TokenTag::kNumber) {
+    out.WriteRaw(static_cast<const Number&>(token).value);
+  } else if (IsWordTag(token.tag)) {
+    out.WriteBinaryString(static_cast<const Word&>(token).lexeme);
+  }
+}
+
+}  // namespace
+
+size_t DumpTokens(Lexer& lexer, DumpFormat format, OutputBuffer& out) {
+  void (*write_token)(const Token&, OutputBuffer&) = nullptr;
+  switch (format) {
+    case DumpFormat::kText:
+      write_token = WriteTextToken;
+      break;
+    case DumpFormat::kNDJson:
+      write_token = WriteJsonToken;
+      break;
+    case DumpFormat::kBinary:
+      out.Write("KTOK");
+      out.WriteRaw(kBinaryDumpVersion);
+      write_token = WriteBinaryToken;
+      break;
+  }
+
+  size_t num_tokens = 0;
+  TokenPtr token = nullptr;
+  do {
+    token = lexer.NextToken();
+    write_token(*token, out);
+    ++num_tokens;
+  } while (token->tag != TokenTag::kEOF);
+  lexer.Reset();
+  return num_tokens;
+}
+
 void swap(Lexer& l1, Lexer& l2) {
   using std::swap;
   swap(l1.pimpl_, l2.pimpl_);
@@ -0,0 +1,213 @@
+#include "kaleidoscope/metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+#include "kaleidoscope/logging.h"
+
+namespace kaleidoscope {
+namespace metrics {
+
+namespace {
+
+constexpr size_t kMaxMetrics = 256;
+
+struct MetricInfo {
+  std::string name;
+  std::string help;
+  MetricType type;
+  Labels labels;
+};
+
+/*!
+ * \brief The copies of every metric owned by one thread
+ *
+ * Only the owner writes them, the atomics just let TakeSnapshot read them
+ * at the same time. Gauges wrap around like unsigned counters.
+ */
+struct ThreadValues {
+  ThreadValues() {
+    for (auto& value : values) value.store(0, std::memory_order_relaxed);
+  }
+
+  void Add(uint32_t id, uint64_t n) {
+    auto& value = values[id];
+    value.store(value.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> values[kMaxMetrics];
+};
+
+struct Registry {
+  std::mutex mutex;
+  std::vector<MetricInfo> metrics;
+  std::vector<ThreadValues*> threads;
+  // what the exited threads had counted
+  uint64_t retired[kMaxMetrics] = {};
+};
+
+Registry& GetRegistry() {
+  // never destroyed, threads may exit while static destructors run
+  static Registry* registry = new Registry();
+  return *registry;
+}
+
+/*! \brief Registers the values of a thread and folds them in when it exits */
+class ThreadHandle {
+ public:
+  ~ThreadHandle() {
+    if (values_ == nullptr) return;
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (size_t i = 0; i < kMaxMetrics; ++i) {
+      registry.retired[i] += values_->values[i].load(std::memory_order_relaxed);
+    }
+    registry.threads.erase(std::find(registry.threads.begin(),
+                                     registry.threads.end(), values_));
+    delete values_;
+  }
+
+  ThreadValues& Get() {
+    if (values_ == nullptr) {
+      values_ = new ThreadValues();
+      Registry& registry = GetRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      registry.threads.push_back(values_);
+    }
+    return *values_;
+  }
+
+ private:
+  ThreadValues* values_ = nullptr;
+};
+
+thread_local ThreadHandle thread_handle;
+
+uint32_t Register(const std::string& name, const std::string& help,
+                  MetricType type, const Labels& labels) {
+  Registry& registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  for (size_t i = 0; i < registry.metrics.size(); ++i) {
+    const MetricInfo& info = registry.metrics[i];
+    if (info.name == name && info.labels == labels) {
+      CHECK(info.type == type) << "Metric " << name << " changed its type";
+      return static_cast<uint32_t>(i);
+    }
+  }
+  CHECK_LT(registry.metrics.size(), kMaxMetrics)
+      << "Too many metrics, cannot register " << name;
+  registry.metrics.push_back(MetricInfo{name, help, type, labels});
+  return static_cast<uint32_t>(registry.metrics.size() - 1);
+}
+
+const char* TypeName(MetricType type) {
+  return type == MetricType::kCounter ? "counter" : "gauge";
+}
+
+/*! \brief Write \a str quoted, escaping what JSON and Prometheus need */
+void WriteQuoted(const std::string& str, std::ostream& out) {
+  out << '"';
+  for (char c : str) {
+    switch (c) {
+      case '"':
+        out << "\\\"";
+        break;
+      case '\\':
+        out << "\\\\";
+        break;
+      case '\n':
+        out << "\\n";
+        break;
+      default:
+        out << c;
+        break;
+    }
+  }
+  out << '"';
+}
+
+}  // namespace
+
+void Counter::Add(uint64_t n) const { thread_handle.Get().Add(id_, n); }
+
+void Gauge::Add(int64_t delta) const {
+  thread_handle.Get().Add(id_, static_cast<uint64_t>(delta));
+}
+
+Counter GetCounter(const std::string& name, const std::string& help,
+                   const Labels& labels) {
+  return Counter(Register(name, help, MetricType::kCounter, labels));
+}
+
+Gauge GetGauge(const std::string& name, const std::string& help,
+               const Labels& labels) {
+  return Gauge(Register(name, help, MetricType::kGauge, labels));
+}
+
+Snapshot TakeSnapshot() {
+  Registry& registry = GetRegistry();
+  Snapshot snapshot;
+  {
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    snapshot.reserve(registry.metrics.size());
+    for (size_t i = 0; i < registry.metrics.size(); ++i) {
+      const MetricInfo& info = registry.metrics[i];
+      uint64_t sum = registry.retired[i];
+      for (const ThreadValues* values : registry.threads) {
+        sum += values->values[i].load(std::memory_order_relaxed);
+      }
+      snapshot.push_back(Sample{info.name, info.help, info.type, info.labels,
+                                static_cast<int64_t>(sum)});
+    }
+  }
+  // keep the labels of a name in registration order
+  std::stable_sort(snapshot.begin(), snapshot.end(),
+                   [](const Sample& a, const Sample& b) {
+                     return a.name < b.name;
+                   });
+  return snapshot;
+}
+
+void WriteJson(const Snapshot& snapshot, std::ostream& out) {
+  out << '[';
+  for (size_t i = 0; i < snapshot.size(); ++i) {
+    const Sample& sample = snapshot[i];
+    out << (i == 0 ? "\n" : ",\n") << "{\"name\":";
+    WriteQuoted(sample.name, out);
+    out << ",\"type\":\"" << TypeName(sample.type) << "\",\"labels\":{";
+    for (size_t j = 0; j < sample.labels.size(); ++j) {
+      if (j > 0) out << ',';
+      WriteQuoted(sample.labels[j].first, out);
+      out << ':';
+      WriteQuoted(sample.labels[j].second, out);
+    }
+    out << "},\"value\":" << sample.value << '}';
+  }
+  out << "\n]\n";
+}
+
+void WritePrometheus(const Snapshot& snapshot, std::ostream& out) {
+  for (size_t i = 0; i < snapshot.size(); ++i) {
+    const Sample& sample = snapshot[i];
+    if (i == 0 || snapshot[i - 1].name != sample.name) {
+      out << "# HELP " << sample.name << ' ' << sample.help << '\n'
+          << "# TYPE " << sample.name << ' ' << TypeName(sample.type) << '\n';
+    }
+    out << sample.name;
+    if (!sample.labels.empty()) {
+      out << '{';
+      for (size_t j = 0; j < sample.labels.size(); ++j) {
+        if (j > 0) out << ',';
+        out << sample.labels[j].first << '=';
+        WriteQuoted(sample.labels[j].second, out);
+      }
+      out << '}';
+    }
+    out << ' ' << sample.value << '\n';
+  }
+}
+
+}  // namespace metrics
+}  // namespace kaleidoscope
@@ -0,0 +1,148 @@
+#include "kaleidoscope/trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "kaleidoscope/dump.h"
+
+namespace kaleidoscope {
+namespace trace {
+
+namespace detail {
+std::atomic<bool> enabled{false};
+}  // namespace detail
+
+namespace {
+
+struct Event {
+  std::string name;
+  std::string detail;
+  int64_t start_ns;
+  int64_t end_ns;
+};
+
+/*! \brief The events of one thread, only contended while writing them */
+struct ThreadBuffer {
+  std::mutex mutex;
+  uint32_t tid = 0;
+  std::vector<Event> events;
+};
+
+struct Registry {
+  std::mutex mutex;
+  // buffers outlive their threads, so Stop sees the finished workers too
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+  std::atomic<int64_t> granularity_ns{0};
+};
+
+Registry& GetRegistry() {
+  // never destroyed, threads may record while static destructors run
+  static Registry* registry = new Registry();
+  return *registry;
+}
+
+ThreadBuffer& GetThreadBuffer() {
+  thread_local ThreadBuffer* buffer = nullptr;
+  if (buffer == nullptr) {
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.buffers.push_back(std::make_unique<ThreadBuffer>());
+    buffer = registry.buffers.back().get();
+    buffer->tid = static_cast<uint32_t>(registry.buffers.size());
+  }
+  return *buffer;
+}
+
+/*! \brief Append \a ns as microseconds with 3 decimals, the trace unit */
+void WriteMicros(OutputBuffer& out, int64_t ns) {
+  out.WriteInt(ns / 1000);
+  out.Put('.');
+  int64_t frac = ns % 1000;
+  out.Put(static_cast<char>('0' + frac / 100));
+  out.Put(static_cast<char>('0' + frac / 10 % 10));
+  out.Put(static_cast<char>('0' + frac % 10));
+}
+
+}  // namespace
+
+void Start(int64_t granularity_us) {
+  Registry& registry = GetRegistry();
+  {
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    for (auto& buffer : registry.buffers) {
+      std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+      buffer->events.clear();
+    }
+  }
+  registry.granularity_ns.store(granularity_us * 1000,
+                                std::memory_order_relaxed);
+  detail::enabled.store(true, std::memory_order_relaxed);
+}
+
+void Stop(const std::string& path) {
+  detail::enabled.store(false, std::memory_order_relaxed);
+
+  Registry& registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  // the first event is time 0 in the viewer
+  int64_t origin_ns = INT64_MAX;
+  for (auto& buffer : registry.buffers) {
+    std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+    for (const auto& event : buffer->events) {
+      origin_ns = std::min(origin_ns, event.start_ns);
+    }
+  }
+
+  OutputBuffer out(path);
+  out.Write("{\"traceEvents\":[");
+  bool first = true;
+  for (auto& buffer : registry.buffers) {
+    std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+    for (const auto& event : buffer->events) {
+      if (!first) out.Put(',');
+      out.Put('\n');
+      first = false;
+      out.Write("{\"ph\":\"X\",\"pid\":1,\"tid\":");
+      out.WriteInt(buffer->tid);
+      out.Write(",\"ts\":");
+      WriteMicros(out, event.start_ns - origin_ns);
+      out.Write(",\"dur\":");
+      WriteMicros(out, event.end_ns - event.start_ns);
+      out.Write(",\"name\":");
+      out.WriteJsonString(event.name);
+      if (!event.detail.empty()) {
+        out.Write(",\"args\":{\"detail\":");
+        out.WriteJsonString(event.detail);
+        out.Put('}');
+      }
+      out.Put('}');
+    }
+    buffer->events.clear();
+  }
+  out.Write("\n],\"displayTimeUnit\":\"ms\"}\n");
+}
+
+int64_t NowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void AddEvent(const std::string& name, const std::string& detail,
+              int64_t start_ns, int64_t end_ns) {
+  if (!IsEnabled()) return;
+  if (end_ns - start_ns <
+      GetRegistry().granularity_ns.load(std::memory_order_relaxed)) {
+    return;
+  }
+  ThreadBuffer& buffer = GetThreadBuffer();
+  std::lock_guard<std::mutex> lock(buffer.mutex);
+  buffer.events.push_back(Event{name, detail, start_ns, end_ns});
+}
+
+}  // namespace trace
+}  // namespace kaleidoscope
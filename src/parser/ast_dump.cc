@@ -0,0 +1,409 @@
+#include <cstdint>
+
+#include "kaleidoscope/ast.h"
+#include "kaleidoscope/dump.h"
+#include "kaleidoscope/parser.h"
+
+namespace kaleidoscope {
+namespace parser {
+
+namespace {
+
+// Node kinds of the binary AST dump, see dump.h for the layout.
+enum class BinaryNodeKind : uint8_t {
+  kNumber = 0,
+  kVariable,
+  kBinary,
+  kCall,
+  kPrototype,
+  kFunction,
+  kIf,
+  kFor,
+  kVar,
+};
+
+// The writers below dispatch on ASTType / ExprType instead of the virtual
+// AST::Dump, so that no node pays for a virtual call or an ostream.
+
+/////////////////////////// Text ///////////////////////////
+// same layout as AST::Dump and its overrides
+
+void WriteTextExpr(const ast::ExprAST* expr, OutputBuffer& out) {
+  switch (expr->GetExprType()) {
+    case ast::ExprType::kNumber:
+      out.WriteDouble(static_cast<const ast::NumberExprAST*>(expr)->GetValue(),
+                      6);
+      break;
+    case ast::ExprType::kVariable:
+      out.Put('%');
+      out.Write(static_cast<const ast::VariableExprAST*>(expr)->GetName());
+      break;
+    case ast::ExprType::kBinary: {
+      auto* bin = static_cast<const ast::BinaryExprAST*>(expr);
+      out.Put('(');
+      WriteTextExpr(bin->GetLHS(), out);
+      out.Write(") ");
+      out.Write(ast::BinoryOpTagName(bin->GetOpTag()));
+      out.Write(" (");
+      WriteTextExpr(bin->GetRHS(), out);
+      out.Put(')');
+      break;
+    }
+    case ast::ExprType::kCall: {
+      auto* call = static_cast<const ast::CallExprAST*>(expr);
+      out.Write(call->GetCallee());
+      out.Put('(');
+      bool first = true;
+      for (const auto& arg : call->GetArgs()) {
+        if (!first) out.Write(", ");
+        first = false;
+        WriteTextExpr(arg.get(), out);
+      }
+      out.Put(')');
+      break;
+    }
+    case ast::ExprType::kIf: {
+      auto* if_expr = static_cast<const ast::IfExprAST*>(expr);
+      out.Write("if (");
+      WriteTextExpr(if_expr->GetCond(), out);
+      out.Write(") then (");
+      WriteTextExpr(if_expr->GetThen(), out);
+      out.Write(") else (");
+      WriteTextExpr(if_expr->GetElse(), out);
+      out.Put(')');
+      break;
+    }
+    case ast::ExprType::kFor: {
+      auto* for_expr = static_cast<const ast::ForExprAST*>(expr);
+      out.Write("for %");
+      out.Write(for_expr->GetVarName());
+      out.Write(" = (");
+      WriteTextExpr(for_expr->GetStart(), out);
+      out.Write("), (");
+      WriteTextExpr(for_expr->GetCond(), out);
+      out.Put(')');
+      if (for_expr->GetStep()) {
+        out.Write(", (");
+        WriteTextExpr(for_expr->GetStep(), out);
+        out.Put(')');
+      }
+      out.Write(" in (");
+      WriteTextExpr(for_expr->GetBody(), out);
+      out.Put(')');
+      break;
+    }
+    case ast::ExprType::kVar: {
+      auto* var_expr = static_cast<const ast::VarExprAST*>(expr);
+      out.Write("var ");
+      bool first = true;
+      for (const auto& var : var_expr->GetVars()) {
+        if (!first) out.Write(", ");
+        first = false;
+        out.Put('%');
+        out.Write(var.first);
+        if (var.second) {
+          out.Write(" = (");
+          WriteTextExpr(var.second.get(), out);
+          out.Put(')');
+        }
+      }
+      out.Write(" in (");
+      WriteTextExpr(var_expr->GetBody(), out);
+      out.Put(')');
+      break;
+    }
+  }
+}
+
+void WriteTextPrototype(const ast::ProtoTypeAST* proto, OutputBuffer& out) {
+  out.Write(proto->GetName());
+  out.Put('(');
+  bool first = true;
+  for (const auto& arg : proto->GetArgs()) {
+    if (!first) out.Write(", ");
+    first = false;
+    out.Write(arg);
+  }
+  out.Write(")\n");
+}
+
+void WriteText(const ast::AST* ast_ptr, OutputBuffer& out) {
+  switch (ast_ptr->GetType()) {
+    case ast::ASTType::kExpr:
+      WriteTextExpr(static_cast<const ast::ExprAST*>(ast_ptr), out);
+      break;
+    case ast::ASTType::kPrototype:
+      WriteTextPrototype(static_cast<const ast::ProtoTypeAST*>(ast_ptr), out);
+      break;
+    case ast::ASTType::kFunction: {
+      auto* func = static_cast<const ast::FunctionAST*>(ast_ptr);
+      for (ast::FunctionAttr attr : ast::kAllFunctionAttrs) {
+        if (!func->HasAttr(attr)) continue;
+        out.Put('@');
+        out.Write(ast::FunctionAttrName(attr));
+        out.Put(' ');
+      }
+      WriteTextPrototype(func->GetProto(), out);
+      out.Write("{\n");
+      WriteTextExpr(func->GetBody(), out);
+      out.Write("\n}\n");
+      break;
+    }
+  }
+}
+
+/////////////////////////// NDJSON ///////////////////////////
+
+void WriteJsonExpr(const ast::ExprAST* expr, OutputBuffer& out) {
+  switch (expr->GetExprType()) {
+    case ast::ExprType::kNumber:
+      out.Write("{\"kind\":\"number\",\"value\":");
+      out.WriteDouble(static_cast<const ast::NumberExprAST*>(expr)->GetValue());
+      break;
+    case ast::ExprType::kVariable:
+      out.Write("{\"kind\":\"variable\",\"name\":");
+      out.WriteJsonString(
+          static_cast<const ast::VariableExprAST*>(expr)->GetName());
+      break;
+    case ast::ExprType::kBinary: {
+      auto* bin = static_cast<const ast::BinaryExprAST*>(expr);
+      out.Write("{\"kind\":\"binary\",\"op\":");
+      out.WriteJsonString(ast::BinoryOpTagName(bin->GetOpTag()));
+      out.Write(",\"lhs\":");
+      WriteJsonExpr(bin->GetLHS(), out);
+      out.Write(",\"rhs\":");
+      WriteJsonExpr(bin->GetRHS(), out);
+      break;
+    }
+    case ast::ExprType::kCall: {
+      auto* call = static_cast<const ast::CallExprAST*>(expr);
+      out.Write("{\"kind\":\"call\",\"callee\":");
+      out.WriteJsonString(call->GetCallee());
+      out.Write(",\"args\":[");
+      bool first = true;
+      for (const auto& arg : call->GetArgs()) {
+        if (!first) out.Put(',');
+        first = false;
+        WriteJsonExpr(arg.get(), out);
+      }
+      out.Put(']');
+      break;
+    }
+    case ast::ExprType::kIf: {
+      auto* if_expr = static_cast<const ast::IfExprAST*>(expr);
+      out.Write("{\"kind\":\"if\",\"cond\":");
+      WriteJsonExpr(if_expr->GetCond(), out);
+      out.Write(",\"then\":");
+      WriteJsonExpr(if_expr->GetThen(), out);
+      out.Write(",\"else\":");
+      WriteJsonExpr(if_expr->GetElse(), out);
+      break;
+    }
+    case ast::ExprType::kFor: {
+      auto* for_expr = static_cast<const ast::ForExprAST*>(expr);
+      out.Write("{\"kind\":\"for\",\"var\":");
+      out.WriteJsonString(for_expr->GetVarName());
+      out.Write(",\"start\":");
+      WriteJsonExpr(for_expr->GetStart(), out);
+      out.Write(",\"cond\":");
+      WriteJsonExpr(for_expr->GetCond(), out);
+      if (for_expr->GetStep()) {
+        out.Write(",\"step\":");
+        WriteJsonExpr(for_expr->GetStep(), out);
+      }
+      out.Write(",\"body\":");
+      WriteJsonExpr(for_expr->GetBody(), out);
+      break;
+    }
+    case ast::ExprType::kVar: {
+      auto* var_expr = static_cast<const ast::VarExprAST*>(expr);
+      out.Write("{\"kind\":\"var\",\"vars\":[");
+      bool first = true;
+      for (const auto& var : var_expr->GetVars()) {
+        if (!first) out.Put(',');
+        first = false;
+        out.Write("{\"name\":");
+        out.WriteJsonString(var.first);
+        if (var.second) {
+          out.Write(",\"init\":");
+          WriteJsonExpr(var.second.get(), out);
+        }
+        out.Put('}');
+      }
+      out.Write("],\"body\":");
+      WriteJsonExpr(var_expr->GetBody(), out);
+      break;
+    }
+  }
+  out.Put('}');
+}
+
+void WriteJsonPrototype(const ast::ProtoTypeAST* proto, OutputBuffer& out) {
+  out.Write("{\"kind\":\"prototype\",\"name\":");
+  out.WriteJsonString(proto->GetName());
+  out.Write(",\"args\":[");
+  bool first = true;
+  for (const auto& arg : proto->GetArgs()) {
+    if (!first) out.Put(',');
+    first = false;
+    out.WriteJsonString(arg);
+  }
+  out.Write("]}");
+}
+
+void WriteJson(const ast::AST* ast_ptr, OutputBuffer& out) {
+  switch (ast_ptr->GetType()) {
+    case ast::ASTType::kExpr:
+      WriteJsonExpr(static_cast<const ast::ExprAST*>(ast_ptr), out);
+      break;
+    case ast::ASTType::kPrototype:
+      WriteJsonPrototype(static_cast<const ast::ProtoTypeAST*>(ast_ptr), out);
+      break;
+    case ast::ASTType::kFunction: {
+      auto* func = static_cast<const ast::FunctionAST*>(ast_ptr);
+      out.Write("{\"kind\":\"function\",\"proto\":");
+      WriteJsonPrototype(func->GetProto(), out);
+      if (func->GetAttrs() != 0) {
+        out.Write(",\"attrs\":[");
+        bool first = true;
+        for (ast::FunctionAttr attr : ast::kAllFunctionAttrs) {
+          if (!func->HasAttr(attr)) continue;
+          if (!first) out.Put(',');
+          first = false;
+          out.WriteJsonString(ast::FunctionAttrName(attr));
+        }
+        out.Put(']');
+      }
+      out.Write(",\"body\":");
+      WriteJsonExpr(func->GetBody(), out);
+      out.Put('}');
+      break;
+    }
+  }
+  out.Put('\n');
+}
+
+/////////////////////////// Binary ///////////////////////////
+
+void WriteNodeKind(BinaryNodeKind kind, OutputBuffer& out) {
+  out.WriteRaw(static_cast<uint8_t>(kind));
+}
+
+void WriteBinaryExpr(const ast::ExprAST* expr, OutputBuffer& out) {
+  switch (expr->GetExprType()) {
+    case ast::ExprType::kNumber:
+      WriteNodeKind(BinaryNodeKind::kNumber, out);
+      out.WriteRaw(static_cast<const ast::NumberExprAST*>(expr)->GetValue());
+      break;
+    case ast::ExprType::kVariable:
+      WriteNodeKind(BinaryNodeKind::kVariable, out);
+      out.WriteBinaryString(
+          static_cast<const ast::VariableExprAST*>(expr)->GetName());
+      break;
+    case ast::ExprType::kBinary: {
+      auto* bin = static_cast<const ast::BinaryExprAST*>(expr);
+      WriteNodeKind(BinaryNodeKind::kBinary, out);
+      out.WriteRaw(static_cast<uint8_t>(bin->GetOpTag()));
+      WriteBinaryExpr(bin->GetLHS(), out);
+      WriteBinaryExpr(bin->GetRHS(), out);
+      break;
+    }
+    case ast::ExprType::kCall: {
+      auto* call = static_cast<const ast::CallExprAST*>(expr);
+      WriteNodeKind(BinaryNodeKind::kCall, out);
+      out.WriteBinaryString(call->GetCallee());
+      out.WriteRaw(static_cast<uint32_t>(call->GetArgs().size()));
+      for (const auto& arg : call->GetArgs()) {
+        WriteBinaryExpr(arg.get(), out);
+      }
+      break;
+    }
+    case ast::ExprType::kIf: {
+      auto* if_expr = static_cast<const ast::IfExprAST*>(expr);
+      WriteNodeKind(BinaryNodeKind::kIf, out);
+      WriteBinaryExpr(if_expr->GetCond(), out);
+      WriteBinaryExpr(if_expr->GetThen(), out);
+      WriteBinaryExpr(if_expr->GetElse(), out);
+      break;
+    }
+    case ast::ExprType::kFor: {
+      auto* for_expr = static_cast<const ast::ForExprAST*>(expr);
+      WriteNodeKind(BinaryNodeKind::kFor, out);
+      out.WriteBinaryString(for_expr->GetVarName());
+      out.WriteRaw(static_cast<uint8_t>(for_expr->GetStep() != nullptr));
+      WriteBinaryExpr(for_expr->GetStart(), out);
+      WriteBinaryExpr(for_expr->GetCond(), out);
+      if (for_expr->GetStep()) WriteBinaryExpr(for_expr->GetStep(), out);
+      WriteBinaryExpr(for_expr->GetBody(), out);
+      break;
+    }
+    case ast::ExprType::kVar: {
+      auto* var_expr = static_cast<const ast::VarExprAST*>(expr);
+      WriteNodeKind(BinaryNodeKind::kVar, out);
+      out.WriteRaw(static_cast<uint32_t>(var_expr->GetVars().size()));
+      for (const auto& var : var_expr->GetVars()) {
+        out.WriteBinaryString(var.first);
+        out.WriteRaw(static_cast<uint8_t>(var.second != nullptr));
+        if (var.second) WriteBinaryExpr(var.second.get(), out);
+      }
+      WriteBinaryExpr(var_expr->GetBody(), out);
+      break;
+    }
+  }
+}
+
+void WriteBinaryPrototype(const ast::ProtoTypeAST* proto, OutputBuffer& out) {
+  WriteNodeKind(BinaryNodeKind::kPrototype, out);
+  out.WriteBinaryString(proto->GetName());
+  out.WriteRaw(static_cast<uint32_t>(proto->GetArgs().size()));
+  for (const auto& arg : proto->GetArgs()) {
+    out.WriteBinaryString(arg);
+  }
+}
+
+void WriteBinary(const ast::AST* ast_ptr, OutputBuffer& out) {
+  switch (ast_ptr->GetType()) {
+    case ast::ASTType::kExpr:
+      WriteBinaryExpr(static_cast<const ast::ExprAST*>(ast_ptr), out);
+      break;
+    case ast::ASTType::kPrototype:
+      WriteBinaryPrototype(static_cast<const ast::ProtoTypeAST*>(ast_ptr),
+                           out);
+      break;
+    case ast::ASTType::kFunction: {
+      auto* func = static_cast<const ast::FunctionAST*>(ast_ptr);
+      WriteNodeKind(BinaryNodeKind::kFunction, out);
+      out.WriteRaw(func->GetAttrs());
+      WriteBinaryPrototype(func->GetProto(), out);
+      WriteBinaryExpr(func->GetBody(), out);
+      break;
+    }
+  }
+}
+
+}  // namespace
+
+void DumpASTList(const std::list<ast::AST::Ptr>& ast_list, DumpFormat format,
+                 OutputBuffer& out) {
+  void (*write_ast)(const ast::AST*, OutputBuffer&) = nullptr;
+  switch (format) {
+    case DumpFormat::kText:
+      write_ast = WriteText;
+      break;
+    case DumpFormat::kNDJson:
+      write_ast = WriteJson;
+      break;
+    case DumpFormat::kBinary:
+      out.Write("KAST");
+      out.WriteRaw(kBinaryDumpVersion);
+      write_ast = WriteBinary;
+      break;
+  }
+
+  for (const auto& ast_ptr : ast_list) {
+    write_ast(ast_ptr.get(), out);
+  }
+}
+
+}  // namespace parser
+}  // namespace kaleidoscope
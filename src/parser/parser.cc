@@ -2,8 +2,11 @@
 
 #include <mutex>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "kaleidoscope/logging.h"
+#include "kaleidoscope/metrics.h"
 
 namespace kaleidoscope {
 namespace parser {
@@ -11,6 +14,7 @@ namespace parser {
 namespace {
 
 void BinopPrecedenceInit(std::unordered_map<std::string, int>& map) {
+  map["="] = 2;
   map["<"] = 10;
   map["+"] = 20;
   map["-"] = 20;
@@ -29,6 +33,47 @@ int BinopPrecedence(const std::string& op) {
   }
 }
 
+/*! \brief Count the AST nodes created, labeled like the NDJSON dump kinds */
+void CountNode(const ast::AST& node) {
+  // indexed by ExprType, then the prototypes and the functions
+  static const char* kNodeKinds[] = {"number", "variable",  "binary",
+                                     "call",   "if",        "for",
+                                     "var",    "prototype", "function"};
+  static const std::vector<metrics::Counter> counters = [] {
+    std::vector<metrics::Counter> counters;
+    for (const char* kind : kNodeKinds) {
+      counters.push_back(metrics::GetCounter("klang_parser_ast_nodes_total",
+                                             "AST nodes created by the parser",
+                                             {{"kind", kind}}));
+    }
+    return counters;
+  }();
+  size_t index;
+  switch (node.GetType()) {
+    case ast::ASTType::kExpr:
+      index = static_cast<size_t>(
+          static_cast<const ast::ExprAST&>(node).GetExprType());
+      break;
+    case ast::ASTType::kPrototype:
+      index = 7;
+      break;
+    case ast::ASTType::kFunction:
+      index = 8;
+      break;
+    default:
+      LOG_FATAL << "Unknown AST type " << static_cast<int>(node.GetType());
+      return;
+  }
+  counters[index].Add();
+}
+
+template <typename T, typename... Args>
+std::unique_ptr<T> MakeNode(Args&&... args) {
+  auto node = std::make_unique<T>(std::forward<Args>(args)...);
+  CountNode(*node);
+  return node;
+}
+
 }  // namespace
 
 #define PARSE_ERROR_LOG(msg)                                               \
@@ -39,7 +84,39 @@ int BinopPrecedence(const std::string& op) {
                 << ", error message: " << msg << std::endl;                \
   }
 
-void Parser::NextToken() { current_token_ = lexer_.NextToken(); }
+void Parser::NextToken() {
+  alloc::PhaseScope phase(alloc::Phase::kLex);
+  if (!trace::IsEnabled()) {
+    current_token_ = lexer_.NextToken();
+    return;
+  }
+  int64_t start_ns = trace::NowNanos();
+  current_token_ = lexer_.NextToken();
+  lex_ns_ += trace::NowNanos() - start_ns;
+  ++num_lexed_;
+}
+
+int64_t Parser::BeginTraceItem() {
+  lex_ns_ = 0;
+  num_lexed_ = 0;
+  return trace::NowNanos();
+}
+
+void Parser::EndTraceItem(int64_t start_ns, const ast::AST& item) {
+  int64_t end_ns = trace::NowNanos();
+  const ast::ProtoTypeAST* proto = nullptr;
+  if (item.GetType() == ast::ASTType::kFunction) {
+    proto = static_cast<const ast::FunctionAST&>(item).GetProto();
+  } else if (item.GetType() == ast::ASTType::kPrototype) {
+    proto = static_cast<const ast::ProtoTypeAST*>(&item);
+  }
+  std::string name = proto && !proto->GetName().empty() ? proto->GetName()
+                                                         : "<expr>";
+  trace::AddEvent("Parse", name, start_ns, end_ns);
+  // the tokens were lexed on demand in between, shown as one span
+  trace::AddEvent("Lex", std::to_string(num_lexed_) + " tokens", start_ns,
+                  start_ns + lex_ns_);
+}
 
 std::optional<std::string> Parser::TryGetLexeme(TokenTag tag) const {
   if (tag != current_token_->tag) {
@@ -60,7 +137,7 @@ Parser::NumberExprASTPtr Parser::NumberExprAST() {
     PARSE_ERROR_LOG("expect a number here.");
     return nullptr;
   }
-  auto number = std::make_unique<ast::NumberExprAST>(
+  auto number = MakeNode<ast::NumberExprAST>(
       std::dynamic_pointer_cast<Number>(current_token_)->value);
   NextToken();
   return number;
@@ -84,7 +161,7 @@ Parser::ExprASTPtr Parser::ParenthesesExprAST() {
   }
 
   lexeme = TryGetLexeme(TokenTag::kPunctuator);
-  if (!lexeme || lexeme.value() == ")") {
+  if (!lexeme || lexeme.value() != ")") {
     PARSE_ERROR_LOG("expect a ')' here.");
     return nullptr;
   }
@@ -103,7 +180,7 @@ Parser::ExprASTPtr Parser::IdentifierExprAST() {
 
   auto lexeme = TryGetLexeme(TokenTag::kPunctuator);
   if (!lexeme || lexeme.value() != "(") {
-    return std::make_unique<ast::VariableExprAST>(name);
+    return MakeNode<ast::VariableExprAST>(name);
   }
 
   // parse call here
@@ -131,7 +208,132 @@ Parser::ExprASTPtr Parser::IdentifierExprAST() {
   }
 
   NextToken();  // eat ')'
-  return std::make_unique<ast::CallExprAST>(name, std::move(args));
+  return MakeNode<ast::CallExprAST>(name, std::move(args));
+}
+
+Parser::IfExprASTPtr Parser::IfExprAST() {
+  if (current_token_->tag != TokenTag::kKwIf) {
+    PARSE_ERROR_LOG("expect 'if' here.");
+    return nullptr;
+  }
+  NextToken();  // eat 'if'
+  auto cond = ExprAST();
+  if (!cond) return nullptr;
+
+  if (current_token_->tag != TokenTag::kKwThen) {
+    PARSE_ERROR_LOG("expect 'then' here.");
+    return nullptr;
+  }
+  NextToken();  // eat 'then'
+  auto then = ExprAST();
+  if (!then) return nullptr;
+
+  if (current_token_->tag != TokenTag::kKwElse) {
+    PARSE_ERROR_LOG("expect 'else' here.");
+    return nullptr;
+  }
+  NextToken();  // eat 'else'
+  auto otherwise = ExprAST();
+  if (!otherwise) return nullptr;
+
+  return MakeNode<ast::IfExprAST>(std::move(cond), std::move(then),
+                                  std::move(otherwise));
+}
+
+Parser::ForExprASTPtr Parser::ForExprAST() {
+  if (current_token_->tag != TokenTag::kKwFor) {
+    PARSE_ERROR_LOG("expect 'for' here.");
+    return nullptr;
+  }
+  NextToken();  // eat 'for'
+
+  auto var_name = TryGetLexeme(TokenTag::kIdentifier);
+  if (!var_name) {
+    PARSE_ERROR_LOG("expect a identifier after 'for'.");
+    return nullptr;
+  }
+  NextToken();  // eat identifier
+
+  auto lexeme = TryGetLexeme(TokenTag::kPunctuator);
+  if (!lexeme || lexeme.value() != "=") {
+    PARSE_ERROR_LOG("expect a '=' after the loop variable.");
+    return nullptr;
+  }
+  NextToken();  // eat '='
+  auto start = ExprAST();
+  if (!start) return nullptr;
+
+  lexeme = TryGetLexeme(TokenTag::kPunctuator);
+  if (!lexeme || lexeme.value() != ",") {
+    PARSE_ERROR_LOG("expect a ',' after the start value.");
+    return nullptr;
+  }
+  NextToken();  // eat ','
+  auto cond = ExprAST();
+  if (!cond) return nullptr;
+
+  // the step is optional
+  ExprASTPtr step = nullptr;
+  lexeme = TryGetLexeme(TokenTag::kPunctuator);
+  if (lexeme && lexeme.value() == ",") {
+    NextToken();  // eat ','
+    step = ExprAST();
+    if (!step) return nullptr;
+  }
+
+  if (current_token_->tag != TokenTag::kKwIn) {
+    PARSE_ERROR_LOG("expect 'in' here.");
+    return nullptr;
+  }
+  NextToken();  // eat 'in'
+  auto body = ExprAST();
+  if (!body) return nullptr;
+
+  return MakeNode<ast::ForExprAST>(var_name.value(), std::move(start),
+                                   std::move(cond), std::move(step),
+                                   std::move(body));
+}
+
+Parser::VarExprASTPtr Parser::VarExprAST() {
+  if (current_token_->tag != TokenTag::kKwVar) {
+    PARSE_ERROR_LOG("expect 'var' here.");
+    return nullptr;
+  }
+  NextToken();  // eat 'var'
+
+  std::vector<ast::VarExprAST::Binding> vars;
+  while (true) {
+    auto name = TryGetLexeme(TokenTag::kIdentifier);
+    if (!name) {
+      PARSE_ERROR_LOG("expect a identifier in 'var'.");
+      return nullptr;
+    }
+    NextToken();  // eat identifier
+
+    // the initializer is optional
+    ExprASTPtr init = nullptr;
+    auto lexeme = TryGetLexeme(TokenTag::kPunctuator);
+    if (lexeme && lexeme.value() == "=") {
+      NextToken();  // eat '='
+      init = ExprAST();
+      if (!init) return nullptr;
+      lexeme = TryGetLexeme(TokenTag::kPunctuator);
+    }
+    vars.emplace_back(name.value(), std::move(init));
+
+    if (!lexeme || lexeme.value() != ",") break;
+    NextToken();  // eat ','
+  }
+
+  if (current_token_->tag != TokenTag::kKwIn) {
+    PARSE_ERROR_LOG("expect 'in' here.");
+    return nullptr;
+  }
+  NextToken();  // eat 'in'
+  auto body = ExprAST();
+  if (!body) return nullptr;
+
+  return MakeNode<ast::VarExprAST>(std::move(vars), std::move(body));
 }
 
 Parser::ExprASTPtr Parser::PrimaryExprAST() {
@@ -141,6 +343,12 @@ Parser::ExprASTPtr Parser::PrimaryExprAST() {
       return IdentifierExprAST();
     case TokenTag::kNumber:
       return NumberExprAST();
+    case TokenTag::kKwIf:
+      return IfExprAST();
+    case TokenTag::kKwFor:
+      return ForExprAST();
+    case TokenTag::kKwVar:
+      return VarExprAST();
     case TokenTag::kPunctuator:
       if (lexeme && lexeme.value() == "(")
         return ParenthesesExprAST();
@@ -191,16 +399,17 @@ Parser::ExprASTPtr Parser::BinOpRHS(int expr_prec, Parser::ExprASTPtr lhs) {
     lexeme = TryGetLexeme(TokenTag::kPunctuator);
     int next_prec = (lexeme) ? BinopPrecedence(lexeme.value()) : -1;
 
-    if (next_prec > expr_prec) {
-      ExprASTPtr rhs = BinOpRHS(expr_prec + 1, std::move(rhs));
-      if (rhs) {
+    // '=' is right associative: a = b = c assigns c to b, then to a
+    bool right_assoc = binop == "=";
+    if (next_prec > tok_prec || (right_assoc && next_prec == tok_prec)) {
+      rhs = BinOpRHS(right_assoc ? tok_prec : tok_prec + 1, std::move(rhs));
+      if (!rhs) {
         return nullptr;
       }
     }
 
     // merge rhs and lhs
-    lhs = std::make_unique<ast::BinaryExprAST>(binop, std::move(lhs),
-                                               std::move(rhs));
+    lhs = MakeNode<ast::BinaryExprAST>(binop, std::move(lhs), std::move(rhs));
   }
 
   return lhs;
@@ -236,10 +445,37 @@ Parser::ProtoTypeASTPtr Parser::PrototypeAST() {
   }
 
   NextToken();  // eat ')'
-  return std::make_unique<ast::ProtoTypeAST>(fn_name, std::move(arg_names));
+  return MakeNode<ast::ProtoTypeAST>(fn_name, std::move(arg_names));
 }
 
 Parser::FunctionASTPtr Parser::FunctionAST() {
+  std::vector<ast::FunctionAttr> attrs;
+  auto lexeme = TryGetLexeme(TokenTag::kPunctuator);
+  while (lexeme && lexeme.value() == "@") {
+    NextToken();  // eat '@'
+    auto name = TryGetLexeme(TokenTag::kIdentifier);
+    if (!name) {
+      PARSE_ERROR_LOG("Expect an annotation name after '@'.");
+      return nullptr;
+    }
+    auto attr = ast::StringToFunctionAttr(name.value());
+    if (attr == ast::FunctionAttr::kNone) {
+      PARSE_ERROR_LOG("Unknown annotation '@" << name.value() << "'.");
+      return nullptr;
+    }
+    for (auto other : attrs) {
+      if (other != attr && (static_cast<uint32_t>(other) & ast::kFPModeAttrs) &&
+          (static_cast<uint32_t>(attr) & ast::kFPModeAttrs)) {
+        PARSE_ERROR_LOG("'@" << ast::FunctionAttrName(other) << "' and '@"
+                             << name.value() << "' cannot be combined.");
+        return nullptr;
+      }
+    }
+    attrs.push_back(attr);
+    NextToken();  // eat annotation name
+    lexeme = TryGetLexeme(TokenTag::kPunctuator);
+  }
+
   if (current_token_->tag != TokenTag::kKwDef) {
     PARSE_ERROR_LOG("Expect 'def' keyword here.");
     return nullptr;
@@ -249,8 +485,9 @@ Parser::FunctionASTPtr Parser::FunctionAST() {
   if (!proto) return nullptr;
 
   if (auto body = ExprAST()) {
-    return std::make_unique<ast::FunctionAST>(std::move(proto),
-                                              std::move(body));
+    auto func = MakeNode<ast::FunctionAST>(std::move(proto), std::move(body));
+    for (auto attr : attrs) func->AddAttr(attr);
+    return func;
   }
   return nullptr;
 }
@@ -268,10 +505,8 @@ Parser::ProtoTypeASTPtr Parser::ExternDeclPrototypeAST() {
 Parser::FunctionASTPtr Parser::GlobalExprAST() {
   if (auto expr = ExprAST()) {
     // make an anonymous proto
-    auto proto =
-        std::make_unique<ast::ProtoTypeAST>("", std::vector<std::string>());
-    return std::make_unique<ast::FunctionAST>(std::move(proto),
-                                              std::move(expr));
+    auto proto = MakeNode<ast::ProtoTypeAST>("", std::vector<std::string>());
+    return MakeNode<ast::FunctionAST>(std::move(proto), std::move(expr));
   }
   return nullptr;
 }
@@ -287,7 +522,7 @@ Parser::FunctionASTPtr Parser::HandleDefinition() {
 }
 
 Parser::ProtoTypeASTPtr Parser::HandleExtern() {
-  auto proto = PrototypeAST();
+  auto proto = ExternDeclPrototypeAST();
   if (!proto) {
     // skip 'extern' or other tokens for error recovery.
     NextToken();
@@ -1,35 +1,92 @@
+#include <algorithm>
+#include <chrono>
 #include <exception>
 #include <filesystem>
 #include <fstream>
+#include <iostream>
 #include <list>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "kaleidoscope/ast.h"
+#include "kaleidoscope/batch.h"
+#include "kaleidoscope/dump.h"
 #include "kaleidoscope/parser.h"
 
+// Usage:
+//   klang_parser <src> <dst> [--format=text|ndjson|binary]
+//   klang_parser --batch=<manifest|dir> <out_dir> [--jobs=N] [--format=...]
 int main(int argc, char** argv) {
   namespace fs = std::filesystem;
-  if (argc != 3) {
+  kaleidoscope::DumpFormat format = kaleidoscope::DumpFormat::kText;
+  std::string batch_input;
+  size_t num_jobs = 0;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.rfind("--format=", 0) == 0) {
+      if (!kaleidoscope::ParseDumpFormat(arg.substr(9), &format)) {
+        throw std::runtime_error("Unknown dump format: " + arg.substr(9));
+      }
+    } else if (arg.rfind("--batch=", 0) == 0) {
+      batch_input = arg.substr(8);
+    } else if (arg.rfind("--jobs=", 0) == 0) {
+      num_jobs = std::stoul(arg.substr(7));
+    } else {
+      paths.push_back(arg);
+    }
+  }
+
+  if (!batch_input.empty()) {
+    if (paths.size() != 1) {
+      throw std::runtime_error("An output directory should be given.");
+    }
+    if (num_jobs == 0) {
+      num_jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    auto items = kaleidoscope::CollectBatchItems(
+        batch_input, paths[0],
+        ".ast" + kaleidoscope::DumpFormatSuffix(format));
+
+    // one parser per worker, reopened for every file it processes
+    std::vector<kaleidoscope::parser::Parser> parsers(num_jobs);
+    auto start = std::chrono::steady_clock::now();
+    auto results = kaleidoscope::RunBatch(
+        items, num_jobs,
+        [&](size_t worker_id, const kaleidoscope::BatchItem& item) {
+          auto& parser = parsers[worker_id];
+          parser.ResetFile(item.src_path);
+          auto ast_list = parser.Parse();
+          kaleidoscope::OutputBuffer out(item.dst_path);
+          kaleidoscope::parser::DumpASTList(ast_list, format, out);
+          return ast_list.size();
+        });
+    std::chrono::duration<double> wall =
+        std::chrono::steady_clock::now() - start;
+    auto num_failed = kaleidoscope::PrintBatchReport(std::cout, items, results,
+                                                     wall.count(), "ASTs");
+    return num_failed == 0 ? 0 : 1;
+  }
+
+  if (paths.size() != 2) {
     throw std::runtime_error(
         "A source file path and a destination path should be given.");
   }
 
-  std::string src_path(argv[1]);
-  std::string dst_path(argv[2]);
+  std::string src_path(paths[0]);
+  std::string dst_path(paths[1]);
 
   kaleidoscope::parser::Parser parser(src_path);
 
   auto out_dir = fs::path(dst_path).parent_path();
-  if (!fs::exists(out_dir)) {
+  if (!out_dir.empty() && !fs::exists(out_dir)) {
     fs::create_directories(out_dir);
   }
-  std::ofstream out_sm(dst_path);
+  kaleidoscope::OutputBuffer out(dst_path);
 
   std::list<kaleidoscope::ast::AST::Ptr> ast_list = parser.Parse();
-
-  for (const auto& ast_ptr : ast_list) {
-    out_sm << (*ast_ptr);
-  }
+  kaleidoscope::parser::DumpASTList(ast_list, format, out);
 
   return 0;
 }
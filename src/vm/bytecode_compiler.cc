@@ -0,0 +1,536 @@
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "kaleidoscope/logging.h"
+#include "kaleidoscope/vm.h"
+
+namespace kaleidoscope {
+namespace vm {
+
+#define CompileError(msg)            \
+  {                                  \
+    LOG_WARNING << msg << std::endl; \
+    return false;                    \
+  }
+
+class BytecodeCompiler::Impl {
+ public:
+  bool Add(const ast::AST* ast_ptr);
+  Program Finish();
+
+ private:
+  struct Function {
+    std::string name;
+    uint32_t num_params = 0;
+    uint32_t num_registers = 0;
+    bool declared = false;  // seen in a prototype or a definition
+    bool defined = false;
+    std::vector<Instruction> code;
+    // (function, instruction) of the calls to this function
+    std::vector<std::pair<uint32_t, uint32_t>> callers;
+  };
+
+  /*! \brief Index of function \a name, creating a placeholder if needed */
+  uint32_t FunctionIndex(const std::string& name);
+
+  bool Declare(const ast::ProtoTypeAST* proto_ptr, uint32_t* idx);
+  bool Define(const ast::FunctionAST* func_ptr);
+
+  /*! \brief Emit the code of \a expr_ptr, \a reg is set to its result */
+  bool Compile(const ast::ExprAST* expr_ptr, uint16_t* reg);
+  bool AllocRegister(uint16_t* reg);
+  void Emit(OpCode op, uint16_t a, uint16_t b = 0, uint16_t c = 0);
+  void EmitWide(OpCode op, uint16_t a, uint32_t bc) {
+    Emit(op, a, static_cast<uint16_t>(bc), static_cast<uint16_t>(bc >> 16));
+  }
+  uint32_t Constant(double value);
+
+  /*! \brief Index of the next instruction of the current function */
+  uint32_t Here() const {
+    return static_cast<uint32_t>(functions_[current_].code.size());
+  }
+  /*! \brief Emit a jump to be pointed somewhere by PatchJump */
+  uint32_t EmitJump(OpCode op, uint16_t a = 0) {
+    uint32_t at = Here();
+    Emit(op, a);
+    return at;
+  }
+  /*! \brief Point the jump at \a at to \a target */
+  void PatchJump(uint32_t at, uint32_t target) {
+    Instruction& inst = functions_[current_].code[at];
+    uint32_t offset = static_cast<uint32_t>(int32_t(target) - int32_t(at));
+    inst.b = static_cast<uint16_t>(offset);
+    inst.c = static_cast<uint16_t>(offset >> 16);
+  }
+
+  std::vector<Function> functions_;
+  std::unordered_map<std::string, uint32_t> function_indices_;
+  std::vector<double> constants_;
+  std::unordered_map<uint64_t, uint32_t> constant_indices_;  // by bits
+  std::vector<uint32_t> entries_;
+  int num_anonymous_functions_ = 0;
+
+  // state of the function being compiled
+  uint32_t current_ = 0;
+  std::unordered_map<std::string, uint16_t> named_registers_;
+  uint32_t next_register_ = 0;
+};
+
+uint32_t BytecodeCompiler::Impl::FunctionIndex(const std::string& name) {
+  auto entry = function_indices_.find(name);
+  if (entry != function_indices_.end()) return entry->second;
+  uint32_t idx = static_cast<uint32_t>(functions_.size());
+  functions_.emplace_back();
+  functions_.back().name = name;
+  if (!name.empty()) function_indices_[name] = idx;
+  return idx;
+}
+
+uint32_t BytecodeCompiler::Impl::Constant(double value) {
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  auto entry = constant_indices_.find(bits);
+  if (entry != constant_indices_.end()) return entry->second;
+  constants_.push_back(value);
+  return constant_indices_[bits] = static_cast<uint32_t>(constants_.size() - 1);
+}
+
+void BytecodeCompiler::Impl::Emit(OpCode op, uint16_t a, uint16_t b,
+                                  uint16_t c) {
+  functions_[current_].code.push_back(Instruction{op, 0, a, b, c});
+}
+
+bool BytecodeCompiler::Impl::AllocRegister(uint16_t* reg) {
+  if (next_register_ >= 0x10000) CompileError("Expression too large.");
+  *reg = static_cast<uint16_t>(next_register_++);
+  functions_[current_].num_registers =
+      std::max(functions_[current_].num_registers, next_register_);
+  return true;
+}
+
+bool BytecodeCompiler::Impl::Compile(const ast::ExprAST* expr_ptr,
+                                     uint16_t* reg) {
+  switch (expr_ptr->GetExprType()) {
+    case ast::ExprType::kNumber: {
+      auto* number_ptr = static_cast<const ast::NumberExprAST*>(expr_ptr);
+      if (!AllocRegister(reg)) return false;
+      EmitWide(OpCode::kConst, *reg, Constant(number_ptr->GetValue()));
+      return true;
+    }
+
+    case ast::ExprType::kVariable: {
+      auto* var_ptr = static_cast<const ast::VariableExprAST*>(expr_ptr);
+      auto entry = named_registers_.find(var_ptr->GetName());
+      if (entry == named_registers_.end()) {
+        CompileError("Unkonwn variable name");
+      }
+      *reg = entry->second;
+      return true;
+    }
+
+    case ast::ExprType::kBinary: {
+      auto* bin_ptr = static_cast<const ast::BinaryExprAST*>(expr_ptr);
+      if (bin_ptr->GetOpTag() == ast::SupportBinaryOpTag::kAssign) {
+        // the value goes into the register of the variable
+        if (bin_ptr->GetLHS()->GetExprType() != ast::ExprType::kVariable) {
+          CompileError("destination of '=' must be a variable");
+        }
+        auto entry = named_registers_.find(
+            static_cast<const ast::VariableExprAST*>(bin_ptr->GetLHS())
+                ->GetName());
+        if (entry == named_registers_.end()) {
+          CompileError("Unkonwn variable name");
+        }
+        uint32_t mark = next_register_;
+        uint16_t value;
+        if (!Compile(bin_ptr->GetRHS(), &value)) return false;
+        next_register_ = mark;
+        if (value != entry->second) Emit(OpCode::kMove, entry->second, value);
+        *reg = entry->second;
+        return true;
+      }
+      OpCode op;
+      switch (bin_ptr->GetOpTag()) {
+        case ast::SupportBinaryOpTag::kAdd:
+          op = OpCode::kAdd;
+          break;
+        case ast::SupportBinaryOpTag::kSub:
+          op = OpCode::kSub;
+          break;
+        case ast::SupportBinaryOpTag::kMul:
+          op = OpCode::kMul;
+          break;
+        case ast::SupportBinaryOpTag::kDiv:
+          op = OpCode::kDiv;
+          break;
+        case ast::SupportBinaryOpTag::kLess:
+          op = OpCode::kLess;
+          break;
+        default:
+          CompileError("Invalid binary operator");
+      }
+      // temporaries are released in stack order, the result may reuse the
+      // register of the left operand
+      uint32_t mark = next_register_;
+      uint16_t lhs, rhs;
+      if (!Compile(bin_ptr->GetLHS(), &lhs)) return false;
+      if (lhs < mark && ast::MayAssign(bin_ptr->GetRHS(), nullptr)) {
+        // the right operand may assign the variable read on the left
+        uint16_t copy;
+        if (!AllocRegister(&copy)) return false;
+        Emit(OpCode::kMove, copy, lhs);
+        lhs = copy;
+      }
+      if (!Compile(bin_ptr->GetRHS(), &rhs)) return false;
+      next_register_ = mark;
+      if (!AllocRegister(reg)) return false;
+      Emit(op, *reg, lhs, rhs);
+      return true;
+    }
+
+    case ast::ExprType::kCall: {
+      auto* call_ptr = static_cast<const ast::CallExprAST*>(expr_ptr);
+      uint32_t callee = FunctionIndex(call_ptr->GetCallee());
+      Function& callee_func = functions_[callee];
+      if (!callee_func.declared) {
+        CompileError("Unknown function referenced");
+      }
+      if (callee_func.num_params != call_ptr->GetArgs().size()) {
+        CompileError("Incorrect # arguments passes");
+      }
+
+      // the arguments go to consecutive registers starting at the result
+      uint32_t base = next_register_;
+      for (size_t i = 0; i < call_ptr->GetArgs().size(); ++i) {
+        next_register_ = base + static_cast<uint32_t>(i);
+        uint16_t arg;
+        if (!Compile(call_ptr->GetArg(static_cast<int>(i)).get(), &arg)) {
+          return false;
+        }
+        next_register_ = base + static_cast<uint32_t>(i);
+        uint16_t slot;
+        if (!AllocRegister(&slot)) return false;
+        if (arg != slot) Emit(OpCode::kMove, slot, arg);
+      }
+      next_register_ = base;
+      if (!AllocRegister(reg)) return false;
+      next_register_ = base + 1;
+      functions_[callee].callers.emplace_back(
+          current_, static_cast<uint32_t>(functions_[current_].code.size()));
+      EmitWide(OpCode::kCall, *reg, callee);
+      return true;
+    }
+
+    case ast::ExprType::kIf: {
+      auto* if_ptr = static_cast<const ast::IfExprAST*>(expr_ptr);
+      // both branches leave their value in the register of the result
+      uint32_t mark = next_register_;
+      uint16_t cond;
+      if (!Compile(if_ptr->GetCond(), &cond)) return false;
+      next_register_ = mark;
+      if (!AllocRegister(reg)) return false;
+      uint32_t to_else = EmitJump(OpCode::kJumpIfZero, cond);
+
+      uint16_t value;
+      if (!Compile(if_ptr->GetThen(), &value)) return false;
+      if (value != *reg) Emit(OpCode::kMove, *reg, value);
+      next_register_ = mark + 1;
+      uint32_t to_end = EmitJump(OpCode::kJump);
+
+      PatchJump(to_else, Here());
+      if (!Compile(if_ptr->GetElse(), &value)) return false;
+      if (value != *reg) Emit(OpCode::kMove, *reg, value);
+      next_register_ = mark + 1;
+      PatchJump(to_end, Here());
+      return true;
+    }
+
+    case ast::ExprType::kFor: {
+      auto* for_ptr = static_cast<const ast::ForExprAST*>(expr_ptr);
+      // var = start; while (cond) { body; var += step; }, the loop variable
+      // keeps its register below the temporaries of the loop
+      uint32_t mark = next_register_;
+      uint16_t start, var;
+      if (!Compile(for_ptr->GetStart(), &start)) return false;
+      next_register_ = mark;
+      if (!AllocRegister(&var)) return false;
+      if (start != var) Emit(OpCode::kMove, var, start);
+
+      const std::string& var_name = for_ptr->GetVarName();
+      auto shadowed = named_registers_.find(var_name);
+      bool has_old = shadowed != named_registers_.end();
+      uint16_t old_reg = has_old ? shadowed->second : 0;
+      named_registers_[var_name] = var;
+      auto restore = [&]() {
+        if (has_old) {
+          named_registers_[var_name] = old_reg;
+        } else {
+          named_registers_.erase(var_name);
+        }
+      };
+
+      uint32_t head = Here();
+      uint16_t cond, body, step;
+      if (!Compile(for_ptr->GetCond(), &cond)) {
+        restore();
+        return false;
+      }
+      uint32_t to_end = EmitJump(OpCode::kJumpIfZero, cond);
+      next_register_ = mark + 1;
+      if (!Compile(for_ptr->GetBody(), &body)) {
+        restore();
+        return false;
+      }
+      next_register_ = mark + 1;
+      if (for_ptr->GetStep()) {
+        if (!Compile(for_ptr->GetStep(), &step)) {
+          restore();
+          return false;
+        }
+      } else {
+        if (!AllocRegister(&step)) {
+          restore();
+          return false;
+        }
+        EmitWide(OpCode::kConst, step, Constant(1.0));
+      }
+      Emit(OpCode::kAdd, var, var, step);
+      next_register_ = mark + 1;
+      PatchJump(EmitJump(OpCode::kJump), head);
+      PatchJump(to_end, Here());
+      restore();
+
+      // a for loop always evaluates to 0
+      next_register_ = mark;
+      if (!AllocRegister(reg)) return false;
+      EmitWide(OpCode::kConst, *reg, Constant(0.0));
+      return true;
+    }
+
+    case ast::ExprType::kVar: {
+      auto* var_ptr = static_cast<const ast::VarExprAST*>(expr_ptr);
+      // the result goes first, the variables get the registers above it
+      uint32_t mark = next_register_;
+      if (!AllocRegister(reg)) return false;
+      std::vector<std::pair<std::string, int32_t>> shadowed;
+      auto restore = [&]() {
+        // in reverse, a name may be bound twice
+        for (auto it = shadowed.rbegin(); it != shadowed.rend(); ++it) {
+          if (it->second >= 0) {
+            named_registers_[it->first] = static_cast<uint16_t>(it->second);
+          } else {
+            named_registers_.erase(it->first);
+          }
+        }
+      };
+
+      for (const auto& binding : var_ptr->GetVars()) {
+        uint32_t var_mark = next_register_;
+        uint16_t init, var;
+        if (binding.second) {
+          if (!Compile(binding.second.get(), &init)) {
+            restore();
+            return false;
+          }
+        } else {
+          if (!AllocRegister(&init)) {
+            restore();
+            return false;
+          }
+          EmitWide(OpCode::kConst, init, Constant(0.0));
+        }
+        next_register_ = var_mark;
+        if (!AllocRegister(&var)) {
+          restore();
+          return false;
+        }
+        if (init != var) Emit(OpCode::kMove, var, init);
+        auto old_reg = named_registers_.find(binding.first);
+        shadowed.emplace_back(binding.first,
+                              old_reg == named_registers_.end()
+                                  ? -1
+                                  : static_cast<int32_t>(old_reg->second));
+        named_registers_[binding.first] = var;
+      }
+
+      uint16_t body;
+      bool ok = Compile(var_ptr->GetBody(), &body);
+      restore();
+      if (!ok) return false;
+      if (body != *reg) Emit(OpCode::kMove, *reg, body);
+      next_register_ = mark + 1;
+      return true;
+    }
+  }
+  CompileError("Unknown expression type.");
+}
+
+bool BytecodeCompiler::Impl::Declare(const ast::ProtoTypeAST* proto_ptr,
+                                     uint32_t* idx) {
+  const std::string& name = proto_ptr->GetName();
+  if (name.empty()) {
+    *idx = FunctionIndex("");
+    functions_[*idx].name =
+        "__anon_expr." + std::to_string(num_anonymous_functions_++);
+  } else {
+    *idx = FunctionIndex(name);
+  }
+
+  Function& func = functions_[*idx];
+  uint32_t num_params = static_cast<uint32_t>(proto_ptr->GetArgs().size());
+  if (func.declared && func.num_params != num_params) {
+    CompileError("Function redeclared with a different # arguments.");
+  }
+  func.declared = true;
+  func.num_params = num_params;
+  return true;
+}
+
+bool BytecodeCompiler::Impl::Define(const ast::FunctionAST* func_ptr) {
+  uint32_t idx;
+  if (!Declare(func_ptr->GetProto(), &idx)) return false;
+  if (functions_[idx].defined) {
+    CompileError("Function cannot be redefined.");
+  }
+
+  current_ = idx;
+  named_registers_.clear();
+  next_register_ = 0;
+  functions_[idx].num_registers = 1;
+  const auto& args = func_ptr->GetProto()->GetArgs();
+  for (size_t i = 0; i < args.size(); ++i) {
+    uint16_t reg;
+    if (!AllocRegister(&reg)) return false;
+    named_registers_[args[i]] = reg;
+  }
+
+  uint16_t result;
+  if (!Compile(func_ptr->GetBody(), &result)) {
+    // drop the broken body, and the calls it made
+    for (auto& func : functions_) {
+      func.callers.erase(
+          std::remove_if(func.callers.begin(), func.callers.end(),
+                         [idx](const std::pair<uint32_t, uint32_t>& caller) {
+                           return caller.first == idx;
+                         }),
+          func.callers.end());
+    }
+    functions_[idx].code.clear();
+    return false;
+  }
+  Emit(OpCode::kRet, result);
+  functions_[idx].defined = true;
+  if (func_ptr->GetProto()->GetName().empty()) entries_.push_back(idx);
+  return true;
+}
+
+bool BytecodeCompiler::Impl::Add(const ast::AST* ast_ptr) {
+  switch (ast_ptr->GetType()) {
+    case ast::ASTType::kPrototype: {
+      uint32_t idx;
+      return Declare(static_cast<const ast::ProtoTypeAST*>(ast_ptr), &idx);
+    }
+    case ast::ASTType::kFunction:
+      return Define(static_cast<const ast::FunctionAST*>(ast_ptr));
+    case ast::ASTType::kExpr:
+      break;
+  }
+  CompileError("Unexpected top-level expression");
+}
+
+Program BytecodeCompiler::Impl::Finish() {
+  std::vector<NativeInfo> natives;
+  std::string strings;
+  auto add_string = [&strings](const std::string& str) {
+    uint32_t offset = static_cast<uint32_t>(strings.size());
+    strings.append(str).push_back('\0');
+    return offset;
+  };
+
+  // Functions without a body are host functions, their calls are turned
+  // into native calls. Only the defined functions are kept.
+  std::vector<uint32_t> new_indices(functions_.size(), UINT32_MAX);
+  std::vector<FunctionInfo> infos;
+  std::vector<Instruction> code;
+  uint32_t num_defined = 0;
+  for (uint32_t i = 0; i < functions_.size(); ++i) {
+    if (functions_[i].defined) new_indices[i] = num_defined++;
+  }
+  for (uint32_t i = 0; i < functions_.size(); ++i) {
+    Function& func = functions_[i];
+    if (func.defined || func.callers.empty()) continue;
+    CHECK(FindNative(func.name, func.num_params))
+        << "Undefined function " << func.name << " with " << func.num_params
+        << " parameters";
+    uint32_t native = static_cast<uint32_t>(natives.size());
+    natives.push_back(NativeInfo{add_string(func.name), func.num_params});
+    for (const auto& caller : func.callers) {
+      Instruction& inst = functions_[caller.first].code[caller.second];
+      inst.op = OpCode::kCallNative;
+      inst.b = static_cast<uint16_t>(native);
+      inst.c = static_cast<uint16_t>(native >> 16);
+    }
+  }
+  for (uint32_t i = 0; i < functions_.size(); ++i) {
+    Function& func = functions_[i];
+    if (!func.defined) continue;
+    for (auto& inst : func.code) {
+      if (inst.op == OpCode::kCall) {
+        uint32_t callee = new_indices[inst.bc()];
+        inst.b = static_cast<uint16_t>(callee);
+        inst.c = static_cast<uint16_t>(callee >> 16);
+      }
+    }
+    FunctionInfo info{};
+    info.name = add_string(func.name);
+    info.num_params = func.num_params;
+    info.num_registers = func.num_registers;
+    info.code_begin = static_cast<uint32_t>(code.size());
+    info.code_size = static_cast<uint32_t>(func.code.size());
+    infos.push_back(info);
+    code.insert(code.end(), func.code.begin(), func.code.end());
+  }
+  std::vector<uint32_t> entries;
+  for (uint32_t idx : entries_) entries.push_back(new_indices[idx]);
+  if (strings.empty()) strings.push_back('\0');
+
+  FileHeader header{};
+  std::memcpy(header.magic, kBytecodeMagic, sizeof(header.magic));
+  header.version = kBytecodeVersion;
+  header.num_constants = static_cast<uint32_t>(constants_.size());
+  header.num_instructions = static_cast<uint32_t>(code.size());
+  header.num_functions = static_cast<uint32_t>(infos.size());
+  header.num_natives = static_cast<uint32_t>(natives.size());
+  header.num_entries = static_cast<uint32_t>(entries.size());
+  header.strings_size = static_cast<uint32_t>(strings.size());
+
+  std::string image;
+  auto append = [&image](const void* data, size_t size) {
+    image.append(static_cast<const char*>(data), size);
+  };
+  append(&header, sizeof(header));
+  append(constants_.data(), constants_.size() * sizeof(double));
+  append(code.data(), code.size() * sizeof(Instruction));
+  append(infos.data(), infos.size() * sizeof(FunctionInfo));
+  append(natives.data(), natives.size() * sizeof(NativeInfo));
+  append(entries.data(), entries.size() * sizeof(uint32_t));
+  append(strings.data(), strings.size());
+  return Program::FromImage(std::move(image));
+}
+
+BytecodeCompiler::BytecodeCompiler() : pimpl_(std::make_unique<Impl>()) {}
+
+BytecodeCompiler::~BytecodeCompiler() = default;
+
+bool BytecodeCompiler::Add(const ast::AST* ast_ptr) {
+  return pimpl_->Add(ast_ptr);
+}
+
+Program BytecodeCompiler::Finish() { return pimpl_->Finish(); }
+
+}  // namespace vm
+}  // namespace kaleidoscope
@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <utility>
+
+#include "kaleidoscope/logging.h"
+#include "kaleidoscope/vm.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif  // _WIN32
+
+namespace kaleidoscope {
+namespace vm {
+
+namespace {
+
+/*! \brief Check that the operands of every instruction stay in range */
+void ValidateFunction(const Program& program, uint32_t idx) {
+  const FileHeader& header = program.Header();
+  const FunctionInfo& func = program.Functions()[idx];
+  const char* name = program.Name(func.name);
+  CHECK(func.code_size > 0 &&
+        uint64_t(func.code_begin) + func.code_size <= header.num_instructions)
+      << "Bad code range of function " << name;
+  CHECK(func.num_registers >= std::max<uint32_t>(1, func.num_params) &&
+        func.num_registers <= 0x10000)
+      << "Bad register count of function " << name;
+
+  auto check_call = [&](uint32_t base, uint32_t num_params) {
+    CHECK_LE(uint64_t(base) + std::max<uint32_t>(1, num_params),
+             func.num_registers)
+        << "Call arguments out of the registers of function " << name;
+  };
+
+  const Instruction* code = program.Code() + func.code_begin;
+  for (uint32_t i = 0; i < func.code_size; ++i) {
+    const Instruction& inst = code[i];
+    switch (inst.op) {
+      case OpCode::kConst:
+        CHECK_LT(inst.bc(), header.num_constants) << "Bad constant index";
+        break;
+      case OpCode::kAdd:
+      case OpCode::kSub:
+      case OpCode::kMul:
+      case OpCode::kDiv:
+      case OpCode::kLess:
+        CHECK_LT(inst.c, func.num_registers) << "Bad register in " << name;
+        // fall through
+      case OpCode::kMove:
+        CHECK_LT(inst.b, func.num_registers) << "Bad register in " << name;
+        break;
+      case OpCode::kCall:
+        CHECK_LT(inst.bc(), header.num_functions) << "Bad function index";
+        check_call(inst.a, program.Functions()[inst.bc()].num_params);
+        break;
+      case OpCode::kCallNative:
+        CHECK_LT(inst.bc(), header.num_natives) << "Bad native index";
+        check_call(inst.a, program.Natives()[inst.bc()].num_params);
+        break;
+      case OpCode::kRet:
+        break;
+      case OpCode::kJump:
+      case OpCode::kJumpIfZero: {
+        int64_t target = int64_t(i) + static_cast<int32_t>(inst.bc());
+        CHECK(target >= 0 && target < func.code_size)
+            << "Jump out of function " << name;
+        break;
+      }
+      default:
+        LOG_FATAL << "Bad opcode " << static_cast<int>(inst.op) << " in "
+                  << name;
+    }
+    CHECK_LT(inst.a, func.num_registers) << "Bad register in " << name;
+  }
+  // the interpreter never checks for the end of the code
+  CHECK(code[func.code_size - 1].op == OpCode::kRet)
+      << "Function " << name << " does not end with a return";
+}
+
+}  // namespace
+
+Program Program::FromImage(std::string image) {
+  auto holder = std::make_shared<std::string>(std::move(image));
+  Program program;
+  program.Attach(std::shared_ptr<const char>(holder, holder->data()),
+                 holder->size());
+  return program;
+}
+
+Program Program::MapFile(const std::string& path) {
+#ifdef _WIN32
+  std::ifstream fin(path, std::ios::binary);
+  CHECK(fin.is_open()) << "Cannot open file: " << path;
+  std::string image((std::istreambuf_iterator<char>(fin)),
+                    std::istreambuf_iterator<char>());
+  return FromImage(std::move(image));
+#else   // _WIN32
+  int fd = open(path.c_str(), O_RDONLY);
+  CHECK(fd >= 0) << "Cannot open file: " << path;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    LOG_FATAL << "Cannot map empty file: " << path;
+  }
+  size_t size = static_cast<size_t>(st.st_size);
+  void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  CHECK(addr != MAP_FAILED) << "Cannot map file: " << path;
+
+  Program program;
+  program.Attach(std::shared_ptr<const char>(
+                     static_cast<const char*>(addr),
+                     [size](const char* p) {
+                       munmap(const_cast<char*>(p), size);
+                     }),
+                 size);
+  return program;
+#endif  // _WIN32
+}
+
+void Program::Save(const std::string& path) const {
+  std::ofstream fout(path, std::ios::binary | std::ios::trunc);
+  CHECK(fout.is_open()) << "Cannot open file: " << path;
+  fout.write(data_.get(), static_cast<std::streamsize>(size_));
+  CHECK(fout.good()) << "Failed to write " << path;
+}
+
+int64_t Program::FindFunction(const std::string& name) const {
+  for (uint32_t i = 0; i < header_->num_functions; ++i) {
+    if (name == Name(functions_[i].name)) return i;
+  }
+  return -1;
+}
+
+void Program::Attach(std::shared_ptr<const char> data, size_t size) {
+  CHECK_GE(size, sizeof(FileHeader)) << "Truncated bytecode";
+  CHECK_EQ(reinterpret_cast<uintptr_t>(data.get()) % alignof(double), 0)
+      << "Misaligned bytecode image";
+  const auto* header = reinterpret_cast<const FileHeader*>(data.get());
+  CHECK(std::memcmp(header->magic, kBytecodeMagic, 4) == 0)
+      << "Not a bytecode file";
+  CHECK_EQ(header->version, kBytecodeVersion) << "Unsupported version";
+
+  // every section follows the previous one, see vm.h
+  uint64_t offsets[7];
+  offsets[0] = sizeof(FileHeader);
+  offsets[1] = offsets[0] + uint64_t(header->num_constants) * sizeof(double);
+  offsets[2] =
+      offsets[1] + uint64_t(header->num_instructions) * sizeof(Instruction);
+  offsets[3] =
+      offsets[2] + uint64_t(header->num_functions) * sizeof(FunctionInfo);
+  offsets[4] = offsets[3] + uint64_t(header->num_natives) * sizeof(NativeInfo);
+  offsets[5] = offsets[4] + uint64_t(header->num_entries) * sizeof(uint32_t);
+  offsets[6] = offsets[5] + header->strings_size;
+  CHECK_EQ(offsets[6], size) << "Truncated bytecode";
+
+  const char* base = data.get();
+  header_ = header;
+  constants_ = reinterpret_cast<const double*>(base + offsets[0]);
+  code_ = reinterpret_cast<const Instruction*>(base + offsets[1]);
+  functions_ = reinterpret_cast<const FunctionInfo*>(base + offsets[2]);
+  natives_ = reinterpret_cast<const NativeInfo*>(base + offsets[3]);
+  entries_ = reinterpret_cast<const uint32_t*>(base + offsets[4]);
+  strings_ = base + offsets[5];
+  data_ = std::move(data);
+  size_ = size;
+
+  CHECK(header->strings_size > 0 && strings_[header->strings_size - 1] == 0)
+      << "Bad string table";
+  for (uint32_t i = 0; i < header->num_natives; ++i) {
+    CHECK_LT(natives_[i].name, header->strings_size) << "Bad native name";
+  }
+  for (uint32_t i = 0; i < header->num_functions; ++i) {
+    CHECK_LT(functions_[i].name, header->strings_size) << "Bad function name";
+  }
+  for (uint32_t i = 0; i < header->num_functions; ++i) {
+    ValidateFunction(*this, i);
+  }
+  for (uint32_t i = 0; i < header->num_entries; ++i) {
+    CHECK(entries_[i] < header->num_functions &&
+          functions_[entries_[i]].num_params == 0)
+        << "Bad entry function";
+  }
+}
+
+}  // namespace vm
+}  // namespace kaleidoscope
@@ -0,0 +1,218 @@
+#include "kaleidoscope/vm.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "kaleidoscope/logging.h"
+
+// Threaded dispatch through a table of label addresses, a GNU extension.
+// Define KALEIDOSCOPE_VM_COMPUTED_GOTO=0 to get the portable switch loop.
+#ifndef KALEIDOSCOPE_VM_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define KALEIDOSCOPE_VM_COMPUTED_GOTO 1
+#else
+#define KALEIDOSCOPE_VM_COMPUTED_GOTO 0
+#endif
+#endif  // KALEIDOSCOPE_VM_COMPUTED_GOTO
+
+namespace kaleidoscope {
+namespace vm {
+
+namespace {
+
+struct Native {
+  const char* name;
+  uint32_t num_params;
+  NativeFunction function;
+};
+
+#define UNARY_NATIVE(fn) \
+  { #fn, 1, [](const double* args) { return std::fn(args[0]); } }
+#define BINARY_NATIVE(fn) \
+  { #fn, 2, [](const double* args) { return std::fn(args[0], args[1]); } }
+
+const Native kNatives[] = {
+    UNARY_NATIVE(sin),    UNARY_NATIVE(cos),   UNARY_NATIVE(tan),
+    UNARY_NATIVE(asin),   UNARY_NATIVE(acos),  UNARY_NATIVE(atan),
+    UNARY_NATIVE(sinh),   UNARY_NATIVE(cosh),  UNARY_NATIVE(tanh),
+    UNARY_NATIVE(exp),    UNARY_NATIVE(log),   UNARY_NATIVE(log10),
+    UNARY_NATIVE(log2),   UNARY_NATIVE(sqrt),  UNARY_NATIVE(fabs),
+    UNARY_NATIVE(floor),  UNARY_NATIVE(ceil),  UNARY_NATIVE(round),
+    UNARY_NATIVE(trunc),  BINARY_NATIVE(pow),  BINARY_NATIVE(atan2),
+    BINARY_NATIVE(fmod),  BINARY_NATIVE(fmin), BINARY_NATIVE(fmax),
+    BINARY_NATIVE(hypot),
+    // the math builtins of the JIT without a C function of their name
+    {"min", 2, [](const double* args) { return std::fmin(args[0], args[1]); }},
+    {"max", 2, [](const double* args) { return std::fmax(args[0], args[1]); }},
+    {"fma", 3,
+     [](const double* args) { return std::fma(args[0], args[1], args[2]); }},
+    {"putchard", 1,
+     [](const double* args) {
+       std::fputc(static_cast<char>(args[0]), stderr);
+       return 0.0;
+     }},
+    {"printd", 1,
+     [](const double* args) {
+       std::fprintf(stderr, "%f\n", args[0]);
+       return 0.0;
+     }},
+};
+
+#undef UNARY_NATIVE
+#undef BINARY_NATIVE
+
+}  // namespace
+
+NativeFunction FindNative(const std::string& name, uint32_t num_params) {
+  for (const auto& native : kNatives) {
+    if (native.num_params == num_params && name == native.name) {
+      return native.function;
+    }
+  }
+  return nullptr;
+}
+
+VM::VM(const Program& program, size_t stack_size)
+    : program_(program), stack_(stack_size) {
+  for (uint32_t i = 0; i < program_.Header().num_natives; ++i) {
+    const NativeInfo& info = program_.Natives()[i];
+    NativeFunction native =
+        FindNative(program_.Name(info.name), info.num_params);
+    CHECK(native) << "Unknown native function " << program_.Name(info.name);
+    natives_.push_back(native);
+  }
+  frames_.reserve(1024);
+}
+
+double VM::Call(uint32_t function_idx, const double* args) {
+  CHECK_LT(function_idx, program_.Header().num_functions)
+      << "Bad function index";
+  const FunctionInfo* functions = program_.Functions();
+  const Instruction* code = program_.Code();
+  const double* constants = program_.Constants();
+  const NativeFunction* natives = natives_.data();
+  const double* stack_end = stack_.data() + stack_.size();
+  const FunctionInfo& entry = functions[function_idx];
+  CHECK_LE(entry.num_registers, stack_.size()) << "Stack overflow";
+
+  double* regs = stack_.data();
+  std::copy_n(args, entry.num_params, regs);
+  const Instruction* pc = code + entry.code_begin;
+  frames_.clear();
+
+#if KALEIDOSCOPE_VM_COMPUTED_GOTO
+  // in the order of OpCode
+  static const void* kDispatch[] = {
+      &&op_kConst, &&op_kMove, &&op_kAdd,  &&op_kSub,        &&op_kMul,
+      &&op_kDiv,   &&op_kLess, &&op_kCall, &&op_kCallNative, &&op_kRet,
+      &&op_kJump,  &&op_kJumpIfZero,
+  };
+  static_assert(sizeof(kDispatch) / sizeof(kDispatch[0]) ==
+                    static_cast<size_t>(OpCode::kNumOpCode),
+                "kDispatch must cover every opcode");
+#define VM_CASE(op) op_##op:
+#define VM_NEXT() goto* kDispatch[static_cast<uint8_t>(pc->op)]
+  VM_NEXT();
+#else   // KALEIDOSCOPE_VM_COMPUTED_GOTO
+#define VM_CASE(op) case OpCode::op:
+#define VM_NEXT() continue
+  while (true) {
+    switch (pc->op) {
+#endif  // KALEIDOSCOPE_VM_COMPUTED_GOTO
+
+  VM_CASE(kConst) {
+    regs[pc->a] = constants[pc->bc()];
+    ++pc;
+    VM_NEXT();
+  }
+  VM_CASE(kMove) {
+    regs[pc->a] = regs[pc->b];
+    ++pc;
+    VM_NEXT();
+  }
+  VM_CASE(kAdd) {
+    regs[pc->a] = regs[pc->b] + regs[pc->c];
+    ++pc;
+    VM_NEXT();
+  }
+  VM_CASE(kSub) {
+    regs[pc->a] = regs[pc->b] - regs[pc->c];
+    ++pc;
+    VM_NEXT();
+  }
+  VM_CASE(kMul) {
+    regs[pc->a] = regs[pc->b] * regs[pc->c];
+    ++pc;
+    VM_NEXT();
+  }
+  VM_CASE(kDiv) {
+    regs[pc->a] = regs[pc->b] / regs[pc->c];
+    ++pc;
+    VM_NEXT();
+  }
+  VM_CASE(kLess) {
+    // unordered like the LLVM backend's fcmp ult, NaN on either side is true
+    regs[pc->a] = !(regs[pc->b] >= regs[pc->c]) ? 1.0 : 0.0;
+    ++pc;
+    VM_NEXT();
+  }
+  VM_CASE(kCall) {
+    const FunctionInfo& callee = functions[pc->bc()];
+    double* callee_regs = regs + pc->a;
+    // a call without arguments may share the window of its caller, so the
+    // frames are bounded as well
+    if (callee_regs + callee.num_registers > stack_end ||
+        frames_.size() >= stack_.size()) {
+      LOG_FATAL << "Stack overflow in " << program_.Name(callee.name);
+    }
+    frames_.push_back(Frame{pc + 1, regs});
+    regs = callee_regs;
+    pc = code + callee.code_begin;
+    VM_NEXT();
+  }
+  VM_CASE(kCallNative) {
+    regs[pc->a] = natives[pc->bc()](regs + pc->a);
+    ++pc;
+    VM_NEXT();
+  }
+  VM_CASE(kRet) {
+    double result = regs[pc->a];
+    if (frames_.empty()) return result;
+    regs[0] = result;
+    pc = frames_.back().return_pc;
+    regs = frames_.back().registers;
+    frames_.pop_back();
+    VM_NEXT();
+  }
+  VM_CASE(kJump) {
+    pc += static_cast<int32_t>(pc->bc());
+    VM_NEXT();
+  }
+  VM_CASE(kJumpIfZero) {
+    // like the LLVM backend, NaN is false
+    double cond = regs[pc->a];
+    pc += cond < 0.0 || cond > 0.0 ? 1 : static_cast<int32_t>(pc->bc());
+    VM_NEXT();
+  }
+
+#if !KALEIDOSCOPE_VM_COMPUTED_GOTO
+      default:
+        LOG_FATAL << "Bad opcode " << static_cast<int>(pc->op);
+    }
+  }
+#endif  // !KALEIDOSCOPE_VM_COMPUTED_GOTO
+#undef VM_CASE
+#undef VM_NEXT
+  return 0;
+}
+
+void VM::RunEntries(std::vector<double>* results) {
+  for (uint32_t i = 0; i < program_.Header().num_entries; ++i) {
+    results->push_back(Call(program_.Entries()[i], nullptr));
+  }
+}
+
+}  // namespace vm
+}  // namespace kaleidoscope
@@ -0,0 +1,55 @@
+#include <exception>
+#include <iostream>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "kaleidoscope/parser.h"
+#include "kaleidoscope/vm.h"
+
+// Usage:
+//   klang_vm <src> [--emit=<bytecode file>]   compile, then run or save
+//   klang_vm --load=<bytecode file>           map and run a saved program
+// Runs every top-level expression and prints its value.
+int main(int argc, char** argv) {
+  std::string src_path, emit_path, load_path;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 7, "--emit=") == 0) {
+      emit_path = arg.substr(7);
+    } else if (arg.compare(0, 7, "--load=") == 0) {
+      load_path = arg.substr(7);
+    } else {
+      src_path = arg;
+    }
+  }
+  if (src_path.empty() == load_path.empty()) {
+    throw std::runtime_error(
+        "Either a source file or a bytecode file should be given.");
+  }
+
+  kaleidoscope::vm::Program program;
+  int num_errors = 0;
+  if (!load_path.empty()) {
+    program = kaleidoscope::vm::Program::MapFile(load_path);
+  } else {
+    kaleidoscope::parser::Parser parser(src_path);
+    kaleidoscope::vm::BytecodeCompiler compiler;
+    for (const auto& ast_ptr : parser.Parse()) {
+      if (!compiler.Add(ast_ptr.get())) ++num_errors;
+    }
+    program = compiler.Finish();
+    if (!emit_path.empty()) {
+      program.Save(emit_path);
+      return num_errors == 0 ? 0 : 1;
+    }
+  }
+
+  kaleidoscope::vm::VM vm(program);
+  std::vector<double> results;
+  vm.RunEntries(&results);
+  for (double result : results) {
+    std::cout << result << '\n';
+  }
+  return num_errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,976 @@
+import os
+import argparse
+import ctypes
+import json
+import random
+import re
+import shutil
+import sys
+import tempfile
+import time
+from subprocess import DEVNULL, PIPE, Popen, run
+
+_DUMP_FORMATS = ["text", "ndjson", "binary"]
+
+
+def gen_source(path: str, size_mb: float, seed: int = 0) -> None:
+    """Generate a synthetic kaleidoscope source file of about size_mb MB."""
+    rng = random.Random(seed)
+    target = int(size_mb * 1024 * 1024)
+    written = 0
+    idx = 0
+    with open(path, "w") as f:
+        while written < target:
+            callee = f"f{rng.randrange(idx)}" if idx > 0 else "g"
+            line = (f"def f{idx}(a b) {callee}(a, b) * "
+                    f"g(b, {rng.random():.6f})\n"
+                    f"f{idx}({rng.randrange(1000)}, 0x{rng.randrange(4096):x})"
+                    f" # expr {idx}\n")
+            f.write(line)
+            written += len(line)
+            idx += 1
+
+
+def timeit(cmd, repeat: int, quiet: bool = False) -> float:
+    """Run cmd repeat times and return the best wall time in seconds."""
+    best = float("inf")
+    for _ in range(repeat):
+        start = time.perf_counter()
+        run(cmd, check=True, stdout=DEVNULL if quiet else None)
+        best = min(best, time.perf_counter() - start)
+    return best
+
+
+def bench_dump(args) -> None:
+    lexer_bin = os.path.join(args.build_dir, "src", "lexer", "klang_lexer")
+    parser_bin = os.path.join(args.build_dir, "src", "parser", "klang_parser")
+    with tempfile.TemporaryDirectory() as tmp:
+        src = os.path.join(tmp, "bench.k")
+        gen_source(src, args.size_mb)
+        src_mb = os.path.getsize(src) / 1024 / 1024
+        print(f"source: {src_mb:.1f} MB, best of {args.repeat} runs")
+        print(f"{'tool':<14}{'format':<8}{'time(s)':>10}"
+              f"{'src MB/s':>10}{'out MB':>10}")
+        for tool, exe in [("klang_lexer", lexer_bin),
+                          ("klang_parser", parser_bin)]:
+            for fmt in _DUMP_FORMATS:
+                dst = os.path.join(tmp, f"out.{fmt}")
+                seconds = timeit([exe, src, dst, f"--format={fmt}"],
+                                 args.repeat)
+                out_mb = os.path.getsize(dst) / 1024 / 1024
+                print(f"{tool:<14}{fmt:<8}{seconds:>10.3f}"
+                      f"{src_mb / seconds:>10.1f}{out_mb:>10.1f}")
+
+
+def bench_batch(args) -> None:
+    lexer_bin = os.path.join(args.build_dir, "src", "lexer", "klang_lexer")
+    parser_bin = os.path.join(args.build_dir, "src", "parser", "klang_parser")
+    with tempfile.TemporaryDirectory() as tmp:
+        src_dir = os.path.join(tmp, "src")
+        os.makedirs(src_dir)
+        srcs = []
+        for i in range(args.num_files):
+            src = os.path.join(src_dir, f"f{i}.k")
+            gen_source(src, args.file_kb / 1024, seed=i)
+            srcs.append(src)
+        print(f"{args.num_files} files of {args.file_kb} KB, "
+              f"best of {args.repeat} runs")
+        print(f"{'tool':<14}{'mode':<22}{'time(s)':>10}{'files/s':>10}")
+        for tool, exe in [("klang_lexer", lexer_bin),
+                          ("klang_parser", parser_bin)]:
+            out_dir = os.path.join(tmp, "out")
+
+            def spawn_each():
+                for i, src in enumerate(srcs):
+                    run([exe, src, os.path.join(out_dir, f"f{i}.out")],
+                        check=True)
+
+            best = float("inf")
+            for _ in range(args.repeat):
+                start = time.perf_counter()
+                spawn_each()
+                best = min(best, time.perf_counter() - start)
+            print(f"{tool:<14}{'process per file':<22}{best:>10.3f}"
+                  f"{args.num_files / best:>10.1f}")
+            for jobs in args.jobs:
+                seconds = timeit([exe, f"--batch={src_dir}", out_dir,
+                                  f"--jobs={jobs}"], args.repeat,
+                                 quiet=True)
+                print(f"{tool:<14}{f'batch --jobs={jobs}':<22}"
+                      f"{seconds:>10.3f}{args.num_files / seconds:>10.1f}")
+
+
+def gen_library(path: str, num_funcs: int, num_used: int) -> None:
+    """Generate num_funcs functions of which the expressions call num_used."""
+    with open(path, "w") as f:
+        f.write("def f0(a b) a * b + 1\n")
+        for idx in range(1, num_funcs):
+            f.write(f"def f{idx}(a b) f{idx - 1}(a + {idx}, b) * "
+                    f"(a - b) / (b + {idx})\n")
+        for idx in range(num_used):
+            f.write(f"f{idx}({idx}, 2)\n")
+
+
+def gen_mixed(path: str, depth: int, num_cold: int) -> None:
+    """Generate a hot call tree of 2**depth leaf calls and cold functions."""
+    with open(path, "w") as f:
+        f.write("def h0(x) x * 0.999 + 1\n")
+        for k in range(1, depth + 1):
+            f.write(f"def h{k}(x) h{k - 1}(h{k - 1}(x))\n")
+        for k in range(num_cold):
+            f.write(f"def c{k}(x y) (x + {k}) * (y - {k}) / (x * y + 1)\n")
+            f.write(f"c{k}({k}, 2)\n")
+        f.write(f"h{depth}(1)\nh{depth}(2)\n")
+
+
+def gen_kernels(path: str, num_funcs: int) -> None:
+    """Generate a chain of loop kernels with local variables, each calling
+    the previous one."""
+    with open(path, "w") as f:
+        f.write("def k0(a b c d) a * b - c * d\n")
+        for i in range(1, num_funcs):
+            f.write(f"def k{i}(a b c d) var s = a, t = b * {i} in "
+                    f"(for j = 0, j < c in s = s + t * j - "
+                    f"k{i - 1}(d, s, 1, j)) + "
+                    f"(if s < d then s * t else s / (t + {i})) + d\n")
+
+
+def gen_redundant(path: str, depth: int) -> None:
+    """Generate 2**depth calls of which all but depth are common subexprs."""
+    with open(path, "w") as f:
+        f.write("extern sqrt(x)\ndef g0(x) sqrt(x * 1.0001 + 0.5)\n")
+        for k in range(1, depth + 1):
+            f.write(f"def g{k}(x) g{k - 1}(x) + g{k - 1}(x) * 0.5\n")
+        f.write(f"g{depth}(1)\ng{depth}(2)\n")
+
+
+def gen_overlapping(path: str, depth: int, memo: bool) -> None:
+    """Generate 2**depth calls on depth * (depth + 1) / 2 distinct args."""
+    prefix = "@memo " if memo else ""
+    with open(path, "w") as f:
+        f.write("def g0(x) x * 0.5 + 1\n")
+        for k in range(1, depth + 1):
+            f.write(f"{prefix}def g{k}(x) g{k - 1}(x) + "
+                    f"g{k - 1}(x + 1) * 0.5\n")
+        f.write(f"g{depth}(1)\ng{depth}(2)\n")
+
+
+def gen_fib(path: str, n: int, memo: bool) -> None:
+    """Generate the integer recursion fib(n), on n + 1 distinct args."""
+    prefix = "@memo " if memo else ""
+    with open(path, "w") as f:
+        f.write(f"{prefix}def fib(n) if n < 2 then n "
+                "else fib(n - 1) + fib(n - 2)\n"
+                f"fib({n})\n")
+
+
+def gen_collisions(path: str, n: int, memo: bool) -> None:
+    """Generate two passes over the integer args 0 to n - 1, many more than
+    the cache holds, so that the second pass hits on colliding entries."""
+    prefix = "@memo " if memo else ""
+    with open(path, "w") as f:
+        f.write(f"{prefix}def h(x) x * 3 + 1\n"
+                "def sum(n) var s = 0 in (for i = 0, i < n in "
+                "s = s + h(i)) + s\n"
+                f"sum({n})\nsum({n})\n")
+
+
+def gen_redefined(path: str, memo: bool) -> None:
+    """Generate a call of g before and after its callee f is redefined."""
+    prefix = "@memo " if memo else ""
+    with open(path, "w") as f:
+        f.write(f"def f(x) x + 1\n{prefix}def g(x) f(x)\ng(1)\n"
+                "def f(x) x + 100\ng(1)\n")
+
+
+def gen_loop(path: str, style: str, depth: int, reps: int) -> None:
+    """Generate reps runs of depth side-effecting calls, as a for loop or
+    as tail or non-tail recursion."""
+    work = {
+        "for": "def work(i n) for k = 0, k < n in drand48()\n",
+        "tail": "def work(i n) if i < n then "
+                "work(i + 1 + drand48() * 0, n) else 0\n",
+        "nontail": "def work(i n) if i < n then "
+                   "drand48() * 0 + work(i + 1, n) else 0\n",
+    }[style]
+    with open(path, "w") as f:
+        f.write("extern drand48()\n" + work)
+        f.write(f"for r = 0, r < {reps} in work(0, {depth})\n")
+
+
+_LOCAL_KERNELS = {
+    "series": "def kernel(x) var s = 0, t = 1 in "
+              "(for k = 1, k < 64 in (s = s + t) + 0 * (t = t * x / k)) + s\n",
+    "horner": "def kernel(x) var r = 0 in "
+              "(for k = 0, k < 64 in r = r * 0.5 + k / (x + 1)) + r\n",
+    "newton": "def kernel(x) var y = x + 1 in "
+              "(for k = 0, k < 64 in y = (y + (x + 1) / y) / 2) + y\n",
+    "reduce": "def kernel(x) var s = 0 in "
+              "(for k = 0, k < 64 in s = s + (x + k) * (x - k)) + s\n",
+}
+
+
+def gen_locals(path: str, kernel: str, reps: int) -> None:
+    """Generate a kernel updating var-bound locals in a loop, called reps
+    times with its results summed up so that none of the calls is dead."""
+    with open(path, "w") as f:
+        f.write(_LOCAL_KERNELS[kernel])
+        f.write(f"var acc = 0 in (for r = 0, r < {reps} in "
+                f"acc = acc + kernel(r / {reps})) + acc\n")
+
+
+def bench_jit(args) -> None:
+    jit_bin = os.path.join(args.build_dir, "src", "ir", "klang_jit")
+    with tempfile.TemporaryDirectory() as tmp:
+        src = os.path.join(tmp, "library.k")
+        gen_library(src, args.num_funcs, args.num_used)
+        print(f"{args.num_funcs} functions, {args.num_used} of them called, "
+              f"best of {args.repeat} runs")
+        print(f"{'mode':<10}{'time(s)':>10}")
+        for mode, flags in [("lazy", []), ("eager", ["--eager"])]:
+            seconds = timeit([jit_bin, src] + flags, args.repeat, quiet=True)
+            print(f"{mode:<10}{seconds:>10.3f}")
+
+
+def bench_opt(args) -> None:
+    jit_bin = os.path.join(args.build_dir, "src", "ir", "klang_jit")
+    with tempfile.TemporaryDirectory() as tmp:
+        src = os.path.join(tmp, "library.k")
+        gen_library(src, args.num_funcs, args.num_funcs)
+        print(f"{args.num_funcs} functions, all called, "
+              f"best of {args.repeat} runs")
+        print(f"{'level':<10}{'time(s)':>10}")
+        for level in ["O0", "O1", "O2", "O3", "Os"]:
+            seconds = timeit([jit_bin, src, f"-{level}"], args.repeat,
+                             quiet=True)
+            print(f"{level:<10}{seconds:>10.3f}")
+
+
+def bench_codegen(args) -> None:
+    jit_bin = os.path.join(args.build_dir, "src", "ir", "klang_jit")
+    with tempfile.TemporaryDirectory() as tmp:
+        src = os.path.join(tmp, "library.k")
+        gen_library(src, args.num_funcs, 1)
+        print(f"{args.num_funcs} functions, best of {args.repeat} runs")
+        print(f"{'jobs':<10}{'time(s)':>10}{'speedup':>10}")
+        base = None
+        for jobs in args.jobs:
+            seconds = timeit([jit_bin, src, f"--jobs={jobs}"], args.repeat,
+                             quiet=True)
+            base = base or seconds
+            print(f"{jobs:<10}{seconds:>10.3f}{base / seconds:>10.2f}")
+
+
+def bench_lowering(args) -> None:
+    jit_bin = os.path.join(args.build_dir, "src", "ir", "klang_jit")
+    with tempfile.TemporaryDirectory() as tmp:
+        library = os.path.join(tmp, "library.k")
+        gen_library(library, args.num_funcs, 1)
+        kernels = os.path.join(tmp, "kernels.k")
+        gen_kernels(kernels, args.num_funcs)
+        for name, src in [("expressions", library), ("loop kernels", kernels)]:
+            print(f"{args.num_funcs} functions of {name}, lowered "
+                  f"{args.reps} times", flush=True)
+            run([jit_bin, src, f"--bench-codegen={args.reps}"], check=True)
+
+
+def gen_folded(path: str, num_funcs: int, num_literals: int) -> None:
+    """Generate functions multiplying x by a product of 1 literals, which
+    the IR builder folds to the constant 1."""
+    product = " * ".join(["1"] * num_literals)
+    with open(path, "w") as f:
+        for i in range(num_funcs):
+            f.write(f"def f{i}(x) x * ({product})\n")
+
+
+# Allocation budgets, checked by the allocs subcommand: per 1000 tokens for
+# the front end, per function for the code generator and per literal for the
+# lowering of folded constants. They leave ~10% over what the loop kernels
+# take now, lower them when an optimization lands.
+_ALLOC_BUDGETS = {
+    "lex per 1k tokens": 950,
+    "parse per 1k tokens": 800,
+    "codegen per function": 95,
+    "codegen per folded literal": 0,
+}
+
+
+def alloc_stats(jit_bin: str, src: str) -> dict:
+    """Run klang_jit with --alloc-stats and --metrics=json on src and return
+    the allocations of every phase and the counters of the metrics."""
+    proc = run([jit_bin, src, "--alloc-stats", "--metrics=json"],
+               stdout=DEVNULL, stderr=PIPE, text=True)
+    if proc.returncode != 0:
+        sys.exit(proc.stderr)
+    out = proc.stderr
+    stats = {}
+    for phase, allocations in re.findall(r"^(\w+): (\d+) allocations",
+                                         out, re.MULTILINE):
+        stats[phase] = int(allocations)
+    for sample in json.loads(out[out.index("\n[") + 1:]):
+        stats[sample["name"]] = stats.get(sample["name"], 0) + sample["value"]
+    return stats
+
+
+def bench_allocs(args) -> None:
+    jit_bin = os.path.join(args.build_dir, "src", "ir", "klang_jit")
+    with tempfile.TemporaryDirectory() as tmp:
+        kernels = os.path.join(tmp, "kernels.k")
+        gen_kernels(kernels, args.num_funcs)
+        stats = alloc_stats(jit_bin, kernels)
+        tokens = stats["klang_lexer_tokens_total"]
+        functions = stats["klang_codegen_functions_total"]
+        measured = {
+            "lex per 1k tokens": 1000 * stats["lex"] / tokens,
+            "parse per 1k tokens": 1000 * stats["parse"] / tokens,
+            "codegen per function": stats["codegen"] / functions,
+        }
+        # only the literals differ between the two programs
+        folded = []
+        for num_literals in [1, 65]:
+            src = os.path.join(tmp, f"folded{num_literals}.k")
+            gen_folded(src, args.num_funcs, num_literals)
+            folded.append(alloc_stats(jit_bin, src)["codegen"])
+        measured["codegen per folded literal"] = \
+            (folded[1] - folded[0]) / (64 * args.num_funcs)
+
+        print(f"{'budget':<30}{'measured':>10}{'limit':>10}")
+        over = []
+        for name, limit in _ALLOC_BUDGETS.items():
+            print(f"{name:<30}{measured[name]:>10.2f}{limit:>10}")
+            if measured[name] > limit:
+                over.append(name)
+        if over:
+            print("over budget: " + ", ".join(over))
+            sys.exit(1)
+
+
+def bench_tiered(args) -> None:
+    jit_bin = os.path.join(args.build_dir, "src", "ir", "klang_jit")
+    with tempfile.TemporaryDirectory() as tmp:
+        src = os.path.join(tmp, "mixed.k")
+        gen_mixed(src, args.depth, args.num_cold)
+        print(f"2^{args.depth} hot calls, {args.num_cold} cold functions, "
+              f"best of {args.repeat} runs")
+        print(f"{'mode':<20}{'time(s)':>10}")
+        for mode, flags in [("-O0", ["-O0"]), ("-O3", ["-O3"]),
+                            ("tiered", [f"--tiered={args.threshold}"])]:
+            seconds = timeit([jit_bin, src] + flags, args.repeat, quiet=True)
+            print(f"{mode:<20}{seconds:>10.3f}")
+
+
+def bench_vm(args) -> None:
+    vm_bin = os.path.join(args.build_dir, "src", "vm", "klang_vm")
+    jit_bin = os.path.join(args.build_dir, "src", "ir", "klang_jit")
+    with tempfile.TemporaryDirectory() as tmp:
+        formula = os.path.join(tmp, "formula.k")
+        with open(formula, "w") as f:
+            f.write("extern sqrt(x)\n"
+                    "def norm(x y) sqrt(x * x + y * y)\n"
+                    "norm(3, 4) / 2\n")
+        hot = os.path.join(tmp, "hot.k")
+        gen_mixed(hot, args.depth, 0)
+        print(f"best of {args.repeat} runs")
+        print(f"{'workload':<16}{'backend':<22}{'time(s)':>10}")
+        for name, src in [("startup", formula),
+                          (f"2^{args.depth} calls", hot)]:
+            image = os.path.join(tmp, "program.kbc")
+            run([vm_bin, src, f"--emit={image}"], check=True)
+            for backend, cmd in [
+                    ("vm", [vm_bin, src]),
+                    ("vm mmap", [vm_bin, f"--load={image}"]),
+                    ("jit -O0", [jit_bin, src, "-O0"]),
+                    ("jit -O2", [jit_bin, src, "-O2"]),
+                    ("jit tiered", [jit_bin, src, "--tiered"])]:
+                seconds = timeit(cmd, args.repeat, quiet=True)
+                print(f"{name:<16}{backend:<22}{seconds:>10.3f}")
+
+
+def bench_loops(args) -> None:
+    jit_bin = os.path.join(args.build_dir, "src", "ir", "klang_jit")
+    reps = max(1, args.iterations // args.depth)
+    with tempfile.TemporaryDirectory() as tmp:
+        print(f"{reps} x {args.depth} iterations, best of {args.repeat} runs")
+        print(f"{'style':<12}{'-O0(s)':>10}{'-O3(s)':>10}")
+        for style in ["for", "tail", "nontail"]:
+            src = os.path.join(tmp, f"{style}.k")
+            gen_loop(src, style, args.depth, reps)
+            seconds = [timeit([jit_bin, src, opt], args.repeat, quiet=True)
+                       for opt in ["-O0", "-O3"]]
+            print(f"{style:<12}{seconds[0]:>10.3f}{seconds[1]:>10.3f}")
+
+
+def bench_locals(args) -> None:
+    jit_bin = os.path.join(args.build_dir, "src", "ir", "klang_jit")
+    compile_bin = os.path.join(args.build_dir, "src", "ir", "klang_compile")
+    levels = ["-O0", "-O1", "-O2"]
+    with tempfile.TemporaryDirectory() as tmp:
+        print("alloca/load/store left in the IR, then the run time of "
+              f"{args.reps} calls, best of {args.repeat} runs")
+        print(f"{'kernel':<10}" + "".join(f"{level:>14}" for level in levels)
+              + f"{'-O0(s)':>10}{'-O2(s)':>10}")
+        for kernel in _LOCAL_KERNELS:
+            src = os.path.join(tmp, f"{kernel}.k")
+            gen_locals(src, kernel, args.reps)
+            counts = []
+            for level in levels:
+                ir = os.path.join(tmp, f"{kernel}{level}.ll")
+                # the driver expression is skipped ahead of time
+                run([compile_bin, src, "-o", ir, level], check=True,
+                    stdout=DEVNULL, stderr=DEVNULL)
+                with open(ir) as f:
+                    insts = [line.split("=", 1)[-1].split()[0]
+                             for line in f if line.startswith("  ")]
+                counts.append("/".join(str(insts.count(op))
+                                       for op in ["alloca", "load", "store"]))
+            seconds = [timeit([jit_bin, src, level], args.repeat, quiet=True)
+                       for level in ["-O0", "-O2"]]
+            print(f"{kernel:<10}" + "".join(f"{c:>14}" for c in counts)
+                  + f"{seconds[0]:>10.3f}{seconds[1]:>10.3f}")
+
+
+def bench_fpmodes(args) -> None:
+    jit_bin = os.path.join(args.build_dir, "src", "ir", "klang_jit")
+    compile_bin = os.path.join(args.build_dir, "src", "ir", "klang_compile")
+    modes = ["strict", "contract", "fast"]
+    inputs = [k / args.samples for k in range(args.samples)]
+    with tempfile.TemporaryDirectory() as tmp:
+        print(f"{args.reps} calls of every kernel at {args.opt}, best of "
+              f"{args.repeat} runs; largest error relative to strict over "
+              f"{args.samples} inputs, from a shared object of each mode")
+        print(f"{'kernel':<10}{'mode':<10}{'time(s)':>10}{'speedup':>10}"
+              f"{'max rel. error':>16}")
+        for kernel in _LOCAL_KERNELS:
+            src = os.path.join(tmp, f"{kernel}.k")
+            gen_locals(src, kernel, args.reps)
+            base_seconds, base_values = None, None
+            for mode in modes:
+                lib = os.path.join(tmp, f"{kernel}-{mode}.so")
+                run([compile_bin, src, "-o", lib, args.opt,
+                     f"--fp-mode={mode}"], check=True, stdout=DEVNULL,
+                    stderr=DEVNULL)
+                func = ctypes.CDLL(lib).kernel
+                func.restype = ctypes.c_double
+                func.argtypes = [ctypes.c_double]
+                values = [func(x) for x in inputs]
+                seconds = timeit([jit_bin, src, args.opt, f"--fp-mode={mode}"],
+                                 args.repeat, quiet=True)
+                if base_values is None:
+                    base_seconds, base_values = seconds, values
+                error = max(abs(v - b) / abs(b) if b != 0 else abs(v)
+                            for v, b in zip(values, base_values))
+                print(f"{kernel:<10}{mode:<10}{seconds:>10.3f}"
+                      f"{base_seconds / seconds:>10.2f}{error:>16.3g}")
+
+
+def bench_simd(args) -> None:
+    jit_bin = os.path.join(args.build_dir, "src", "ir", "klang_jit")
+    with tempfile.TemporaryDirectory() as tmp:
+        src = os.path.join(tmp, "formulas.k")
+        with open(src, "w") as f:
+            f.write("def poly(x) ((x * 0.5 + 1.5) * x - 2) * x + 0.25\n"
+                    "def ratio(a b c) (a * b - c) / (a + b * c + 1)\n"
+                    "def blend(a b c d) a * d + b * (1 - d) - c * c\n")
+        for func in ["poly", "ratio", "blend"]:
+            print(f"{func}, {args.rows} rows, {args.opt}")
+            run([jit_bin, src, args.opt, f"--bench-batch={func}",
+                 f"--rows={args.rows}"], check=True)
+
+
+def bench_hotswap(args) -> None:
+    jit_bin = os.path.join(args.build_dir, "src", "ir", "klang_jit")
+    with tempfile.TemporaryDirectory() as tmp:
+        src = os.path.join(tmp, "library.k")
+        gen_library(src, args.num_funcs, 1)
+        with open(src, "a") as f:
+            rng = random.Random(0)
+            for k in range(args.num_updates):
+                idx = rng.randrange(1, args.num_funcs)
+                f.write(f"def f{idx}(a b) f{idx - 1}(a + {k}, b) * "
+                        f"(a + b) / (b + {idx})\n")
+                f.write(f"f{args.num_funcs - 1}(1, 2)\n")
+        print(f"{args.num_funcs} functions, {args.num_updates} redefinitions")
+        print("whole session, the cost of recompiling everything:")
+        seconds = timeit([jit_bin, src, "--redefinable"], args.repeat,
+                         quiet=True)
+        print(f"  {seconds:.3f}s")
+        print("single function updates:")
+        run([jit_bin, src, "--redefinable", "--swap-stats"], check=True,
+            stdout=DEVNULL)
+
+
+def bench_cache(args) -> None:
+    jit_bin = os.path.join(args.build_dir, "src", "ir", "klang_jit")
+    with tempfile.TemporaryDirectory() as tmp:
+        src = os.path.join(tmp, "library.k")
+        gen_library(src, args.num_funcs, args.num_funcs)
+        cache = os.path.join(tmp, "cache")
+        cmd = [jit_bin, src, args.opt]
+        print(f"{args.num_funcs} functions, all called, {args.opt}, "
+              f"best of {args.repeat} runs")
+        print(f"{'start':<10}{'time(s)':>10}{'speedup':>10}")
+        base = timeit(cmd, args.repeat, quiet=True)
+        print(f"{'no cache':<10}{base:>10.3f}{1:>10.2f}")
+        # every cold start begins with an empty cache
+        cold = float("inf")
+        for _ in range(args.repeat):
+            shutil.rmtree(cache, ignore_errors=True)
+            cold = min(cold, timeit(cmd + [f"--cache-dir={cache}"], 1,
+                                    quiet=True))
+        print(f"{'cold':<10}{cold:>10.3f}{base / cold:>10.2f}")
+        warm = timeit(cmd + [f"--cache-dir={cache}"], args.repeat, quiet=True)
+        print(f"{'warm':<10}{warm:>10.3f}{base / warm:>10.2f}")
+
+
+def bench_ipo(args) -> None:
+    jit_bin = os.path.join(args.build_dir, "src", "ir", "klang_jit")
+    with tempfile.TemporaryDirectory() as tmp:
+        redundant = os.path.join(tmp, "redundant.k")
+        gen_redundant(redundant, args.depth)
+        tree = os.path.join(tmp, "tree.k")
+        gen_mixed(tree, args.depth, 0)
+        print(f"call trees of depth {args.depth}, best of {args.repeat} runs")
+        print(f"{'program':<12}{'mode':<18}{'time(s)':>10}")
+        for name, src in [("redundant", redundant), ("nested", tree)]:
+            for mode, flags in [("-O3", ["-O3"]),
+                                ("whole program", ["--whole-program"])]:
+                seconds = timeit([jit_bin, src] + flags, args.repeat,
+                                 quiet=True)
+                print(f"{name:<12}{mode:<18}{seconds:>10.3f}")
+
+
+def bench_memo(args) -> None:
+    jit_bin = os.path.join(args.build_dir, "src", "ir", "klang_jit")
+    with tempfile.TemporaryDirectory() as tmp:
+        print(f"overlapping call trees, best of {args.repeat} runs")
+        print(f"{'depth':<8}{'plain(s)':>10}{'@memo(s)':>10}")
+        for depth in range(args.min_depth, args.max_depth + 1, 4):
+            seconds = []
+            for memo in [False, True]:
+                src = os.path.join(tmp, f"memo{int(memo)}.k")
+                gen_overlapping(src, depth, memo)
+                seconds.append(timeit([jit_bin, src, "--tiered"],
+                                      args.repeat, quiet=True))
+            print(f"{depth:<8}{seconds[0]:>10.3f}{seconds[1]:>10.3f}")
+
+        # small integers only differ in the high bits, which the hash of
+        # the cache must spread over all of its entries
+        print(f"integer recursion fib(n), best of {args.repeat} runs")
+        print(f"{'n':<8}{'plain(s)':>10}{'@memo(s)':>10}")
+        for n in args.fib:
+            cells = []
+            for memo in [False, True]:
+                # without the cache, fib(n) makes about 1.6**n calls
+                if not memo and n > 40:
+                    cells.append(f"{'-':>10}")
+                    continue
+                src = os.path.join(tmp, f"fib{int(memo)}.k")
+                gen_fib(src, n, memo)
+                seconds = timeit([jit_bin, src], args.repeat, quiet=True)
+                cells.append(f"{seconds:>10.3f}")
+            print(f"{n:<8}{cells[0]}{cells[1]}")
+
+
+def program_output(cmd, src: str, stdin: bool) -> str:
+    """Run cmd on src, or with src as its stdin, and return what it printed,
+    exiting on an error."""
+    with open(src) as f:
+        proc = run(cmd + ([] if stdin else [src]),
+                   stdin=f if stdin else DEVNULL,
+                   stdout=PIPE, stderr=PIPE, text=True)
+    if proc.returncode != 0:
+        sys.exit(f"{' '.join(cmd)} on {src} failed:\n{proc.stderr}")
+    return proc.stdout
+
+
+def check_memo(args) -> None:
+    ir_dir = os.path.join(args.build_dir, "src", "ir")
+    jit_bin = os.path.join(ir_dir, "klang_jit")
+    vm_bin = os.path.join(args.build_dir, "src", "vm", "klang_vm")
+    # (mode, command, reads the program from stdin, allows redefinitions)
+    modes = [("-O0", [jit_bin, "-O0"], False, False),
+             ("-O2", [jit_bin, "-O2"], False, False),
+             ("tiered", [jit_bin, "--tiered"], False, False),
+             ("redefinable", [jit_bin, "--redefinable"], False, True),
+             ("whole program", [jit_bin, "--whole-program"], False, False),
+             ("repl", [jit_bin], True, True),
+             ("vm", [vm_bin], False, False)]
+    with tempfile.TemporaryDirectory() as tmp:
+        # (case, writes the plain or @memo program, redefines a function)
+        cases = [
+            ("overlapping", lambda path, memo:
+             gen_overlapping(path, args.depth, memo), False),
+            ("fib", lambda path, memo: gen_fib(path, args.fib, memo), False),
+            ("collisions", lambda path, memo:
+             gen_collisions(path, args.num_keys, memo), False),
+            ("redefined", gen_redefined, True),
+        ]
+        print(f"{'case':<14}{'mode':<16}{'result':>8}")
+        failed = []
+        for case, gen, redefines in cases:
+            plain = os.path.join(tmp, f"{case}0.k")
+            memo = os.path.join(tmp, f"{case}1.k")
+            gen(plain, False)
+            gen(memo, True)
+            for mode, cmd, stdin, redefinable in modes:
+                if redefines and not redefinable:
+                    continue
+                same = (program_output(cmd, plain, stdin) ==
+                        program_output(cmd, memo, stdin))
+                print(f"{case:<14}{mode:<16}{'ok' if same else 'DIFFERS':>8}")
+                if not same:
+                    failed.append(f"{case} {mode}")
+
+        # without the cache, fib(90) makes about 1.6**90 calls, so it is
+        # checked against its exact value. The VM ignores @memo.
+        src = os.path.join(tmp, "fib90.k")
+        gen_fib(src, 90, True)
+        a, b = 0, 1
+        for _ in range(90):
+            a, b = b, a + b
+        for mode, cmd, stdin, _ in modes[:-1]:
+            printed = program_output(cmd, src, stdin).split()
+            same = len(printed) == 1 and float(printed[0]) == float(f"{a:g}")
+            print(f"{'fib(90)':<14}{mode:<16}{'ok' if same else 'DIFFERS':>8}")
+            if not same:
+                failed.append(f"fib(90) {mode}")
+        if failed:
+            print("differs: " + ", ".join(failed))
+            sys.exit(1)
+
+
+def gen_specializable(path: str, depth: int, iters: int) -> None:
+    """Hot loop calling recursive functions with a constant depth."""
+    with open(path, "w") as f:
+        f.write("def pw(x n) if n < 1 then 1 else x * pw(x, n - 1)\n"
+                "def series(x n) if n < 1 then 1 "
+                "else 1 + x * series(x, n - 1) / n\n"
+                "def shape(kind x y) if kind < 1 then x * y "
+                "else if kind < 2 then x * y * 0.5 else 3.14159 * x * y\n"
+                "def run(m) var s = 0 in (for i = 0, i < m in "
+                f"s = s + pw(1 + i * 0.000000001, {depth}) + "
+                f"series(i * 0.000000001, {depth}) + "
+                f"shape(1, i * 0.000000001, 0.5)) + s\n"
+                f"run({iters})\n")
+
+
+def bench_specialize(args) -> None:
+    jit_bin = os.path.join(args.build_dir, "src", "ir", "klang_jit")
+    with tempfile.TemporaryDirectory() as tmp:
+        src = os.path.join(tmp, "specialize.k")
+        print(f"{args.iters} iterations, best of {args.repeat} runs")
+        print(f"{'depth':<8}{'mode':<18}{'plain(s)':>10}{'special(s)':>12}")
+        for depth in args.depths:
+            gen_specializable(src, depth, args.iters)
+            for mode, flags in [("-O2", ["-O2"]),
+                                ("whole program", ["--whole-program"])]:
+                seconds = [timeit([jit_bin, src] + flags + extra,
+                                  args.repeat, quiet=True)
+                           for extra in [[], ["--specialize"]]]
+                print(f"{depth:<8}{mode:<18}{seconds[0]:>10.3f}"
+                      f"{seconds[1]:>12.3f}")
+
+
+def latencies(cmd, num_requests: int):
+    """Run cmd num_requests times and return the p50 and p99 wall time in
+    milliseconds."""
+    samples = []
+    for _ in range(num_requests):
+        start = time.perf_counter()
+        run(cmd, check=True, stdout=DEVNULL)
+        samples.append((time.perf_counter() - start) * 1000)
+    samples.sort()
+    return (samples[len(samples) // 2],
+            samples[min(len(samples) - 1, len(samples) * 99 // 100)])
+
+
+def start_daemon(ir_dir: str, sock: str) -> Popen:
+    """Start klangd on sock and wait until it listens."""
+    daemon = Popen([os.path.join(ir_dir, "klangd"), sock])
+    deadline = time.time() + 10
+    while not os.path.exists(sock):
+        if time.time() > deadline or daemon.poll() is not None:
+            daemon.kill()
+            sys.exit("klangd did not start")
+        time.sleep(0.01)
+    return daemon
+
+
+def bench_daemon(args) -> None:
+    ir_dir = os.path.join(args.build_dir, "src", "ir")
+    jit_bin = os.path.join(ir_dir, "klang_jit")
+    client_bin = os.path.join(ir_dir, "klang_client")
+    with tempfile.TemporaryDirectory() as tmp:
+        src = os.path.join(tmp, "library.k")
+        gen_library(src, args.num_funcs, 1)
+        sock = os.path.join(tmp, "klangd.sock")
+        daemon = start_daemon(ir_dir, sock)
+        try:
+            print(f"{args.num_funcs} functions, {args.requests} requests")
+            print(f"{'mode':<20}{'p50(ms)':>10}{'p99(ms)':>10}")
+            for mode, cmd in [("process", [jit_bin, src]),
+                              ("client process", [client_bin, sock, src])]:
+                p50, p99 = latencies(cmd, args.requests)
+                print(f"{mode:<20}{p50:>10.2f}{p99:>10.2f}")
+            # the same requests over one connection, without the client
+            # start-up
+            result = run([client_bin, sock, src,
+                          f"--repeat={args.requests}"],
+                         check=True, stdout=DEVNULL, stderr=PIPE, text=True)
+            match = re.search(r"p50: (\S+) ms, p99: (\S+) ms", result.stderr)
+            print(f"{'connection':<20}{float(match.group(1)):>10.2f}"
+                  f"{float(match.group(2)):>10.2f}")
+        finally:
+            run([client_bin, sock, "--shutdown"], stdout=DEVNULL)
+            daemon.wait()
+
+
+def check_daemon(args) -> None:
+    ir_dir = os.path.join(args.build_dir, "src", "ir")
+    client_bin = os.path.join(ir_dir, "klang_client")
+    with tempfile.TemporaryDirectory() as tmp:
+        bad = os.path.join(tmp, "bad.k")
+        with open(bad, "w") as f:
+            f.write("extern nosuch(x)\ndef g(x) nosuch(x)\ng(1)\n")
+        good = os.path.join(tmp, "good.k")
+        with open(good, "w") as f:
+            f.write("def sq(x) x * x\nsq(3)\n")
+        sock = os.path.join(tmp, "klangd.sock")
+        daemon = start_daemon(ir_dir, sock)
+        try:
+            # a failing request gets an error back, and the daemon goes on
+            # serving the next one
+            print(f"{'request':<24}{'result':>10}")
+            failed = []
+            for name, src, flags, expected in [
+                    ("unresolved extern", bad, [], None),
+                    ("unresolved, whole prog", bad, ["--whole-program"], None),
+                    ("good", good, [], "9")]:
+                proc = run([client_bin, sock, src] + flags,
+                           stdout=PIPE, stderr=PIPE, text=True)
+                if expected is None:
+                    ok = proc.returncode != 0 and "failed" in proc.stderr
+                else:
+                    ok = (proc.returncode == 0 and
+                          proc.stdout.split() == [expected])
+                ok = ok and daemon.poll() is None
+                print(f"{name:<24}{'ok' if ok else 'FAILED':>10}")
+                if not ok:
+                    failed.append(name)
+        finally:
+            if daemon.poll() is None:
+                run([client_bin, sock, "--shutdown"], stdout=DEVNULL)
+            daemon.wait()
+        if failed:
+            print("failed: " + ", ".join(failed))
+            sys.exit(1)
+
+
+def bench_repl(args) -> None:
+    jit_bin = os.path.join(args.build_dir, "src", "ir", "klang_jit")
+    lines = ["def sq(x) x * x"]
+    lines += [f"sq({idx}) + {idx}" for idx in range(args.lines)]
+    source = "\n".join(lines) + "\n"
+    print(f"{args.lines} lines calling a function, after the first "
+          f"{args.warmup}")
+    print(f"{'mode':<12}{'p50(ms)':>10}{'p99(ms)':>10}")
+    for mode, flags in [("quick", []), ("-O2", ["-O2"])]:
+        result = run([jit_bin] + flags, input=source, check=True,
+                     stdout=DEVNULL, stderr=PIPE, text=True)
+        samples = [float(ms) for ms in
+                   re.findall(r"^\((\S+) ms\)$", result.stderr, re.M)]
+        samples = sorted(samples[args.warmup:])
+        p50 = samples[len(samples) // 2]
+        p99 = samples[min(len(samples) - 1, len(samples) * 99 // 100)]
+        print(f"{mode:<12}{p50:>10.3f}{p99:>10.3f}")
+
+
+parser = argparse.ArgumentParser(
+    description="throughput benchmarks of the kaleidoscope tools")
+parser.add_argument("--build-dir", type=str, default="build",
+                    help="the cmake build directory holding the executables")
+parser.add_argument("--repeat", type=int, default=3,
+                    help="number of runs of every measurement")
+subparsers = parser.add_subparsers(dest="bench", required=True)
+
+dump_parser = subparsers.add_parser(
+    "dump", help="token and AST dump throughput of every output format")
+dump_parser.add_argument("--size-mb", type=float, default=16,
+                         help="size of the generated source file")
+dump_parser.set_defaults(func=bench_dump)
+
+batch_parser = subparsers.add_parser(
+    "batch", help="batch mode against one process per source file")
+batch_parser.add_argument("--num-files", type=int, default=2000,
+                          help="number of generated source files")
+batch_parser.add_argument("--file-kb", type=float, default=2,
+                          help="size of every generated source file")
+batch_parser.add_argument("--jobs", type=int, nargs="+",
+                          default=sorted({1, os.cpu_count() or 1}),
+                          help="worker counts to measure the batch mode with")
+batch_parser.set_defaults(func=bench_batch)
+
+jit_parser = subparsers.add_parser(
+    "jit", help="start-up time of the lazy JIT against eager compilation")
+jit_parser.add_argument("--num-funcs", type=int, default=5000,
+                        help="number of generated functions")
+jit_parser.add_argument("--num-used", type=int, default=10,
+                        help="number of functions called by expressions")
+jit_parser.set_defaults(func=bench_jit)
+
+opt_parser = subparsers.add_parser(
+    "opt", help="end-to-end JIT time of every optimization level")
+opt_parser.add_argument("--num-funcs", type=int, default=500,
+                        help="number of generated functions")
+opt_parser.set_defaults(func=bench_opt)
+
+codegen_parser = subparsers.add_parser(
+    "codegen", help="core scaling of the parallel IR generation")
+codegen_parser.add_argument("--num-funcs", type=int, default=20000,
+                            help="number of generated functions")
+codegen_parser.add_argument("--jobs", type=int, nargs="+",
+                            default=sorted({1, 2, 4, os.cpu_count() or 1}),
+                            help="worker counts to measure")
+codegen_parser.set_defaults(func=bench_codegen)
+
+lowering_parser = subparsers.add_parser(
+    "lowering", help="speed of the code generator alone, and its "
+    "allocations in the builds that track them")
+lowering_parser.add_argument("--num-funcs", type=int, default=5000,
+                             help="number of generated functions")
+lowering_parser.add_argument("--reps", type=int, default=10,
+                             help="number of times the program is lowered")
+lowering_parser.set_defaults(func=bench_lowering)
+
+allocs_parser = subparsers.add_parser(
+    "allocs", help="allocation budgets of the compiler phases, fails when one "
+    "is exceeded (needs -DKALEIDOSCOPE_TRACK_ALLOCATIONS=ON)")
+allocs_parser.add_argument("--num-funcs", type=int, default=2000,
+                           help="number of generated functions")
+allocs_parser.set_defaults(func=bench_allocs)
+
+tiered_parser = subparsers.add_parser(
+    "tiered", help="tiered execution against a single tier on a mixed load")
+tiered_parser.add_argument("--depth", type=int, default=22,
+                           help="depth of the hot call tree")
+tiered_parser.add_argument("--num-cold", type=int, default=1000,
+                           help="number of functions called only once")
+tiered_parser.add_argument("--threshold", type=int, default=1000,
+                           help="calls after which a function is hot")
+tiered_parser.set_defaults(func=bench_tiered)
+
+vm_parser = subparsers.add_parser(
+    "vm", help="start-up and steady-state speed of the VM against the JIT")
+vm_parser.add_argument("--depth", type=int, default=22,
+                       help="depth of the hot call tree")
+vm_parser.set_defaults(func=bench_vm)
+
+loops_parser = subparsers.add_parser(
+    "loops", help="for loops against the equivalent recursion")
+loops_parser.add_argument("--iterations", type=int, default=20000000,
+                          help="total number of iterations")
+loops_parser.add_argument("--depth", type=int, default=10000,
+                          help="iterations per loop, i.e. recursion depth")
+loops_parser.set_defaults(func=bench_loops)
+
+locals_parser = subparsers.add_parser(
+    "locals", help="mutable locals, before and after their promotion")
+locals_parser.add_argument("--reps", type=int, default=1000000,
+                           help="number of calls of every kernel")
+locals_parser.set_defaults(func=bench_locals)
+
+fpmodes_parser = subparsers.add_parser(
+    "fpmodes", help="speed and accuracy of the floating-point modes")
+fpmodes_parser.add_argument("--reps", type=int, default=1000000,
+                            help="number of calls of every kernel")
+fpmodes_parser.add_argument("--opt", type=str, default="-O3",
+                            help="optimization level of the kernels")
+fpmodes_parser.add_argument("--samples", type=int, default=1000,
+                            help="number of inputs the errors are taken over")
+fpmodes_parser.set_defaults(func=bench_fpmodes)
+
+simd_parser = subparsers.add_parser(
+    "simd", help="vectorized batch evaluation against a scalar call loop")
+simd_parser.add_argument("--rows", type=int, default=1 << 20,
+                         help="number of rows of every column")
+simd_parser.add_argument("--opt", type=str, default="-O3",
+                         help="optimization level of the scalar functions")
+simd_parser.set_defaults(func=bench_simd)
+
+hotswap_parser = subparsers.add_parser(
+    "hotswap", help="latency of redefining one function in a live session")
+hotswap_parser.add_argument("--num-funcs", type=int, default=5000,
+                            help="number of generated functions")
+hotswap_parser.add_argument("--num-updates", type=int, default=20,
+                            help="number of redefinitions")
+hotswap_parser.set_defaults(func=bench_hotswap)
+
+cache_parser = subparsers.add_parser(
+    "cache", help="cold and warm starts with the on-disk object cache")
+cache_parser.add_argument("--num-funcs", type=int, default=500,
+                          help="number of generated functions")
+cache_parser.add_argument("--opt", type=str, default="-O2",
+                          help="optimization level of the functions")
+cache_parser.set_defaults(func=bench_cache)
+
+ipo_parser = subparsers.add_parser(
+    "ipo", help="whole-program optimization on call-heavy programs")
+ipo_parser.add_argument("--depth", type=int, default=24,
+                        help="depth of the generated call trees")
+ipo_parser.set_defaults(func=bench_ipo)
+
+memo_parser = subparsers.add_parser(
+    "memo", help="@memo on functions with overlapping subproblems")
+memo_parser.add_argument("--min-depth", type=int, default=16,
+                         help="smallest depth of the generated call trees")
+memo_parser.add_argument("--max-depth", type=int, default=28,
+                         help="largest depth of the generated call trees")
+memo_parser.add_argument("--fib", type=int, nargs="+",
+                         default=[30, 35, 38, 90],
+                         help="arguments of the integer recursion fib(n)")
+memo_parser.set_defaults(func=bench_memo)
+
+memo_check_parser = subparsers.add_parser(
+    "memo-check", help="outputs of @memo programs against the plain ones in "
+    "every mode, fails when one differs")
+memo_check_parser.add_argument("--depth", type=int, default=12,
+                               help="depth of the overlapping call trees")
+memo_check_parser.add_argument("--fib", type=int, default=25,
+                               help="argument of the integer recursion fib(n)")
+memo_check_parser.add_argument("--num-keys", type=int, default=100000,
+                               help="number of integer args of the cache")
+memo_check_parser.set_defaults(func=check_memo)
+
+specialize_parser = subparsers.add_parser(
+    "specialize", help="calls specialized to their constant arguments")
+specialize_parser.add_argument("--depths", type=int, nargs="+",
+                               default=[4, 8, 16],
+                               help="constant recursion depths of the calls")
+specialize_parser.add_argument("--iters", type=int, default=10000000,
+                               help="iterations of the hot loop")
+specialize_parser.set_defaults(func=bench_specialize)
+
+daemon_parser = subparsers.add_parser(
+    "daemon", help="request latency of klangd against a process per request")
+daemon_parser.add_argument("--num-funcs", type=int, default=20,
+                           help="number of generated functions")
+daemon_parser.add_argument("--requests", type=int, default=100,
+                           help="number of requests of every mode")
+daemon_parser.set_defaults(func=bench_daemon)
+
+daemon_check_parser = subparsers.add_parser(
+    "daemon-check", help="klangd answers a failing request with an error and "
+    "serves the next one, fails otherwise")
+daemon_check_parser.set_defaults(func=check_daemon)
+
+repl_parser = subparsers.add_parser(
+    "repl", help="latency of the lines typed into the klang_jit REPL")
+repl_parser.add_argument("--lines", type=int, default=500,
+                         help="number of expression lines")
+repl_parser.add_argument("--warmup", type=int, default=10,
+                         help="number of first lines left out")
+repl_parser.set_defaults(func=bench_repl)
+
+if __name__ == "__main__":
+    args = parser.parse_args()
+    args.func(args)